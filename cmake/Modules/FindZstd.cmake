@@ -0,0 +1,21 @@
+# - Find zstd
+# Find the native zstd includes and library
+#
+#  ZSTD_INCLUDE_DIR - where to find zstd.h
+#  ZSTD_LIBRARY     - the zstd library
+#  ZSTD_FOUND       - True if zstd found.
+
+if(ZSTD_INCLUDE_DIR)
+    # Already in cache, be silent
+    set(ZSTD_FIND_QUIETLY TRUE)
+endif(ZSTD_INCLUDE_DIR)
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+# MSVC builds may be named zstd_static or libzstd
+find_library(ZSTD_LIBRARY NAMES zstd zstd_static libzstd)
+# Handle the QUIETLY and REQUIRED arguments and set ZSTD_FOUND
+# to TRUE if all listed variables are TRUE.
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Zstd DEFAULT_MSG
+    ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
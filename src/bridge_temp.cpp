@@ -215,6 +215,38 @@ int bridge_env_clear_objects(command_context_t *ctx)
 	return 0;
 }
 
+int bridge_env_convert_map(command_context_t *ctx, uint32_t *count, int *complete)
+{
+	if (!ctx)
+		return -1;
+
+	ServerEnvironment *env = static_cast<ServerEnvironment*>(ctx->bridge_env);
+	if (!env)
+		return -1;
+
+	bool c;
+	*count = env->getServerMap().convertAllBlocks(&c);
+	*complete = c;
+
+	return 0;
+}
+
+int bridge_env_save_map(command_context_t *ctx)
+{
+	if (!ctx)
+		return -1;
+
+	Server *server = static_cast<Server*>(ctx->bridge_server);
+	if (!server)
+		return -1;
+
+	// The environment is locked here, the server saves once it isn't
+	Player *player = static_cast<Player*>(ctx->bridge_player);
+	server->requestMapSave(player ? player->peer_id : PEER_ID_INEXISTENT);
+
+	return 0;
+}
+
 int bridge_move_player(command_context_t *ctx, v3_t *pos)
 {
 	if (!ctx)
@@ -382,7 +382,8 @@ void Client::step(float dtime)
 			// [3] u8[20] player_name
 			// [23] u8[28] password (new in some version)
 			// [51] u16 client network protocol version (new in some version)
-			SharedBuffer<u8> data(2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2);
+			// [53] u16 block codecs the client reads (new in some version)
+			SharedBuffer<u8> data(2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2+2);
 			writeU16(&data[0], TOSERVER_INIT);
 			writeU8(&data[2], SER_FMT_VER_HIGHEST);
 
@@ -398,6 +399,8 @@ void Client::step(float dtime)
 			// This should be incremented in each version
 			writeU16(&data[51], PROTOCOL_VERSION);
 
+			writeU16(&data[53], SER_CODEC_MASK);
+
 			// Send as unreliable
 			Send(0, data, false);
 		}
@@ -1325,6 +1328,11 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		}
 	}
 	break;
+	case TOCLIENT_ACTIVE_OBJECT_POSITIONS:
+	{
+		m_env.processActiveObjectPositions(&data[2], datasize-2);
+	}
+	break;
 	case TOCLIENT_MOVE_PLAYER:
 	{
 		std::string datastring((char*)&data[2], datasize-2);
@@ -28,8 +28,9 @@
 #define CLIENTSERVER_HEADER
 
 #include "utility.h"
+#include "constants.h"
 
-#define PROTOCOL_VERSION 11
+#define PROTOCOL_VERSION 12
 /* the last protocol version used by 0.3.x minetest-c55 clients */
 #define PROTOCOL_DOTTHREE 3
 /* this is the oldest protocol that we will allow to connect
@@ -40,6 +41,11 @@
 
 #define PASSWORD_SIZE 28       // Maximum password length. Allows for base64-encoded SHA-1 (27+\0).
 
+/* the first protocol version with TOCLIENT_ACTIVE_OBJECT_POSITIONS */
+#define PROTOCOL_OBJECT_POSITIONS 12
+/* object positions are sent in 32ths of a node */
+#define OBJECT_POSITION_QUANTUM (BS/32.0)
+
 enum ToClientCommand
 {
 	TOCLIENT_INIT = 0x10,
@@ -237,6 +243,29 @@ enum ToClientCommand
 			}
 		}
 	*/
+
+	TOCLIENT_ACTIVE_OBJECT_POSITIONS = 0x43,
+	/*
+		Replaces the position messages (command 0) of active objects
+		for clients of PROTOCOL_OBJECT_POSITIONS and later.
+		Keyframes are sent reliably, deltas unreliably. A delta is
+		ignored unless its keyframe number is the last one received.
+
+		u16 command
+		v3s16 origin block, usually the one the player is in
+		u16 count
+		for each object {
+			u16 id
+			u8 flags: 1 = keyframe
+			u8 keyframe number
+			if keyframe {
+				v3s16 position - origin block's position, in quanta
+			}else{
+				s8 x,y,z position - keyframe position, in quanta
+			}
+			u8 yaw, in 256ths of a turn
+		}
+	*/
 };
 
 enum ToServerCommand
@@ -250,6 +279,7 @@ enum ToServerCommand
 		[3] u8[20] player_name
 		[23] u8[28] password
 		[51] u16 client network protocol version
+		[53] u16 SER_CODEC_MASK, the block codecs the client reads
 	*/
 
 	TOSERVER_INIT2 = 0x11,
@@ -391,6 +421,36 @@ enum ToServerCommand
 	*/
 };
 
+/*
+	Helpers for TOCLIENT_ACTIVE_OBJECT_POSITIONS
+*/
+
+// Returns false if pos is too far from the origin block for a keyframe
+inline bool objectPositionToKeyframe(v3f pos, v3s16 origin, v3s16 &keyframe)
+{
+	v3f rel = (pos - intToFloat(origin*MAP_BLOCKSIZE, BS)) / OBJECT_POSITION_QUANTUM;
+	if (fabs(rel.X) > 32000 || fabs(rel.Y) > 32000 || fabs(rel.Z) > 32000)
+		return false;
+	keyframe = v3s16(floor(rel.X+0.5), floor(rel.Y+0.5), floor(rel.Z+0.5));
+	return true;
+}
+
+inline v3f objectKeyframeToPosition(v3s16 keyframe, v3s16 origin)
+{
+	return intToFloat(origin*MAP_BLOCKSIZE, BS)
+		+ v3f(keyframe.X, keyframe.Y, keyframe.Z) * OBJECT_POSITION_QUANTUM;
+}
+
+inline u8 objectYawToU8(f32 yaw)
+{
+	return (u8)((s32)floor(wrapDegrees_0_360(yaw) * 256.0 / 360.0 + 0.5) & 0xff);
+}
+
+inline f32 objectYawFromU8(u8 yaw)
+{
+	return (f32)yaw * 360.0 / 256.0;
+}
+
 inline SharedBuffer<u8> makePacket_TOCLIENT_TIME_OF_DAY(u16 time_of_day, float time_speed, u32 time)
 {
 	SharedBuffer<u8> data(2+2+4+4);
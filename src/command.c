@@ -284,6 +284,8 @@ int command_init()
 	command_add("unban",command_unban,0);
 	command_add("adduser",command_adduser,0);
 	command_add("clearobjects",command_clearobjects,0);
+	command_add("convertmap",command_convertmap,0);
+	command_add("save",command_save_map,0);
 	command_add("setpassword",command_setpassword,0);
 /*	command_add("bind",event_bind);
 
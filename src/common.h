@@ -195,6 +195,8 @@ int command_ban(command_context_t *ctx, array_t *args);
 int command_unban(command_context_t *ctx, array_t *args);
 int command_adduser(command_context_t *ctx, array_t *args);
 int command_clearobjects(command_context_t *ctx, array_t *args);
+int command_convertmap(command_context_t *ctx, array_t *args);
+int command_save_map(command_context_t *ctx, array_t *args);
 int command_setpassword(command_context_t *ctx, array_t *args);
 
 /* defined in world.c */
@@ -232,6 +234,8 @@ EXTERNC int bridge_set_player_password(command_context_t *ctx, char* name, char*
 EXTERNC int bridge_env_check_player(command_context_t *ctx, char* name);
 EXTERNC int bridge_env_player_pos(command_context_t *ctx, char* name, v3_t *pos);
 EXTERNC int bridge_env_clear_objects(command_context_t *ctx);
+EXTERNC int bridge_env_convert_map(command_context_t *ctx, uint32_t *count, int *complete);
+EXTERNC int bridge_env_save_map(command_context_t *ctx);
 EXTERNC int bridge_move_player(command_context_t *ctx, v3_t *pos);
 EXTERNC unsigned char* bridge_sha1(char *str);
 
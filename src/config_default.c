@@ -155,6 +155,7 @@ void config_default_init()
 	config_set_default("world.game.environment.season","auto",NULL);
 	config_set_default("world.game.motd","",NULL);
 	config_set_default("world.map.type","default",NULL);
+	config_set_default("world.map.codec","zlib",NULL);
 
 	/* server */
 	config_set_default("world.server.chunk.range.active","2",NULL);
@@ -173,6 +174,9 @@ void config_default_init()
 	config_set_default("server.net.client.queue.delay","2.0",NULL);
 	config_set_default("server.net.client.time.interval","5",NULL);
 	config_set_default("server.net.client.object.interval","0.2",NULL);
+	config_set_default("server.net.client.object.budget","10000",NULL);
+	config_set_default("server.net.client.budget","131072",NULL);
+	config_set_default("server.net.budget","1048576",NULL);
 	/* only enable http on the server, singleplayer doesn't need it */
 #ifndef SERVER
 	config_set_default("server.net.http","false",NULL);
@@ -180,8 +184,16 @@ void config_default_init()
 	config_set_default("server.net.http","true",NULL);
 #endif
 	config_set_default("server.net.chunk.max","20",NULL);
+	config_set_default("server.net.chunk.threads","2",NULL);
+	config_set_default("server.net.chunk.codec","zstd",NULL);
+	config_set_default("server.net.chunk.culling","true",NULL);
 	config_set_default("server.chunk.timeout","19",NULL);
+	config_set_default("server.emerge.threads","2",NULL);
+	config_set_default("server.emerge.prefetch.cache","256",NULL);
+	config_set_default("server.env.step.budget","10",NULL);
+	config_set_default("server.liquid.budget","50",NULL);
 	config_set_default("server.save.interval","60",NULL);
+	config_set_default("server.save.queue.size","1024",NULL);
 
 
 	config_set_default("global.api.address","servers.voxelands.com",NULL);
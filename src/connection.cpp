@@ -48,36 +48,53 @@ BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 	return p;
 }
 
+/*
+	Grows data by header_size at the front. This is done in place if
+	data has headroom left for it, otherwise data is copied into a new
+	buffer with room for the rest of the headers.
+*/
+static SharedBuffer<u8> prependHeader(SharedBuffer<u8> data, u32 header_size)
+{
+	if(data.prepend(header_size))
+		return data;
+	SharedBuffer<u8> b(header_size + data.getSize(), PACKET_HEADROOM);
+	memcpy(&b[header_size], *data, data.getSize());
+	return b;
+}
+
 BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 		u32 protocol_id, u16 sender_peer_id, u8 channel)
 {
-	return makePacket(address, *data, data.getSize(),
-			protocol_id, sender_peer_id, channel);
+	BufferedPacket p;
+	p.data = prependHeader(data, BASE_HEADER_SIZE);
+	p.address = address;
+
+	writeU32(&p.data[0], protocol_id);
+	writeU16(&p.data[4], sender_peer_id);
+	writeU8(&p.data[6], channel);
+
+	return p;
 }
 
 SharedBuffer<u8> makeOriginalPacket(
 		SharedBuffer<u8> data)
 {
-	u32 header_size = 1;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	SharedBuffer<u8> b = prependHeader(data, ORIGINAL_HEADER_SIZE);
 
 	writeU8(&b[0], TYPE_ORIGINAL);
 
-	memcpy(&b[header_size], *data, data.getSize());
-
 	return b;
 }
 
-core::list<SharedBuffer<u8> > makeSplitPacket(
+core::list<PacketParts> makeSplitPacket(
 		SharedBuffer<u8> data,
 		u32 chunksize_max,
 		u16 seqnum)
 {
 	// Chunk packets, containing the TYPE_SPLIT header
-	core::list<SharedBuffer<u8> > chunks;
+	core::list<PacketParts> chunks;
 
-	u32 chunk_header_size = 7;
+	u32 chunk_header_size = SPLIT_HEADER_SIZE;
 	u32 maximum_data_size = chunksize_max - chunk_header_size;
 	u32 start = 0;
 	u32 end = 0;
@@ -88,15 +105,15 @@ core::list<SharedBuffer<u8> > makeSplitPacket(
 			end = data.getSize() - 1;
 
 		u32 payload_size = end - start + 1;
-		u32 packet_size = chunk_header_size + payload_size;
-
-		SharedBuffer<u8> chunk(packet_size);
 
-		writeU8(&chunk[0], TYPE_SPLIT);
-		writeU16(&chunk[1], seqnum);
+		PacketParts chunk;
+		chunk.data = SharedBuffer<u8>(chunk_header_size,
+				BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE);
+		writeU8(&chunk.data[0], TYPE_SPLIT);
+		writeU16(&chunk.data[1], seqnum);
 		// [3] u16 chunk_count is written at next stage
-		writeU16(&chunk[5], chunk_num);
-		memcpy(&chunk[chunk_header_size], &data[start], payload_size);
+		writeU16(&chunk.data[5], chunk_num);
+		chunk.tail = data.slice(start, payload_size);
 
 		chunks.push_back(chunk);
 
@@ -107,23 +124,23 @@ core::list<SharedBuffer<u8> > makeSplitPacket(
 
 	u16 chunk_count = chunks.getSize();
 
-	core::list<SharedBuffer<u8> >::Iterator i = chunks.begin();
+	core::list<PacketParts>::Iterator i = chunks.begin();
 	for(; i != chunks.end(); i++)
 	{
 		// Write chunk_count
-		writeU16(&((*i)[3]), chunk_count);
+		writeU16(&i->data[3], chunk_count);
 	}
 
 	return chunks;
 }
 
-core::list<SharedBuffer<u8> > makeAutoSplitPacket(
+core::list<PacketParts> makeAutoSplitPacket(
 		SharedBuffer<u8> data,
 		u32 chunksize_max,
 		u16 &split_seqnum)
 {
-	u32 original_header_size = 1;
-	core::list<SharedBuffer<u8> > list;
+	u32 original_header_size = ORIGINAL_HEADER_SIZE;
+	core::list<PacketParts> list;
 	if(data.getSize() + original_header_size > chunksize_max)
 	{
 		list = makeSplitPacket(data, chunksize_max, split_seqnum);
@@ -132,7 +149,9 @@ core::list<SharedBuffer<u8> > makeAutoSplitPacket(
 	}
 	else
 	{
-		list.push_back(makeOriginalPacket(data));
+		PacketParts original;
+		original.data = makeOriginalPacket(data);
+		list.push_back(original);
 	}
 	return list;
 }
@@ -144,15 +163,11 @@ SharedBuffer<u8> makeReliablePacket(
 	/*dstream<<"BEGIN SharedBuffer<u8> makeReliablePacket()"<<std::endl;
 	dstream<<"data.getSize()="<<data.getSize()<<", data[0]="
 			<<((unsigned int)data[0]&0xff)<<std::endl;*/
-	u32 header_size = 3;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	SharedBuffer<u8> b = prependHeader(data, RELIABLE_HEADER_SIZE);
 
 	writeU8(&b[0], TYPE_RELIABLE);
 	writeU16(&b[1], seqnum);
 
-	memcpy(&b[header_size], *data, data.getSize());
-
 	/*dstream<<"data.getSize()="<<data.getSize()<<", data[0]="
 			<<((unsigned int)data[0]&0xff)<<std::endl;*/
 	//dstream<<"END SharedBuffer<u8> makeReliablePacket()"<<std::endl;
@@ -163,68 +178,67 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_slots(RELIABLE_BUFFER_INITIAL),
+	m_count(0),
+	m_first(0),
+	m_last(0),
+	m_time(0),
+	m_next_timer_id(0)
+{
+}
+
 void ReliablePacketBuffer::print()
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	if(empty())
+		return;
+	for(u16 s=m_first; ; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		dout_con<<s<<" ";
+		if(getSlot(s))
+			dout_con<<s<<" ";
+		if(s == m_last)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
-	return m_list.empty();
+	return m_count == 0;
 }
 u32 ReliablePacketBuffer::size()
 {
-	return m_list.getSize();
+	return m_count;
 }
 RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
-	}
-	return i;
+	Slot *slot = getSlot(seqnum);
+	if(slot == NULL)
+		return notFound();
+	return &slot->packet;
 }
 RPBSearchResult ReliablePacketBuffer::notFound()
 {
-	return m_list.end();
+	return NULL;
 }
 u16 ReliablePacketBuffer::getFirstSeqnum()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	return readU16(&p.data[BASE_HEADER_SIZE+1]);
+	return m_first;
 }
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	core::list<BufferedPacket>::Iterator i = m_list.begin();
-	m_list.erase(i);
-	return p;
+	return take(getSlot(m_first));
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	Slot *slot = getSlot(seqnum);
+	if(slot == NULL){
 		dout_con<<"Not found"<<std::endl;
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-	m_list.erase(r);
-	return p;
+	return take(slot);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p)
 {
@@ -233,82 +247,200 @@ void ReliablePacketBuffer::insert(BufferedPacket &p)
 	assert(type == TYPE_RELIABLE);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
 
-	// Find the right place for the packet and insert it there
-
-	// If list is empty, just add it
-	if(m_list.empty())
+	if(empty())
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
+		m_first = seqnum;
+		m_last = seqnum;
 	}
-	// Otherwise find the right place
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	for(; i != m_list.end(); i++){
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		if(s == seqnum){
+	else
+	{
+		if(getSlot(seqnum) != NULL)
 			throw AlreadyExistsException("Same seqnum in list");
+
+		u16 first = m_first;
+		u16 last = m_last;
+		if(seqnum_higher(first, seqnum))
+			first = seqnum;
+		if(seqnum_higher(seqnum, last))
+			last = seqnum;
+
+		// Make room for everything between the first and the last
+		u32 span = (u32)(u16)(last - first) + 1;
+		if(span > RELIABLE_BUFFER_MAX)
+			throw InvalidIncomingDataException("Reliable seqnum out of range");
+		u32 capacity = m_slots.size();
+		while(capacity < span)
+			capacity *= 2;
+		if(capacity != m_slots.size())
+			resize(capacity);
+
+		m_first = first;
+		m_last = last;
+	}
+
+	Slot *slot = &m_slots[seqnum & (m_slots.size() - 1)];
+	slot->packet = p;
+	slot->used = true;
+	slot->seqnum = seqnum;
+	slot->buffered_time = m_time;
+	m_count++;
+	restartTimer(slot);
+
+	// Drop timers of packets that are gone
+	while(m_timers.empty() == false && isTimerValid(m_timers.front()) == false)
+		m_timers.pop_front();
+}
+
+void ReliablePacketBuffer::incrementTimeouts(float dtime)
+{
+	m_time += dtime;
+}
+
+bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
+{
+	if(empty())
+		return false;
+	return (m_time - getSlot(m_first)->buffered_time >= timeout);
+}
+
+core::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
+{
+	core::list<BufferedPacket> timed_outs;
+	// Restarted timers go to the back, don't see them again
+	u32 count = m_timers.size();
+	for(u32 i=0; i<count; i++)
+	{
+		Timer t = m_timers.front();
+		if(isTimerValid(t) == false){
+			m_timers.pop_front();
+			continue;
 		}
-		if(seqnum_higher(s, seqnum)){
+		Slot *slot = getSlot(t.seqnum);
+		if(m_time - slot->sent_time < timeout)
 			break;
-		}
+		m_timers.pop_front();
+
+		BufferedPacket p = slot->packet;
+		p.time = m_time - slot->sent_time;
+		p.totaltime = m_time - slot->buffered_time;
+		timed_outs.push_back(p);
+
+		slot->packet.resent = true;
+		restartTimer(slot);
 	}
-	// If we're at the end of the list, add the packet to the
-	// end of the list
-	if(i == m_list.end())
+	return timed_outs;
+}
+
+u32 ReliablePacketBuffer::popBefore(u16 seqnum)
+{
+	u32 count = 0;
+	while(empty() == false && seqnum_higher(seqnum, m_first))
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
+		take(getSlot(m_first));
+		count++;
 	}
-	// Insert before i
-	m_list.insert_before(i, p);
+	return count;
 }
 
-void ReliablePacketBuffer::incrementTimeouts(float dtime)
+core::list<BufferedPacket> ReliablePacketBuffer::getMissingBefore(u16 seqnum,
+		float min_time)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		i->time += dtime;
-		i->totaltime += dtime;
+	core::list<BufferedPacket> missing;
+	if(empty())
+		return missing;
+	for(u16 s=m_first; seqnum_higher(seqnum, s); s++)
+	{
+		Slot *slot = getSlot(s);
+		if(slot != NULL && m_time - slot->sent_time >= min_time)
+		{
+			BufferedPacket p = slot->packet;
+			p.time = m_time - slot->sent_time;
+			p.totaltime = m_time - slot->buffered_time;
+			missing.push_back(p);
+
+			slot->packet.resent = true;
+			restartTimer(slot);
+		}
+		if(s == m_last)
+			break;
 	}
+	return missing;
 }
 
-void ReliablePacketBuffer::resetTimedOuts(float timeout)
+u32 ReliablePacketBuffer::getReceivedMask(u16 seqnum)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->time >= timeout)
-			i->time = 0.0;
+	u32 mask = 0;
+	if(empty())
+		return mask;
+	for(u16 i=0; i<32; i++)
+	{
+		if(getSlot(seqnum + 1 + i) != NULL)
+			mask |= (u32)1 << i;
 	}
+	return mask;
 }
 
-bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
+BufferedPacket ReliablePacketBuffer::take(Slot *slot)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->totaltime >= timeout)
-			return true;
+	BufferedPacket p = slot->packet;
+	p.time = m_time - slot->sent_time;
+	p.totaltime = m_time - slot->buffered_time;
+
+	slot->packet = BufferedPacket();
+	slot->used = false;
+	m_count--;
+
+	if(empty())
+	{
+		// All the timers are stale now
+		m_timers.clear();
+		m_time = 0;
+		if(m_slots.size() > RELIABLE_BUFFER_INITIAL)
+			std::vector<Slot>(RELIABLE_BUFFER_INITIAL).swap(m_slots);
+		return p;
 	}
-	return false;
+
+	// Keep the ends on packets that exist
+	u16 seqnum = slot->seqnum;
+	if(seqnum == m_first)
+	{
+		while(getSlot(m_first) == NULL)
+			m_first++;
+	}
+	else if(seqnum == m_last)
+	{
+		while(getSlot(m_last) == NULL)
+			m_last--;
+	}
+	return p;
 }
 
-core::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
+void ReliablePacketBuffer::restartTimer(Slot *slot)
 {
-	core::list<BufferedPacket> timed_outs;
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	slot->sent_time = m_time;
+	slot->timer_id = m_next_timer_id++;
+	Timer t;
+	t.seqnum = slot->seqnum;
+	t.id = slot->timer_id;
+	m_timers.push_back(t);
+}
+
+bool ReliablePacketBuffer::isTimerValid(const Timer &t)
+{
+	Slot *slot = getSlot(t.seqnum);
+	return (slot != NULL && slot->timer_id == t.id);
+}
+
+void ReliablePacketBuffer::resize(u32 capacity)
+{
+	std::vector<Slot> slots(capacity);
+	for(u32 i=0; i<m_slots.size(); i++)
 	{
-		if(i->time >= timeout)
-			timed_outs.push_back(*i);
+		Slot &slot = m_slots[i];
+		if(slot.used)
+			slots[slot.seqnum & (capacity - 1)] = slot;
 	}
-	return timed_outs;
+	m_slots.swap(slots);
 }
 
 /*
@@ -330,7 +462,7 @@ IncomingSplitBuffer::~IncomingSplitBuffer()
 */
 SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 {
-	u32 headersize = BASE_HEADER_SIZE + 7;
+	u32 headersize = BASE_HEADER_SIZE + SPLIT_HEADER_SIZE;
 	assert(p.data.getSize() >= headersize);
 	u8 type = readU8(&p.data[BASE_HEADER_SIZE+0]);
 	assert(type == TYPE_SPLIT);
@@ -365,8 +497,7 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 
 	// Cut chunk data out of packet
 	u32 chunkdatasize = p.data.getSize() - headersize;
-	SharedBuffer<u8> chunkdata(chunkdatasize);
-	memcpy(*chunkdata, &(p.data[headersize]), chunkdatasize);
+	SharedBuffer<u8> chunkdata = p.data.slice(headersize, chunkdatasize);
 
 	// Set chunk data in buffer
 	sp->chunks[chunk_num] = chunkdata;
@@ -438,11 +569,46 @@ Channel::Channel()
 	next_outgoing_seqnum = SEQNUM_INITIAL;
 	next_incoming_seqnum = SEQNUM_INITIAL;
 	next_outgoing_split_seqnum = SEQNUM_INITIAL;
+	cwnd = CWND_INITIAL;
+	ssthresh = SSTHRESH_INITIAL;
+	recovery_seqnum = SEQNUM_INITIAL;
+	in_recovery = false;
 }
 Channel::~Channel()
 {
 }
 
+void Channel::reportAck(u16 seqnum, u32 count)
+{
+	// Everything sent before the last loss has been acknowledged
+	if(in_recovery && seqnum_higher(recovery_seqnum, seqnum) == false)
+		in_recovery = false;
+
+	for(u32 i=0; i<count; i++)
+	{
+		if(cwnd < ssthresh)
+			cwnd += 1.0;
+		else
+			cwnd += 1.0 / cwnd;
+	}
+	if(cwnd > CWND_MAX)
+		cwnd = CWND_MAX;
+}
+
+void Channel::reportLoss(u16 seqnum)
+{
+	// The window has already been halved for this one
+	if(in_recovery && seqnum_higher(recovery_seqnum, seqnum))
+		return;
+
+	ssthresh = cwnd / 2.0;
+	if(ssthresh < CWND_MIN)
+		ssthresh = CWND_MIN;
+	cwnd = ssthresh;
+	recovery_seqnum = next_outgoing_seqnum;
+	in_recovery = true;
+}
+
 /*
 	Peer
 */
@@ -458,7 +624,9 @@ Peer::Peer(u16 a_id, Address a_address):
 	m_sendtime_accu(0),
 	m_max_packets_per_second(10),
 	m_num_sent(0),
-	m_max_num_sent(0)
+	m_max_num_sent(0),
+	m_reliables_sent(0),
+	m_reliables_resent(0)
 {
 }
 Peer::~Peer()
@@ -467,20 +635,6 @@ Peer::~Peer()
 
 void Peer::reportRTT(float rtt)
 {
-	if(rtt >= 0.0){
-		if(rtt < 0.01){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 10;
-		} else if(rtt < 0.2){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 2;
-		} else {
-			m_max_packets_per_second *= 0.8;
-			if(m_max_packets_per_second < 10)
-				m_max_packets_per_second = 10;
-		}
-	}
-
 	if(rtt < -0.999)
 	{}
 	else if(avg_rtt < 0.0)
@@ -506,6 +660,37 @@ void Peer::reportRTT(float rtt)
 	resend_timeout = timeout;
 }
 
+float Peer::getPacingRate()
+{
+	float rtt = avg_rtt;
+	// No samples yet
+	if(rtt < 0.0)
+		rtt = 0.1;
+	if(rtt < 0.01)
+		rtt = 0.01;
+
+	// Pace faster while the busiest channel is still probing
+	float cwnd_sum = 0;
+	Channel *busiest = &channels[0];
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+	{
+		cwnd_sum += channels[i].cwnd;
+		if(channels[i].outgoing_reliables.size() >
+				busiest->outgoing_reliables.size())
+			busiest = &channels[i];
+	}
+	float gain = PACING_GAIN;
+	if(busiest->cwnd < busiest->ssthresh)
+		gain = PACING_GAIN_SLOWSTART;
+
+	float rate = cwnd_sum / rtt * gain;
+	if(rate < PACING_RATE_MIN)
+		rate = PACING_RATE_MIN;
+	if(rate > PACING_RATE_MAX)
+		rate = PACING_RATE_MAX;
+	return rate;
+}
+
 /*
 	Connection
 */
@@ -571,10 +756,9 @@ void * Connection::Thread()
 
 		runTimeouts(dtime);
 
-		while(m_command_queue.size() != 0){
-			ConnectionCommand c = m_command_queue.pop_front();
+		ConnectionCommand c;
+		while(m_command_queue.try_pop_front(c))
 			processCommand(c);
-		}
 
 		send(dtime);
 
@@ -633,6 +817,7 @@ void Connection::send(float dtime)
 			j.atEnd() == false; j++)
 	{
 		Peer *peer = j.getNode()->getValue();
+		peer->m_max_packets_per_second = peer->getPacingRate();
 		peer->m_sendtime_accu += dtime;
 		peer->m_num_sent = 0;
 		peer->m_max_num_sent = peer->m_sendtime_accu *
@@ -644,11 +829,12 @@ void Connection::send(float dtime)
 		Peer *peer = getPeerNoEx(packet.peer_id);
 		if(!peer)
 			continue;
-		if(peer->channels[packet.channelnum].outgoing_reliables.size() >= 5){
+		Channel *channel = &peer->channels[packet.channelnum];
+		if(channel->outgoing_reliables.size() >= channel->cwnd){
 			postponed_packets.push_back(packet);
 		} else if(peer->m_num_sent < peer->m_max_num_sent){
 			rawSendAsPacket(packet.peer_id, packet.channelnum,
-					packet.data, packet.reliable);
+					packet.data, packet.reliable, packet.tail);
 			peer->m_num_sent++;
 		} else {
 			postponed_packets.push_back(packet);
@@ -672,49 +858,58 @@ void Connection::send(float dtime)
 // Receive packets from the network and buffers and create ConnectionEvents
 void Connection::receive()
 {
-	u32 datasize = 100000;
-	// TODO: We can not know how many layers of header there are.
-	// For now, just assume there are no other than the base headers.
-	u32 packet_maxsize = datasize + BASE_HEADER_SIZE;
-	SharedBuffer<u8> packetdata(packet_maxsize);
-
 	bool single_wait_done = false;
 
 	for(;;)
 	{
-	try{
 		/* Check if some buffer has relevant data */
+		for(;;)
 		{
-			u16 peer_id;
-			SharedBuffer<u8> resultdata;
-			bool got = getFromBuffers(peer_id, resultdata);
-			if(got){
+			try{
+				u16 peer_id;
+				SharedBuffer<u8> resultdata;
+				if(getFromBuffers(peer_id, resultdata) == false)
+					break;
 				ConnectionEvent e;
 				e.dataReceived(peer_id, resultdata);
 				putEvent(e);
-				continue;
+			}catch(InvalidIncomingDataException &e){
+			}
+			catch(ProcessedSilentlyException &e){
 			}
 		}
 
-		if(single_wait_done){
-			if(m_socket.WaitData(0) == false)
-				break;
-		}
+		// Get the replies to the last batch out before waiting
+		flushSends();
 
+		// Only the first batch waits for data
+		int count = m_socket.ReceiveBatch(m_receive_batch, !single_wait_done);
 		single_wait_done = true;
+		if(count == 0)
+			break;
 
-		Address sender;
-		s32 received_size = m_socket.Receive(sender, *packetdata, packet_maxsize);
+		for(int i=0; i<count; i++){
+			if(m_receive_batch.sizes[i] == 0)
+				continue;
+			processDatagram(m_receive_batch.addresses[i],
+					m_receive_batch.getData(i), m_receive_batch.sizes[i]);
+		}
+	}
 
-		if(received_size < 0)
-			break;
-		if(received_size < BASE_HEADER_SIZE)
-			continue;
-		if(readU32(&packetdata[0]) != m_protocol_id)
-			continue;
+	flushSends();
+}
 
-		u16 peer_id = readPeerId(*packetdata);
-		u8 channelnum = readChannel(*packetdata);
+void Connection::processDatagram(Address &sender, u8 *packetdata,
+		u32 received_size)
+{
+	if(received_size < BASE_HEADER_SIZE)
+		return;
+	if(readU32(&packetdata[0]) != m_protocol_id)
+		return;
+
+	try{
+		u16 peer_id = readPeerId(packetdata);
+		u8 channelnum = readChannel(packetdata);
 		if(channelnum > CHANNEL_COUNT-1){
 			PrintInfo(derr_con);
 			derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
@@ -788,7 +983,7 @@ void Connection::receive()
 			}
 			if(out_of_ids){
 				errorstream<<getDesc()<<" ran out of peer ids"<<std::endl;
-				continue;
+				return;
 			}
 
 			PrintInfo();
@@ -837,7 +1032,7 @@ void Connection::receive()
 			PrintInfo(derr_con);
 			derr_con<<"Peer "<<peer_id<<" sending from different address."
 					" Ignoring."<<std::endl;
-			continue;
+			return;
 		}
 
 		peer->timeout_counter = 0.0;
@@ -860,21 +1055,26 @@ void Connection::receive()
 			dout_con<<"ProcessPacket returned data of size "
 					<<resultdata.getSize()<<std::endl;
 
-			if(datasize < resultdata.getSize())
-				throw InvalidIncomingDataException
-						("Buffer too small for received data");
-
 			ConnectionEvent e;
 			e.dataReceived(peer_id, resultdata);
 			putEvent(e);
-			continue;
 		}catch(ProcessedSilentlyException &e){
 		}
 	}catch(InvalidIncomingDataException &e){
 	}
 	catch(ProcessedSilentlyException &e){
 	}
-	} // for
+}
+
+void Connection::flushSends()
+{
+	try{
+		m_socket.FlushSends();
+		m_sending.clear();
+	}catch(SendFailedException &e){
+		PrintInfo(derr_con);
+		derr_con<<"Failed to send queued packets"<<std::endl;
+	}
 }
 
 void Connection::runTimeouts(float dtime)
@@ -936,7 +1136,8 @@ void Connection::runTimeouts(float dtime)
 			timed_outs = channel->
 					outgoing_reliables.getTimedOuts(resend_timeout);
 
-			channel->outgoing_reliables.resetTimedOuts(resend_timeout);
+			if(timed_outs.empty())
+				continue;
 
 			j = timed_outs.begin();
 			for(; j != timed_outs.end(); j++)
@@ -955,13 +1156,19 @@ void Connection::runTimeouts(float dtime)
 						<<std::endl;
 
 				rawSend(*j);
-
-				// Enlarge avg_rtt and resend_timeout:
-				// The rtt will be at least the timeout.
-				// NOTE: This won't affect the timeout of the next
-				// checked channel because it was cached.
-				peer->reportRTT(resend_timeout);
+				peer->m_reliables_resent++;
 			}
+
+			channel->reportLoss(readU16(
+					&(timed_outs.begin()->data[BASE_HEADER_SIZE+1])));
+
+			// Back off until the next RTT sample. avg_rtt is left
+			// alone as the pacing rate is derived from it.
+			// NOTE: This won't affect the timeout of the next
+			// checked channel because it was cached.
+			peer->resend_timeout = resend_timeout * 2;
+			if(peer->resend_timeout > RESEND_TIMEOUT_MAX)
+				peer->resend_timeout = RESEND_TIMEOUT_MAX;
 		}
 
 		/*
@@ -1052,6 +1259,7 @@ void Connection::disconnect()
 		Peer *peer = j.getNode()->getValue();
 		rawSendAsPacket(peer->id, 0, data, false);
 	}
+	flushSends();
 }
 
 void Connection::sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
@@ -1081,29 +1289,27 @@ void Connection::send(u16 peer_id, u8 channelnum,
 	if(reliable)
 		chunksize_max -= RELIABLE_HEADER_SIZE;
 
-	core::list<SharedBuffer<u8> > originals;
+	core::list<PacketParts> originals;
 	originals = makeAutoSplitPacket(data, chunksize_max,
 			channel->next_outgoing_split_seqnum);
 
-	core::list<SharedBuffer<u8> >::Iterator i;
+	core::list<PacketParts>::Iterator i;
 	i = originals.begin();
 	for(; i != originals.end(); i++)
 	{
-		SharedBuffer<u8> original = *i;
-
-		sendAsPacket(peer_id, channelnum, original, reliable);
+		sendAsPacket(peer_id, channelnum, i->data, reliable, i->tail);
 	}
 }
 
 void Connection::sendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		SharedBuffer<u8> data, bool reliable, SharedBuffer<u8> tail)
 {
-	OutgoingPacket packet(peer_id, channelnum, data, reliable);
+	OutgoingPacket packet(peer_id, channelnum, data, reliable, tail);
 	m_outgoing_queue.push_back(packet);
 }
 
 void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		SharedBuffer<u8> data, bool reliable, SharedBuffer<u8> tail)
 {
 	Peer *peer = getPeerNoEx(peer_id);
 	if(!peer)
@@ -1120,6 +1326,7 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 		// Add base headers and make a packet
 		BufferedPacket p = makePacket(peer->address, reliable,
 				m_protocol_id, m_peer_id, channelnum);
+		p.tail = tail;
 
 		try{
 			// Buffer the packet
@@ -1136,12 +1343,14 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 
 		// Send the packet
 		rawSend(p);
+		peer->m_reliables_sent++;
 	}
 	else
 	{
 		// Add base headers and make a packet
 		BufferedPacket p = makePacket(peer->address, data,
 				m_protocol_id, m_peer_id, channelnum);
+		p.tail = tail;
 
 		// Send the packet
 		rawSend(p);
@@ -1151,7 +1360,9 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 void Connection::rawSend(const BufferedPacket &packet)
 {
 	try{
-		m_socket.Send(packet.address, *packet.data, packet.data.getSize());
+		m_sending.push_back(packet);
+		m_socket.QueueSend(packet.address, *packet.data, packet.data.getSize(),
+				*packet.tail, packet.tail.getSize());
 	} catch(SendFailedException &e){
 		derr_con<<"Connection::rawSend(): SendFailedException: "
 				<<packet.address.serializeString()<<std::endl;
@@ -1258,8 +1469,8 @@ bool Connection::checkIncomingBuffers(Channel *channel, u16 &peer_id,
 
 			u32 headers_size = BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE;
 			// Get out the inside packet and re-process it
-			SharedBuffer<u8> payload(p.data.getSize() - headers_size);
-			memcpy(*payload, &p.data[headers_size], payload.getSize());
+			SharedBuffer<u8> payload = p.data.slice(headers_size,
+					p.data.getSize() - headers_size);
 
 			dst = processPacket(channel, payload, peer_id, channelnum, true);
 			return true;
@@ -1288,40 +1499,16 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 
 		if(controltype == CONTROLTYPE_ACK)
 		{
-			if(packetdata.getSize() < 4)
+			if(packetdata.getSize() < ACK_HEADER_SIZE)
 				throw InvalidIncomingDataException
 						("packetdata.getSize() < 4 (ACK header size)");
 
-			u16 seqnum = readU16(&packetdata[2]);
 			PrintInfo();
 			dout_con<<"Got CONTROLTYPE_ACK: channelnum="
 					<<((int)channelnum&0xff)<<", peer_id="<<peer_id
-					<<", seqnum="<<seqnum<<std::endl;
-
-			try{
-				BufferedPacket p = channel->outgoing_reliables.popSeqnum(seqnum);
-				// Get round trip time
-				float rtt = p.totaltime;
-
-				// Let peer calculate stuff according to it
-				// (avg_rtt and resend_timeout)
-				Peer *peer = getPeer(peer_id);
-				peer->reportRTT(rtt);
+					<<", seqnum="<<readU16(&packetdata[2])<<std::endl;
 
-				//PrintInfo(dout_con);
-				//dout_con<<"RTT = "<<rtt<<std::endl;
-
-				/*dout_con<<"OUTGOING: ";
-				PrintInfo();
-				channel->outgoing_reliables.print();
-				dout_con<<std::endl;*/
-			}
-			catch(NotFoundException &e){
-				PrintInfo(derr_con);
-				derr_con<<"WARNING: ACKed packet not "
-						"in outgoing queue"
-						<<std::endl;
-			}
+			processAck(getPeer(peer_id), channel, packetdata);
 
 			throw ProcessedSilentlyException("Got an ACK");
 		}
@@ -1386,9 +1573,8 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		dout_con<<"RETURNING TYPE_ORIGINAL to user"
 				<<std::endl;
 		// Get the inside packet out and return it
-		SharedBuffer<u8> payload(packetdata.getSize() - ORIGINAL_HEADER_SIZE);
-		memcpy(*payload, &packetdata[ORIGINAL_HEADER_SIZE], payload.getSize());
-		return payload;
+		return packetdata.slice(ORIGINAL_HEADER_SIZE,
+				packetdata.getSize() - ORIGINAL_HEADER_SIZE);
 	}
 	else if(type == TYPE_SPLIT)
 	{
@@ -1443,14 +1629,8 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		//DEBUG
 		//assert(channel->incoming_reliables.size() < 100);
 
-		// Send a CONTROLTYPE_ACK
-		SharedBuffer<u8> reply(4);
-		writeU8(&reply[0], TYPE_CONTROL);
-		writeU8(&reply[1], CONTROLTYPE_ACK);
-		writeU16(&reply[2], seqnum);
-		rawSendAsPacket(peer_id, channelnum, reply, false);
-
-		//if(seqnum_higher(seqnum, channel->next_incoming_seqnum))
+		// Buffer it before ACKing so that a packet the buffer can't
+		// take is not ACKed
 		if(is_future_packet)
 		{
 			/*PrintInfo();
@@ -1477,7 +1657,29 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 			catch(AlreadyExistsException &e)
 			{
 			}
+		}
+
+		// Everything before this has been received
+		u16 received_until = channel->next_incoming_seqnum;
+		if(seqnum == received_until)
+			received_until++;
+		while(channel->incoming_reliables.findPacket(received_until) !=
+				channel->incoming_reliables.notFound())
+			received_until++;
+
+		// Send a CONTROLTYPE_ACK
+		SharedBuffer<u8> reply(SELECTIVE_ACK_SIZE);
+		writeU8(&reply[0], TYPE_CONTROL);
+		writeU8(&reply[1], CONTROLTYPE_ACK);
+		writeU16(&reply[2], seqnum);
+		writeU16(&reply[4], received_until);
+		writeU32(&reply[6], channel->incoming_reliables.getReceivedMask(
+				received_until));
+		rawSendAsPacket(peer_id, channelnum, reply, false);
 
+		//if(seqnum_higher(seqnum, channel->next_incoming_seqnum))
+		if(is_future_packet)
+		{
 			throw ProcessedSilentlyException("Buffered future reliable packet");
 		}
 		//else if(seqnum_higher(channel->next_incoming_seqnum, seqnum))
@@ -1490,8 +1692,8 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		channel->next_incoming_seqnum++;
 
 		// Get out the inside packet and re-process it
-		SharedBuffer<u8> payload(packetdata.getSize() - RELIABLE_HEADER_SIZE);
-		memcpy(*payload, &packetdata[RELIABLE_HEADER_SIZE], payload.getSize());
+		SharedBuffer<u8> payload = packetdata.slice(RELIABLE_HEADER_SIZE,
+				packetdata.getSize() - RELIABLE_HEADER_SIZE);
 
 		return processPacket(channel, payload, peer_id, channelnum, true);
 	}
@@ -1509,6 +1711,80 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 	throw BaseException("Error in Channel::ProcessPacket()");
 }
 
+void Connection::processAck(Peer *peer, Channel *channel,
+		SharedBuffer<u8> &data)
+{
+	ReliablePacketBuffer &outgoing = channel->outgoing_reliables;
+	u16 seqnum = readU16(&data[2]);
+	u16 highest = seqnum;
+	u32 acked = 0;
+
+	try{
+		BufferedPacket p = outgoing.popSeqnum(seqnum);
+		acked++;
+		// Get round trip time, unless it's ambiguous
+		// Let peer calculate stuff according to it
+		// (avg_rtt and resend_timeout)
+		if(p.resent == false)
+			peer->reportRTT(p.totaltime);
+	}
+	catch(NotFoundException &e){
+		PrintInfo(derr_con);
+		derr_con<<"WARNING: ACKed packet not "
+				"in outgoing queue"
+				<<std::endl;
+	}
+
+	// Older peers only ACK the one packet
+	if(data.getSize() >= SELECTIVE_ACK_SIZE)
+	{
+		u16 received_until = readU16(&data[4]);
+		u32 received = readU32(&data[6]);
+
+		acked += outgoing.popBefore(received_until);
+		if(seqnum_higher((u16)(received_until - 1), highest))
+			highest = received_until - 1;
+
+		for(u16 i=0; i<32; i++)
+		{
+			if((received & ((u32)1 << i)) == 0)
+				continue;
+			u16 s = received_until + 1 + i;
+			if(outgoing.findPacket(s) != outgoing.notFound()){
+				outgoing.popSeqnum(s);
+				acked++;
+			}
+			if(seqnum_higher(s, highest))
+				highest = s;
+		}
+
+		/*
+			Packets sent before the highest received one that have not
+			been acknowledged within a round trip are most likely lost.
+			Re-send them now instead of waiting for resend_timeout.
+		*/
+		float min_time = peer->avg_rtt;
+		if(min_time < 0.0)
+			min_time = peer->resend_timeout;
+		core::list<BufferedPacket> missing =
+				outgoing.getMissingBefore(highest, min_time);
+		if(missing.empty() == false)
+		{
+			core::list<BufferedPacket>::Iterator i = missing.begin();
+			for(; i != missing.end(); i++)
+			{
+				rawSend(*i);
+				peer->m_reliables_resent++;
+			}
+			channel->reportLoss(readU16(
+					&(missing.begin()->data[BASE_HEADER_SIZE+1])));
+		}
+	}
+
+	if(acked != 0)
+		channel->reportAck(highest, acked);
+}
+
 bool Connection::deletePeer(u16 peer_id, bool timeout)
 {
 	if(m_peers.find(peer_id) == NULL)
@@ -1530,12 +1806,10 @@ bool Connection::deletePeer(u16 peer_id, bool timeout)
 
 ConnectionEvent Connection::getEvent()
 {
-	if(m_event_queue.size() == 0){
-		ConnectionEvent e;
+	ConnectionEvent e;
+	if(m_event_queue.try_pop_front(e) == false)
 		e.type = CONNEVENT_NONE;
-		return e;
-	}
-	return m_event_queue.pop_front();
+	return e;
 }
 
 ConnectionEvent Connection::waitEvent(u32 timeout_ms)
@@ -1593,9 +1867,14 @@ void Connection::Disconnect()
 }
 
 u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
+{
+	return Receive(peer_id, data, m_bc_receive_timeout);
+}
+
+u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data, u32 timeout_ms)
 {
 	for(;;){
-		ConnectionEvent e = waitEvent(m_bc_receive_timeout);
+		ConnectionEvent e = waitEvent(timeout_ms);
 		if(e.type != CONNEVENT_NONE)
 			dout_con<<getDesc()<<": Receive: got event: "
 					<<e.describe()<<std::endl;
@@ -1604,7 +1883,7 @@ u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
 			throw NoIncomingDataException("No incoming data");
 		case CONNEVENT_DATA_RECEIVED:
 			peer_id = e.peer_id;
-			data = SharedBuffer<u8>(e.data);
+			data = e.data;
 			return e.data.getSize();
 		case CONNEVENT_PEER_ADDED: {
 			Peer tmp(e.peer_id, e.address);
@@ -1657,6 +1936,24 @@ float Connection::GetPeerAvgRTT(u16 peer_id)
 	return getPeer(peer_id)->avg_rtt;
 }
 
+PeerStats Connection::GetPeerStats(u16 peer_id)
+{
+	JMutexAutoLock peerlock(m_peers_mutex);
+	Peer *peer = getPeer(peer_id);
+	PeerStats stats;
+	stats.avg_rtt = peer->avg_rtt;
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+	{
+		stats.cwnd += peer->channels[i].cwnd;
+		stats.in_flight += peer->channels[i].outgoing_reliables.size();
+	}
+	if(peer->m_reliables_sent != 0)
+		stats.loss_ratio = (float)peer->m_reliables_resent /
+				peer->m_reliables_sent;
+	stats.pacing_rate = peer->m_max_packets_per_second;
+	return stats;
+}
+
 void Connection::DeletePeer(u16 peer_id)
 {
 	ConnectionCommand c;
@@ -28,6 +28,8 @@
 
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <deque>
 #include "debug.h"
 #include "common_irrlicht.h"
 #include "socket.h"
@@ -120,21 +122,30 @@ inline bool seqnum_higher(u16 higher, u16 lower)
 	if(lower > higher && lower - higher > SEQNUM_MAX/2){
 		return true;
 	}
+	// Likewise, lower has wrapped around and higher has not
+	if(higher > lower && higher - lower > SEQNUM_MAX/2){
+		return false;
+	}
 	return (higher > lower);
 }
 
 struct BufferedPacket
 {
 	BufferedPacket(u8 *a_data, u32 a_size):
-		data(a_data, a_size), time(0.0), totaltime(0.0)
+		data(a_data, a_size), time(0.0), totaltime(0.0), resent(false)
 	{}
 	BufferedPacket(u32 a_size):
-		data(a_size), time(0.0), totaltime(0.0)
+		data(a_size), time(0.0), totaltime(0.0), resent(false)
+	{}
+	BufferedPacket():
+		time(0.0), totaltime(0.0), resent(false)
 	{}
 	SharedBuffer<u8> data; // Data of the packet, including headers
+	SharedBuffer<u8> tail; // Sent after data, usually a slice of user data
 	float time; // Seconds from buffering the packet or re-sending
 	float totaltime; // Seconds from buffering the packet
 	Address address; // Sender or destination
+	bool resent; // RTT samples are not taken from re-sent packets
 };
 
 // This adds the base headers to the data and makes a packet out of it
@@ -147,15 +158,26 @@ BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 SharedBuffer<u8> makeOriginalPacket(
 		SharedBuffer<u8> data);
 
-// Split data in chunks and add TYPE_SPLIT headers to them
-core::list<SharedBuffer<u8> > makeSplitPacket(
+/*
+	A packet on its way down the protocol layers, which prepend their
+	headers to data. tail is sent after data without being copied.
+*/
+struct PacketParts
+{
+	SharedBuffer<u8> data;
+	SharedBuffer<u8> tail;
+};
+
+// Split data in chunks and add TYPE_SPLIT headers to them.
+// The chunks are tails that share the storage of data.
+core::list<PacketParts> makeSplitPacket(
 		SharedBuffer<u8> data,
 		u32 chunksize_max,
 		u16 seqnum);
 
 // Depending on size, make a TYPE_ORIGINAL or TYPE_SPLIT packet
 // Increments split_seqnum if a split packet is made
-core::list<SharedBuffer<u8> > makeAutoSplitPacket(
+core::list<PacketParts> makeAutoSplitPacket(
 		SharedBuffer<u8> data,
 		u32 chunksize_max,
 		u16 &split_seqnum);
@@ -216,6 +238,11 @@ CONTROL: This is a packet used by the protocol.
 controltype and data description:
 	CONTROLTYPE_ACK
 		[2] u16 seqnum
+		Optional selective part, ignored by older peers:
+		[4] u16 next_incoming_seqnum
+		- All seqnums before this have been received
+		[6] u32 received
+		- Bit i is set if next_incoming_seqnum+1+i has been received
 	CONTROLTYPE_SET_PEER_ID
 		[2] u16 peer_id_new
 	CONTROLTYPE_PING
@@ -228,6 +255,8 @@ controltype and data description:
 #define CONTROLTYPE_SET_PEER_ID 1
 #define CONTROLTYPE_PING 2
 #define CONTROLTYPE_DISCO 3
+#define ACK_HEADER_SIZE 4
+#define SELECTIVE_ACK_SIZE 10
 /*
 ORIGINAL: This is a plain packet with no control and no error
 checking at all.
@@ -270,19 +299,42 @@ checking at all.
 */
 #define TYPE_RELIABLE 3
 #define RELIABLE_HEADER_SIZE 3
+#define SPLIT_HEADER_SIZE 7
+/*
+	Data given to Connection::Send() can be allocated with this much
+	headroom, so that the headers of a packet that isn't split are
+	prepended to it in place instead of it being copied.
+*/
+#define PACKET_HEADROOM (BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE \
+		+ ORIGINAL_HEADER_SIZE)
 //#define SEQNUM_INITIAL 0x10
 #define SEQNUM_INITIAL 65500
 
 /*
 	A buffer which stores reliable packets and sorts them internally
 	for fast access to the smallest one.
+
+	Packets are kept in a ring indexed by seqnum, which grows to fit
+	the span between the smallest and the largest seqnum. Lookups and
+	removals are O(1).
+
+	Resend timers: the time each packet was last sent is appended to a
+	queue, which is thus ordered by age. Timed out packets are taken
+	from its front and re-queued; entries of packets that have since
+	been removed or re-sent are skipped.
 */
 
-typedef core::list<BufferedPacket>::Iterator RPBSearchResult;
+// Initial and maximum ring sizes
+#define RELIABLE_BUFFER_INITIAL 32
+#define RELIABLE_BUFFER_MAX 32768
+
+// A packet pointer, NULL if not found
+typedef BufferedPacket* RPBSearchResult;
 
 class ReliablePacketBuffer
 {
 public:
+	ReliablePacketBuffer();
 
 	void print();
 	bool empty();
@@ -292,14 +344,68 @@ public:
 	u16 getFirstSeqnum();
 	BufferedPacket popFirst();
 	BufferedPacket popSeqnum(u16 seqnum);
+	// Throws InvalidIncomingDataException if seqnum is too far from the
+	// packets already in the buffer
 	void insert(BufferedPacket &p);
 	void incrementTimeouts(float dtime);
-	void resetTimedOuts(float timeout);
+	// Assumes packets are inserted in seqnum order, as outgoing ones are
 	bool anyTotaltimeReached(float timeout);
+	// Returns the packets that have waited for timeout since they were
+	// last sent, marks them as re-sent and restarts their timers
 	core::list<BufferedPacket> getTimedOuts(float timeout);
+	// Removes the packets before seqnum, returns how many there were
+	u32 popBefore(u16 seqnum);
+	/*
+		Returns the packets before seqnum that have waited for at least
+		min_time, marks them as re-sent and restarts their timers
+	*/
+	core::list<BufferedPacket> getMissingBefore(u16 seqnum, float min_time);
+	// Bit i is set if seqnum+1+i is in the buffer
+	u32 getReceivedMask(u16 seqnum);
 
 private:
-	core::list<BufferedPacket> m_list;
+	struct Slot
+	{
+		Slot(): used(false), seqnum(0), sent_time(0), buffered_time(0),
+				timer_id(0) {}
+		BufferedPacket packet;
+		bool used;
+		u16 seqnum;
+		float sent_time;
+		float buffered_time;
+		// Matches the queued timer that is still valid
+		u32 timer_id;
+	};
+	struct Timer
+	{
+		u16 seqnum;
+		u32 id;
+	};
+
+	Slot *getSlot(u16 seqnum)
+	{
+		Slot *slot = &m_slots[seqnum & (m_slots.size() - 1)];
+		if(slot->used && slot->seqnum == seqnum)
+			return slot;
+		return NULL;
+	}
+	// Fills in the time fields and empties the slot
+	BufferedPacket take(Slot *slot);
+	void restartTimer(Slot *slot);
+	bool isTimerValid(const Timer &t);
+	void resize(u32 capacity);
+
+	// Size is a power of two
+	std::vector<Slot> m_slots;
+	u32 m_count;
+	// Valid if m_count != 0
+	u16 m_first;
+	u16 m_last;
+	// Seconds, advanced by incrementTimeouts(). Reset when the buffer
+	// empties so that it stays precise.
+	float m_time;
+	std::deque<Timer> m_timers;
+	u32 m_next_timer_id;
 };
 
 /*
@@ -342,6 +448,21 @@ struct Channel
 	ReliablePacketBuffer outgoing_reliables;
 
 	IncomingSplitBuffer incoming_splits;
+
+	/*
+		Congestion control (AIMD) of outgoing reliables: the window
+		grows by one packet per ACK in slow start and by one packet per
+		window after that, and is halved once per window of losses.
+	*/
+	void reportAck(u16 seqnum, u32 count);
+	void reportLoss(u16 seqnum);
+
+	// Maximum number of unacknowledged reliables, in packets
+	float cwnd;
+	float ssthresh;
+	// Losses of packets sent before this don't shrink the window again
+	u16 recovery_seqnum;
+	bool in_recovery;
 };
 
 class Peer;
@@ -382,6 +503,9 @@ public:
 	*/
 	void reportRTT(float rtt);
 
+	// Packets per second allowed by the congestion windows
+	float getPacingRate();
+
 	Channel channels[CHANNEL_COUNT];
 
 	// Address of the peer
@@ -405,9 +529,32 @@ public:
 	int m_num_sent;
 	int m_max_num_sent;
 
+	// Statistics
+	u32 m_reliables_sent;
+	u32 m_reliables_resent;
+
 private:
 };
 
+struct PeerStats
+{
+	float avg_rtt;
+	// Summed over channels
+	float cwnd;
+	u32 in_flight;
+	// Fraction of reliables that had to be re-sent
+	float loss_ratio;
+	float pacing_rate;
+
+	PeerStats():
+		avg_rtt(-1.0),
+		cwnd(0),
+		in_flight(0),
+		loss_ratio(0),
+		pacing_rate(0)
+	{}
+};
+
 /*
 	Connection
 */
@@ -417,13 +564,15 @@ struct OutgoingPacket
 	u16 peer_id;
 	u8 channelnum;
 	SharedBuffer<u8> data;
+	SharedBuffer<u8> tail;
 	bool reliable;
 
 	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
-			bool reliable_):
+			bool reliable_, SharedBuffer<u8> tail_):
 		peer_id(peer_id_),
 		channelnum(channelnum_),
 		data(data_),
+		tail(tail_),
 		reliable(reliable_)
 	{
 	}
@@ -440,7 +589,7 @@ struct ConnectionEvent
 {
 	enum ConnectionEventType type;
 	u16 peer_id;
-	Buffer<u8> data;
+	SharedBuffer<u8> data;
 	bool timeout;
 	Address address;
 
@@ -499,7 +648,7 @@ struct ConnectionCommand
 	Address address;
 	u16 peer_id;
 	u8 channelnum;
-	Buffer<u8> data;
+	SharedBuffer<u8> data;
 	bool reliable;
 
 	ConnectionCommand(): type(CONNCMD_NONE) {}
@@ -562,19 +711,27 @@ public:
 	bool Connected();
 	void Disconnect();
 	u32 Receive(u16 &peer_id, SharedBuffer<u8> &data);
+	u32 Receive(u16 &peer_id, SharedBuffer<u8> &data, u32 timeout_ms);
 	void SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void Send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void RunTimeouts(float dtime); // dummy
 	u16 GetPeerID(){ return m_peer_id; }
 	Address GetPeerAddress(u16 peer_id);
 	float GetPeerAvgRTT(u16 peer_id);
+	PeerStats GetPeerStats(u16 peer_id);
 	void DeletePeer(u16 peer_id);
+	// For testing, see UDPSocket::setLinkSimulation()
+	void SetLinkSimulation(u32 latency_ms, float loss_ratio)
+	{ m_socket.setLinkSimulation(latency_ms, loss_ratio); }
 
 private:
 	void putEvent(ConnectionEvent &e);
 	void processCommand(ConnectionCommand &c);
 	void send(float dtime);
 	void receive();
+	void processDatagram(Address &sender, u8 *packetdata, u32 received_size);
+	// Sends the packets queued in the socket
+	void flushSends();
 	void runTimeouts(float dtime);
 	void serve(u16 port);
 	void connect(Address address);
@@ -582,9 +739,11 @@ private:
 	void sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void sendAsPacket(u16 peer_id, u8 channelnum,
-			SharedBuffer<u8> data, bool reliable);
+			SharedBuffer<u8> data, bool reliable,
+			SharedBuffer<u8> tail=SharedBuffer<u8>());
 	void rawSendAsPacket(u16 peer_id, u8 channelnum,
-			SharedBuffer<u8> data, bool reliable);
+			SharedBuffer<u8> data, bool reliable,
+			SharedBuffer<u8> tail=SharedBuffer<u8>());
 	void rawSend(const BufferedPacket &packet);
 	Peer* getPeer(u16 peer_id);
 	Peer* getPeerNoEx(u16 peer_id);
@@ -607,15 +766,22 @@ private:
 			SharedBuffer<u8> packetdata, u16 peer_id,
 			u8 channelnum, bool reliable);
 	bool deletePeer(u16 peer_id, bool timeout);
+	// Handles an ACK of seqnum and the selective part if there is one
+	void processAck(Peer *peer, Channel *channel, SharedBuffer<u8> &data);
 
 	Queue<OutgoingPacket> m_outgoing_queue;
-	MutexedQueue<ConnectionEvent> m_event_queue;
-	MutexedQueue<ConnectionCommand> m_command_queue;
+	// Events go to the user thread and commands come from any thread
+	LockFreeQueue<ConnectionEvent> m_event_queue;
+	LockFreeQueue<ConnectionCommand> m_command_queue;
 
 	u32 m_protocol_id;
 	u32 m_max_packet_size;
 	float m_timeout;
 	UDPSocket m_socket;
+	UDPBatch m_receive_batch;
+	// Packets queued in m_socket, which refers to their data until
+	// flushSends()
+	std::vector<BufferedPacket> m_sending;
 	u16 m_peer_id;
 
 	core::map<u16, Peer*> m_peers;
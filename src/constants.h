@@ -48,6 +48,30 @@
 // resend_timeout = avg_rtt * this
 #define RESEND_TIMEOUT_FACTOR 4
 
+// Congestion window of a channel's outgoing reliables, in packets
+#define CWND_INITIAL 4
+#define CWND_MIN 2
+#define CWND_MAX 256
+#define SSTHRESH_INITIAL 64
+// Packets are paced at cwnd/avg_rtt times this
+#define PACING_GAIN_SLOWSTART 2.0
+#define PACING_GAIN 1.25
+// Packets per second
+#define PACING_RATE_MIN 10
+#define PACING_RATE_MAX 5000
+
+// Packets handled by one Server::Receive() before the next AsyncRunStep()
+#define SERVER_RECEIVE_BATCH 64
+
+// Seconds of budget a peer or the server can save up while idle
+#define SEND_BUDGET_BURST 0.25
+// Bytes a peer may send per round of the send scheduler
+#define SEND_QUANTUM 1024
+// Unreliable packets are dropped when a peer's queue has this many bytes
+#define SEND_UNRELIABLE_QUEUE_MAX 16384
+// Blocks up to this distance from the player go in the near block queue
+#define SEND_NEAR_BLOCK_DISTANCE 2
+
 #define PI 3.14159
 
 // The absolute working limit is (2^15 - viewing_range).
@@ -65,6 +89,9 @@
 */
 //#define MAP_BLOCKSIZE 32
 
+// Blocks held in compact storage are kept loaded this many times longer
+#define COMPACT_BLOCK_UNLOAD_FACTOR 4
+
 // Sectors are split to SECTOR_HEIGHTMAP_SPLIT^2 heightmaps
 #define SECTOR_HEIGHTMAP_SPLIT (MAP_BLOCKSIZE/8)
 
@@ -76,6 +103,8 @@
 // Override for the previous one when distance of block
 // is very low
 #define BLOCK_SEND_DISABLE_LIMITS_MAX_D 1
+// Blocks this far or further are only sent if they are near ground level
+#define BLOCK_SEND_GROUND_ONLY_MIN_D 4
 
 #define PLAYER_INVENTORY_SIZE (8*4)
 
@@ -530,6 +530,7 @@ void content_mapnode_init(bool repeat)
 	f->type = CMT_DIRT;
 	f->dig_time = 1.0;
 	f->farm_ploughable = true;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_ASH;
@@ -563,6 +564,7 @@ void content_mapnode_init(bool repeat)
 	f->cook_type = COOK_FURNACE|COOK_SMELTERY;
 	f->type = CMT_DIRT;
 	f->dig_time = 1.0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 	content_list_add("cooking",i,1,0);
 	content_list_add("decrafting",i,1,0);
@@ -704,6 +706,7 @@ void content_mapnode_init(bool repeat)
 	f->cook_result = std::string("MaterialItem2 ")+itos(CONTENT_TERRACOTTA)+" 1";
 	f->type = CMT_DIRT;
 	f->dig_time = 1.0;
+	f->envticks = true;
 	crafting::setSoftBlockRecipe(CONTENT_CRAFTITEM_CLAY,CONTENT_CLAY);
 	content_list_add("craftguide",i,1,0);
 	content_list_add("creative",i,1,0);
@@ -2244,6 +2247,7 @@ void content_mapnode_init(bool repeat)
 	f->dig_time = 0.9;
 	f->crush_result = std::string("MaterialItem2 ")+itos(CONTENT_GRAVEL)+" 1";
 	f->crush_type = CRUSH_CRUSHER;
+	f->envticks = true;
 	crafting::set5Recipe(CONTENT_ROUGHSTONE,CONTENT_COBBLE);
 	crafting::setHardBlockRecipe(CONTENT_ROCK,CONTENT_COBBLE);
 	content_list_add("craftguide",i,1,0);
@@ -44,6 +44,7 @@ void content_mapnode_farm(bool repeat)
 	f->dug_item = std::string("MaterialItem2 ")+itos(CONTENT_MUD)+" 1";
 	f->type = CMT_DIRT;
 	f->dig_time = 1.0;
+	f->envticks = true;
 	content_list_add("decrafting",i,1,0);
 
 	i = CONTENT_FERTILIZER;
@@ -427,6 +428,7 @@ void content_mapnode_farm(bool repeat)
 	f->dig_time = 0.4;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 
 	i = CONTENT_FARM_COTTON;
 	f = &content_features(i);
@@ -474,6 +476,7 @@ void content_mapnode_farm(bool repeat)
 	f->dig_time = 0.4;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 
 	i = CONTENT_DEAD_VINE;
 	f = &content_features(i);
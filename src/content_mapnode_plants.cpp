@@ -129,6 +129,7 @@ void content_mapnode_plants(bool repeat)
 	f->type = CMT_TREE;
 	f->dig_time = 1.0;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_YOUNG_JUNGLETREE;
@@ -149,6 +150,7 @@ void content_mapnode_plants(bool repeat)
 	f->type = CMT_TREE;
 	f->dig_time = 1.0;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_YOUNG_APPLE_TREE;
@@ -169,6 +171,7 @@ void content_mapnode_plants(bool repeat)
 	f->type = CMT_TREE;
 	f->dig_time = 1.0;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_YOUNG_CONIFER_TREE;
@@ -189,6 +192,7 @@ void content_mapnode_plants(bool repeat)
 	f->type = CMT_TREE;
 	f->dig_time = 1.0;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_JUNGLEGRASS;
@@ -394,6 +398,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.15;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("decrafting",i,1,0);
 	content_list_add("cooking",i,1,0);
 
@@ -634,6 +639,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.15;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("decrafting",i,1,0);
 
 	i = CONTENT_TRIMMED_APPLE_BLOSSOM;
@@ -676,6 +682,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.20;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_CACTUS_FLOWER;
@@ -696,6 +703,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.20;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 	content_list_add("decrafting",i,1,0);
 
@@ -717,6 +725,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.20;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_CACTUS;
@@ -740,6 +749,7 @@ void content_mapnode_plants(bool repeat)
 	f->type = CMT_WOOD;
 	f->dig_time = 0.75;
 	f->pressure_type = CST_CRUSHABLE;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_PAPYRUS;
@@ -763,6 +773,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.25;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_SAPLING;
@@ -784,6 +795,7 @@ void content_mapnode_plants(bool repeat)
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
 	f->fertilizer_affects = true;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_APPLE_SAPLING;
@@ -805,6 +817,7 @@ void content_mapnode_plants(bool repeat)
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
 	f->fertilizer_affects = true;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_JUNGLESAPLING;
@@ -826,6 +839,7 @@ void content_mapnode_plants(bool repeat)
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
 	f->fertilizer_affects = true;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_CONIFER_SAPLING;
@@ -847,6 +861,7 @@ void content_mapnode_plants(bool repeat)
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
 	f->fertilizer_affects = true;
+	f->envticks = true;
 	content_list_add("creative",i,1,0);
 
 	i = CONTENT_APPLE;
@@ -896,6 +911,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.10;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 
 	i = CONTENT_WILDGRASS_LONG;
 	f = &content_features(i);
@@ -963,6 +979,7 @@ void content_mapnode_plants(bool repeat)
 	f->dig_time = 0.10;
 	f->pressure_type = CST_CRUSHABLE;
 	f->suffocation_per_second = 0;
+	f->envticks = true;
 
 	i = CONTENT_FLOWER_ROSE;
 	f = &content_features(i);
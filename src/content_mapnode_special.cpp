@@ -1212,6 +1212,7 @@ void content_mapnode_special(bool repeat)
 	f->post_effect_color = video::SColor(192, 255, 64, 0);
 #endif
 	f->pressure_type = CST_CRUSHED;
+	f->envticks = true;
 
 	i = CONTENT_TORCH;
 	f = &content_features(i);
@@ -36,10 +36,12 @@
 #include "content_sao.h"
 #include "content_mob.h"
 #include "plantgrowth.h"
+#include "noise.h"
 #include "log.h"
 #include "profiler.h"
 #include "server.h"
 #include "client.h"
+#include "clientserver.h"
 
 #include "nvp.h"
 #include "path.h"
@@ -305,6 +307,180 @@ void ActiveBlockList::update(std::list<v3s16> &active_positions,
 	}
 }
 
+/*
+	ActiveObjectGrid
+*/
+
+void ActiveObjectGrid::insert(ServerActiveObject *obj)
+{
+	v3s16 blockpos = getNodeBlockPos(floatToInt(obj->getBasePosition(), BS));
+	m_blocks[blockpos].push_back(obj);
+	m_object_blocks[obj->getId()] = blockpos;
+}
+
+void ActiveObjectGrid::remove(u16 id)
+{
+	std::map<u16, v3s16>::iterator i = m_object_blocks.find(id);
+	if (i == m_object_blocks.end())
+		return;
+	std::map<v3s16, std::vector<ServerActiveObject*> >::iterator b = m_blocks.find(i->second);
+	if (b != m_blocks.end()) {
+		std::vector<ServerActiveObject*> &objects = b->second;
+		for (u32 k=0; k<objects.size(); k++) {
+			if (objects[k]->getId() != id)
+				continue;
+			objects[k] = objects.back();
+			objects.pop_back();
+			break;
+		}
+		if (objects.empty())
+			m_blocks.erase(b);
+	}
+	m_object_blocks.erase(i);
+}
+
+void ActiveObjectGrid::update(ServerActiveObject *obj)
+{
+	v3s16 blockpos = getNodeBlockPos(floatToInt(obj->getBasePosition(), BS));
+	std::map<u16, v3s16>::iterator i = m_object_blocks.find(obj->getId());
+	if (i != m_object_blocks.end() && i->second == blockpos)
+		return;
+	remove(obj->getId());
+	insert(obj);
+}
+
+void ActiveObjectGrid::getNear(v3f pos, f32 radius, std::vector<ServerActiveObject*> &dest)
+{
+	v3f r(radius, radius, radius);
+	v3s16 bmin = getNodeBlockPos(floatToInt(pos - r, BS));
+	v3s16 bmax = getNodeBlockPos(floatToInt(pos + r, BS));
+	u32 rows = (u32)(bmax.X-bmin.X+1) * (bmax.Y-bmin.Y+1);
+
+	// With few blocks that have objects, just go through all of them
+	if (rows > m_blocks.size()) {
+		for (std::map<v3s16, std::vector<ServerActiveObject*> >::iterator i = m_blocks.begin(); i != m_blocks.end(); i++) {
+			v3s16 p = i->first;
+			if (p.X < bmin.X || p.Y < bmin.Y || p.Z < bmin.Z)
+				continue;
+			if (p.X > bmax.X || p.Y > bmax.Y || p.Z > bmax.Z)
+				continue;
+			dest.insert(dest.end(), i->second.begin(), i->second.end());
+		}
+		return;
+	}
+
+	// The blocks are ordered by X, Y and then Z, so each row of blocks
+	// along Z is found with a single lookup
+	v3s16 p;
+	p.Z = bmin.Z;
+	for (p.X=bmin.X; p.X<=bmax.X; p.X++)
+	for (p.Y=bmin.Y; p.Y<=bmax.Y; p.Y++) {
+		std::map<v3s16, std::vector<ServerActiveObject*> >::iterator i = m_blocks.lower_bound(p);
+		for (; i != m_blocks.end(); i++) {
+			v3s16 b = i->first;
+			if (b.X != p.X || b.Y != p.Y || b.Z > bmax.Z)
+				break;
+			dest.insert(dest.end(), i->second.begin(), i->second.end());
+		}
+	}
+}
+
+/*
+	The contents that have a case in the node step of
+	ServerEnvironment::step(). Air is only stepped in space, which is
+	looked at whole.
+*/
+static const content_t g_envstep_contents[] = {
+	CONTENT_MUD, CONTENT_CLAY, CONTENT_FARM_WHEAT,
+	CONTENT_FARM_MELON, CONTENT_FARM_PUMPKIN, CONTENT_FARM_POTATO,
+	CONTENT_FARM_CARROT, CONTENT_FARM_BEETROOT,
+	CONTENT_FARM_COTTON, CONTENT_WATER, CONTENT_WATERSOURCE,
+	CONTENT_ICE, CONTENT_SNOW, CONTENT_SNOW_BLOCK,
+	CONTENT_FARM_DIRT, CONTENT_FARM_GRAPEVINE,
+	CONTENT_FARM_TRELLIS_GRAPE, CONTENT_WILDGRASS_SHORT,
+	CONTENT_WILDGRASS_LONG, CONTENT_FLOWER_STEM, CONTENT_DEADGRASS,
+	CONTENT_FLOWER_ROSE, CONTENT_FLOWER_DAFFODIL,
+	CONTENT_FLOWER_TULIP, CONTENT_CACTUS, CONTENT_CACTUS_BLOSSOM,
+	CONTENT_CACTUS_FLOWER, CONTENT_CACTUS_FRUIT,
+	CONTENT_APPLE_LEAVES, CONTENT_JUNGLELEAVES,
+	CONTENT_CONIFER_LEAVES, CONTENT_LEAVES, CONTENT_LEAVES_AUTUMN,
+	CONTENT_LEAVES_WINTER, CONTENT_LEAVES_SNOWY,
+	CONTENT_APPLE_BLOSSOM, CONTENT_FIRE_SHORTTERM, CONTENT_FIRE,
+	CONTENT_FLASH, CONTENT_TNT, CONTENT_COBBLE, CONTENT_SAPLING,
+	CONTENT_YOUNG_TREE, CONTENT_APPLE_SAPLING,
+	CONTENT_YOUNG_APPLE_TREE, CONTENT_JUNGLESAPLING,
+	CONTENT_YOUNG_JUNGLETREE, CONTENT_CONIFER_SAPLING,
+	CONTENT_YOUNG_CONIFER_TREE, CONTENT_APPLE, CONTENT_SAND,
+	CONTENT_SPONGE, CONTENT_PAPYRUS, CONTENT_STEAM,
+	CONTENT_LAVASOURCE, CONTENT_LAVA, CONTENT_VACUUM,
+	CONTENT_LIFE_SUPPORT,
+};
+
+void envstep_init()
+{
+	for (u32 i=0; i<sizeof(g_envstep_contents)/sizeof(content_t); i++) {
+		content_features(g_envstep_contents[i]).envstep = true;
+	}
+	// Their tick counts must go on
+	for (u16 i=0; i<=MAX_CONTENT; i++) {
+		if (content_features(i).envticks)
+			content_features(i).envstep = true;
+	}
+}
+
+/*
+	Whether snow falls in the biome at the season and time of day
+*/
+static bool biome_coldzone(uint8_t biome, u16 season, uint16_t time)
+{
+	switch (biome) {
+	case BIOME_JUNGLE:
+		if (season == ENV_SEASON_WINTER && time > 4000 && time < 8000)
+			return true;
+		break;
+	case BIOME_OCEAN:
+		if (season == ENV_SEASON_WINTER)
+			return true;
+		break;
+	case BIOME_PLAINS:
+		if (season == ENV_SEASON_WINTER && (time < 6000 || time > 18000))
+			return true;
+		break;
+	case BIOME_FOREST:
+		if (season == ENV_SEASON_WINTER)
+			return true;
+		break;
+	case BIOME_SKY:
+	case BIOME_SNOWCAP:
+		return true;
+	case BIOME_LAKE:
+		if (
+			season == ENV_SEASON_WINTER
+			|| (
+				season == ENV_SEASON_AUTUMN
+				&& (time < 6000 || time > 18000)
+			) || (
+				season == ENV_SEASON_SPRING
+				&& time > 4000
+				&& time < 8000
+			)
+		)
+			return true;
+		break;
+	case BIOME_BEACH:
+		if (season == ENV_SEASON_WINTER)
+			return true;
+		break;
+	case BIOME_UNKNOWN:
+	case BIOME_WOODLANDS:
+		if (season == ENV_SEASON_WINTER)
+			return true;
+	default:
+		break;
+	}
+	return false;
+}
+
 /*
 	ServerEnvironment
 */
@@ -315,8 +491,12 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, Server *server):
 	m_send_recommended_timer(0),
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
-	m_players_sleeping(false)
+	m_players_sleeping(false),
+	m_envstep_clock(0),
+	m_envstep_season(0),
+	m_envstep_time(0)
 {
+	envstep_init();
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -614,6 +794,7 @@ void ServerEnvironment::clearAllObjects()
 			continue;
 		}
 		// Delete active object
+		m_active_object_grid.remove(id);
 		delete obj;
 		// Id to be removed from m_active_objects
 		objects_to_remove.push_back(id);
@@ -1016,6 +1197,123 @@ bool ServerEnvironment::dropToParcel(v3s16 pos, InventoryItem *item)
 	return false;
 }
 
+/*
+	The phase of an active block in the 10 second node step period, in
+	seconds. Hashing the position spreads neighbouring blocks apart.
+*/
+static float envstep_phase(v3s16 bp)
+{
+	u32 h = ((u32)bp.X*73856093) ^ ((u32)bp.Y*19349663) ^ ((u32)bp.Z*83492791);
+	return (float)(h%10000)/1000.0;
+}
+
+void ServerEnvironment::queueDueBlocks(float dtime)
+{
+	float from = m_envstep_clock;
+	float to = from+dtime;
+	m_envstep_clock = fmod(to, 10.0);
+	for (std::set<v3s16>::iterator i = m_active_blocks.m_list.begin(); i != m_active_blocks.m_list.end(); i++) {
+		float phase = envstep_phase(*i);
+		if (
+			dtime < 10.0
+			&& (phase < from || phase >= to)
+			&& (phase+10.0 < from || phase+10.0 >= to)
+		)
+			continue;
+		// Still waiting from last time if the steps fall behind
+		if (m_envstep_queued.find(*i) != m_envstep_queued.end())
+			continue;
+		m_envstep_queue.push_back(*i);
+		m_envstep_queued.insert(*i);
+	}
+}
+
+void ServerEnvironment::surveyBlock(EnvStepBlock &s)
+{
+	MapBlock *block = s.block;
+	uint8_t biome = block->getBiome();
+	s.coldzone = biome_coldzone(biome, m_envstep_season, m_envstep_time);
+	bool snow = (s.coldzone && biome != BIOME_BEACH);
+
+	/*
+		Only nodes with ContentFeatures::envstep have anything to do,
+		unless the block needs looking at whole: for air in space, snow
+		in cold zones or a mob spawn area. Blocks that are all air or
+		have none can't have a spawn area.
+	*/
+	u32 air_nodes = block->getAirNodeCount();
+	bool spawn_search = (
+		!block->has_spawn_area
+		&& air_nodes > 0
+		&& air_nodes < MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+	);
+	bool whole_block = (biome == BIOME_SPACE || snow || spawn_search);
+	s.skipped = (!whole_block && block->getEnvStepNodeCount() == 0);
+	if (s.skipped)
+		return;
+
+	PseudoRandom pr(s.seed);
+	v3s16 p0;
+	for (p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+	for (p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+	for (p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++) {
+		MapNode n = block->getNodeNoEx(p0);
+		content_t c = n.getContent();
+		ContentFeatures &f = content_features(c);
+		if (!f.envstep && !whole_block)
+			continue;
+		u32 envticks = block->incNodeTicks(p0);
+
+		if (
+			!block->has_spawn_area
+			&& (
+				f.draw_type == CDT_DIRTLIKE
+				|| c == CONTENT_SAND
+				|| c == CONTENT_STONE
+			)
+		) {
+			MapNode n1 = block->getNodeNoEx(p0+v3s16(0,1,0));
+			MapNode n2 = block->getNodeNoEx(p0+v3s16(0,2,0));
+			if (
+				content_features(n1.getContent()).air_equivalent
+				&& content_features(n2.getContent()).air_equivalent
+				&& pr.range(0,5) == 0
+			) {
+				block->spawn_area = p0;
+				block->has_spawn_area = true;
+			}
+		}
+
+		/*
+			Leave out the nodes that would certainly be left as they
+			are: snow only falls on nodes with air above, and dirt
+			with nothing on it is only changed if it has an overlay
+		*/
+		if (!f.envstep) {
+			if (
+				!(biome == BIOME_SPACE && c == CONTENT_AIR)
+				&& !(
+					snow
+					&& block->getNodeParent(p0+v3s16(0,1,0)).getContent() == CONTENT_AIR
+				)
+			)
+				continue;
+		}else if (
+			(c == CONTENT_MUD || c == CONTENT_CLAY)
+			&& n.param1 == 0
+			&& !content_features(block->getNodeParent(p0+v3s16(0,1,0)).getContent()).air_equivalent
+		) {
+			continue;
+		}
+
+		EnvStepNode sn;
+		sn.p0 = p0;
+		sn.content = c;
+		sn.envticks = envticks;
+		s.nodes.push_back(sn);
+	}
+}
+
 void ServerEnvironment::step(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -1082,8 +1380,8 @@ void ServerEnvironment::step(float dtime)
 				MapNode n = m_map->getNodeNoEx(bottompos);
 				if (n.getContent() == CONTENT_MUD && (n.param1&0xF0) != 0x10) {
 					n.param1 |= 0x10;
-					n.envticks = 0;
 					m_map->setNode(bottompos, n);
+					m_map->setNodeTicks(bottompos, 0);
 				}else{
 					bottompos.Y += 1;
 					MapNode n = m_map->getNodeNoEx(bottompos);
@@ -1217,14 +1515,10 @@ void ServerEnvironment::step(float dtime)
 	*/
 	bool circuitstep = m_active_blocks_circuit_interval.step(dtime, 0.5);
 	bool metastep = m_active_blocks_nodemetadata_interval.step(dtime, 1.0);
-	bool nodestep = m_active_blocks_test_interval.step(dtime, 10.0);
 
-	if (circuitstep || metastep || nodestep) {
+	if (circuitstep || metastep) {
 		float circuit_dtime = 0.5;
 		float meta_dtime = 1.0;
-		u16 season = getSeason();
-		uint16_t time = getTimeOfDay();
-		bool unsafe_fire = config_get_bool("world.game.environment.fire.spread");
 		for (std::set<v3s16>::iterator i = m_active_blocks.m_list.begin(); i != m_active_blocks.m_list.end(); i++) {
 			v3s16 bp = *i;
 
@@ -1241,8 +1535,7 @@ void ServerEnvironment::step(float dtime)
 			block->m_active_objects.swap(new_list);
 
 			// Reset block usage timer
-			if (circuitstep || metastep)
-				block->resetUsageTimer();
+			block->resetUsageTimer();
 
 			// Set current time as timestamp
 			block->setTimestampNoChangedFlag(m_game_time);
@@ -1301,9 +1594,65 @@ void ServerEnvironment::step(float dtime)
 				}
 				m_poststep_nodeswaps.clear();
 			}
+		}
+	}
 
-			if (!nodestep)
+	/*
+		Node step. Each active block is stepped once every 10 seconds,
+		at its own phase of the period so that the work is spread over
+		the steps. Blocks falling due are queued and surveyed in
+		batches, each step takes batches for as long as its time budget
+		lasts and leaves the rest for the next one.
+	*/
+	{
+		queueDueBlocks(dtime);
+
+		u16 season = getSeason();
+		uint16_t time = getTimeOfDay();
+		bool unsafe_fire = config_get_bool("world.game.environment.fire.spread");
+		u32 budget_ms = config_get_int("server.env.step.budget");
+		u32 batch = 4;
+		u32 start_ms = porting::getTimeMs();
+		bool stepped = !m_envstep_queue.empty();
+		u32 envstep_searched = 0;
+		u32 envstep_skipped = 0;
+		std::vector<u32> envstep_nodes(MAX_CONTENT+1, 0);
+		std::vector<u32> envstep_us(MAX_CONTENT+1, 0);
+		m_envstep_season = season;
+		m_envstep_time = time;
+		m_envstep_blocks.clear();
+		u32 envstep_i = 0;
+		for (;;) {
+			if (envstep_i == m_envstep_blocks.size()) {
+				if (m_envstep_queue.empty() || porting::getTimeMs()-start_ms >= budget_ms)
+					break;
+				m_envstep_blocks.clear();
+				envstep_i = 0;
+				while (m_envstep_blocks.size() < batch && !m_envstep_queue.empty()) {
+					v3s16 bp = m_envstep_queue.front();
+					m_envstep_queue.pop_front();
+					m_envstep_queued.erase(bp);
+					if (!m_active_blocks.contains(bp))
+						continue;
+					MapBlock *block = m_map->getBlockNoCreateNoEx(bp);
+					if (block == NULL)
+						continue;
+					EnvStepBlock s;
+					s.block = block;
+					s.seed = myrand();
+					s.coldzone = false;
+					s.skipped = true;
+					m_envstep_blocks.push_back(s);
+				}
+				ScopeProfiler sp(g_profiler, "SEnv: node step survey avg", SPT_AVG);
+				for (u32 i=0; i<m_envstep_blocks.size(); i++) {
+					surveyBlock(m_envstep_blocks[i]);
+				}
 				continue;
+			}
+
+			EnvStepBlock *survey = &m_envstep_blocks[envstep_i++];
+			MapBlock *block = survey->block;
 
 			bool has_steam_sound = false;
 
@@ -1316,8 +1665,9 @@ void ServerEnvironment::step(float dtime)
 
 				Reading can be done quickly directly from the block.
 
-				Everything should bind to inside this single content
-				searching loop to keep things fast.
+				The nodes to step were found by the survey of the block,
+				see surveyBlock(). A node that this step doesn't need
+				to look at should be left out there.
 			*/
 
 			if (block->last_spawn < m_time_of_day-6000) {
@@ -1343,81 +1693,25 @@ void ServerEnvironment::step(float dtime)
 				}
 			}
 
-			v3s16 p0;
 			uint8_t biome = block->getBiome();
-			bool coldzone = false;
-			switch (biome) {
-			case BIOME_JUNGLE:
-				if (season == ENV_SEASON_WINTER && time > 4000 && time < 8000)
-					coldzone = true;
-				break;
-			case BIOME_OCEAN:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-				break;
-			case BIOME_PLAINS:
-				if (season == ENV_SEASON_WINTER && (time < 6000 || time > 18000))
-					coldzone = true;
-				break;
-			case BIOME_FOREST:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-				break;
-			case BIOME_SKY:
-			case BIOME_SNOWCAP:
-				coldzone = true;
-				break;
-			case BIOME_LAKE:
-			if (
-				season == ENV_SEASON_WINTER
-				|| (
-					season == ENV_SEASON_AUTUMN
-					&& (time < 6000 || time > 18000)
-				) || (
-					season == ENV_SEASON_SPRING
-					&& time > 4000
-					&& time < 8000
-				)
-			) {
-				coldzone = true;
-			}
-				break;
-			case BIOME_BEACH:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-				break;
-			case BIOME_UNKNOWN:
-			case BIOME_WOODLANDS:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-			default:
-				break;
+			bool coldzone = survey->coldzone;
+			if (survey->skipped) {
+				envstep_skipped++;
+				continue;
 			}
-			for (p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-			for (p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-			for (p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++) {
-				v3s16 p = p0 + block->getPosRelative();
-				block->incNodeTicks(p0);
-				MapNode n = block->getNodeNoEx(p0);
-				if (
-					!block->has_spawn_area
-					&& (
-						content_features(n.getContent()).draw_type == CDT_DIRTLIKE
-						|| n.getContent() == CONTENT_SAND
-						|| n.getContent() == CONTENT_STONE
-					)
-				) {
-					MapNode n1 = block->getNodeNoEx(p0+v3s16(0,1,0));
-					MapNode n2 = block->getNodeNoEx(p0+v3s16(0,2,0));
-					if (
-						content_features(n1.getContent()).air_equivalent
-						&& content_features(n2.getContent()).air_equivalent
-						&& myrand_range(0,5) == 0
-					) {
-						block->spawn_area = p0;
-						block->has_spawn_area = true;
-					}
-				}
+			envstep_searched++;
+
+			for (std::vector<EnvStepNode>::iterator ni = survey->nodes.begin(); ni != survey->nodes.end(); ni++) {
+				// Steps before this one may have replaced the node
+				MapNode n = block->getNodeNoEx(ni->p0);
+				if (n.getContent() != ni->content)
+					continue;
+				if (content_features(n.getContent()).envstep)
+					envstep_nodes[n.getContent()]++;
+				// Also counts when a case continues the loop
+				TimeTaker node_timer("node step", &envstep_us[n.getContent()], PRECISION_MICRO);
+				v3s16 p = ni->p0 + block->getPosRelative();
+				u32 envticks = ni->envticks;
 
 				switch(n.getContent()) {
 	/*
@@ -1501,7 +1795,7 @@ void ServerEnvironment::step(float dtime)
 								m_map->updateNodeWithEvent(p, n);
 							}
 						// footsteps fade out
-						}else if ((n.param1&0x10) == 0x10 && n.envticks > 3) {
+						}else if ((n.param1&0x10) == 0x10 && envticks > 3) {
 							n.param1 &= ~0x10;
 							m_map->updateNodeWithEvent(p,n);
 						// autumn grass in autumn/winter
@@ -1733,7 +2027,7 @@ void ServerEnvironment::step(float dtime)
 				// Grow stuff on farm dirt
 				case CONTENT_FARM_DIRT:
 				{
-					if (n.envticks%4 == 0) { // with this plants take around 10 minutes to grow
+					if (envticks%4 == 0) { // with this plants take around 10 minutes to grow
 						s16 max_d = 3;
 						v3s16 temp_p = p;
 						v3s16 test_p;
@@ -1796,7 +2090,7 @@ void ServerEnvironment::step(float dtime)
 				 */
 				case CONTENT_FARM_GRAPEVINE:
 				{
-					if (n.envticks%3 == 0) {
+					if (envticks%3 == 0) {
 						MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
 						if (
 							n_btm.getContent() != CONTENT_FARM_GRAPEVINE
@@ -1811,7 +2105,7 @@ void ServerEnvironment::step(float dtime)
 				}
 				case CONTENT_FARM_TRELLIS_GRAPE:
 				{
-					if (n.envticks%3 == 0) {
+					if (envticks%3 == 0) {
 						MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
 						if (
 							n_btm.getContent() != CONTENT_FARM_TRELLIS_GRAPE
@@ -1834,7 +2128,7 @@ void ServerEnvironment::step(float dtime)
 						|| n_btm.getContent() == CONTENT_MUDSNOW
 						|| n_btm.getContent() == CONTENT_MUD
 					) {
-						if (p.Y > -1 && n.envticks > 10) {
+						if (p.Y > -1 && envticks > 10) {
 							MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
 							if (n_btm.getContent() != CONTENT_MUD) {
 								if (n_top.getLightBlend(getDayNightRatio()) >= 13) {
@@ -1896,7 +2190,7 @@ void ServerEnvironment::step(float dtime)
 					if (ch) {
 						if (season == ENV_SEASON_SPRING)
 							break;
-						if ((ch == 50 || p.Y > -1) && n.envticks > 20) {
+						if ((ch == 50 || p.Y > -1) && envticks > 20) {
 							MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
 							if (n_top.getLightBlend(getDayNightRatio()) >= 13) {
 								switch (myrand()%3) {
@@ -1968,7 +2262,7 @@ void ServerEnvironment::step(float dtime)
 				// cactus flowers and fruit
 				case CONTENT_CACTUS:
 				{
-					if (n.envticks > 30) {
+					if (envticks > 30) {
 						bool fully_grown = false;
 						int found = 1;
 						v3s16 p_test = p;
@@ -2021,7 +2315,7 @@ void ServerEnvironment::step(float dtime)
 
 				case CONTENT_CACTUS_BLOSSOM:
 				{
-					if (n.envticks > 30) {
+					if (envticks > 30) {
 						MapNode n_test=m_map->getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
 						if (n_test.getContent() == CONTENT_CACTUS) {
 							n.setContent(CONTENT_CACTUS_FLOWER);
@@ -2033,7 +2327,7 @@ void ServerEnvironment::step(float dtime)
 
 				case CONTENT_CACTUS_FLOWER:
 				{
-					if (n.envticks > 30) {
+					if (envticks > 30) {
 						MapNode n_test=m_map->getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
 						// sometimes fruit, sometimes the flower dies
 						if (n_test.getContent() == CONTENT_CACTUS && myrand()%10 < 6) {
@@ -2048,7 +2342,7 @@ void ServerEnvironment::step(float dtime)
 
 				case CONTENT_CACTUS_FRUIT:
 				{
-					if (n.envticks > 60) {
+					if (envticks > 60) {
 						MapNode n_test=m_map->getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
 						// when the fruit dies, sometimes a new blossom appears
 						if (n_test.getContent() == CONTENT_CACTUS && myrand()%10 == 0) {
@@ -2078,7 +2372,7 @@ void ServerEnvironment::step(float dtime)
 							dropToParcel(p,item);
 						}
 					}else if (
-						n.envticks%30 == 0
+						envticks%30 == 0
 						&& (
 							season == ENV_SEASON_WINTER
 							|| season == ENV_SEASON_SPRING
@@ -2204,7 +2498,7 @@ void ServerEnvironment::step(float dtime)
 
 				case CONTENT_APPLE_BLOSSOM:
 				{
-					if (n.envticks > 30) {
+					if (envticks > 30) {
 						// don't turn all blossoms to apples
 						// blossoms look nice
 						if (searchNear(p,v3s16(3,3,3),CONTENT_APPLE_TREE,NULL)) {
@@ -2239,7 +2533,7 @@ void ServerEnvironment::step(float dtime)
 				case CONTENT_FIRE_SHORTTERM:
 				{
 					if (unsafe_fire) {
-						if (n.envticks > 2) {
+						if (envticks > 2) {
 							s16 bs_rad = config_get_int("world.game.borderstone.radius");
 							bs_rad += 2;
 							// if any node is border stone protected, don't spread
@@ -2264,12 +2558,12 @@ void ServerEnvironment::step(float dtime)
 								}
 							}
 						}
-						if (n.envticks > 10) {
+						if (envticks > 10) {
 							m_map->removeNodeWithEvent(p);
 							InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_ASH,1,0,0);
 							dropToParcel(p,item);
 						}
-					}else if (n.envticks > 2) {
+					}else if (envticks > 2) {
 						m_map->removeNodeWithEvent(p);
 						InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_ASH,1,0,0);
 						dropToParcel(p,item);
@@ -2371,7 +2665,7 @@ void ServerEnvironment::step(float dtime)
 				// cobble becomes mossy underwater
 				case CONTENT_COBBLE:
 				{
-					if (n.envticks > 30 && n.envticks%4 == 0) {
+					if (envticks > 30 && envticks%4 == 0) {
 						MapNode a = m_map->getNodeNoEx(p+v3s16(0,1,0));
 						if (a.getContent() == CONTENT_WATERSOURCE) {
 							n.setContent(CONTENT_MOSSYCOBBLE);
@@ -2395,7 +2689,7 @@ void ServerEnvironment::step(float dtime)
 				// Make trees from saplings!
 				case CONTENT_SAPLING:
 				{
-					if (n.envticks > 1000) {
+					if (envticks > 1000) {
 						// full grown tree
 						actionstream<<"A sapling grows into a tree at "<<PP(p)<<std::endl;
 						std::vector<content_t> search;
@@ -2425,7 +2719,7 @@ void ServerEnvironment::step(float dtime)
 						}else{
 							plantgrowth_tree(this,p);
 						}
-					}else if (n.envticks > 15) {
+					}else if (envticks > 15) {
 						std::vector<content_t> search;
 						search.push_back(CONTENT_AIR);
 						search.push_back(CONTENT_TREE);
@@ -2464,7 +2758,7 @@ void ServerEnvironment::step(float dtime)
 				break;
 				case CONTENT_YOUNG_TREE:
 				{
-					if (n.envticks > 15) {
+					if (envticks > 15) {
 						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
 						if (
 							below == CONTENT_MUD
@@ -2504,7 +2798,7 @@ void ServerEnvironment::step(float dtime)
 									m_map->addNodeWithEvent(p+v3s16(0,2,1),nn);
 									m_map->addNodeWithEvent(p+v3s16(0,2,-1),nn);
 								}
-							}else if (above == CONTENT_YOUNG_TREE && n.envticks > 40) {
+							}else if (above == CONTENT_YOUNG_TREE && envticks > 40) {
 								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
 								content_t top = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
 								if (abv == CONTENT_YOUNG_TREE && top == CONTENT_LEAVES) {
@@ -2534,11 +2828,11 @@ void ServerEnvironment::step(float dtime)
 
 				case CONTENT_APPLE_SAPLING:
 				{
-					if (n.envticks > 1000) {
+					if (envticks > 1000) {
 						actionstream<<"A sapling grows into a tree at "<<PP(p)<<std::endl;
 
 						plantgrowth_appletree(this,p);
-					}else if (n.envticks > 15) {
+					}else if (envticks > 15) {
 						std::vector<content_t> search;
 						search.push_back(CONTENT_AIR);
 						search.push_back(CONTENT_TREE);
@@ -2577,7 +2871,7 @@ void ServerEnvironment::step(float dtime)
 				break;
 				case CONTENT_YOUNG_APPLE_TREE:
 				{
-					if (n.envticks > 15) {
+					if (envticks > 15) {
 						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
 						if (
 							below == CONTENT_MUD
@@ -2617,7 +2911,7 @@ void ServerEnvironment::step(float dtime)
 									m_map->addNodeWithEvent(p+v3s16(0,2,1),nn);
 									m_map->addNodeWithEvent(p+v3s16(0,2,-1),nn);
 								}
-							}else if (above == CONTENT_YOUNG_APPLE_TREE && n.envticks > 40) {
+							}else if (above == CONTENT_YOUNG_APPLE_TREE && envticks > 40) {
 								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
 								content_t top = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
 								if (abv == CONTENT_YOUNG_APPLE_TREE && top == CONTENT_APPLE_LEAVES) {
@@ -2642,11 +2936,11 @@ void ServerEnvironment::step(float dtime)
 
 				case CONTENT_JUNGLESAPLING:
 				{
-					if (n.envticks > 1000) {
+					if (envticks > 1000) {
 						actionstream<<"A sapling grows into a jungle tree at "<<PP(p)<<std::endl;
 
 						plantgrowth_jungletree(this,p);
-					}else if (n.envticks > 15) {
+					}else if (envticks > 15) {
 						std::vector<content_t> search;
 						search.push_back(CONTENT_AIR);
 						search.push_back(CONTENT_TREE);
@@ -2685,7 +2979,7 @@ void ServerEnvironment::step(float dtime)
 				break;
 				case CONTENT_YOUNG_JUNGLETREE:
 				{
-					if (n.envticks > 15) {
+					if (envticks > 15) {
 						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
 						if (
 							below == CONTENT_MUD
@@ -2726,7 +3020,7 @@ void ServerEnvironment::step(float dtime)
 									m_map->addNodeWithEvent(p+v3s16(0,3,1),nn);
 									m_map->addNodeWithEvent(p+v3s16(0,3,-1),nn);
 								}
-							}else if (above == CONTENT_YOUNG_JUNGLETREE && n.envticks > 40) {
+							}else if (above == CONTENT_YOUNG_JUNGLETREE && envticks > 40) {
 								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
 								content_t abv1 = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
 								content_t top = m_map->getNodeNoEx(p+v3s16(0,4,0)).getContent();
@@ -2752,11 +3046,11 @@ void ServerEnvironment::step(float dtime)
 
 				case CONTENT_CONIFER_SAPLING:
 				{
-					if (n.envticks > 1000) {
+					if (envticks > 1000) {
 						actionstream<<"A sapling grows into a conifer tree at "<<PP(p)<<std::endl;
 
 						plantgrowth_conifertree(this,p);
-					}else if (n.envticks > 15) {
+					}else if (envticks > 15) {
 						std::vector<content_t> search;
 						search.push_back(CONTENT_AIR);
 						search.push_back(CONTENT_TREE);
@@ -2795,7 +3089,7 @@ void ServerEnvironment::step(float dtime)
 				break;
 				case CONTENT_YOUNG_CONIFER_TREE:
 				{
-					if (n.envticks > 15) {
+					if (envticks > 15) {
 						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
 						if (
 							below == CONTENT_MUD
@@ -2836,7 +3130,7 @@ void ServerEnvironment::step(float dtime)
 									m_map->addNodeWithEvent(p+v3s16(0,2,1),nn);
 									m_map->addNodeWithEvent(p+v3s16(0,2,-1),nn);
 								}
-							}else if (above == CONTENT_YOUNG_CONIFER_TREE && n.envticks > 40) {
+							}else if (above == CONTENT_YOUNG_CONIFER_TREE && envticks > 40) {
 								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
 								content_t top = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
 								if (abv == CONTENT_YOUNG_CONIFER_TREE && top == CONTENT_CONIFER_LEAVES) {
@@ -2877,7 +3171,7 @@ void ServerEnvironment::step(float dtime)
 				// grow sponges on sand in water
 				case CONTENT_SAND:
 				{
-					if (n.envticks%30 == 0) {
+					if (envticks%30 == 0) {
 						MapNode n_top1 = m_map->getNodeNoEx(p+v3s16(0,1,0));
 						MapNode n_top2 = m_map->getNodeNoEx(p+v3s16(0,2,0));
 						if (
@@ -2927,7 +3221,7 @@ void ServerEnvironment::step(float dtime)
 				// make papyrus grow near water
 				case CONTENT_PAPYRUS:
 				{
-					if (n.envticks%10 == 0) {
+					if (envticks%10 == 0) {
 						MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
 						if (n_btm.getContent() == CONTENT_MUD) {
 							if (searchNear(p,v3s16(2,2,2),CONTENT_WATERSOURCE,NULL))
@@ -3096,6 +3390,28 @@ void ServerEnvironment::step(float dtime)
 			}
 			m_delayed_node_changes.clear();
 		}
+
+		m_envstep_blocks.clear();
+
+		if (stepped) {
+			u32 envstep_ms = porting::getTimeMs()-start_ms;
+			g_profiler->avg("SEnv: node step ms", envstep_ms);
+			if (envstep_ms > budget_ms)
+				g_profiler->add("SEnv: node step over budget (num)", 1);
+			g_profiler->add("SEnv: node step blocks searched (num)", envstep_searched);
+			g_profiler->add("SEnv: node step blocks skipped (num)", envstep_skipped);
+			for (u16 c=0; c<=MAX_CONTENT; c++) {
+				if (envstep_nodes[c] != 0) {
+					std::string name = std::string("SEnv: node step ")+content_features(c).description+" (num)";
+					g_profiler->add(name, envstep_nodes[c]);
+				}
+				if (envstep_us[c] != 0) {
+					std::string name = std::string("SEnv: node step ")+content_features(c).description+" (us)";
+					g_profiler->add(name, envstep_us[c]);
+				}
+			}
+		}
+		g_profiler->avg("SEnv: node step backlog", m_envstep_queue.size());
 	}
 
 	/*
@@ -3133,6 +3449,7 @@ void ServerEnvironment::step(float dtime)
 			}
 			// Step object
 			obj->step(dtime, send_recommended);
+			m_active_object_grid.update(obj);
 			// Read messages from object
 			while (obj->m_messages_out.size() > 0) {
 				m_active_object_messages.push_back(obj->m_messages_out.pop_front());
@@ -3162,8 +3479,10 @@ ServerActiveObject* ServerEnvironment::getActiveObject(u16 id)
 
 void ServerEnvironment::getActiveObjects(v3f origin, f32 max_d, core::array<DistanceSortedActiveObject> &dest)
 {
-	for (std::map<u16, ServerActiveObject*>::iterator i = m_active_objects.begin(); i != m_active_objects.end(); i++) {
-		ServerActiveObject* obj = i->second;
+	std::vector<ServerActiveObject*> objects;
+	m_active_object_grid.getNear(origin, max_d, objects);
+	for (std::vector<ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++) {
+		ServerActiveObject* obj = *i;
 
 		f32 d = (obj->getBasePosition() - origin).getLength();
 
@@ -3508,13 +3827,13 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
+		Only the objects in the blocks near pos are looked at.
 	*/
-	for (std::map<u16, ServerActiveObject*>::iterator i = m_active_objects.begin(); i != m_active_objects.end(); i++) {
-		u16 id = i->first;
-		// Get object
-		ServerActiveObject *object = i->second;
-		if (object == NULL)
-			continue;
+	std::vector<ServerActiveObject*> objects;
+	m_active_object_grid.getNear(pos_f, radius_f, objects);
+	for (std::vector<ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++) {
+		ServerActiveObject *object = *i;
+		u16 id = object->getId();
 		// Discard if removed
 		if (object->m_removed || object->m_pending_deactivation)
 			continue;
@@ -3620,6 +3939,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object, bool set_c
 	}
 
 	m_active_objects[object->getId()] = object;
+	m_active_object_grid.insert(object);
 
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -3709,6 +4029,7 @@ void ServerEnvironment::removeRemovedObjects()
 		}
 
 		// Delete
+		m_active_object_grid.remove(id);
 		delete obj;
 		// Id to be removed from m_active_objects
 		objects_to_remove.push_back(id);
@@ -3871,6 +4192,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 				}
 			}
 			// delete active object
+			m_active_object_grid.remove(id);
 			delete obj;
 			// id to be removed from m_active_objects
 			objects_to_remove.push_back(id);
@@ -3956,6 +4278,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 
 
 		// Delete active object
+		m_active_object_grid.remove(id);
 		delete obj;
 		// Id to be removed from m_active_objects
 		objects_to_remove.push_back(id);
@@ -4426,7 +4749,6 @@ void ClientEnvironment::step(float dtime)
 			MapNode n = m_map->getNodeNoEx(bottompos);
 			if (content_features(n.getContent()).draw_type == CDT_DIRTLIKE && (n.param1&0xF0) == 0) {
 				n.param1 |= 0x10;
-				n.envticks = 0;
 				m_map->setNode(bottompos, n);
 				// Update mesh on client
 				if (m_map->mapType() == MAPTYPE_CLIENT) {
@@ -4567,6 +4889,7 @@ void ClientEnvironment::removeActiveObject(u16 id)
 	obj->removeFromScene();
 	delete obj;
 	m_active_objects.erase(id);
+	m_object_keyframes.erase(id);
 }
 
 void ClientEnvironment::processActiveObjectMessage(u16 id,
@@ -4582,6 +4905,58 @@ void ClientEnvironment::processActiveObjectMessage(u16 id,
 	obj->processMessage(data);
 }
 
+void ClientEnvironment::processActiveObjectPositions(u8 *data, u32 size)
+{
+	if (size < 8)
+		return;
+	v3s16 origin = readV3S16(&data[0]);
+	u16 count = readU16(&data[6]);
+	u32 p = 8;
+	for (u16 i=0; i<count; i++) {
+		if (p+4 > size)
+			break;
+		u16 id = readU16(&data[p]);
+		u8 flags = readU8(&data[p+2]);
+		u8 num = readU8(&data[p+3]);
+		p += 4;
+
+		v3f pos;
+		bool valid = true;
+		if (flags & 1) {
+			if (p+7 > size)
+				break;
+			pos = objectKeyframeToPosition(readV3S16(&data[p]), origin);
+			p += 6;
+			ObjectKeyframe &keyframe = m_object_keyframes[id];
+			keyframe.num = num;
+			keyframe.pos = pos;
+		}else{
+			if (p+4 > size)
+				break;
+			v3f delta(readS8(&data[p]), readS8(&data[p+1]), readS8(&data[p+2]));
+			p += 3;
+			// A delta against a keyframe that hasn't arrived is useless
+			std::map<u16, ObjectKeyframe>::iterator k = m_object_keyframes.find(id);
+			if (k == m_object_keyframes.end() || k->second.num != num) {
+				valid = false;
+			}else{
+				pos = k->second.pos + delta * OBJECT_POSITION_QUANTUM;
+			}
+		}
+		f32 yaw = objectYawFromU8(readU8(&data[p]));
+		p += 1;
+		if (!valid)
+			continue;
+
+		// Pass on as a regular position message
+		std::ostringstream os(std::ios::binary);
+		writeU8(os, 0);
+		writeV3F1000(os, pos);
+		writeF1000(os, yaw);
+		processActiveObjectMessage(id, os.str());
+	}
+}
+
 /*
 	Callbacks for activeobjects
 */
@@ -269,6 +269,68 @@ public:
 private:
 };
 
+/*
+	Active objects by the block they are in, used by ServerEnvironment
+	to find the objects near a position without going through all of
+	them
+*/
+
+class ActiveObjectGrid
+{
+public:
+	void insert(ServerActiveObject *obj);
+	void remove(u16 id);
+	// Moves the object if it has gone to another block
+	void update(ServerActiveObject *obj);
+	/*
+		Gets the objects in the blocks that are at least partly within
+		radius of pos. They still need to be checked for distance.
+	*/
+	void getNear(v3f pos, f32 radius, std::vector<ServerActiveObject*> &dest);
+
+	void clear(){
+		m_blocks.clear();
+		m_object_blocks.clear();
+	}
+
+private:
+	std::map<v3s16, std::vector<ServerActiveObject*> > m_blocks;
+	std::map<u16, v3s16> m_object_blocks;
+};
+
+/*
+	Sets ContentFeatures::envstep for the contents that
+	ServerEnvironment::step() does anything with on its node steps
+*/
+void envstep_init();
+
+/*
+	A node that the node step of ServerEnvironment::step() has something
+	to do with, as its block's survey found it
+*/
+struct EnvStepNode
+{
+	v3s16 p0;
+	content_t content;
+	u32 envticks;
+};
+
+/*
+	The survey of an active block for the node step. A few blocks are
+	surveyed at a time, and what is found is done afterwards, block by
+	block as before.
+*/
+struct EnvStepBlock
+{
+	MapBlock *block;
+	// Seeds the random choices of the survey
+	u32 seed;
+	bool coldzone;
+	// Nothing to do in the block
+	bool skipped;
+	std::vector<EnvStepNode> nodes;
+};
+
 /*
 	The server-side environment.
 
@@ -445,6 +507,14 @@ private:
 	*/
 	void deactivateFarObjects(bool force_delete);
 
+	/*
+		Node step surveys, see EnvStepBlock
+	*/
+
+	// Queues the active blocks whose phase comes in the next dtime
+	void queueDueBlocks(float dtime);
+	void surveyBlock(EnvStepBlock &s);
+
 	/*
 		Member variables
 	*/
@@ -457,6 +527,8 @@ private:
 	std::map<v3s16,MapNode>m_poststep_nodeswaps;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// The same objects by position
+	ActiveObjectGrid m_active_object_grid;
 	// Outgoing network message buffer for active objects
 	Queue<ActiveObjectMessage> m_active_object_messages;
 	// the env events for sending to clients
@@ -467,7 +539,6 @@ private:
 	// List of active blocks
 	ActiveBlockList m_active_blocks;
 	IntervalLimiter m_active_blocks_management_interval;
-	IntervalLimiter m_active_blocks_test_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
 	IntervalLimiter m_active_blocks_circuit_interval;
 	// Time from the beginning of the game in seconds.
@@ -477,6 +548,14 @@ private:
 	float m_game_time_fraction_counter;
 	// whether players are sleeping
 	int m_players_sleeping;
+	// Seconds into the node step period, and the blocks due
+	float m_envstep_clock;
+	std::list<v3s16> m_envstep_queue;
+	std::set<v3s16> m_envstep_queued;
+	// The node step surveys and what they are made for
+	std::vector<EnvStepBlock> m_envstep_blocks;
+	u16 m_envstep_season;
+	u16 m_envstep_time;
 };
 
 #ifndef SERVER
@@ -573,6 +652,11 @@ public:
 	void removeActiveObject(u16 id);
 
 	void processActiveObjectMessage(u16 id, const std::string &data);
+	/*
+		Decodes TOCLIENT_ACTIVE_OBJECT_POSITIONS, without the command,
+		into position messages for the objects
+	*/
+	void processActiveObjectPositions(u8 *data, u32 size);
 
 	/*
 		Callbacks for activeobjects
@@ -622,6 +706,13 @@ private:
 	LocalPlayer *m_local_player;
 	scene::ISceneManager *m_smgr;
 	std::map<u16, ClientActiveObject*> m_active_objects;
+	// The last position keyframe received for each object
+	struct ObjectKeyframe
+	{
+		u8 num;
+		v3f pos;
+	};
+	std::map<u16, ObjectKeyframe> m_object_keyframes;
 	Queue<ClientEnvEvent> m_client_event_queue;
 	IntervalLimiter m_active_object_light_update_interval;
 	IntervalLimiter m_damage_interval;
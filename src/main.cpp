@@ -80,6 +80,13 @@
 #include "xCGUITTFont.h"
 #endif
 #include "sound.h"
+#include "map.h"
+#include "mapsector.h"
+#include "content_mapnode.h"
+#include "noise.h"
+#include "connection.h"
+#include "clientserver.h"
+#include "serverobject.h"
 
 // This makes textures
 ITextureSource *g_texturesource = NULL;
@@ -572,6 +579,27 @@ v3f tempv3f2;
 std::string tempstring;
 std::string tempstring2;
 
+/*
+	A map of blank blocks, radius blocks out from the origin each way
+*/
+class SpeedTestMap : public Map
+{
+public:
+	SpeedTestMap(s16 radius):
+		Map(dstream)
+	{
+		for (s16 z=-radius; z<radius; z++)
+		for (s16 x=-radius; x<radius; x++) {
+			v2s16 p2d(x,z);
+			MapSector *sector = new ServerMapSector(this, p2d);
+			m_sectors.insert(p2d, sector);
+			for (s16 y=-radius; y<radius; y++) {
+				sector->createBlankBlock(y);
+			}
+		}
+	}
+};
+
 void SpeedTests()
 {
 	{
@@ -659,6 +687,398 @@ void SpeedTests()
 		dstream<<"Done. "<<dtime<<"ms, "
 				<<per_ms<<"/ms"<<std::endl;
 	}
+
+	{
+		SpeedTestMap map(4);
+		s16 r = 4*MAP_BLOCKSIZE;
+
+		{
+			// Walks the nodes in index order, as lighting and ABMs do
+			TimeTaker timer("Testing coherent Map::getNodeNoEx speed");
+			u32 n = 0;
+			for (u32 j=0; j<8; j++)
+			for (s16 z=-r; z<r; z++)
+			for (s16 y=-r; y<r; y++)
+			for (s16 x=-r; x<r; x++) {
+				temp16 += map.getNodeNoEx(v3s16(x,y,z)).getContent();
+				n++;
+			}
+			u32 dtime = timer.stop();
+			u32 per_ms = n / MYMAX(dtime, 1);
+			dstream<<"Done. "<<dtime<<"ms, "
+					<<per_ms<<"/ms"<<std::endl;
+		}
+
+		{
+			TimeTaker timer("Testing random Map::getNodeNoEx speed");
+			PseudoRandom pr(42);
+			u32 n = 0;
+			for (; n<2000000; n++) {
+				v3s16 p(pr.range(-r,r-1), pr.range(-r,r-1), pr.range(-r,r-1));
+				temp16 += map.getNodeNoEx(p).getContent();
+			}
+			u32 dtime = timer.stop();
+			u32 per_ms = n / MYMAX(dtime, 1);
+			dstream<<"Done. "<<dtime<<"ms, "
+					<<per_ms<<"/ms"<<std::endl;
+		}
+	}
+
+	{
+		/*
+			A dam breaking: a reservoir of water at the top of a stone
+			slope 128 nodes across is let go. The slope steps down a
+			node every 4 nodes, so the flow keeps going down it and
+			covers all of it in about 50 ticks.
+		*/
+		SpeedTestMap map(4);
+		s16 r = 4*MAP_BLOCKSIZE;
+		MapNode stone(CONTENT_STONE);
+		MapNode air(CONTENT_AIR);
+		MapNode water(CONTENT_WATERSOURCE);
+		for (s16 z=-r; z<r; z++)
+		for (s16 x=-r; x<r; x++) {
+			s16 floor = -r + 40 - (x+r)/4;
+			for (s16 y=-r; y<-r+56; y++) {
+				if (y <= floor)
+					map.setNode(v3s16(x,y,z), stone);
+				else if (x < -r+MAP_BLOCKSIZE && y <= floor+8)
+					map.setNode(v3s16(x,y,z), water);
+				else
+					map.setNode(v3s16(x,y,z), air);
+			}
+		}
+		for (s16 z=-r; z<r; z++)
+		for (s16 y=-r+37; y<-r+48; y++)
+			map.queueLiquid(v3s16(-r+MAP_BLOCKSIZE-1,y,z));
+
+		TimeTaker timer("Testing liquid transform speed (dam break)");
+		u32 max_ms = 0;
+		u32 ticks = 0;
+		for (; ticks<60; ticks++) {
+			core::map<v3s16, MapBlock*> modified_blocks;
+			u32 start_ms = porting::getTimeMs();
+			map.transformLiquids(modified_blocks);
+			max_ms = MYMAX(max_ms, porting::getTimeMs()-start_ms);
+		}
+		u32 dtime = timer.stop();
+		dstream<<"Done. "<<dtime<<"ms, "<<ticks<<" ticks, longest "
+				<<max_ms<<"ms"<<std::endl;
+	}
+
+	{
+		/*
+			Lighting: ground with a roof over part of it, lit from
+			scratch, then changed by single nodes and by explosions
+		*/
+		SpeedTestMap map(4);
+		s16 r = 4*MAP_BLOCKSIZE;
+		MapNode stone(CONTENT_STONE);
+		MapNode air(CONTENT_AIR);
+		MapNode flash(CONTENT_FLASH);
+		std::string player_name("speedtest");
+		core::map<v3s16, MapBlock*> blocks;
+		for (s16 z=-r; z<r; z++)
+		for (s16 y=-r; y<r; y++)
+		for (s16 x=-r; x<r; x++) {
+			bool roof = (y == 8 && x > -20 && x < 20 && z > -20 && z < 20);
+			map.setNode(v3s16(x,y,z), (y < 0 || roof) ? stone : air);
+		}
+		for (s16 z=-4; z<4; z++)
+		for (s16 y=-4; y<4; y++)
+		for (s16 x=-4; x<4; x++) {
+			v3s16 p(x,y,z);
+			blocks.insert(p, map.getBlockNoCreateNoEx(p));
+		}
+
+		{
+			TimeTaker timer("Testing lighting speed (fresh blocks)");
+			core::map<v3s16, MapBlock*> modified_blocks;
+			map.updateLighting(blocks, modified_blocks);
+			u32 dtime = timer.stop();
+			dstream<<"Done. "<<dtime<<"ms, "<<blocks.size()<<" blocks"<<std::endl;
+		}
+
+		{
+			// Building and digging about the roof
+			TimeTaker timer("Testing lighting speed (single node edits)");
+			PseudoRandom pr(7);
+			u32 n = 0;
+			for (; n<1000; n++) {
+				v3s16 p(pr.range(-40,40), pr.range(-1,9), pr.range(-40,40));
+				core::map<v3s16, MapBlock*> modified_blocks;
+				if (map.getNodeNoEx(p).getContent() == CONTENT_AIR)
+					map.addNodeAndUpdate(p, stone, modified_blocks, player_name);
+				else
+					map.removeNodeAndUpdate(p, modified_blocks);
+			}
+			u32 dtime = timer.stop();
+			u32 per_ms = n / MYMAX(dtime, 1);
+			dstream<<"Done. "<<dtime<<"ms, "<<per_ms<<"/ms"<<std::endl;
+		}
+
+		{
+			// Craters as TNT leaves them, flashes that are then removed
+			TimeTaker timer("Testing lighting speed (TNT craters)");
+			u32 n = 0;
+			for (; n<8; n++) {
+				v3s16 c(-35+n*10, -1, -20+n*5);
+				for (s16 z=-2; z<=2; z++)
+				for (s16 y=-2; y<=2; y++)
+				for (s16 x=-2; x<=2; x++) {
+					core::map<v3s16, MapBlock*> modified_blocks;
+					map.addNodeAndUpdate(c+v3s16(x,y,z), flash, modified_blocks, player_name);
+				}
+				for (s16 z=-2; z<=2; z++)
+				for (s16 y=-2; y<=2; y++)
+				for (s16 x=-2; x<=2; x++) {
+					core::map<v3s16, MapBlock*> modified_blocks;
+					map.removeNodeAndUpdate(c+v3s16(x,y,z), modified_blocks);
+				}
+			}
+			u32 dtime = timer.stop();
+			dstream<<"Done. "<<dtime<<"ms, "<<n<<" craters"<<std::endl;
+		}
+	}
+
+	{
+		// A thousand packets in flight, acked slightly out of order
+		TimeTaker timer("Testing ReliablePacketBuffer ack speed");
+		con::ReliablePacketBuffer buffer;
+		const u32 in_flight = 1024;
+		const u32 pool_size = 2048;
+		Address address;
+		SharedBuffer<u8> data(100);
+		core::array<con::BufferedPacket> pool;
+		for (u32 i=0; i<pool_size; i++) {
+			SharedBuffer<u8> reliable = con::makeReliablePacket(data, i);
+			pool.push_back(con::makePacket(address, reliable, PROTOCOL_ID, 1, 0));
+		}
+		PseudoRandom pr(42);
+		u16 seqnum = 0;
+		u32 n = 0;
+		for (u32 i=0; i<200000; i++) {
+			con::BufferedPacket &p = pool[seqnum % pool_size];
+			writeU16(&p.data[BASE_HEADER_SIZE+1], seqnum++);
+			buffer.insert(p);
+			n++;
+			while (buffer.size() > in_flight) {
+				u16 s = buffer.getFirstSeqnum() + pr.range(0, 63);
+				if (buffer.findPacket(s) != buffer.notFound())
+					buffer.popSeqnum(s);
+				else
+					buffer.popFirst();
+				n++;
+			}
+			if (i % 64 == 0) {
+				buffer.incrementTimeouts(0.001);
+				buffer.getTimedOuts(1.0);
+			}
+		}
+		u32 dtime = timer.stop();
+		u32 per_ms = n / MYMAX(dtime, 1);
+		dstream<<"Done. "<<dtime<<"ms, "
+				<<per_ms<<"/ms"<<std::endl;
+	}
+
+	{
+		// Block packets made into reliable datagrams, as done by the
+		// connection thread for every sent block. Connection::Send()
+		// hands the buffer to it without copying.
+		TimeTaker timer("Testing block packet send path speed");
+		Address address;
+		u16 split_seqnum = 0;
+		u16 seqnum = 0;
+		u32 n = 0;
+		u32 bytes = 0;
+		for (u32 i=0; i<20000; i++) {
+			SharedBuffer<u8> block(300 + (i%8)*400, PACKET_HEADROOM);
+			core::list<con::PacketParts> chunks = con::makeAutoSplitPacket(
+					block, 512 - BASE_HEADER_SIZE - RELIABLE_HEADER_SIZE,
+					split_seqnum);
+			for (core::list<con::PacketParts>::Iterator j = chunks.begin();
+					j != chunks.end(); j++) {
+				SharedBuffer<u8> reliable = con::makeReliablePacket(j->data, seqnum++);
+				con::BufferedPacket p = con::makePacket(address, reliable,
+						PROTOCOL_ID, 1, 0);
+				bytes += p.data.getSize() + j->tail.getSize();
+			}
+			n++;
+		}
+		u32 dtime = timer.stop();
+		u32 per_ms = n / MYMAX(dtime, 1);
+		dstream<<"Done. "<<dtime<<"ms, "<<per_ms<<"/ms, "
+				<<(bytes/n)<<" bytes per block"<<std::endl;
+	}
+
+	{
+		// A thousand objects around 30 players, as checked for every
+		// client by the server
+		class SpeedTestSAO : public ServerActiveObject
+		{
+		public:
+			SpeedTestSAO(u16 id, v3f pos):
+				ServerActiveObject(NULL, id, pos)
+			{}
+			u8 getType() const
+			{
+				return ACTIVEOBJECT_TYPE_INVALID;
+			}
+		};
+		ActiveObjectGrid grid;
+		std::map<u16, ServerActiveObject*> objects;
+		core::array<v3f> players;
+		PseudoRandom pr(42);
+		for (u32 i=0; i<30; i++)
+			players.push_back(v3f(pr.range(-1500,1500), pr.range(-50,50), pr.range(-1500,1500))*2*BS);
+		for (u16 id=1; id<=1000; id++) {
+			v3f p = players[id%players.size()]
+					+ v3f(pr.range(-32,32), pr.range(-16,16), pr.range(-32,32))*BS;
+			objects[id] = new SpeedTestSAO(id, p);
+			grid.insert(objects[id]);
+		}
+		f32 radius = 3*MAP_BLOCKSIZE*BS;
+
+		{
+			TimeTaker timer("Testing active object queries by scanning");
+			u32 n = 0;
+			for (u32 j=0; j<100; j++)
+			for (u32 i=0; i<players.size(); i++) {
+				for (std::map<u16, ServerActiveObject*>::iterator k = objects.begin(); k != objects.end(); k++) {
+					if (k->second->getBasePosition().getDistanceFrom(players[i]) <= radius)
+						temp16 += k->first;
+				}
+				n++;
+			}
+			u32 dtime = timer.stop();
+			u32 per_ms = n / MYMAX(dtime, 1);
+			dstream<<"Done. "<<dtime<<"ms, "
+					<<per_ms<<"/ms"<<std::endl;
+		}
+
+		{
+			TimeTaker timer("Testing active object queries by ActiveObjectGrid");
+			u32 n = 0;
+			std::vector<ServerActiveObject*> nearby;
+			for (u32 j=0; j<100; j++)
+			for (u32 i=0; i<players.size(); i++) {
+				nearby.clear();
+				grid.getNear(players[i], radius, nearby);
+				for (u32 k=0; k<nearby.size(); k++) {
+					if (nearby[k]->getBasePosition().getDistanceFrom(players[i]) <= radius)
+						temp16 += nearby[k]->getId();
+				}
+				n++;
+			}
+			u32 dtime = timer.stop();
+			u32 per_ms = n / MYMAX(dtime, 1);
+			dstream<<"Done. "<<dtime<<"ms, "
+					<<per_ms<<"/ms"<<std::endl;
+		}
+
+		for (std::map<u16, ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++)
+			delete i->second;
+	}
+
+	{
+		/*
+			A player walking along X, one block every 10 steps, with
+			every unsent block in range sent each step
+		*/
+		s16 range = 10;
+		u32 steps = 500;
+
+		{
+			TimeTaker timer("Testing finding unsent blocks by scanning shells");
+			core::map<v3s16, bool> sent;
+			u32 found = 0;
+			for (u32 j=0; j<steps; j++) {
+				v3s16 center(j/10,0,0);
+				for (s16 d=0; d<=range; d++) {
+					core::list<v3s16> list;
+					getFacePositions(list, d);
+					for (core::list<v3s16>::Iterator i = list.begin(); i != list.end(); i++) {
+						v3s16 p = *i + center;
+						if (abs(p.Y - center.Y) > range/2)
+							continue;
+						if (sent.find(p) != NULL)
+							continue;
+						sent.insert(p, true);
+						found++;
+					}
+				}
+			}
+			u32 dtime = timer.stop();
+			dstream<<"Done. "<<dtime<<"ms, "<<found<<" blocks"<<std::endl;
+		}
+
+		{
+			TimeTaker timer("Testing finding unsent blocks by BlockSendFrontier");
+			core::map<v3s16, bool> sent;
+			BlockSendFrontier frontier;
+			u32 found = 0;
+			for (u32 j=0; j<steps; j++) {
+				v3s16 center(j/10,0,0);
+				frontier.update(center, range, sent);
+				for (s16 d=0; d<=range; d++) {
+					std::vector<v3s16> list;
+					frontier.get(d, list);
+					for (u32 i=0; i<list.size(); i++) {
+						sent.insert(list[i], true);
+						frontier.remove(list[i]);
+						found++;
+					}
+				}
+			}
+			u32 dtime = timer.stop();
+			dstream<<"Done. "<<dtime<<"ms, "<<found<<" blocks"<<std::endl;
+		}
+	}
+
+	{
+		// Loopback link with a 50ms round trip and 5% loss each way
+		con::Connection server(PROTOCOL_ID, 512, CONNECTION_TIMEOUT);
+		con::Connection client(PROTOCOL_ID, 512, CONNECTION_TIMEOUT);
+		server.SetLinkSimulation(25, 0.05);
+		client.SetLinkSimulation(25, 0.05);
+		server.Serve(30001);
+		client.Connect(Address(127,0,0,1, 30001));
+		client.SetTimeoutMs(10);
+
+		u32 wait_start = porting::getTimeMs();
+		while (!client.Connected() && porting::getTimeMs() - wait_start < 5000) {
+			sleep_ms(10);
+		}
+
+		TimeTaker timer("Testing reliable transfer over a lossy link");
+		const u32 count = 2000;
+		const u32 size = 400;
+		SharedBuffer<u8> data(size);
+		memset(*data, 0, size);
+		// The first client gets peer id 2
+		for (u32 i=0; i<count; i++) {
+			server.Send(2, 0, data, true);
+		}
+		u32 received = 0;
+		while (received < count && timer.getTime() < 60000) {
+			try{
+				u16 peer_id;
+				SharedBuffer<u8> recvdata;
+				client.Receive(peer_id, recvdata);
+				received++;
+			}catch(con::NoIncomingDataException &e) {
+			}
+		}
+		u32 dtime = timer.stop();
+		dstream<<"Done. "<<dtime<<"ms, "<<received<<"/"<<count<<" packets, "
+				<<(received*size/MYMAX(dtime, 1))<<"KB/s"<<std::endl;
+		try{
+			con::PeerStats stats = server.GetPeerStats(2);
+			dstream<<"cwnd="<<stats.cwnd<<" rtt="<<stats.avg_rtt
+					<<" loss="<<stats.loss_ratio<<std::endl;
+		}catch(con::PeerNotFoundException &e) {
+		}
+	}
 }
 
 void drawMenuBackground(video::IVideoDriver* driver)
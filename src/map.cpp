@@ -66,13 +66,128 @@
 			BLOB data
 */
 
+/*
+	MapBlockIndex
+*/
+
+MapBlockIndex::MapBlockIndex():
+	m_capacity(64),
+	m_count(0)
+{
+	m_slots = new Slot[m_capacity];
+	for (u32 i=0; i<m_capacity; i++) {
+		m_slots[i].block = NULL;
+	}
+}
+
+MapBlockIndex::~MapBlockIndex()
+{
+	delete[] m_slots;
+}
+
+void MapBlockIndex::insert(v3s16 p, MapBlock *block)
+{
+	if ((m_count+1)*2 > m_capacity)
+		resize(m_capacity*2);
+
+	u32 mask = m_capacity-1;
+	u32 i = hash(p)&mask;
+	for (; m_slots[i].block != NULL; i = (i+1)&mask) {
+		if (m_slots[i].pos == p) {
+			m_slots[i].block = block;
+			return;
+		}
+	}
+	m_slots[i].pos = p;
+	m_slots[i].block = block;
+	m_count++;
+}
+
+void MapBlockIndex::remove(v3s16 p)
+{
+	u32 mask = m_capacity-1;
+	u32 i = hash(p)&mask;
+	for (;; i = (i+1)&mask) {
+		if (m_slots[i].block == NULL)
+			return;
+		if (m_slots[i].pos == p)
+			break;
+	}
+	m_slots[i].block = NULL;
+	m_count--;
+
+	/*
+		Move back the entries after the hole that can't be found past
+		it anymore, so lookups needn't step over removed entries
+	*/
+	for (u32 j = (i+1)&mask; m_slots[j].block != NULL; j = (j+1)&mask) {
+		u32 home = hash(m_slots[j].pos)&mask;
+		// Whether home lies cyclically in (i, j]
+		bool reachable = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+		if (reachable)
+			continue;
+		m_slots[i] = m_slots[j];
+		m_slots[j].block = NULL;
+		i = j;
+	}
+
+	if (m_capacity > 64 && m_count*8 < m_capacity)
+		resize(m_capacity/2);
+}
+
+void MapBlockIndex::resize(u32 capacity)
+{
+	Slot *old_slots = m_slots;
+	u32 old_capacity = m_capacity;
+
+	m_slots = new Slot[capacity];
+	m_capacity = capacity;
+	for (u32 i=0; i<m_capacity; i++) {
+		m_slots[i].block = NULL;
+	}
+
+	u32 mask = m_capacity-1;
+	for (u32 k=0; k<old_capacity; k++) {
+		if (old_slots[k].block == NULL)
+			continue;
+		u32 i = hash(old_slots[k].pos)&mask;
+		while (m_slots[i].block != NULL)
+			i = (i+1)&mask;
+		m_slots[i] = old_slots[k];
+	}
+
+	delete[] old_slots;
+}
+
 /*
 	Map
 */
 
+/*
+	Start of the block generation counter of the next map, see
+	m_block_generation.
+*/
+static u32 g_block_generation_start = 0;
+
+/*
+	The last block each thread got from getBlockNoCreateNoEx().
+	Consecutive lookups mostly hit the same block.
+*/
+struct BlockLookupCache
+{
+	Map *map;
+	u32 generation;
+	s16 x;
+	s16 y;
+	s16 z;
+	MapBlock *block;
+};
+static THREAD_LOCAL BlockLookupCache t_block_cache;
+
 Map::Map(std::ostream &dout):
 	m_dout(dout),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_block_generation(g_block_generation_start += 0x10000)
 {
 	/*m_sector_mutex.Init();
 	assert(m_sector_mutex.IsInitialized());*/
@@ -151,14 +266,41 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
+	BlockLookupCache &cache = t_block_cache;
+	if (
+		cache.map == this
+		&& cache.generation == m_block_generation
+		&& cache.x == p3d.X
+		&& cache.y == p3d.Y
+		&& cache.z == p3d.Z
+	)
+		return cache.block;
+
+	MapBlock *block = m_block_index.get(p3d);
+	if (block == NULL)
 		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
+
+	cache.map = this;
+	cache.generation = m_block_generation;
+	cache.x = p3d.X;
+	cache.y = p3d.Y;
+	cache.z = p3d.Z;
+	cache.block = block;
+
 	return block;
 }
 
+void Map::blockAdded(MapBlock *block)
+{
+	m_block_index.insert(block->getPos(), block);
+}
+
+void Map::blockRemoved(MapBlock *block)
+{
+	m_block_index.remove(block->getPos());
+	m_block_generation++;
+}
+
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
 {
 	MapBlock *block = getBlockNoCreateNoEx(p3d);
@@ -229,335 +371,168 @@ void Map::setNode(v3s16 p, MapNode & n)
 	block->setNodeNoCheck(relpos, n);
 }
 
+u32 Map::getNodeTicks(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if (block == NULL)
+		return 0;
+	return block->getNodeTicks(p - blockpos*MAP_BLOCKSIZE);
+}
 
-/*
-	Goes recursively through the neighbours of the node.
+void Map::setNodeTicks(v3s16 p, u32 ticks)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if (block == NULL)
+		return;
+	block->setNodeTicks(p - blockpos*MAP_BLOCKSIZE, ticks);
+}
 
-	Alters only transparent nodes.
 
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
+/*
+	MapLighter
+*/
 
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
+MapLighter::MapLighter(Map *map, enum LightBank bank,
+		core::map<v3s16, MapBlock*> &modified_blocks):
+	m_map(map),
+	m_bank(bank),
+	m_modified_blocks(modified_blocks),
+	m_block(NULL),
+	m_block_valid(false),
+	m_modified_last(NULL)
+{
+}
 
-	values of from_nodes are lighting values.
-*/
-void Map::unspreadLight(enum LightBank bank,
-		core::map<v3s16, u8> & from_nodes,
-		core::map<v3s16, bool> & light_sources,
-		core::map<v3s16, MapBlock*>  & modified_blocks)
+void MapLighter::unlight(v3s16 p, u8 lightwas)
 {
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
+	m_unlight[lightwas].push_back(p);
+}
 
-	if(from_nodes.size() == 0)
+void MapLighter::addSource(v3s16 p)
+{
+	v3s16 relpos;
+	MapBlock *block = getNodeBlock(p, relpos);
+	if (block == NULL)
 		return;
+	bool pos_ok;
+	m_spread[block->getNodeNoCheck(relpos, &pos_ok).getLight(m_bank)].push_back(p);
+}
 
-	u32 blockchangecount = 0;
+MapBlock *MapLighter::getNodeBlock(v3s16 p, v3s16 &relpos)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	if (!m_block_valid || blockpos != m_blockpos) {
+		m_block = m_map->getBlockNoCreateNoEx(blockpos);
+		if (m_block != NULL && m_block->isDummy())
+			m_block = NULL;
+		m_blockpos = blockpos;
+		m_block_valid = true;
+	}
+	relpos = p - blockpos*MAP_BLOCKSIZE;
+	return m_block;
+}
 
-	core::map<v3s16, u8> unlighted_nodes;
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
+void MapLighter::modified(MapBlock *block)
+{
+	if (block == m_modified_last)
+		return;
+	m_modified_last = block;
+	m_modified_blocks.insert(block->getPos(), block);
+}
 
+void MapLighter::update()
+{
 	/*
-		Initialize block cache
+		Darken the neighbours that are dimmer than the light that was
+		taken away, they could have been lit by it. A neighbour that is
+		as bright or brighter has light of its own to spread back.
+		Darkened nodes only queue dimmer ones, so the queues empty from
+		the brightest down.
 	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(; j.atEnd() == false; j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if (block->isDummy())
-			continue;
-
-		u8 oldlight = j.getNode()->getValue();
-
-		// Loop through 6 neighbors
-		for (u16 i=0; i<6; i++) {
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
-
-			// Only fetch a new block if the block position has changed
-			try{
-				if (block == NULL || blockpos != blockpos_last) {
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
-
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
-			}catch(InvalidPositionException &e) {
+	for (s16 light=LIGHT_SUN; light>=0; light--) {
+		std::vector<v3s16> &queue = m_unlight[light];
+		for (u32 k=0; k<queue.size(); k++) {
+			v3s16 pos = queue[k];
+			v3s16 relpos;
+			MapBlock *block = getNodeBlock(pos, relpos);
+			if (block == NULL)
 				continue;
-			}
-
-			// Calculate relative position in block
-			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-			// Get node straight from the block
-			bool is_valid_position;
-			MapNode n2 = block->getNode(relpos, &is_valid_position);
-			if (!is_valid_position)
-				continue;
-
-			bool changed = false;
-
-			//TODO: Optimize output by optimizing light_sources?
-
-			/*
-				If the neighbor is dimmer than what was specified
-				as oldlight (the light of the previous node)
-			*/
-			if (n2.getLight(bank) < oldlight) {
-				/*
-					And the neighbor is transparent and it has some light
-				*/
-				if (content_features(n2).light_propagates && n2.getLight(bank) != 0) {
-					/*
-						Set light to 0 and add to queue
-					*/
-
-					u8 current_light = n2.getLight(bank);
-					n2.setLight(bank, 0);
-					block->setNode(relpos, n2);
-
-					unlighted_nodes.insert(n2pos, current_light);
-					changed = true;
-
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						infostream<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
+			for (u16 i=0; i<6; i++) {
+				v3s16 n2pos = pos + g_6dirs[i];
+				v3s16 n2rel = relpos + g_6dirs[i];
+				MapBlock *block2 = block;
+				bool pos_ok;
+				MapNode n2 = block2->getNodeNoCheck(n2rel, &pos_ok);
+				if (!pos_ok) {
+					block2 = getNodeBlock(n2pos, n2rel);
+					if (block2 == NULL)
+						continue;
+					n2 = block2->getNodeNoCheck(n2rel, &pos_ok);
+				}
+				u8 light2 = n2.getLight(m_bank);
+				if (light2 >= light) {
+					m_spread[light2].push_back(n2pos);
+				}else if (light2 != 0 && content_features(n2).light_propagates) {
+					n2.setLight(m_bank, 0);
+					block2->setNodeNoCheck(n2rel, n2);
+					modified(block2);
+					m_unlight[light2].push_back(n2pos);
 				}
-
-				/*// DEBUG
-				if(light_sources.find(n2pos) != NULL)
-					light_sources.remove(n2pos);*/
-			}else{
-				light_sources.insert(n2pos, true);
-			}
-
-			// Add to modified_blocks
-			if (changed == true && block_checked_in_modified == false) {
-				// If the block is not found in modified_blocks, add.
-				if (modified_blocks.find(blockpos) == NULL)
-					modified_blocks.insert(blockpos, block);
-				block_checked_in_modified = true;
 			}
 		}
+		queue.clear();
 	}
 
-	/*infostream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
-}
-
-/*
-	A single-node wrapper of the above
-*/
-void Map::unLightNeighbors(enum LightBank bank,
-		v3s16 pos, u8 lightwas,
-		core::map<v3s16, bool> & light_sources,
-		core::map<v3s16, MapBlock*>  & modified_blocks)
-{
-	core::map<v3s16, u8> from_nodes;
-	from_nodes.insert(pos, lightwas);
-
-	unspreadLight(bank, from_nodes, light_sources, modified_blocks);
-}
-
-/*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
-*/
-void Map::spreadLight(enum LightBank bank,
-		core::map<v3s16, bool> & from_nodes,
-		core::map<v3s16, MapBlock*> & modified_blocks)
-{
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.size() == 0)
-		return;
-
-	u32 blockchangecount = 0;
-
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
-
 	/*
-		Initialize block cache
+		Spread light from the brightest nodes first. A node queued
+		again since, at another light, is passed over here. A neighbour
+		brighter than the node could have lit it is queued as well, as
+		it has light to spread back, and the queues go back up to it.
 	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(; j.atEnd() == false; j++)
-	//for(; j != from_nodes.end(); j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-		//v3s16 pos = *j;
-		//infostream<<"pos=("<<pos.X<<","<<pos.Y<<","<<pos.Z<<")"<<std::endl;
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
+	s16 light = LIGHT_SUN;
+	while (light >= 0) {
+		std::vector<v3s16> &queue = m_spread[light];
+		if (queue.empty()) {
+			light--;
 			continue;
 		}
-
-		if(block->isDummy())
+		v3s16 pos = queue.back();
+		queue.pop_back();
+		v3s16 relpos;
+		MapBlock *block = getNodeBlock(pos, relpos);
+		if (block == NULL)
 			continue;
-
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		bool is_valid_position;
-		MapNode n = block->getNode(relpos, &is_valid_position);
-
-		u8 oldlight = n.getLight(bank);
-		u8 newlight = diminish_light(oldlight);
-
-		// Loop through 6 neighbors
+		bool pos_ok;
+		if (block->getNodeNoCheck(relpos, &pos_ok).getLight(m_bank) != light)
+			continue;
+		u8 newlight = diminish_light(light);
+		u8 brighter = undiminish_light(light);
 		for (u16 i=0; i<6; i++) {
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
-
-			// Only fetch a new block if the block position has changed
-			try{
-				if (block == NULL || blockpos != blockpos_last) {
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
-
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
-			}catch(InvalidPositionException &e) {
-				continue;
-			}
-
-			// Calculate relative position in block
-			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-			// Get node straight from the block
-			MapNode n2 = block->getNode(relpos, &is_valid_position);
-			if (!is_valid_position)
-				continue;
-
-			bool changed = false;
-			/*
-				If the neighbor is brighter than the current node,
-				add to list (it will light up this node on its turn)
-			*/
-			if (n2.getLight(bank) > undiminish_light(oldlight)) {
-				lighted_nodes.insert(n2pos, true);
-				//lighted_nodes.push_back(n2pos);
-				changed = true;
-			}
-			/*
-				If the neighbor is dimmer than how much light this node
-				would spread on it, add to list
-			*/
-			if (n2.getLight(bank) < newlight) {
-				if (content_features(n2).light_propagates) {
-					n2.setLight(bank, newlight);
-					block->setNode(relpos, n2);
-					lighted_nodes.insert(n2pos, true);
-					//lighted_nodes.push_back(n2pos);
-					changed = true;
-				}
+			v3s16 n2pos = pos + g_6dirs[i];
+			v3s16 n2rel = relpos + g_6dirs[i];
+			MapBlock *block2 = block;
+			MapNode n2 = block2->getNodeNoCheck(n2rel, &pos_ok);
+			if (!pos_ok) {
+				block2 = getNodeBlock(n2pos, n2rel);
+				if (block2 == NULL)
+					continue;
+				n2 = block2->getNodeNoCheck(n2rel, &pos_ok);
 			}
-
-			// Add to modified_blocks
-			if (changed == true && block_checked_in_modified == false) {
-				// If the block is not found in modified_blocks, add.
-				if (modified_blocks.find(blockpos) == NULL)
-					modified_blocks.insert(blockpos, block);
-				block_checked_in_modified = true;
+			u8 light2 = n2.getLight(m_bank);
+			if (light2 > brighter) {
+				m_spread[light2].push_back(n2pos);
+				if (light2 > light)
+					light = light2;
+			}else if (light2 < newlight && content_features(n2).light_propagates) {
+				n2.setLight(m_bank, newlight);
+				block2->setNodeNoCheck(n2rel, n2);
+				modified(block2);
+				m_spread[newlight].push_back(n2pos);
 			}
 		}
 	}
-
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if (lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, modified_blocks);
-}
-
-/*
-	A single-node source variation of the above.
-*/
-void Map::lightNeighbors(enum LightBank bank,
-		v3s16 pos,
-		core::map<v3s16, MapBlock*> & modified_blocks)
-{
-	core::map<v3s16, bool> from_nodes;
-	from_nodes.insert(pos, true);
-	spreadLight(bank, from_nodes, modified_blocks);
 }
 
 v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
@@ -646,11 +621,9 @@ void Map::updateLighting(enum LightBank bank,
 
 	//TimeTaker timer("updateLighting");
 
-	core::map<v3s16, MapBlock*> blocks_to_update;
+	MapLighter lighter(this, bank, modified_blocks);
 
-	core::map<v3s16, bool> light_sources;
-
-	core::map<v3s16, u8> unlight_from;
+	std::vector<v3s16> light_sources;
 
 	core::map<v3s16, MapBlock*>::Iterator i;
 	i = a_blocks.getIterator();
@@ -665,22 +638,24 @@ void Map::updateLighting(enum LightBank bank,
 			v3s16 pos = block->getPos();
 			modified_blocks.insert(pos, block);
 
-			blocks_to_update.insert(pos, block);
+			// Lighting of block will be updated completely
+			block->setLightingExpired(false);
 
 			/*
 				Clear all light from block
 			*/
+			v3s16 pos_relative = block->getPosRelative();
 			for (s16 z=0; z<MAP_BLOCKSIZE; z++)
 			for (s16 x=0; x<MAP_BLOCKSIZE; x++)
 			for (s16 y=0; y<MAP_BLOCKSIZE; y++) {
-					v3s16 p(x,y,z);
 					bool is_valid_position;
-					MapNode n = block->getNode(v3s16(x,y,z),&is_valid_position);
-					if (!is_valid_position)
-						continue;
+					MapNode n = block->getNodeNoCheck(x,y,z,&is_valid_position);
 					u8 oldlight = n.getLight(bank);
+					// Only actual changes are written, to keep packed storage
+					u8 param1 = n.param1;
 					n.setLight(bank, 0);
-					block->setNode(v3s16(x,y,z), n);
+					if (n.param1 != param1)
+						block->setNodeNoCheck(x,y,z, n);
 
 					// Collect borders for unlighting
 					if (
@@ -688,16 +663,15 @@ void Map::updateLighting(enum LightBank bank,
 						|| y==0 || y == MAP_BLOCKSIZE-1
 						|| z==0 || z == MAP_BLOCKSIZE-1
 					) {
-						v3s16 p_map = p + v3s16(
-								MAP_BLOCKSIZE*pos.X,
-								MAP_BLOCKSIZE*pos.Y,
-								MAP_BLOCKSIZE*pos.Z);
-						unlight_from.insert(p_map, oldlight);
+						lighter.unlight(pos_relative + v3s16(x,y,z), oldlight);
 					}
 			}
 
 			if (bank == LIGHTBANK_DAY) {
+				light_sources.clear();
 				bool bottom_valid = block->propagateSunlight(light_sources);
+				for (u32 j=0; j<light_sources.size(); j++)
+					lighter.addSource(light_sources[j]);
 
 				// If bottom is valid, we're done.
 				if(bottom_valid)
@@ -722,38 +696,7 @@ void Map::updateLighting(enum LightBank bank,
 		}
 	}
 
-	{
-		//MapVoxelManipulator vmanip(this);
-
-		// Make a manual voxel manipulator and load all the blocks
-		// that touch the requested blocks
-		ManualMapVoxelManipulator vmanip(this);
-		core::map<v3s16, MapBlock*>::Iterator i;
-		i = blocks_to_update.getIterator();
-		for (; i.atEnd() == false; i++) {
-			MapBlock *block = i.getNode()->getValue();
-			v3s16 p = block->getPos();
-
-			// Add all surrounding blocks
-			vmanip.initialEmerge(p - v3s16(1,1,1), p + v3s16(1,1,1));
-
-			// Lighting of block will be updated completely
-			block->setLightingExpired(false);
-		}
-
-		{
-			//TimeTaker timer("unSpreadLight");
-			vmanip.unspreadLight(bank, unlight_from, light_sources);
-		}
-		{
-			//TimeTaker timer("spreadLight");
-			vmanip.spreadLight(bank, light_sources);
-		}
-		{
-			//TimeTaker timer("blitBack");
-			vmanip.blitBack(modified_blocks);
-		}
-	}
+	lighter.update();
 
 	//m_dout<<"Done ("<<getTimestamp()<<")"<<std::endl;
 }
@@ -795,7 +738,9 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	v3s16 toppos = p + v3s16(0,1,0);
 
 	bool node_under_sunlight = true;
-	core::map<v3s16, bool> light_sources;
+	MapLighter day(this, LIGHTBANK_DAY, modified_blocks);
+	MapLighter night(this, LIGHTBANK_NIGHT, modified_blocks);
+	MapLighter *lighters[] = {&day, &night};
 
 	/*
 		If there is a node at top and it doesn't have sunlight,
@@ -839,7 +784,7 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		// to 0.
 		// This also collects the nodes at the border which will spread
 		// light again into this.
-		unLightNeighbors(bank, p, lightwas, light_sources, modified_blocks);
+		lighters[i]->unlight(p, lightwas);
 
 		n.setLight(bank, 0);
 	}
@@ -887,9 +832,7 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 				break;
 
 			if (n2.getLight(LIGHTBANK_DAY) == LIGHT_SUN) {
-				unLightNeighbors(LIGHTBANK_DAY,
-						n2pos, n2.getLight(LIGHTBANK_DAY),
-						light_sources, modified_blocks);
+				day.unlight(n2pos, LIGHT_SUN);
 				n2.setLight(LIGHTBANK_DAY, 0);
 				setNode(n2pos, n2);
 			}
@@ -898,14 +841,12 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		}
 	}
 
-	for (s32 i=0; i<2; i++) {
-		enum LightBank bank = banks[i];
-
-		/*
-			Spread light from all nodes that might be capable of doing so
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
-	}
+	/*
+		Take the light away and spread it again from all nodes that
+		might be capable of doing so
+	*/
+	day.update();
+	night.update();
 
 	/*
 		Update information about whether day and night light differ
@@ -936,7 +877,7 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		bool pos_ok;
 		MapNode n2 = getNodeNoEx(p2,&pos_ok);
 		if (pos_ok && (content_features(n2).liquid_type != LIQUID_NONE || n2.getContent() == CONTENT_AIR))
-			m_transforming_liquid.push_back(p2);
+			queueLiquid(p2);
 	}
 }
 
@@ -968,7 +909,9 @@ void Map::removeNodeAndUpdate(v3s16 p,
 			node_under_sunlight = false;
 	}
 
-	core::map<v3s16, bool> light_sources;
+	MapLighter day(this, LIGHTBANK_DAY, modified_blocks);
+	MapLighter night(this, LIGHTBANK_NIGHT, modified_blocks);
+	MapLighter *lighters[] = {&day, &night};
 
 	enum LightBank banks[] = {
 		LIGHTBANK_DAY,
@@ -980,9 +923,7 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		/*
 			Unlight neighbors (in case the node is a light source)
 		*/
-		unLightNeighbors(bank, p,
-				getNode(p).getLight(bank),
-				light_sources, modified_blocks);
+		lighters[i]->unlight(p, getNode(p).getLight(bank));
 	}
 
 	/*
@@ -1000,15 +941,6 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	n.setContent(replace_material);
 	setNode(p, n);
 
-	for (s32 i=0; i<2; i++) {
-		enum LightBank bank = banks[i];
-
-		/*
-			Recalculate lighting
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
-	}
-
 	// Add the block of the removed node to modified_blocks
 	v3s16 blockpos = getNodeBlockPos(p);
 	MapBlock * block = getBlockNoCreate(blockpos);
@@ -1031,7 +963,7 @@ void Map::removeNodeAndUpdate(v3s16 p,
 			/*m_dout<<DTIME<<"lighting neighbors of node ("
 					<<p2.X<<","<<p2.Y<<","<<p2.Z<<")"
 					<<std::endl;*/
-			lightNeighbors(LIGHTBANK_DAY, p2, modified_blocks);
+			day.addSource(p2);
 		}
 	}else{
 		// Set the lighting of this node to 0
@@ -1051,9 +983,15 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		v3s16 n2p = getBrightestNeighbour(bank, p);
 		bool pos_ok = isValidPosition(n2p);
 		if (pos_ok)
-			lightNeighbors(bank, n2p, modified_blocks);
+			lighters[i]->addSource(n2p);
 	}
 
+	/*
+		Recalculate lighting
+	*/
+	day.update();
+	night.update();
+
 	/*
 		Update information about whether day and night light differ
 	*/
@@ -1085,7 +1023,7 @@ void Map::removeNodeAndUpdate(v3s16 p,
 
 		MapNode n2 = getNodeNoEx(p2,&pos_ok);
 		if (pos_ok && (content_features(n2).liquid_type != LIQUID_NONE || n2.getContent() == CONTENT_AIR))
-			m_transforming_liquid.push_back(p2);
+			queueLiquid(p2);
 	}
 }
 
@@ -1232,6 +1170,8 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	core::list<v2s16> sector_deletion_queue;
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
+	u32 loaded_blocks_count = 0;
+	u32 loaded_blocks_memory = 0;
 
 	core::map<v2s16, MapSector*>::Iterator si;
 
@@ -1253,7 +1193,19 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 
 			block->incrementUsageTimer(dtime);
 
-			if(block->getUsageTimer() > unload_timeout)
+			// Compact blocks cost little to keep around
+			float timeout = unload_timeout;
+			if (save_before_unloading && block->isCompact())
+				timeout *= COMPACT_BLOCK_UNLOAD_FACTOR;
+
+			// A modified block is kept until the save queue has room
+			bool unload = block->getUsageTimer() > timeout;
+			if(unload && save_before_unloading
+					&& block->getModified() != MOD_STATE_CLEAN
+					&& canSave() == false)
+				unload = false;
+
+			if(unload)
 			{
 				v3s16 p = block->getPos();
 
@@ -1276,6 +1228,11 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 			else
 			{
 				all_blocks_deleted = false;
+				// Not used since the last update
+				if (block->getUsageTimer() > dtime)
+					block->compact();
+				loaded_blocks_count++;
+				loaded_blocks_memory += block->getMemoryUsage();
 			}
 		}
 
@@ -1289,6 +1246,12 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	// Finally delete the empty sectors
 	deleteSectors(sector_deletion_queue);
 
+	if (loaded_blocks_count != 0) {
+		std::string prefix = save_before_unloading ? "ServerMap: " : "ClientMap: ";
+		g_profiler->avg(prefix+"node bytes per loaded block",
+				loaded_blocks_memory/loaded_blocks_count);
+	}
+
 	if(deleted_blocks_count != 0)
 	{
 		PrintInfo(infostream); // ServerMap/ClientMap:
@@ -1333,16 +1296,35 @@ struct NodeNeighbor {
 	v3s16 p;
 };
 
+void Map::queueLiquid(v3s16 p, MapBlock *near)
+{
+	MapBlock *block = near;
+	v3s16 p_rel;
+	if (block != NULL) {
+		p_rel = p - block->getPosRelative();
+		if (!block->isValidPosition(p_rel.X, p_rel.Y, p_rel.Z))
+			block = NULL;
+	}
+	if (block == NULL) {
+		v3s16 blockpos = getNodeBlockPos(p);
+		block = getBlockNoCreateNoEx(blockpos);
+		if (block == NULL || block->isDummy())
+			return;
+		p_rel = p - blockpos*MAP_BLOCKSIZE;
+	}
+	if (block->queueLiquid(p_rel))
+		m_liquid_blocks.push_back(block->getPos());
+}
+
 void Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks)
 {
 	DSTACK(__FUNCTION_NAME);
 	//TimeTaker timer("transformLiquids()");
 
+	u32 budget_ms = config_get_int("server.liquid.budget");
+	u32 start_ms = porting::getTimeMs();
 	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
-
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+	bool over_budget = false;
 
 	// list of nodes that due to viscosity have not reached their max level height
 	UniqueQueue<v3s16> must_reflow;
@@ -1350,233 +1332,264 @@ void Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks)
 	// List of MapBlocks that will require a lighting update (due to lava)
 	core::map<v3s16, MapBlock*> lighting_modified_blocks;
 
-	while(m_transforming_liquid.size() != 0)
+	/*
+		Each pass takes the nodes each block had queued when it is
+		reached, so nodes queued meanwhile wait for the next pass. Three
+		passes at most, as the single queue this replaces went through
+		three times the length it started with.
+	*/
+	for (u32 pass=0; pass<3 && !over_budget; pass++)
+	for (u32 blocks=m_liquid_blocks.size(); blocks>0 && !over_budget; blocks--)
 	{
-		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size * 3)
-			break;
-		loopcount++;
+		v3s16 blockpos = m_liquid_blocks.pop_front();
+		MapBlock *block = getBlockNoCreateNoEx(blockpos);
+		if (block == NULL || block->isDummy())
+			continue;
+		v3s16 blockpos_nodes = blockpos*MAP_BLOCKSIZE;
+		bool block_modified = false;
+		bool block_lighting = false;
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.pop_front();
+		for (u32 count=block->getLiquidQueueSize(); count>0; count--)
+		{
+			loopcount++;
 
-		MapNode n0 = getNodeNoEx(p0);
+			/*
+				Get a queued transforming liquid node
+			*/
+			v3s16 p0_rel = block->popLiquid();
+			v3s16 p0 = blockpos_nodes + p0_rel;
 
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		u8 liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
-		switch (liquid_type) {
-		case LIQUID_SOURCE:
-			liquid_level = LIQUID_LEVEL_SOURCE;
-			liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
-			break;
-		case LIQUID_FLOWING:
-			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-			liquid_kind = n0.getContent();
-			break;
-		case LIQUID_NONE:
-			// if this is an air node, it *could* be transformed into a liquid. otherwise,
-			// continue with the next node.
-			if (n0.getContent() != CONTENT_AIR)
-				continue;
-			liquid_kind = CONTENT_AIR;
-			break;
-		}
+			bool pos_ok;
+			MapNode n0 = block->getNodeNoCheck(p0_rel, &pos_ok);
 
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
+			/*
+				Collect information about current node
+			 */
+			s8 liquid_level = -1;
+			u8 liquid_kind = CONTENT_IGNORE;
+			LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
+			switch (liquid_type) {
+			case LIQUID_SOURCE:
+				liquid_level = LIQUID_LEVEL_SOURCE;
+				liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
+				break;
+			case LIQUID_FLOWING:
+				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+				liquid_kind = n0.getContent();
+				break;
+			case LIQUID_NONE:
+				// if this is an air node, it *could* be transformed into a liquid. otherwise,
+				// continue with the next node.
+				if (n0.getContent() != CONTENT_AIR)
+					continue;
+				liquid_kind = CONTENT_AIR;
+				break;
 			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
-			switch (content_features(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (nb.n.getContent() == CONTENT_AIR) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER) {
+
+			/*
+				Collect information about the environment
+			 */
+			const v3s16 *dirs = g_6dirs;
+			NodeNeighbor sources[6]; // surrounding sources
+			int num_sources = 0;
+			NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+			int num_flows = 0;
+			NodeNeighbor airs[6]; // surrounding air
+			int num_airs = 0;
+			NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+			int num_neutrals = 0;
+			bool flowing_down = false;
+			for (u16 i = 0; i < 6; i++) {
+				NeighborType nt = NEIGHBOR_SAME_LEVEL;
+				switch (i) {
+					case 1:
+						nt = NEIGHBOR_UPPER;
+						break;
+					case 4:
+						nt = NEIGHBOR_LOWER;
+						break;
+				}
+				v3s16 npos = p0 + dirs[i];
+				// Most neighbours are in the same block
+				bool in_block;
+				MapNode nn = block->getNodeNoCheck(p0_rel + dirs[i], &in_block);
+				if (!in_block)
+					nn = getNodeNoEx(npos);
+				NodeNeighbor nb = {nn, nt, npos};
+				switch (content_features(nb.n.getContent()).liquid_type) {
+					case LIQUID_NONE:
+						if (nb.n.getContent() == CONTENT_AIR) {
+							airs[num_airs++] = nb;
+							// if the current node is a water source the neighbor
+							// should be enqueded for transformation regardless of whether the
+							// current node changes or not.
+							if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+								queueLiquid(npos, block);
+							// if the current node happens to be a flowing node, it will start to flow down here.
+							if (nb.t == NEIGHBOR_LOWER) {
+								flowing_down = true;
+							}
+						}else if (nb.t == NEIGHBOR_LOWER && nb.n.getContent() == CONTENT_IGNORE) {
 							flowing_down = true;
+							neutrals[num_neutrals++] = nb;
+						} else {
+							neutrals[num_neutrals++] = nb;
 						}
-					}else if (nb.t == NEIGHBOR_LOWER && nb.n.getContent() == CONTENT_IGNORE) {
-						flowing_down = true;
-						neutrals[num_neutrals++] = nb;
-					} else {
-						neutrals[num_neutrals++] = nb;
-					}
-					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-					if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						// Do not count bottom source, it will screw things up
-						if (dirs[i].Y != -1)
-							sources[num_sources++] = nb;
-					}
-					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-					if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
-					}
-					break;
-			}
-		}
-
-		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-		if (num_sources >= 2 || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = content_features(liquid_kind).liquid_alternative_source;
-		} else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
-			new_node_content = liquid_kind;
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level)
-							max_node_level = nb_liquid_level;
 						break;
-					case NEIGHBOR_LOWER:
+					case LIQUID_SOURCE:
+						// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+						if (liquid_kind == CONTENT_AIR)
+							liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+						if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind) {
+							neutrals[num_neutrals++] = nb;
+						} else {
+							// Do not count bottom source, it will screw things up
+							if (dirs[i].Y != -1)
+								sources[num_sources++] = nb;
+						}
 						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
-							max_node_level = nb_liquid_level - 1;
+					case LIQUID_FLOWING:
+						// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+						if (liquid_kind == CONTENT_AIR)
+							liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+						if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind) {
+							neutrals[num_neutrals++] = nb;
+						} else {
+							flows[num_flows++] = nb;
+							if (nb.t == NEIGHBOR_LOWER)
+								flowing_down = true;
 						}
 						break;
 				}
 			}
 
-			u8 viscosity = content_features(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else
-				new_node_level = max_node_level;
-
-			if (new_node_level >= 0)
+			/*
+				decide on the type (and possibly level) of the current node
+			 */
+			content_t new_node_content;
+			s8 new_node_level = -1;
+			s8 max_node_level = -1;
+			if (num_sources >= 2 || liquid_type == LIQUID_SOURCE) {
+				// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+				// or the flowing alternative of the first of the surrounding sources (if it's air), so
+				// it's perfectly safe to use liquid_kind here to determine the new node content.
+				new_node_content = content_features(liquid_kind).liquid_alternative_source;
+			} else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER) {
+				// liquid_kind is set properly, see above
 				new_node_content = liquid_kind;
-			else
-				new_node_content = CONTENT_AIR;
+				max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+			} else {
+				// no surrounding sources, so get the maximum level that can flow into this node
+				for (u16 i = 0; i < num_flows; i++) {
+					u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+					switch (flows[i].t) {
+						case NEIGHBOR_UPPER:
+							if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+								max_node_level = LIQUID_LEVEL_MAX;
+								if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+									max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+							} else if (nb_liquid_level > max_node_level)
+								max_node_level = nb_liquid_level;
+							break;
+						case NEIGHBOR_LOWER:
+							break;
+						case NEIGHBOR_SAME_LEVEL:
+							if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+								nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
+								max_node_level = nb_liquid_level - 1;
+							}
+							break;
+					}
+				}
 
-		}
+				u8 viscosity = content_features(liquid_kind).liquid_viscosity;
+				if (viscosity > 1 && max_node_level != liquid_level) {
+					// amount to gain, limited by viscosity
+					// must be at least 1 in absolute value
+					s8 level_inc = max_node_level - liquid_level;
+					if (level_inc < -viscosity || level_inc > viscosity)
+						new_node_level = liquid_level + level_inc/viscosity;
+					else if (level_inc < 0)
+						new_node_level = liquid_level - 1;
+					else if (level_inc > 0)
+						new_node_level = liquid_level + 1;
+					if (new_node_level != max_node_level)
+						must_reflow.push_back(p0);
+				} else
+					new_node_level = max_node_level;
+
+				if (new_node_level >= 0)
+					new_node_content = liquid_kind;
+				else
+					new_node_content = CONTENT_AIR;
 
-		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() && (content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-										 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-										 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-										 == flowing_down)))
-			continue;
+			}
 
+			/*
+				check if anything has changed. if not, just continue with the next node.
+			 */
+			if (new_node_content == n0.getContent() && (content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+											 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+											 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+											 == flowing_down)))
+				continue;
 
-		/*
-			update the current node
-		 */
-		if (content_features(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-		n0.setContent(new_node_content);
-		setNode(p0, n0);
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if(block != NULL) {
-			modified_blocks.insert(blockpos, block);
+
+			/*
+				update the current node
+			 */
+			if (content_features(new_node_content).liquid_type == LIQUID_FLOWING) {
+				// set level to last 3 bits, flowing down bit to 4th bit
+				n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+			} else {
+				// set the liquid level and flow bit to 0
+				n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+			}
+			n0.setContent(new_node_content);
+			block->setNodeNoCheck(p0_rel, n0);
+			block_modified = true;
 			// If node emits light, MapBlock requires lighting update
 			if(content_features(n0).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
-		}
+				block_lighting = true;
 
-		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (content_features(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
+			/*
+				enqueue neighbors for update if neccessary
+			 */
+			switch (content_features(n0.getContent()).liquid_type) {
+				case LIQUID_SOURCE:
+				case LIQUID_FLOWING:
+					// make sure source flows into all neighboring nodes
+					for (u16 i = 0; i < num_flows; i++)
+						if (flows[i].t != NEIGHBOR_UPPER)
+							queueLiquid(flows[i].p, block);
+					for (u16 i = 0; i < num_airs; i++)
+						if (airs[i].t != NEIGHBOR_UPPER)
+							queueLiquid(airs[i].p, block);
+					break;
+				case LIQUID_NONE:
+					// this flow has turned to air; neighboring flows might need to do the same
+					for (u16 i = 0; i < num_flows; i++)
+						queueLiquid(flows[i].p, block);
+					break;
+			}
 		}
+
+		if (block_modified)
+			modified_blocks.insert(blockpos, block);
+		if (block_lighting)
+			lighting_modified_blocks[blockpos] = block;
+		if (block->getLiquidQueueSize() != 0)
+			m_liquid_blocks.push_back(blockpos);
+		if (porting::getTimeMs()-start_ms >= budget_ms)
+			over_budget = true;
 	}
 	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
+	g_profiler->add("Map: liquid nodes (num)", loopcount);
+	if (over_budget)
+		g_profiler->add("Map: liquid over budget (num)", 1);
+	g_profiler->avg("Map: liquid blocks queued", m_liquid_blocks.size());
 	while (must_reflow.size() > 0)
-		m_transforming_liquid.push_back(must_reflow.pop_front());
+		queueLiquid(must_reflow.pop_front());
 	updateLighting(lighting_modified_blocks, modified_blocks);
 }
 
@@ -1679,6 +1692,247 @@ void Map::nodeMetadataStep(float dtime, core::map<v3s16, MapBlock*> &changed_blo
 	}
 }
 
+/*
+	MapSaveThread
+*/
+
+MapSaveThread::MapSaveThread():
+	SimpleThread(),
+	m_seq(0),
+	m_watchers(0),
+	m_failed(false),
+	m_database(NULL),
+	m_database_write(NULL)
+{
+	m_mutex.Init();
+
+	int max = config_get_int("server.save.queue.size");
+	if (max < 16)
+		max = 16;
+	m_max = max;
+}
+
+MapSaveThread::~MapSaveThread()
+{
+	flush();
+	stop();
+
+	if (m_database_write)
+		sqlite3_finalize(m_database_write);
+	if (m_database)
+		sqlite3_close(m_database);
+}
+
+void MapSaveThread::openDatabase()
+{
+	char buff[1024];
+	int d;
+
+	if (!path_get((char*)"world",(char*)"map.sqlite",0,buff,1024))
+		throw FileNotGoodException("map.sqlite: Cannot find database file path");
+
+	d = sqlite3_open_v2(buff, &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if (d != SQLITE_OK) {
+		infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("map.sqlite: Cannot open database file");
+	}
+
+	// With WAL a commit only needs to sync at checkpoints
+	if (sqlite3_exec(m_database, "PRAGMA synchronous=NORMAL;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: Database pragma failed: "<<sqlite3_errmsg(m_database)<<std::endl;
+	sqlite3_busy_timeout(m_database, 5000);
+
+	d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
+	if (d != SQLITE_OK) {
+		infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("map.sqlite: Cannot prepare write statement");
+	}
+}
+
+void MapSaveThread::queue(v3s16 p, const std::string &blob)
+{
+	bool full = false;
+	{
+		JMutexAutoLock lock(m_mutex);
+		core::map<v3s16, Entry>::Node *n = m_pending.find(p);
+		if (n != NULL) {
+			n->getValue().blob = blob;
+			n->getValue().seq = ++m_seq;
+		}else{
+			Entry e;
+			e.blob = blob;
+			e.seq = ++m_seq;
+			m_pending.insert(p, e);
+			full = (m_pending.size() >= m_max);
+		}
+		if (m_watchers)
+			m_changed.set(p, m_seq);
+	}
+
+	// Start writing now instead of at the end of the save
+	if (full)
+		trigger();
+}
+
+bool MapSaveThread::full()
+{
+	return (size() >= m_max);
+}
+
+void MapSaveThread::waitForRoom()
+{
+	if (full() == false)
+		return;
+	ScopeProfiler sp(g_profiler, "MapSaveThread: queue full wait", SPT_AVG);
+	while (full() && m_failed == false) {
+		trigger();
+		// Also wakes up now and then in case the thread stopped
+		// just before the trigger
+		m_written.wait(100);
+	}
+}
+
+bool MapSaveThread::get(v3s16 p, std::string *blob)
+{
+	JMutexAutoLock lock(m_mutex);
+	core::map<v3s16, Entry>::Node *n = m_pending.find(p);
+	if (n == NULL)
+		return false;
+	*blob = n->getValue().blob;
+	return true;
+}
+
+void MapSaveThread::flush()
+{
+	while (size() != 0 && m_failed == false) {
+		trigger();
+		// Also wakes up now and then in case the thread stopped
+		// just before the trigger
+		m_written.wait(100);
+	}
+}
+
+u32 MapSaveThread::watch()
+{
+	JMutexAutoLock lock(m_mutex);
+	m_watchers++;
+	return m_seq;
+}
+
+void MapSaveThread::unwatch()
+{
+	JMutexAutoLock lock(m_mutex);
+	m_watchers--;
+	// Reads starting from now see everything written so far
+	if (m_watchers == 0)
+		m_changed.clear();
+}
+
+bool MapSaveThread::changedSince(v3s16 p, u32 seq)
+{
+	JMutexAutoLock lock(m_mutex);
+	// Not written yet, the database has an older copy
+	if (m_pending.find(p) != NULL)
+		return true;
+	// Queued or written after the read started
+	core::map<v3s16, u32>::Node *n = m_changed.find(p);
+	return (n != NULL && n->getValue() > seq);
+}
+
+void MapSaveThread::takeBatch(core::list<v3s16> &batch_pos, core::list<Entry> &batch, u32 max)
+{
+	JMutexAutoLock lock(m_mutex);
+	for (core::map<v3s16, Entry>::Iterator i = m_pending.getIterator(); i.atEnd() == false; i++) {
+		batch_pos.push_back(i.getNode()->getKey());
+		batch.push_back(i.getNode()->getValue());
+		if (batch.size() >= max)
+			break;
+	}
+}
+
+void MapSaveThread::removeWritten(core::list<v3s16> &batch_pos, core::list<Entry> &batch)
+{
+	JMutexAutoLock lock(m_mutex);
+	core::list<v3s16>::Iterator pi = batch_pos.begin();
+	for (core::list<Entry>::Iterator i = batch.begin(); i != batch.end(); i++, pi++) {
+		core::map<v3s16, Entry>::Node *n = m_pending.find(*pi);
+		// Unless it was queued again
+		if (n == NULL || n->getValue().seq != i->seq)
+			continue;
+		m_pending.remove(*pi);
+		if (m_watchers)
+			m_changed.set(*pi, ++m_seq);
+	}
+}
+
+void * MapSaveThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapSaveThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	bool finished = false;
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	if (m_database == NULL)
+		openDatabase();
+
+	while (getRun()) {
+		core::list<v3s16> batch_pos;
+		core::list<Entry> batch;
+		takeBatch(batch_pos, batch, 256);
+		if (batch.size() == 0)
+			break;
+
+		{
+			ScopeProfiler sp(g_profiler, "MapSaveThread: write batch", SPT_AVG);
+
+			if (sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+				infostream<<"WARNING: MapSaveThread: BEGIN failed, saving might be slow."<<std::endl;
+
+			core::list<v3s16>::Iterator pi = batch_pos.begin();
+			for (core::list<Entry>::Iterator i = batch.begin(); i != batch.end(); i++, pi++) {
+				v3s16 p = *pi;
+				const std::string &blob = i->blob;
+
+				if (sqlite3_bind_int64(m_database_write, 1, ServerMap::getBlockAsInteger(p)) != SQLITE_OK)
+					infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+				if (sqlite3_bind_blob(m_database_write, 2, (void *)blob.c_str(), blob.size(), NULL) != SQLITE_OK)
+					infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+				if (sqlite3_step(m_database_write) != SQLITE_DONE)
+					infostream<<"WARNING: Block failed to save ("<<p.X<<", "<<p.Y<<", "<<p.Z<<") "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+				// Make ready for later reuse
+				sqlite3_reset(m_database_write);
+			}
+
+			if (sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+				infostream<<"WARNING: MapSaveThread: COMMIT failed, map might not have saved."<<std::endl;
+		}
+
+		g_profiler->add("MapSaveThread: blocks written (num)", batch.size());
+
+		removeWritten(batch_pos, batch);
+		m_written.signal();
+	}
+
+	finished = true;
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	// Don't let anything wait for writes that won't happen
+	if (finished == false) {
+		errorstream<<"MapSaveThread: Stopped on an error, the map isn't saved any more."<<std::endl;
+		m_failed = true;
+	}
+	m_written.signal();
+
+	return NULL;
+}
+
 /*
 	ServerMap
 */
@@ -1688,11 +1942,23 @@ ServerMap::ServerMap():
 	m_seed(0),
 	m_database(NULL),
 	m_database_read(NULL),
-	m_database_write(NULL)
+	m_database_list(NULL),
+	m_prefetch_clock(0),
+	m_prefetch_database(NULL),
+	m_prefetch_read(NULL)
 {
 	char b[1024];
 	infostream<<__FUNCTION_NAME<<std::endl;
 
+	m_prefetch_mutex.Init();
+	m_prefetch_db_mutex.Init();
+	{
+		int max = config_get_int("server.emerge.prefetch.cache");
+		if (max < 0)
+			max = 0;
+		m_prefetch_max = max;
+	}
+
 	config_load("world","world.cfg");
 
 	loadMapMeta();
@@ -1719,6 +1985,7 @@ ServerMap::~ServerMap()
 
 	try{
 		save(true);
+		flushSave();
 		infostream<<"Server: saved map"<<std::endl;
 	}
 	catch(std::exception &e)
@@ -1729,17 +1996,24 @@ ServerMap::~ServerMap()
 	/*
 		Close database if it was opened
 	*/
+	for (core::map<v3s16, PrefetchedBlock>::Iterator i = m_prefetched.getIterator(); i.atEnd() == false; i++) {
+		delete i.getNode()->getValue().block;
+	}
+	m_prefetched.clear();
+	if(m_prefetch_read)
+		sqlite3_finalize(m_prefetch_read);
+	if(m_prefetch_database)
+		sqlite3_close(m_prefetch_database);
+
 	if(m_database_read)
 		sqlite3_finalize(m_database_read);
-	if(m_database_write)
-		sqlite3_finalize(m_database_write);
 	if(m_database_list)
 		sqlite3_finalize(m_database_list);
 	if(m_database)
 		sqlite3_close(m_database);
 }
 
-void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
+void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos, bool track_changes)
 {
 	// Do nothing if not inside limits (+-1 because of neighbors)
 	if (
@@ -1788,6 +2062,8 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 
 				// Lighting will not be valid after make_chunk is called
 				block->setLightingExpired(true);
+				// Don't let the area be unloaded while it's being made
+				block->resetUsageTimer();
 			}
 		}
 	}
@@ -1804,6 +2080,7 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	v3s16 bigarea_blocks_max = blockpos + v3s16(1,1,1);
 
 	data->vmanip = new ManualMapVoxelManipulator(this);
+	data->vmanip->setTrackChanges(track_changes);
 
 	// Add the area
 	{
@@ -1835,14 +2112,19 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 	*/
 	while (data->transforming_liquid.size() > 0) {
 		v3s16 p = data->transforming_liquid.pop_front();
-		m_transforming_liquid.push_back(p);
+		queueLiquid(p);
 	}
 
 	/*
 		Get central block
 	*/
 	MapBlock *block = getBlockNoCreateNoEx(data->blockpos);
-	assert(block);
+	if (block == NULL) {
+		infostream<<"WARNING: "<<__FUNCTION_NAME
+				<<": central block was unloaded while being made"
+				<<std::endl;
+		return NULL;
+	}
 
 	block->setBiome(data->biome);
 
@@ -1940,7 +2222,9 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 		for(s16 z=-1; z<=1; z++)
 		{
 			v3s16 p = block->getPos()+v3s16(x,y,z);
-			getBlockNoCreateNoEx(p)->setLightingExpired(false);
+			MapBlock *b = getBlockNoCreateNoEx(p);
+			if (b)
+				b->setLightingExpired(false);
 		}
 	}
 
@@ -2220,18 +2504,20 @@ void ServerMap::verifyDatabase() {
 		if(needs_create)
 			createDatabase();
 
+		/*
+			Blocks are written by the save thread while this connection
+			reads them, in WAL mode neither waits for the other
+		*/
+		if(sqlite3_exec(m_database, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL) != SQLITE_OK)
+			infostream<<"WARNING: Database failed to switch to WAL: "<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_busy_timeout(m_database, 5000);
+
 		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
 		if(d != SQLITE_OK) {
 			infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
 			throw FileNotGoodException("map.sqlite: Cannot prepare read statement");
 		}
 
-		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("map.sqlite: Cannot prepare write statement");
-		}
-
 		d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
 		if(d != SQLITE_OK) {
 			infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
@@ -2247,7 +2533,7 @@ sqlite3_int64 ServerMap::getBlockAsInteger(const v3s16 pos) {
 		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
 }
 
-void ServerMap::save(bool only_changed)
+bool ServerMap::save(bool only_changed, bool wait)
 {
 	DSTACK(__FUNCTION_NAME);
 
@@ -2257,9 +2543,7 @@ void ServerMap::save(bool only_changed)
 
 	u32 block_count = 0;
 	u32 block_count_all = 0; // Number of blocks in memory
-
-	// Don't do anything with sqlite unless something is really saved
-	bool save_started = false;
+	bool complete = true;
 
 	for (core::map<v2s16, MapSector*>::Iterator i = m_sectors.getIterator(); i.atEnd() == false; i++) {
 		ServerMapSector *sector = (ServerMapSector*)i.getNode()->getValue();
@@ -2277,18 +2561,21 @@ void ServerMap::save(bool only_changed)
 				block->getModified() >= MOD_STATE_WRITE_NEEDED
 				|| only_changed == false
 			) {
-				// Lazy beginSave()
-				if (!save_started) {
-					beginSave();
-					save_started = true;
+				if (m_save_thread.full()) {
+					if (wait == false) {
+						complete = false;
+						break;
+					}
+					m_save_thread.waitForRoom();
 				}
-
 				saveBlock(block);
 				block_count++;
 			}
 		}
+		if (complete == false)
+			break;
 	}
-	if (save_started)
+	if (block_count != 0)
 		endSave();
 
 	/*
@@ -2300,6 +2587,10 @@ void ServerMap::save(bool only_changed)
 				<<", "<<block_count_all<<" blocks in memory."
 				<<std::endl;
 	}
+	if (complete == false)
+		infostream<<"ServerMap: Save queue is full, saving the rest later."<<std::endl;
+
+	return complete;
 }
 
 static s32 unsignedToSigned(s32 i, s32 max_positive)
@@ -2336,6 +2627,85 @@ void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
 		v3s16 p = getIntegerAsBlock(block_i);
 		dst.push_back(p);
 	}
+	sqlite3_reset(m_database_list);
+}
+
+u32 ServerMap::convertAllBlocks(bool *complete)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	core::list<v3s16> loadable_blocks;
+	listAllLoadableBlocks(loadable_blocks);
+
+	u32 converted = 0;
+	*complete = true;
+
+	for (core::list<v3s16>::Iterator i = loadable_blocks.begin(); i != loadable_blocks.end(); i++) {
+		v3s16 p = *i;
+		std::string blob;
+
+		// Saved in the current format but not written yet
+		if (m_save_thread.get(p, &blob))
+			continue;
+
+		if (sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(p)) != SQLITE_OK)
+			infostream<<"WARNING: Could not bind block position for load: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		if (sqlite3_step(m_database_read) == SQLITE_ROW) {
+			const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
+			size_t len = sqlite3_column_bytes(m_database_read, 0);
+			blob = std::string(data, len);
+		}
+		sqlite3_reset(m_database_read);
+
+		if (blob.size() < 4)
+			continue;
+
+		/*
+			[0] u8 serialization version
+			[1] u8 flags
+			[2] u8 biome
+			[3] u8 codec
+		*/
+		u8 version = blob[0];
+		u8 codec = version > 22 ? blob[3] : SER_CODEC_ZLIB;
+		if (version == SER_FMT_VER_HIGHEST && codec == m_codec)
+			continue;
+
+		// The environment is locked, leave the rest for another run
+		if (m_save_thread.full()) {
+			*complete = false;
+			break;
+		}
+
+		// A loaded block is the newer copy
+		MapBlock *block = getBlockNoCreateNoEx(p);
+		if (block && !block->isDummy()) {
+			saveBlock(block);
+			converted++;
+			continue;
+		}
+
+		try{
+			std::istringstream is(blob, std::ios_base::binary);
+			is.read((char*)&version, 1);
+
+			MapBlock tmp(this, p);
+			tmp.deSerialize(is, version);
+			tmp.deSerializeDiskExtra(is, version);
+
+			saveBlock(&tmp);
+			converted++;
+		}catch(SerializationError &e) {
+			infostream<<"WARNING: Invalid block data in database "
+					<<"("<<p.X<<","<<p.Y<<","<<p.Z<<"), not converting. "
+					<<"what()="<<e.what()
+					<<std::endl;
+		}
+	}
+	endSave();
+
+	return converted;
 }
 
 void ServerMap::loadMapMeta()
@@ -2362,18 +2732,19 @@ void ServerMap::loadMapMeta()
 	}else{
 		config_set("world.map.type","default");
 	}
+	m_codec = serCodecI(config_get("world.map.codec"));
 }
 
-void ServerMap::beginSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+void ServerMap::endSave() {
+	m_save_thread.trigger();
 }
 
-void ServerMap::endSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: endSave() failed, map might not have saved.";
+void ServerMap::flushSave() {
+	m_save_thread.flush();
+}
+
+void ServerMap::waitSaveRoom() {
+	m_save_thread.waitForRoom();
 }
 
 void ServerMap::saveBlock(MapBlock *block)
@@ -2407,26 +2778,16 @@ void ServerMap::saveBlock(MapBlock *block)
 	o.write((char*)&version, 1);
 
 	// Write basic data
-	block->serialize(o, version);
+	block->serialize(o, version, m_codec);
 
 	// Write extra data stored on disk
 	block->serializeDiskExtra(o, version);
 
-	// Write block to database
+	// Queue block to be written to database
+	m_save_thread.queue(p3d, o.str());
 
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
-
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
-		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) // TODO this mught not be the right length
-		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	int written = sqlite3_step(m_database_write);
-	if(written != SQLITE_DONE)
-		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
-		<<sqlite3_errmsg(m_database)<<std::endl;
-	// Make ready for later reuse
-	sqlite3_reset(m_database_write);
+	// A prefetched copy is older now
+	dropPrefetchedBlock(p3d);
 
 	// We just wrote it to the disk so clear modified flag
 	block->resetModified();
@@ -2471,15 +2832,20 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 		if (created_new)
 			sector->insertBlock(block);
 
+		// We just loaded it from, so it's up-to-date.
+		block->resetModified();
+
 		/*
-			Save blocks loaded in old format in new format
+			Save blocks loaded in old format in new format, or leave
+			them to the next save if the save queue is full
 		*/
 
-		if (version < SER_FMT_VER_HIGHEST || save_after_load)
-			saveBlock(block);
-
-		// We just loaded it from, so it's up-to-date.
-		block->resetModified();
+		if (version < SER_FMT_VER_HIGHEST || save_after_load) {
+			if (canSave())
+				saveBlock(block);
+			else
+				block->raiseModified(MOD_STATE_WRITE_NEEDED);
+		}
 
 	} catch(SerializationError &e) {
 		infostream<<"WARNING: Invalid block data in database "
@@ -2498,6 +2864,44 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	verifyDatabase();
 
+	/*
+		A block that is saved but not yet written is newer than
+		the one in the database
+	*/
+	{
+		std::string datastr;
+		if (m_save_thread.get(blockpos, &datastr)) {
+			dropPrefetchedBlock(blockpos);
+			MapSector *sector = createSector(p2d);
+			loadBlock(&datastr, blockpos, sector, false);
+			return getBlockNoCreateNoEx(blockpos);
+		}
+	}
+
+	/*
+		Then one that prefetchBlocks() decoded already, it can only be
+		inserted if there isn't a block object in its place
+	*/
+	{
+		bool save_after_load = false;
+		MapBlock *block = takePrefetchedBlock(blockpos, &save_after_load);
+		if (block) {
+			MapSector *sector = createSector(p2d);
+			if (sector->getBlockNoCreateNoEx(blockpos.Y) == NULL) {
+				sector->insertBlock(block);
+				block->resetModified();
+				if (save_after_load) {
+					if (canSave())
+						saveBlock(block);
+					else
+						block->raiseModified(MOD_STATE_WRITE_NEEDED);
+				}
+				return block;
+			}
+			delete block;
+		}
+	}
+
 	if (sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
 		infostream<<"WARNING: Could not bind block position for load: "
 			<<sqlite3_errmsg(m_database)<<std::endl;
@@ -2528,6 +2932,150 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	return getBlockNoCreateNoEx(blockpos);
 }
 
+void ServerMap::prefetchBlocks(v3s16 p, s16 range)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	if (m_prefetch_max == 0)
+		return;
+
+	/*
+		Blocks saved before this that aren't written yet, and blocks
+		saved or written from now on, can be read as older copies
+	*/
+	u32 save_seq = m_save_thread.watch();
+
+	/*
+		Read the stored blocks, X is the least significant part of
+		the key so every row along X is a single range
+	*/
+	core::list<v3s16> read_pos;
+	core::list<std::string> read_blobs;
+	{
+		ScopeProfiler sp(g_profiler, "ServerMap: prefetch read", SPT_AVG);
+		JMutexAutoLock dblock(m_prefetch_db_mutex);
+
+		/*
+			Open the connection once there is a database, the map
+			will still load everything one by one if this fails
+		*/
+		char buff[1024];
+		if (m_prefetch_read == NULL && path_get((char*)"world",(char*)"map.sqlite",1,buff,1024)) {
+			if (m_prefetch_database == NULL
+					&& sqlite3_open_v2(buff, &m_prefetch_database, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK)
+				sqlite3_busy_timeout(m_prefetch_database, 5000);
+			if (m_prefetch_database != NULL
+					&& sqlite3_prepare(m_prefetch_database, "SELECT `pos`, `data` FROM `blocks` WHERE `pos` BETWEEN ? AND ?", -1, &m_prefetch_read, NULL) != SQLITE_OK) {
+				infostream<<"WARNING: Database range statment failed to prepare: "<<sqlite3_errmsg(m_prefetch_database)<<std::endl;
+				m_prefetch_read = NULL;
+			}
+		}
+
+		for (s16 z=p.Z-range; m_prefetch_read && z<=p.Z+range; z++) {
+			for (s16 y=p.Y-range; y<=p.Y+range; y++) {
+				sqlite3_bind_int64(m_prefetch_read, 1, getBlockAsInteger(v3s16(p.X-range,y,z)));
+				sqlite3_bind_int64(m_prefetch_read, 2, getBlockAsInteger(v3s16(p.X+range,y,z)));
+				while (sqlite3_step(m_prefetch_read) == SQLITE_ROW) {
+					v3s16 bp = getIntegerAsBlock(sqlite3_column_int64(m_prefetch_read, 0));
+					if (m_save_thread.changedSince(bp, save_seq))
+						continue;
+					{
+						JMutexAutoLock lock(m_prefetch_mutex);
+						if (m_prefetched.find(bp) != NULL)
+							continue;
+					}
+					const char *data = (const char *)sqlite3_column_blob(m_prefetch_read, 1);
+					size_t len = sqlite3_column_bytes(m_prefetch_read, 1);
+					read_pos.push_back(bp);
+					read_blobs.push_back(std::string(data, len));
+				}
+				sqlite3_reset(m_prefetch_read);
+			}
+		}
+	}
+
+	/*
+		Decode them
+	*/
+	core::list<PrefetchedBlock> decoded;
+	{
+		ScopeProfiler sp(g_profiler, "ServerMap: prefetch decode", SPT_AVG);
+		core::list<std::string>::Iterator bi = read_blobs.begin();
+		for (core::list<v3s16>::Iterator i = read_pos.begin(); i != read_pos.end(); i++, bi++) {
+			PrefetchedBlock pb;
+			pb.block = new MapBlock(this, *i);
+			pb.used = 0;
+			try{
+				std::istringstream is(*bi, std::ios_base::binary);
+				u8 version = SER_FMT_VER_INVALID;
+				is.read((char*)&version, 1);
+				if (is.fail())
+					throw SerializationError("ServerMap::prefetchBlocks(): Failed"
+							" to read MapBlock version");
+				pb.block->deSerialize(is, version);
+				pb.block->deSerializeDiskExtra(is, version);
+				pb.save_after_load = (version < SER_FMT_VER_HIGHEST);
+			}catch(SerializationError &e) {
+				// loadBlock() will complain about it
+				delete pb.block;
+				continue;
+			}
+			decoded.push_back(pb);
+		}
+	}
+
+	/*
+		Put them in the cache, unless they were saved or written
+		meanwhile. A block saved after this is dropped from the cache
+		by saveBlock().
+	*/
+	JMutexAutoLock lock(m_prefetch_mutex);
+	for (core::list<PrefetchedBlock>::Iterator i = decoded.begin(); i != decoded.end(); i++) {
+		v3s16 bp = i->block->getPos();
+		if (m_save_thread.changedSince(bp, save_seq) || m_prefetched.find(bp) != NULL) {
+			delete i->block;
+			continue;
+		}
+		if (m_prefetched.size() >= m_prefetch_max) {
+			// Drop the least recently used one
+			core::map<v3s16, PrefetchedBlock>::Node *oldest = NULL;
+			for (core::map<v3s16, PrefetchedBlock>::Iterator j = m_prefetched.getIterator(); j.atEnd() == false; j++) {
+				if (oldest == NULL || j.getNode()->getValue().used < oldest->getValue().used)
+					oldest = j.getNode();
+			}
+			delete oldest->getValue().block;
+			m_prefetched.remove(oldest->getKey());
+		}
+		i->used = ++m_prefetch_clock;
+		m_prefetched.insert(bp, *i);
+		g_profiler->add("ServerMap: prefetched blocks (num)", 1);
+	}
+	m_save_thread.unwatch();
+}
+
+MapBlock* ServerMap::takePrefetchedBlock(v3s16 p, bool *save_after_load)
+{
+	JMutexAutoLock lock(m_prefetch_mutex);
+	core::map<v3s16, PrefetchedBlock>::Node *n = m_prefetched.find(p);
+	if (n == NULL)
+		return NULL;
+	MapBlock *block = n->getValue().block;
+	*save_after_load = n->getValue().save_after_load;
+	m_prefetched.remove(p);
+	g_profiler->add("ServerMap: prefetch hits (num)", 1);
+	return block;
+}
+
+void ServerMap::dropPrefetchedBlock(v3s16 p)
+{
+	JMutexAutoLock lock(m_prefetch_mutex);
+	core::map<v3s16, PrefetchedBlock>::Node *n = m_prefetched.find(p);
+	if (n == NULL)
+		return;
+	delete n->getValue().block;
+	m_prefetched.remove(p);
+}
+
 void ServerMap::PrintInfo(std::ostream &out)
 {
 	out<<"ServerMap: ";
@@ -3455,12 +4003,16 @@ void MapVoxelManipulator::blitBack(core::map<v3s16, MapBlock*> & modified_blocks
 
 ManualMapVoxelManipulator::ManualMapVoxelManipulator(Map *map):
 		MapVoxelManipulator(map),
-		m_create_area(false)
+		m_create_area(false),
+		m_track_changes(false),
+		m_initial_data(NULL)
 {
 }
 
 ManualMapVoxelManipulator::~ManualMapVoxelManipulator()
 {
+	if (m_initial_data)
+		delete[] m_initial_data;
 }
 
 void ManualMapVoxelManipulator::emerge(VoxelArea a, s32 caller_id)
@@ -3535,6 +4087,42 @@ void ManualMapVoxelManipulator::initialEmerge(
 
 		m_loaded_blocks.insert(p, !block_data_inexistent);
 	}
+
+	if (m_track_changes) {
+		if (m_initial_data)
+			delete[] m_initial_data;
+		m_initial_area = m_area;
+		m_initial_data = new MapNode[m_area.getVolume()];
+		memcpy(m_initial_data, m_data, m_area.getVolume()*sizeof(MapNode));
+	}
+}
+
+/*
+	Copies the data of one block back to the map. With change tracking
+	only the nodes that differ from the initially loaded data are
+	written, so edits made to the map in the meantime are kept.
+*/
+void ManualMapVoxelManipulator::blitBackBlock(MapBlock *block)
+{
+	if (m_initial_data == NULL) {
+		block->copyFrom(*this);
+		return;
+	}
+
+	v3s16 p0 = block->getPosRelative();
+	v3s16 p;
+	for (p.Z=0; p.Z<MAP_BLOCKSIZE; p.Z++)
+	for (p.Y=0; p.Y<MAP_BLOCKSIZE; p.Y++)
+	for (p.X=0; p.X<MAP_BLOCKSIZE; p.X++) {
+		v3s16 ap = p0+p;
+		MapNode &n = m_data[m_area.index(ap)];
+		if (
+			m_initial_area.contains(ap)
+			&& n == m_initial_data[m_initial_area.index(ap)]
+		)
+			continue;
+		block->setNodeNoCheck(p,n);
+	}
 }
 
 void ManualMapVoxelManipulator::blitBackAll(
@@ -3565,7 +4153,7 @@ void ManualMapVoxelManipulator::blitBackAll(
 			continue;
 		}
 
-		block->copyFrom(*this);
+		blitBackBlock(block);
 
 		if (modified_blocks)
 			modified_blocks->insert(p, block);
@@ -3600,7 +4188,7 @@ void ManualMapVoxelManipulator::blitBackAllWithMeta(
 			continue;
 		}
 
-		block->copyFrom(*this);
+		blitBackBlock(block);
 
 		if (modified_blocks)
 			modified_blocks->insert(p, block);
@@ -31,6 +31,7 @@
 #include <jthread.h>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "common_irrlicht.h"
 #include "mapgen.h"
@@ -44,6 +45,7 @@ extern "C" {
 
 using namespace jthread;
 
+class Map;
 class MapSector;
 class ServerMapSector;
 class ClientMapSector;
@@ -127,6 +129,111 @@ public:
 	virtual void onMapEditEvent(MapEditEvent *event) = 0;
 };
 
+/*
+	The loaded blocks of a Map by position, for looking them up without
+	going through the sectors.
+
+	An open addressing hash table with linear probing, kept at most
+	half full.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+	~MapBlockIndex();
+
+	// Returns NULL if not found
+	MapBlock *get(v3s16 p)
+	{
+		u32 mask = m_capacity-1;
+		for (u32 i = hash(p)&mask;; i = (i+1)&mask) {
+			Slot &slot = m_slots[i];
+			if (slot.block == NULL)
+				return NULL;
+			if (slot.pos == p)
+				return slot.block;
+		}
+	}
+
+	void insert(v3s16 p, MapBlock *block);
+	void remove(v3s16 p);
+
+	u32 size()
+	{
+		return m_count;
+	}
+
+private:
+	struct Slot
+	{
+		v3s16 pos;
+		MapBlock *block;
+	};
+
+	static u32 hash(v3s16 p)
+	{
+		u32 h = (u32)(u16)p.X*73856093
+			^ (u32)(u16)p.Y*19349663
+			^ (u32)(u16)p.Z*83492791;
+		return h^(h>>16);
+	}
+
+	void resize(u32 capacity);
+
+	// Power of two
+	u32 m_capacity;
+	u32 m_count;
+	Slot *m_slots;
+
+	MapBlockIndex(const MapBlockIndex &);
+	MapBlockIndex &operator=(const MapBlockIndex &);
+};
+
+/*
+	Works out light changes in one bank breadth first, straight on the
+	nodes of the loaded blocks. Nodes wait in a queue for each light
+	level and the brightest are taken first, so a node is lit once
+	with the light it ends up with. Nodes of blocks that aren't loaded
+	are left alone.
+*/
+class MapLighter
+{
+public:
+	MapLighter(Map *map, enum LightBank bank,
+			core::map<v3s16, MapBlock*> &modified_blocks);
+
+	// The node at p had lightwas and has been darkened, the light it
+	// spread is to be taken away. The caller darkens the node.
+	void unlight(v3s16 p, u8 lightwas);
+	// The node at p may light its neighbours
+	void addSource(v3s16 p);
+	// Takes the light away as queued by unlight(), then spreads light
+	// from the sources, both the added ones and the lit nodes found at
+	// the edge of the darkened ones
+	void update();
+
+private:
+	// The block holding p and the position of p in it, NULL if not
+	// loaded
+	MapBlock *getNodeBlock(v3s16 p, v3s16 &relpos);
+	void modified(MapBlock *block);
+
+	Map *m_map;
+	enum LightBank m_bank;
+	core::map<v3s16, MapBlock*> &m_modified_blocks;
+
+	// Nodes to darken the neighbours of, by the light they had
+	std::vector<v3s16> m_unlight[LIGHT_SUN+1];
+	// Nodes to spread light from, by their light
+	std::vector<v3s16> m_spread[LIGHT_SUN+1];
+
+	// Last block looked up, and last one added to m_modified_blocks
+	v3s16 m_blockpos;
+	MapBlock *m_block;
+	bool m_block_valid;
+	MapBlock *m_modified_last;
+};
+
 class Map /*: public NodeContainer*/
 {
 public:
@@ -179,6 +286,10 @@ public:
 	// Returns NULL if not found
 	MapBlock * getBlockNoCreateNoEx(v3s16 p);
 
+	// Called by the sectors of the map as blocks are added and deleted
+	void blockAdded(MapBlock *block);
+	void blockRemoved(MapBlock *block);
+
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool allow_generate=true, bool *was_generated=NULL)
 	{ return getBlockNoCreateNoEx(p); }
@@ -197,23 +308,9 @@ public:
 	// Returns a CONTENT_IGNORE node if not found
 	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL);
 
-	void unspreadLight(enum LightBank bank,
-			core::map<v3s16, u8> & from_nodes,
-			core::map<v3s16, bool> & light_sources,
-			core::map<v3s16, MapBlock*> & modified_blocks);
-
-	void unLightNeighbors(enum LightBank bank,
-			v3s16 pos, u8 lightwas,
-			core::map<v3s16, bool> & light_sources,
-			core::map<v3s16, MapBlock*> & modified_blocks);
-
-	void spreadLight(enum LightBank bank,
-			core::map<v3s16, bool> & from_nodes,
-			core::map<v3s16, MapBlock*> & modified_blocks);
-
-	void lightNeighbors(enum LightBank bank,
-			v3s16 pos,
-			core::map<v3s16, MapBlock*> & modified_blocks);
+	// Node tick counts, see MapBlock::incNodeTicks(). 0 if not found
+	u32 getNodeTicks(v3s16 p);
+	void setNodeTicks(v3s16 p, u32 ticks);
 
 	v3s16 getBrightestNeighbour(enum LightBank bank, v3s16 p);
 
@@ -260,7 +357,9 @@ public:
 	virtual void beginSave() {return;};
 	virtual void endSave() {return;};
 
-	virtual void save(bool only_changed){assert(0);};
+	virtual bool save(bool only_changed, bool wait=true){assert(0); return true;};
+	// Tells whether saveBlock() can take more blocks now
+	virtual bool canSave() {return true;};
 
 	// Server implements this.
 	// Client leaves it as no-op.
@@ -291,6 +390,14 @@ public:
 	// For debug printing. Prints "Map: ", "ServerMap: " or "ClientMap: "
 	virtual void PrintInfo(std::ostream &out);
 
+	/*
+		Liquid nodes are queued in the MapBlock that holds them, and
+		the blocks with queued nodes in the Map. transformLiquids()
+		goes through the blocks in turn for as long as its time budget
+		lasts and leaves the rest for the next call.
+	*/
+	// near is a block likely to hold p, which saves looking it up
+	void queueLiquid(v3s16 p, MapBlock *near=NULL);
 	void transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks);
 
 	/*
@@ -326,8 +433,112 @@ protected:
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
-	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	// Every block in m_sectors
+	MapBlockIndex m_block_index;
+	/*
+		Changes whenever a block is removed, so that the blocks cached
+		by getBlockNoCreateNoEx() aren't used after being deleted.
+		Maps start counting from different values, as a map can be
+		created where one was deleted.
+	*/
+	u32 m_block_generation;
+
+	// Blocks with transforming liquid nodes queued, see queueLiquid()
+	UniqueQueue<v3s16> m_liquid_blocks;
+};
+
+/*
+	Writes serialized blocks to the map database in its own thread.
+
+	Blocks are written in batches of one transaction each, through a
+	connection of its own. A block that is queued again before it is
+	written is only written once.
+
+	Queueing never waits, as it is done with the environment locked.
+	The queue is bounded by the callers instead: while full() they
+	leave modified blocks modified for a later save, or wait for room
+	with waitForRoom() if the environment isn't locked.
+*/
+class MapSaveThread : public SimpleThread
+{
+public:
+	MapSaveThread();
+	~MapSaveThread();
+
+	void * Thread();
+
+	void trigger()
+	{
+		if (m_failed)
+			return;
+		setRun(true);
+		if (IsRunning() == false)
+			Start();
+	}
+
+	// Queues a block to be written, see full()
+	void queue(v3s16 p, const std::string &blob);
+	// Tells whether the queue has reached server.save.queue.size
+	bool full();
+	// Waits until the queue isn't full
+	void waitForRoom();
+	// Gets a queued block that isn't written yet
+	bool get(v3s16 p, std::string *blob);
+	// Waits until everything queued so far is written, or the thread
+	// has failed
+	void flush();
+
+	/*
+		While a database read is watching, blocks queued or written
+		are remembered, so that a copy read meanwhile can be told to
+		be old. watch() returns the sequence number to pass to
+		changedSince(), every watch() needs an unwatch().
+	*/
+	u32 watch();
+	void unwatch();
+	// Tells whether a block read after watch() returned seq can be old
+	bool changedSince(v3s16 p, u32 seq);
+
+	struct Entry
+	{
+		std::string blob;
+		// Tells whether it was queued again while being written
+		u32 seq;
+	};
+
+	/*
+		The thread takes a batch of queued blocks, writes them and then
+		removes them with removeWritten(). The entries stay queued
+		until then so that loading them still finds them.
+	*/
+	void takeBatch(core::list<v3s16> &batch_pos, core::list<Entry> &batch, u32 max);
+	void removeWritten(core::list<v3s16> &batch_pos, core::list<Entry> &batch);
+
+	u32 size()
+	{
+		JMutexAutoLock lock(m_mutex);
+		return m_pending.size();
+	}
+
+private:
+	void openDatabase();
+
+	JMutex m_mutex;
+	core::map<v3s16, Entry> m_pending;
+	u32 m_seq;
+	// Number of watch() calls without an unwatch()
+	u32 m_watchers;
+	// Sequence number of the last queue or write of blocks, see watch()
+	core::map<v3s16, u32> m_changed;
+	// Queue length at which the queue is full
+	u32 m_max;
+	// Signaled by the thread after each batch and when it stops
+	ThreadEvent m_written;
+	// Set when the thread stopped on an error, nothing is written after
+	volatile bool m_failed;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_write;
 };
 
 /*
@@ -357,8 +568,13 @@ public:
 
 	/*
 		Blocks are generated by using these and makeBlock().
+
+		If track_changes is set, only the nodes that makeBlock()
+		actually changes are written back by finishBlockMake(), so
+		the map can be edited while makeBlock() runs without the
+		environment lock.
 	*/
-	void initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos);
+	void initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos, bool track_changes=false);
 	MapBlock* finishBlockMake(mapgen::BlockMakeData *data,
 			core::map<v3s16, MapBlock*> &changed_blocks);
 
@@ -397,22 +613,47 @@ public:
 	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
 	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
 
-	// Call these before and after saving of blocks
-	void beginSave();
+	// Call this after saving blocks, starts writing them
 	void endSave();
+	// Waits until all saved blocks are in the database
+	void flushSave();
+	// Waits until the save queue has room for more blocks
+	void waitSaveRoom();
 
-	void save(bool only_changed);
+	/*
+		With wait set, waits for room in the save queue when it fills
+		up, the environment must not be locked then. Without it the
+		save stops there, and returns false. The blocks not saved stay
+		modified for the next save.
+	*/
+	bool save(bool only_changed, bool wait=true);
 	//void loadAll();
 
 	void listAllLoadableBlocks(core::list<v3s16> &dst);
+	// Rewrites blocks stored in an older format or another codec,
+	// returns the number of blocks rewritten. Stops early when the
+	// save queue is full, and sets complete to false then.
+	u32 convertAllBlocks(bool *complete);
 
 	void loadMapMeta();
 
+	bool canSave()
+	{
+		return !m_save_thread.full();
+	}
 	void saveBlock(MapBlock *block);
 	MapBlock* loadBlock(v3s16 p);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Reads the stored blocks within range of p with one range
+		query per row and decodes them. This doesn't need the map to
+		be locked, loadBlock() takes the blocks from the cache they
+		are put in.
+	*/
+	void prefetchBlocks(v3s16 p, s16 range);
+
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
 
@@ -423,14 +664,44 @@ private:
 	// Seed used for all kinds of randomness
 	uint64_t m_seed;
 	MapGenType m_type;
+	// Codec blocks are written to the database with
+	u8 m_codec;
 
 	/*
 		SQLite database and statements
 	*/
 	sqlite3 *m_database;
 	sqlite3_stmt *m_database_read;
-	sqlite3_stmt *m_database_write;
 	sqlite3_stmt *m_database_list;
+
+	/*
+		Blocks decoded by prefetchBlocks() that aren't in the map
+	*/
+	struct PrefetchedBlock
+	{
+		MapBlock *block;
+		// Stored in an old format
+		bool save_after_load;
+		// For dropping the least recently used ones
+		u32 used;
+	};
+	// Takes a block out of the cache, NULL if it isn't there
+	MapBlock* takePrefetchedBlock(v3s16 p, bool *save_after_load);
+	void dropPrefetchedBlock(v3s16 p);
+
+	// Locks the prefetch cache and the two members below it
+	JMutex m_prefetch_mutex;
+	core::map<v3s16, PrefetchedBlock> m_prefetched;
+	u32 m_prefetch_clock;
+	u32 m_prefetch_max;
+
+	// Prefetching reads through a connection of its own
+	JMutex m_prefetch_db_mutex;
+	sqlite3 *m_prefetch_database;
+	sqlite3_stmt *m_prefetch_read;
+
+	// Writes the blocks saveBlock() serializes
+	MapSaveThread m_save_thread;
 };
 
 /*
@@ -610,13 +881,26 @@ public:
 
 	void initialEmerge(v3s16 blockpos_min, v3s16 blockpos_max);
 
+	/*
+		Keep a copy of the data loaded by initialEmerge(), and only
+		blit back nodes that differ from it. Set before initialEmerge().
+	*/
+	void setTrackChanges(bool track)
+	{m_track_changes = track;}
+
 	// This is much faster with big chunks of generated data
 	void blitBackAll(core::map<v3s16, MapBlock*> * modified_blocks);
 	// Slower than above, but doesn't screw up node metadata
 	void blitBackAllWithMeta(core::map<v3s16, MapBlock*> * modified_blocks);
 
 protected:
+	void blitBackBlock(MapBlock *block);
+
 	bool m_create_area;
+	bool m_track_changes;
+	// Copy of the data as it was after initialEmerge()
+	VoxelArea m_initial_area;
+	MapNode *m_initial_data;
 };
 
 #endif
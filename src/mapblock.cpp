@@ -30,15 +30,129 @@
 // For g_settings
 #include "main.h"
 #include "light.h"
+#include "porting.h"
 #include <sstream>
 #ifndef SERVER
 #include "sound.h"
 #endif
 
+/*
+	NodeTickTable
+*/
+
+NodeTickTable::NodeTickTable():
+	m_array(NULL)
+{
+}
+
+NodeTickTable::~NodeTickTable()
+{
+	if (m_array)
+		delete[] m_array;
+}
+
+std::vector<NodeTickTable::Entry>::iterator NodeTickTable::find(u16 i)
+{
+	std::vector<Entry>::iterator lo = m_list.begin();
+	u32 count = m_list.size();
+	while (count > 0) {
+		u32 half = count/2;
+		std::vector<Entry>::iterator mid = lo+half;
+		if (mid->index < i) {
+			lo = mid+1;
+			count -= half+1;
+		}else{
+			count = half;
+		}
+	}
+	return lo;
+}
+
+void NodeTickTable::makeArray()
+{
+	u32 l = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	m_array = new u32[l];
+	memset(m_array, 0, l*sizeof(u32));
+	for (std::vector<Entry>::iterator it = m_list.begin(); it != m_list.end(); it++) {
+		m_array[it->index] = it->ticks;
+	}
+	std::vector<Entry>().swap(m_list);
+}
+
+u32 NodeTickTable::get(u16 i)
+{
+	if (m_array)
+		return m_array[i];
+	std::vector<Entry>::iterator it = find(i);
+	if (it == m_list.end() || it->index != i)
+		return 0;
+	return it->ticks;
+}
+
+void NodeTickTable::set(u16 i, u32 ticks)
+{
+	if (m_array) {
+		m_array[i] = ticks;
+		return;
+	}
+	std::vector<Entry>::iterator it = find(i);
+	if (it != m_list.end() && it->index == i) {
+		if (ticks == 0) {
+			m_list.erase(it);
+		}else{
+			it->ticks = ticks;
+		}
+		return;
+	}
+	if (ticks == 0)
+		return;
+	if (m_list.size() >= NODETICKS_LIST_MAX) {
+		makeArray();
+		m_array[i] = ticks;
+		return;
+	}
+	Entry e;
+	e.index = i;
+	e.ticks = ticks;
+	m_list.insert(it, e);
+}
+
+u32 NodeTickTable::increment(u16 i)
+{
+	if (m_array)
+		return ++m_array[i];
+	std::vector<Entry>::iterator it = find(i);
+	if (it != m_list.end() && it->index == i)
+		return ++it->ticks;
+	set(i, 1);
+	return 1;
+}
+
+void NodeTickTable::clear()
+{
+	if (m_array) {
+		delete[] m_array;
+		m_array = NULL;
+	}
+	std::vector<Entry>().swap(m_list);
+}
+
+u32 NodeTickTable::getMemoryUsage()
+{
+	if (m_array)
+		return MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*sizeof(u32);
+	return m_list.capacity()*sizeof(Entry);
+}
+
 /*
 	MapBlock
 */
 
+/*
+	Load generation of the next MapBlock, see m_load_generation
+*/
+static u32 g_load_generation = 0;
+
 MapBlock::MapBlock(Map *parent, v3s16 pos, bool dummy):
 	has_spawn_area(false),
 	spawn_area(0,0,0),
@@ -47,6 +161,8 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, bool dummy):
 	m_pos(pos),
 	m_biome(BIOME_UNKNOWN),
 	m_modified(MOD_STATE_WRITE_NEEDED),
+	m_mod_counter(0),
+	m_load_generation(atomic_add(&g_load_generation, 1)),
 	is_underground(false),
 	m_lighting_expired(true),
 	m_day_night_differs(false),
@@ -54,7 +170,18 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, bool dummy):
 	m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 	m_usage_timer(0)
 {
+	m_storage = MBS_NONE;
 	data = NULL;
+	m_palette_size = 0;
+	m_packed_bits = 0;
+	m_packed = NULL;
+	m_compact_mod_counter = m_mod_counter-1;
+	m_opaque_faces = 0;
+	m_opaque_faces_mod_counter = m_mod_counter-1;
+	m_envstep_nodes = 0;
+	m_air_nodes = 0;
+	m_node_counts_valid = false;
+	m_liquid_head = 0;
 	if (dummy == false)
 		reallocate();
 
@@ -85,8 +212,7 @@ MapBlock::~MapBlock()
 	}
 #endif
 
-	if (data)
-		delete[] data;
+	freeNodes();
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -100,14 +226,14 @@ MapNode MapBlock::getNodeParent(v3s16 p, bool *is_valid_position)
 {
 	if (isValidPosition(p.X,p.Y,p.Z) == false)
 		return m_parent->getNodeNoEx(getPosRelative() + p, is_valid_position);
-	if (data == NULL) {
+	if (isDummy()) {
 		if (is_valid_position)
 			*is_valid_position = false;
 		return MapNode(CONTENT_IGNORE);
 	}
 	if (is_valid_position)
 		*is_valid_position = true;
-	return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+	return nodeAt(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
 }
 
 void MapBlock::setNodeParent(v3s16 p, MapNode & n)
@@ -115,7 +241,10 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	if (isValidPosition(p.X,p.Y,p.Z) == false) {
 		m_parent->setNode(getPosRelative() + p, n);
 	}else{
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		u32 i = p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X;
+		nodeReplaced(i, n);
+		setNodeAt(i, n);
+		m_mod_counter++;
 	}
 }
 
@@ -138,7 +267,7 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	if black_air_left!=NULL, it is set to true if non-sunlighted
 	air is left in block.
 */
-bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
+bool MapBlock::propagateSunlight(std::vector<v3s16> & light_sources,
 		bool remove_light, bool *black_air_left)
 {
 	// Whether the sunlight at the top of the bottom block is valid
@@ -146,6 +275,8 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 
 	v3s16 pos_relative = getPosRelative();
 
+	m_mod_counter++;
+
 	for (s16 x=0; x<MAP_BLOCKSIZE; x++) {
 		for (s16 z=0; z<MAP_BLOCKSIZE; z++) {
 			bool no_sunlight = false;
@@ -187,7 +318,8 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 
 			for (; y >= 0; y--) {
 				v3s16 pos(x, y, z);
-				MapNode &n = getNodeRef(pos);
+				u32 i = z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x;
+				MapNode n = nodeAt(i);
 				ContentFeatures &f = content_features(n);
 
 				if (current_light != 0 && (current_light != LIGHT_SUN || !f.sunlight_propagates)) {
@@ -205,11 +337,16 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 
 				u8 old_light = n.getLight(LIGHTBANK_DAY);
 
-				if (current_light > old_light || remove_light)
+				// Only actual changes are written, to keep packed storage
+				if (current_light > old_light || remove_light) {
+					u8 param1 = n.param1;
 					n.setLight(LIGHTBANK_DAY, current_light);
+					if (n.param1 != param1)
+						setNodeAt(i, n);
+				}
 
 				if (diminish_light(current_light) != 0)
-					light_sources.insert(pos_relative + pos, true);
+					light_sources.push_back(pos_relative + pos);
 
 				if (current_light == 0 && stopped_to_solid_object && black_air_left)
 					*black_air_left = true;
@@ -252,15 +389,150 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 	return block_below_is_valid;
 }
 
+/*
+	Node storage
+*/
+
+bool MapBlock::compact()
+{
+	if (m_storage != MBS_FULL || m_compact_mod_counter == m_mod_counter)
+		return false;
+	m_compact_mod_counter = m_mod_counter;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	// Find the distinct nodes, giving up when there are too many
+	MapNode palette[MAPBLOCK_PALETTE_MAX];
+	u8 palette_size = 0;
+	u8 j = 0;
+	for (u32 i=0; i<nodecount; i++) {
+		MapNode &n = data[i];
+		if (palette_size != 0 && palette[j] == n)
+			continue;
+		for (j=0; j<palette_size && !(palette[j] == n); j++);
+		if (j < palette_size)
+			continue;
+		if (palette_size == MAPBLOCK_PALETTE_MAX)
+			return false;
+		palette[palette_size++] = n;
+	}
+
+	u8 bits = 4;
+	if (palette_size == 1) {
+		bits = 0;
+	}else if (palette_size == 2) {
+		bits = 1;
+	}else if (palette_size <= 4) {
+		bits = 2;
+	}
+
+	u8 *packed = NULL;
+	if (bits != 0) {
+		u32 length = nodecount*bits/8;
+		packed = new u8[length];
+		memset(packed, 0, length);
+		j = 0;
+		for (u32 i=0; i<nodecount; i++) {
+			MapNode &n = data[i];
+			if (!(palette[j] == n)) {
+				for (j=0; !(palette[j] == n); j++);
+			}
+			u32 bit = i*bits;
+			packed[bit>>3] |= j<<(bit&7);
+		}
+	}
+
+	freeNodes();
+	m_storage = MBS_PALETTE;
+	for (j=0; j<palette_size; j++) {
+		m_palette[j] = palette[j];
+	}
+	m_palette_size = palette_size;
+	m_packed_bits = bits;
+	m_packed = packed;
+
+	return true;
+}
+
+void MapBlock::expand()
+{
+	if (m_storage == MBS_FULL)
+		return;
+
+	MapNode *nodes = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	if (m_storage == MBS_PALETTE)
+		getNodes(nodes);
+
+	freeNodes();
+	m_storage = MBS_FULL;
+	data = nodes;
+}
+
+void MapBlock::getNodes(MapNode *dst)
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if (m_storage == MBS_FULL) {
+		memcpy(dst, data, nodecount*sizeof(MapNode));
+		return;
+	}
+	for (u32 i=0; i<nodecount; i++) {
+		dst[i] = nodeAt(i);
+	}
+}
+
+bool MapBlock::setPackedNode(u32 i, MapNode &n)
+{
+	u8 j = 0;
+	for (; j<m_palette_size && !(m_palette[j] == n); j++);
+
+	if (j == m_palette_size) {
+		// A new node fits if the index bits have room for it
+		if (m_palette_size >= (1<<m_packed_bits))
+			return false;
+		m_palette[m_palette_size++] = n;
+	}
+
+	if (m_packed_bits == 0)
+		return true;
+
+	u32 bit = i*m_packed_bits;
+	u8 mask = ((1<<m_packed_bits)-1)<<(bit&7);
+	m_packed[bit>>3] = (m_packed[bit>>3]&~mask) | (j<<(bit&7));
+	return true;
+}
+
+void MapBlock::freeNodes()
+{
+	if (data) {
+		delete[] data;
+		data = NULL;
+	}
+	if (m_packed) {
+		delete[] m_packed;
+		m_packed = NULL;
+	}
+	m_palette_size = 0;
+	m_packed_bits = 0;
+	m_storage = MBS_NONE;
+}
 
 void MapBlock::copyTo(VoxelManipulator &dst)
 {
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
-	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
+	if (m_storage == MBS_FULL) {
+		// Copy from data to VoxelManipulator
+		dst.copyFrom(data, data_area, v3s16(0,0,0),
+				getPosRelative(), data_size);
+		return;
+	}
+
+	MapNode *nodes = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	getNodes(nodes);
+	dst.copyFrom(nodes, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	delete[] nodes;
 }
 
 void MapBlock::copyFrom(VoxelManipulator &dst)
@@ -268,14 +540,37 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
+	expand();
+
+	// Tick counts of the nodes that get replaced are forgotten
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	content_t *old_content = NULL;
+	if (!m_node_ticks.empty()) {
+		old_content = new content_t[nodecount];
+		for (u32 i=0; i<nodecount; i++) {
+			old_content[i] = data[i].getContent();
+		}
+	}
+
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	if (old_content) {
+		for (u32 i=0; i<nodecount; i++) {
+			if (data[i].getContent() != old_content[i])
+				m_node_ticks.set(i, 0);
+		}
+		delete[] old_content;
+	}
+
+	m_node_counts_valid = false;
+	m_mod_counter++;
 }
 
 void MapBlock::updateDayNightDiff()
 {
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
@@ -288,7 +583,7 @@ void MapBlock::updateDayNightDiff()
 	*/
 	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 	{
-		MapNode &n = data[i];
+		MapNode n = nodeAt(i);
 		if(n.getLight(LIGHTBANK_DAY) != n.getLight(LIGHTBANK_NIGHT))
 		{
 			differs = true;
@@ -305,7 +600,7 @@ void MapBlock::updateDayNightDiff()
 		bool only_air = true;
 		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 		{
-			MapNode &n = data[i];
+			MapNode n = nodeAt(i);
 			if(n.getContent() != CONTENT_AIR)
 			{
 				only_air = false;
@@ -317,9 +612,132 @@ void MapBlock::updateDayNightDiff()
 	}
 
 	// Set member variable
+	if (differs != m_day_night_differs)
+		m_mod_counter++;
 	m_day_night_differs = differs;
 }
 
+static bool node_is_opaque(MapNode n)
+{
+	ContentFeatures &f = content_features(n);
+	if (f.light_propagates)
+		return false;
+	return (f.draw_type == CDT_CUBELIKE || f.draw_type == CDT_DIRTLIKE);
+}
+
+u8 MapBlock::getOpaqueFaces()
+{
+	if (m_opaque_faces_mod_counter == m_mod_counter)
+		return m_opaque_faces;
+	m_opaque_faces_mod_counter = m_mod_counter;
+
+	if (isDummy()) {
+		m_opaque_faces = 0;
+		return 0;
+	}
+	if (isUniform()) {
+		m_opaque_faces = node_is_opaque(nodeAt(0)) ? 0x3f : 0;
+		return m_opaque_faces;
+	}
+
+	u8 faces = 0;
+	for (u32 j=0; j<6; j++) {
+		v3s16 dir = g_6dirs[j];
+		bool opaque = true;
+		for (s16 a=0; a<MAP_BLOCKSIZE && opaque; a++)
+		for (s16 b=0; b<MAP_BLOCKSIZE && opaque; b++) {
+			// a and b go along the face, the other one is at its side
+			v3s16 p;
+			if (dir.X != 0)
+				p = v3s16(dir.X > 0 ? MAP_BLOCKSIZE-1 : 0, a, b);
+			else if (dir.Y != 0)
+				p = v3s16(a, dir.Y > 0 ? MAP_BLOCKSIZE-1 : 0, b);
+			else
+				p = v3s16(a, b, dir.Z > 0 ? MAP_BLOCKSIZE-1 : 0);
+			if (!node_is_opaque(nodeAt(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X)))
+				opaque = false;
+		}
+		if (opaque)
+			faces |= (1<<j);
+	}
+
+	m_opaque_faces = faces;
+	return faces;
+}
+
+bool MapBlock::queueLiquid(v3s16 p)
+{
+	u16 i = p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X;
+	if (m_liquid_queued.empty())
+		m_liquid_queued.resize(MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE/32, 0);
+	u32 bit = 1<<(i&31);
+	if (m_liquid_queued[i>>5] & bit)
+		return false;
+	m_liquid_queued[i>>5] |= bit;
+	bool was_empty = (m_liquid_head == m_liquid_queue.size());
+	m_liquid_queue.push_back(i);
+	return was_empty;
+}
+
+v3s16 MapBlock::popLiquid()
+{
+	u16 i = m_liquid_queue[m_liquid_head++];
+	m_liquid_queued[i>>5] &= ~(1<<(i&31));
+	if (m_liquid_head == m_liquid_queue.size()) {
+		std::vector<u16>().swap(m_liquid_queue);
+		std::vector<u32>().swap(m_liquid_queued);
+		m_liquid_head = 0;
+	}else if (m_liquid_head >= 1024 && m_liquid_head*2 >= m_liquid_queue.size()) {
+		// Drop the taken part so the queue doesn't keep growing
+		m_liquid_queue.erase(m_liquid_queue.begin(), m_liquid_queue.begin()+m_liquid_head);
+		m_liquid_head = 0;
+	}
+	return v3s16(
+		i%MAP_BLOCKSIZE,
+		(i/MAP_BLOCKSIZE)%MAP_BLOCKSIZE,
+		i/(MAP_BLOCKSIZE*MAP_BLOCKSIZE)
+	);
+}
+
+void MapBlock::countNodes()
+{
+	m_envstep_nodes = 0;
+	m_air_nodes = 0;
+	m_node_counts_valid = true;
+	if (isDummy())
+		return;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if (m_storage == MBS_PALETTE) {
+		// Count the uses of each palette entry, then weigh them
+		u32 uses[MAPBLOCK_PALETTE_MAX] = {0};
+		if (m_packed_bits == 0) {
+			uses[0] = nodecount;
+		}else{
+			for (u32 i=0; i<nodecount; i++) {
+				u32 bit = i*m_packed_bits;
+				uses[(m_packed[bit>>3]>>(bit&7)) & ((1<<m_packed_bits)-1)]++;
+			}
+		}
+		for (u32 j=0; j<m_palette_size; j++) {
+			ContentFeatures &f = content_features(m_palette[j].getContent());
+			if (f.envstep)
+				m_envstep_nodes += uses[j];
+			if (f.air_equivalent)
+				m_air_nodes += uses[j];
+		}
+		return;
+	}
+
+	for (u32 i=0; i<nodecount; i++) {
+		ContentFeatures &f = content_features(data[i].getContent());
+		if (f.envstep)
+			m_envstep_nodes++;
+		if (f.air_equivalent)
+			m_air_nodes++;
+	}
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -329,7 +747,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeNoEx(v3s16(p2d.X, y, p2d.Y));
 			if(content_features(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -350,29 +768,60 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 	Serialization
 */
 
-void MapBlock::serialize(std::ostream &os, u8 version)
+void MapBlock::serialize(std::ostream &os, u8 version, u8 codec)
 {
 	if (!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
-	if (data == NULL)
+	if (isDummy())
 		throw SerializationError("ERROR: Not writing dummy block.");
 
+	std::ostringstream oss(std::ios_base::binary);
+	m_node_metadata.serialize(oss);
+
+	if (m_storage == MBS_FULL) {
+		serializeData(os, version, codec, getSerializationFlags(), m_biome, data, oss.str());
+		return;
+	}
+
+	MapNode *nodes = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	getNodes(nodes);
+	serializeData(os, version, codec, getSerializationFlags(), m_biome, nodes, oss.str());
+	delete[] nodes;
+}
+
+u8 MapBlock::getSerializationFlags()
+{
+	u8 flags = 0;
+	if (is_underground)
+		flags |= 0x01;
+	if (m_day_night_differs)
+		flags |= 0x02;
+	if (m_lighting_expired)
+		flags |= 0x04;
+	if (m_generated == false)
+		flags |= 0x08;
+	return flags;
+}
+
+void MapBlock::serializeData(std::ostream &os, u8 version, u8 codec, u8 flags,
+		u8 biome, MapNode *data, const std::string &metadata)
+{
 	{
 		// First byte
-		u8 flags = 0;
-		if (is_underground)
-			flags |= 0x01;
-		if (m_day_night_differs)
-			flags |= 0x02;
-		if (m_lighting_expired)
-			flags |= 0x04;
-		if (m_generated == false)
-			flags |= 0x08;
 		os.write((char*)&flags, 1);
 
 		if (version > 21)
-			os.write((char*)&m_biome,1);
+			os.write((char*)&biome,1);
+
+		// Older versions are always zlib'd
+		if (version > 22) {
+			if (!ser_codec_supported(codec))
+				throw SerializationError("MapBlock::serialize: unknown codec");
+			os.write((char*)&codec,1);
+		}else{
+			codec = SER_CODEC_ZLIB;
+		}
 
 		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 
@@ -399,16 +848,12 @@ void MapBlock::serialize(std::ostream &os, u8 version)
 			Compress data to output stream
 		*/
 
-		compress(databuf, os, version);
+		compressCodec(databuf, os, codec);
 
 		/*
 			NodeMetadata
 		*/
-		{
-			std::ostringstream oss(std::ios_base::binary);
-			m_node_metadata.serialize(oss);
-			compressZlib(oss.str(), os);
-		}
+		compressCodec(metadata, os, codec);
 	}
 }
 
@@ -417,6 +862,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 	if (!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
+	m_mod_counter++;
+
 	{
 		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 
@@ -431,15 +878,23 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 		if (version > 21)
 			is.read((char*)&m_biome,1);
 
+		u8 codec = SER_CODEC_ZLIB;
+		if (version > 22) {
+			is.read((char*)&codec,1);
+			if (!ser_codec_supported(codec))
+				throw SerializationError("MapBlock::deSerialize: unknown codec");
+		}
+
 		// Uncompress data
 		std::ostringstream os(std::ios_base::binary);
-		decompress(is, os, version);
+		decompressCodec(is, os, codec);
 		std::string s = os.str();
 		if (s.size() != nodecount*sl)
 			throw SerializationError("MapBlock::deSerialize: decompress resulted in size"
 						" other than nodecount*nodelength");
 
 		// deserialize nodes from buffer
+		expand();
 		for (u32 i=0; i<nodecount; i++) {
 			SharedBuffer<u8> buf(sl);
 			for (u32 k=0; k<sl; k++) {
@@ -447,6 +902,9 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 			}
 			data[i].deSerialize(*buf, version);
 		}
+		m_node_ticks.clear();
+		m_node_counts_valid = false;
+		compact();
 
 		/*
 			NodeMetadata
@@ -454,7 +912,7 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 		// Ignore errors
 		try{
 			std::ostringstream oss(std::ios_base::binary);
-			decompressZlib(is, oss);
+			decompressCodec(is, oss, codec);
 			std::istringstream iss(oss.str(), std::ios_base::binary);
 			m_node_metadata.deSerialize(iss);
 		}catch(SerializationError &e) {
@@ -646,5 +1104,42 @@ std::string analyze_block(MapBlock *block)
 	return desc.str().substr(0, desc.str().size()-2);
 }
 
+/*
+	MapBlockSnapshot
+*/
+
+MapBlockSnapshot::MapBlockSnapshot(MapBlock *block):
+	m_pos(block->getPos()),
+	m_mod_counter(block->getModCounter()),
+	m_load_generation(block->getLoadGeneration()),
+	m_flags(block->getSerializationFlags()),
+	m_biome(block->getBiome()),
+	m_data(NULL)
+{
+	if (block->isDummy())
+		throw SerializationError("ERROR: Not taking snapshot of dummy block.");
+
+	m_data = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	block->getNodes(m_data);
+
+	std::ostringstream oss(std::ios_base::binary);
+	block->m_node_metadata.serialize(oss);
+	m_metadata = oss.str();
+}
+
+MapBlockSnapshot::~MapBlockSnapshot()
+{
+	delete[] m_data;
+}
+
+void MapBlockSnapshot::serialize(std::ostream &os, u8 version, u8 codec)
+{
+	if (!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+
+	MapBlock::serializeData(os, version, codec, m_flags, m_biome, m_data, m_metadata);
+}
+
+
 
 //END
@@ -30,6 +30,7 @@
 #include <jmutex.h>
 #include <jmutexautolock.h>
 #include <exception>
+#include <vector>
 #include "debug.h"
 #include "common_irrlicht.h"
 #include "mapnode.h"
@@ -117,6 +118,78 @@ public:
 };
 #endif
 
+/*
+	How many times the environment has stepped each node of a block,
+	for the nodes whose content uses it (ContentFeatures::envticks).
+
+	Only a few nodes of a block usually count, so the counts are kept
+	in a list sorted by node index. Once the list grows long it is
+	replaced by an array holding a count for every node of the block.
+*/
+
+// Length at which the list is replaced by the array
+#define NODETICKS_LIST_MAX 1024
+
+class NodeTickTable
+{
+public:
+	NodeTickTable();
+	~NodeTickTable();
+
+	u32 get(u16 i);
+	// Setting 0 forgets the node
+	void set(u16 i, u32 ticks);
+	// Returns the new count
+	u32 increment(u16 i);
+	void clear();
+
+	bool empty()
+	{
+		return (m_array == NULL && m_list.empty());
+	}
+	bool isArray()
+	{
+		return (m_array != NULL);
+	}
+
+	// Heap memory used by the table, in bytes
+	u32 getMemoryUsage();
+
+private:
+	struct Entry
+	{
+		u16 index;
+		u32 ticks;
+	};
+
+	// First entry with an index not lower than i
+	std::vector<Entry>::iterator find(u16 i);
+	void makeArray();
+
+	std::vector<Entry> m_list;
+	u32 *m_array;
+
+	NodeTickTable(const NodeTickTable &);
+	NodeTickTable &operator=(const NodeTickTable &);
+};
+
+/*
+	How the nodes of a MapBlock are held in memory
+*/
+enum MapBlockStorage
+{
+	// Dummy block, no nodes
+	MBS_NONE,
+	// An array of all the nodes
+	MBS_FULL,
+	// Indices into a palette of the distinct nodes, packed in
+	// m_packed_bits bits each. With 0 bits every node is the same.
+	MBS_PALETTE
+};
+
+// Blocks with more distinct nodes than this are held as MBS_FULL
+#define MAPBLOCK_PALETTE_MAX 16
+
 /*
 	MapBlock itself
 */
@@ -137,26 +210,48 @@ public:
 		return m_parent;
 	}
 
+	// Fills the block with CONTENT_IGNORE
 	void reallocate()
 	{
-		if(data != NULL)
-			delete[] data;
-		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
-		data = new MapNode[l];
-		for(u32 i=0; i<l; i++){
-			//data[i] = MapNode();
-			data[i] = MapNode(CONTENT_IGNORE);
-		}
+		freeNodes();
+		m_storage = MBS_PALETTE;
+		m_palette[0] = MapNode(CONTENT_IGNORE);
+		m_palette_size = 1;
+		m_packed_bits = 0;
+		m_node_ticks.clear();
+		m_node_counts_valid = false;
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 
+	/*
+		Node storage, see MapBlockStorage. Blocks are held as a full
+		array whenever they are written to, compact() packs them again.
+	*/
+
+	// Returns true if the block is now held in less memory
+	bool compact();
+	// Holds the block as a full array
+	void expand();
+
+	bool isCompact()
+	{
+		return (m_storage == MBS_PALETTE);
+	}
+	bool isUniform()
+	{
+		return (m_storage == MBS_PALETTE && m_packed_bits == 0);
+	}
+
+	// Copies every node of the block to dst, in index order
+	void getNodes(MapNode *dst);
+
 	/*
 		Flags
 	*/
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (m_storage == MBS_NONE);
 	}
 	void unDummify()
 	{
@@ -195,6 +290,7 @@ public:
 	void raiseModified(u32 mod)
 	{
 		m_modified = MYMAX(m_modified, mod);
+		m_mod_counter++;
 	}
 	u32 getModified()
 	{
@@ -204,6 +300,16 @@ public:
 	{
 		m_modified = MOD_STATE_CLEAN;
 	}
+	// See m_mod_counter
+	u32 getModCounter()
+	{
+		return m_mod_counter;
+	}
+	// See m_load_generation
+	u32 getLoadGeneration()
+	{
+		return m_load_generation;
+	}
 
 	// is_underground getter/setter
 	bool getIsUnderground()
@@ -256,7 +362,7 @@ public:
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -283,6 +389,7 @@ public:
 	void setBiome(uint8_t biome)
 	{
 		m_biome = biome;
+		m_mod_counter++;
 	}
 
 	core::aabbox3d<s16> getBox()
@@ -299,7 +406,7 @@ public:
 
 	bool isValidPosition(s16 x, s16 y, s16 z)
 	{
-		if (data == NULL)
+		if (isDummy())
 			return false;
 		return (
 			x >= 0 && x < MAP_BLOCKSIZE
@@ -313,7 +420,7 @@ public:
 		*valid_position = isValidPosition(x, y, z);
 		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return nodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 
 	MapNode getNode(v3s16 p, bool *valid_position)
@@ -334,7 +441,9 @@ public:
 	{
 		if (!isValidPosition(x,y,z))
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		u32 i = z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x;
+		nodeReplaced(i, n);
+		setNodeAt(i, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 
@@ -343,11 +452,63 @@ public:
 		setNode(p.X, p.Y, p.Z, n);
 	}
 
-	void incNodeTicks(v3s16 p)
+	/*
+		Node tick counters, kept for nodes whose content has
+		ContentFeatures::envticks set. Replacing the content of a node
+		resets its count.
+	*/
+
+	// Counts a step of the node and returns the new count, or 0 if
+	// the node's content doesn't count steps
+	u32 incNodeTicks(v3s16 p)
+	{
+		if (!isValidPosition(p.X,p.Y,p.Z))
+			return 0;
+		u32 i = p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X;
+		if (!content_features(nodeAt(i).getContent()).envticks)
+			return 0;
+		return m_node_ticks.increment(i);
+	}
+
+	u32 getNodeTicks(v3s16 p)
+	{
+		if (!isValidPosition(p.X,p.Y,p.Z))
+			return 0;
+		return m_node_ticks.get(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
+	}
+
+	void setNodeTicks(v3s16 p, u32 ticks)
 	{
 		if (!isValidPosition(p.X,p.Y,p.Z))
 			return;
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X].envticks++;
+		m_node_ticks.set(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X, ticks);
+	}
+
+	/*
+		Nodes of the block queued for Map::transformLiquids(), in the
+		order they were queued and each only once.
+	*/
+
+	// Returns true if the queue was empty, then the Map has to queue
+	// the block too
+	bool queueLiquid(v3s16 p);
+	// Takes the node at the front, the queue must not be empty
+	v3s16 popLiquid();
+	u32 getLiquidQueueSize()
+	{
+		return m_liquid_queue.size() - m_liquid_head;
+	}
+
+	// Heap memory used by the nodes and their tick counts, in bytes
+	u32 getMemoryUsage()
+	{
+		u32 size = m_node_ticks.getMemoryUsage();
+		size += m_liquid_queue.capacity()*sizeof(u16) + m_liquid_queued.capacity()*sizeof(u32);
+		if (m_storage == MBS_FULL)
+			size += MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*sizeof(MapNode);
+		else if (m_storage == MBS_PALETTE)
+			size += MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*m_packed_bits/8;
+		return size;
 	}
 
 	/*
@@ -359,7 +520,7 @@ public:
 		*valid_position = isValidPosition(x, y, z);
 		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return nodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 
 	MapNode getNodeNoCheck(v3s16 p, bool *valid_position)
@@ -369,9 +530,11 @@ public:
 
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		u32 i = z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x;
+		nodeReplaced(i, n);
+		setNodeAt(i, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 
@@ -420,7 +583,7 @@ public:
 	}
 
 	// See comments in mapblock.cpp
-	bool propagateSunlight(core::map<v3s16, bool> & light_sources,
+	bool propagateSunlight(std::vector<v3s16> & light_sources,
 			bool remove_light=false, bool *black_air_left=NULL);
 
 	// Copies data to VoxelManipulator to getPosRelative()
@@ -445,6 +608,32 @@ public:
 		return m_day_night_differs;
 	}
 
+	/*
+		Faces of the block that are fully covered by opaque nodes, one
+		bit for each direction of g_6dirs. Nothing can be seen through
+		such a face.
+		Worked out again when the block has changed since last time.
+	*/
+	u8 getOpaqueFaces();
+
+	/*
+		Number of nodes whose content has ContentFeatures::envstep
+		set, and of air equivalent nodes. Single node writes keep these
+		up to date, they are counted again after bulk writes.
+	*/
+	u32 getEnvStepNodeCount()
+	{
+		if (!m_node_counts_valid)
+			countNodes();
+		return m_envstep_nodes;
+	}
+	u32 getAirNodeCount()
+	{
+		if (!m_node_counts_valid)
+			countNodes();
+		return m_air_nodes;
+	}
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -498,7 +687,11 @@ public:
 	*/
 
 	// These don't write or read version by itself
-	void serialize(std::ostream &os, u8 version);
+	// codec is one of SER_CODEC_*, only written from version 23 up
+	void serialize(std::ostream &os, u8 version, u8 codec=SER_CODEC_ZLIB);
+	// Writes what serialize() does from the given parts of a block
+	static void serializeData(std::ostream &os, u8 version, u8 codec, u8 flags,
+			u8 biome, MapNode *data, const std::string &metadata);
 	void deSerialize(std::istream &is, u8 version);
 	// Used after the basic ones when writing on disk (serverside)
 	void serializeDiskExtra(std::ostream &os, u8 version);
@@ -514,17 +707,21 @@ private:
 		Private methods
 	*/
 
+	// The flags byte of the serialized block
+	u8 getSerializationFlags();
+
 	/*
 		Used only internally, because changes can't be tracked
 	*/
 
 	MapNode & getNodeRef(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
+		expand();
 		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
 	}
 	MapNode & getNodeRef(v3s16 &p)
@@ -532,6 +729,54 @@ private:
 		return getNodeRef(p.X, p.Y, p.Z);
 	}
 
+	// Forgets the tick count of node i if n replaces its content, and
+	// keeps the node counts
+	void nodeReplaced(u32 i, MapNode &n)
+	{
+		content_t old_content = nodeAt(i).getContent();
+		if (old_content == n.getContent())
+			return;
+		if (!m_node_ticks.empty())
+			m_node_ticks.set(i, 0);
+		if (m_node_counts_valid) {
+			ContentFeatures &f_old = content_features(old_content);
+			ContentFeatures &f_new = content_features(n.getContent());
+			m_envstep_nodes += (u32)f_new.envstep - (u32)f_old.envstep;
+			m_air_nodes += (u32)f_new.air_equivalent - (u32)f_old.air_equivalent;
+		}
+	}
+
+	void countNodes();
+
+	/*
+		Node access by index whatever the storage is. The block must
+		not be a dummy.
+	*/
+
+	MapNode nodeAt(u32 i)
+	{
+		if (m_storage == MBS_FULL)
+			return data[i];
+		if (m_packed_bits == 0)
+			return m_palette[0];
+		u32 bit = i*m_packed_bits;
+		return m_palette[(m_packed[bit>>3]>>(bit&7)) & ((1<<m_packed_bits)-1)];
+	}
+
+	void setNodeAt(u32 i, MapNode &n)
+	{
+		if (m_storage != MBS_FULL) {
+			if (setPackedNode(i, n))
+				return;
+			expand();
+		}
+		data[i] = n;
+	}
+
+	// Stores n at i if it is in the palette, returns false if not
+	bool setPackedNode(u32 i, MapNode &n);
+	void freeNodes();
+
 public:
 	/*
 		Public member variables
@@ -561,11 +806,33 @@ private:
 	uint8_t m_biome;
 
 	/*
-		If NULL, block is a dummy block.
+		If MBS_NONE, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
+	u8 m_storage;
+
+	// MBS_FULL: every node of the block
 	MapNode * data;
 
+	// MBS_PALETTE: the distinct nodes and the packed indices into them
+	MapNode m_palette[MAPBLOCK_PALETTE_MAX];
+	u8 m_palette_size;
+	u8 m_packed_bits;
+	u8 *m_packed;
+
+	// m_mod_counter at the last compact(), which needn't look again
+	// before the block changes
+	u32 m_compact_mod_counter;
+
+	NodeTickTable m_node_ticks;
+
+	// See queueLiquid(), node indices from m_liquid_head on are queued
+	// and have their bit set in m_liquid_queued. Both are freed when
+	// the queue empties.
+	std::vector<u16> m_liquid_queue;
+	u32 m_liquid_head;
+	std::vector<u32> m_liquid_queued;
+
 	/*
 		- On the server, this is used for telling whether the
 		  block has been modified from the one on disk.
@@ -573,6 +840,20 @@ private:
 	*/
 	u32 m_modified;
 
+	/*
+		Incremented on every change to the block, unlike m_modified
+		this is never reset. Used for telling whether data made from
+		the block earlier is still current.
+	*/
+	u32 m_mod_counter;
+
+	/*
+		Different for every MapBlock object made, so that data made
+		from a block isn't taken for that of a block loaded later at
+		the same position, or at the same address.
+	*/
+	u32 m_load_generation;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
@@ -595,6 +876,15 @@ private:
 	// Whether day and night lighting differs
 	bool m_day_night_differs;
 
+	// See getOpaqueFaces(), made at m_opaque_faces_mod_counter
+	u8 m_opaque_faces;
+	u32 m_opaque_faces_mod_counter;
+
+	// See getEnvStepNodeCount(), countNodes() makes them valid
+	u32 m_envstep_nodes;
+	u32 m_air_nodes;
+	bool m_node_counts_valid;
+
 	bool m_generated;
 
 #ifndef SERVER // Only on client
@@ -617,6 +907,48 @@ private:
 		Map will unload the block when this reaches a timeout.
 	*/
 	float m_usage_timer;
+
+	friend class MapBlockSnapshot;
+};
+
+/*
+	A copy of the parts of a block that MapBlock::serialize writes.
+
+	This is taken while the map is locked, after which the block can
+	be serialized and compressed without access to the map.
+*/
+class MapBlockSnapshot
+{
+public:
+	MapBlockSnapshot(MapBlock *block);
+	~MapBlockSnapshot();
+
+	v3s16 getPos()
+	{
+		return m_pos;
+	}
+	// The modification counter of the block when this was taken
+	u32 getModCounter()
+	{
+		return m_mod_counter;
+	}
+	// The load generation of the block
+	u32 getLoadGeneration()
+	{
+		return m_load_generation;
+	}
+
+	// Same as MapBlock::serialize
+	void serialize(std::ostream &os, u8 version, u8 codec=SER_CODEC_ZLIB);
+
+private:
+	v3s16 m_pos;
+	u32 m_mod_counter;
+	u32 m_load_generation;
+	u8 m_flags;
+	u8 m_biome;
+	MapNode *m_data;
+	std::string m_metadata;
 };
 
 inline bool blockpos_over_limit(v3s16 p)
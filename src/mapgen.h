@@ -33,6 +33,7 @@
 class MapBlock;
 class ManualMapVoxelManipulator;
 class VoxelManipulator;
+class PseudoRandom;
 struct NoiseParams;
 
 enum MapGenType {
@@ -88,15 +89,15 @@ namespace mapgen
 	void make_block(BlockMakeData *data);
 
 	/* defined in mapgen_plants.cpp */
-	void make_papyrus(VoxelManipulator &vmanip, v3s16 p0);
-	void make_cactus(VoxelManipulator &vmanip, v3s16 p0);
+	void make_papyrus(VoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random);
+	void make_cactus(VoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random);
 
 	/* defined in mapgen_trees.cpp */
-	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0);
-	void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0);
-	void make_conifertree(ManualMapVoxelManipulator &vmanip, v3s16 p0);
-	void make_largetree(ManualMapVoxelManipulator &vmanip, v3s16 p0);
-	void make_jungletree(ManualMapVoxelManipulator &vmanip, v3s16 p0);
+	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random);
+	void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random);
+	void make_conifertree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random);
+	void make_largetree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random);
+	void make_jungletree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random);
 
 	/* defined in mapgen_rocks.cpp */
 	void make_boulder(ManualMapVoxelManipulator &vmanip, v3s16 pos, uint16_t size, content_t inner, content_t outer, content_t replace);
@@ -505,31 +505,31 @@ void make_block(BlockMakeData *data)
 						// Papyrus grows only on mud and in water
 						}else if (y <= WATER_LEVEL) {
 							p.Y++;
-							make_papyrus(vmanip, p);
+							make_papyrus(vmanip, p, treerandom);
 						// Trees grow only on mud and grass, on land
 						}else if (data->biome == BIOME_LAKE) {
-							make_appletree(vmanip, p);
+							make_appletree(vmanip, p, treerandom);
 						}else if (y > (WATER_LEVEL+2)) {
 							p.Y++;
 							if (data->biome == BIOME_JUNGLE) {
-								make_jungletree(vmanip, p);
+								make_jungletree(vmanip, p, treerandom);
 							// connifers
 							}else if (data->biome == BIOME_SNOWCAP) {
-								make_conifertree(vmanip, p);
+								make_conifertree(vmanip, p, treerandom);
 							}else if (data->biome == BIOME_PLAINS) {
-								make_tree(vmanip, p);
+								make_tree(vmanip, p, treerandom);
 							// regular trees
-							}else if (myrand_range(0,10) != 0) {
-								make_tree(vmanip, p);
+							}else if (treerandom.range(0,10) != 0) {
+								make_tree(vmanip, p, treerandom);
 							}else{
-								make_largetree(vmanip, p);
+								make_largetree(vmanip, p, treerandom);
 							}
 						}
 					// Cactii grow only on sand, on land
 					}else if (n->getContent() == CONTENT_DESERT_SAND) {
 						if (y > (WATER_LEVEL+2)) {
 							p.Y++;
-							make_cactus(vmanip, p);
+							make_cactus(vmanip, p, treerandom);
 						}
 					// bushes on clay
 					}else if (n->getContent() == CONTENT_CLAY) {
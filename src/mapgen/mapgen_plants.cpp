@@ -27,15 +27,16 @@
 #include "voxel.h"
 #include "content_mapnode.h"
 #include "map.h"
+#include "noise.h"
 
 namespace mapgen
 {
 
-void make_papyrus(VoxelManipulator &vmanip, v3s16 p0)
+void make_papyrus(VoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode papyrusnode(CONTENT_PAPYRUS);
 
-	s16 trunk_h = myrand_range(2, 3);
+	s16 trunk_h = random.range(2, 3);
 	v3s16 p1 = p0;
 	for (s16 ii=0; ii<trunk_h; ii++) {
 		if (vmanip.m_area.contains(p1))
@@ -44,12 +45,12 @@ void make_papyrus(VoxelManipulator &vmanip, v3s16 p0)
 	}
 }
 
-void make_cactus(VoxelManipulator &vmanip, v3s16 p0)
+void make_cactus(VoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode cactusnode(CONTENT_CACTUS);
 
 	s16 trunk_h = 3;
-	if (myrand()%5000 == 0)
+	if (random.next()%5000 == 0)
 		trunk_h = 4;
 	v3s16 p1 = p0;
 	for (s16 ii=0; ii<trunk_h; ii++) {
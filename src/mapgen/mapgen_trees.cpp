@@ -27,17 +27,18 @@
 #include "voxel.h"
 #include "content_mapnode.h"
 #include "map.h"
+#include "noise.h"
 
 namespace mapgen
 {
 
-void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
+void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_TREE);
 	MapNode leavesnode(CONTENT_LEAVES);
 	uint8_t b = 0xE0;
 
-	s16 trunk_h = myrand_range(5,6);
+	s16 trunk_h = random.range(5,6);
 	v3s16 p1 = p0;
 	for (s16 ii=0; ii<trunk_h; ii++) {
 		treenode.param1 = b|ii;
@@ -73,9 +74,9 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for (s16 z=0; z<=d; z++) {
@@ -107,14 +108,14 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 	}
 }
 
-void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
+void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_APPLE_TREE);
 	MapNode leavesnode(CONTENT_APPLE_LEAVES);
 	MapNode applenode(CONTENT_APPLE);
 	uint8_t b = 0xE0;
 
-	s16 trunk_h = myrand_range(4, 5);
+	s16 trunk_h = random.range(4, 5);
 	v3s16 p1 = p0;
 	for (s16 ii=0; ii<trunk_h; ii++) {
 		treenode.param1 = b|ii;
@@ -149,9 +150,9 @@ void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -163,7 +164,7 @@ void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 	}
 
 	// not all apple trees have apples
-	bool have_fruit = (myrand_range(0,4) == 0);
+	bool have_fruit = (random.range(0,4) == 0);
 
 	// Blit leaves to vmanip
 	for(s16 z=leaves_a.MinEdge.Z; z<=leaves_a.MaxEdge.Z; z++)
@@ -179,7 +180,7 @@ void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 			continue;
 		u32 i = leaves_a.index(x,y,z);
 		if (leaves_d[i] == 1) {
-			bool is_apple = myrand_range(0,99) < 10;
+			bool is_apple = random.range(0,99) < 10;
 			if (have_fruit && is_apple) {
 				vmanip.m_data[vi] = applenode;
 			}else{
@@ -189,13 +190,13 @@ void make_appletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 	}
 }
 
-void make_conifertree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
+void make_conifertree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_CONIFER_TREE);
 	MapNode leavesnode(CONTENT_CONIFER_LEAVES);
 	uint8_t b = 0xE0;
 
-	s16 trunk_h = myrand_range(8, 11);
+	s16 trunk_h = random.range(8, 11);
 	v3s16 p1 = p0;
 	for (s16 ii=0; ii<trunk_h; ii++) {
 		treenode.param1 = b|ii;
@@ -229,13 +230,13 @@ void make_conifertree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 
 }
 
-void make_largetree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
+void make_largetree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_TREE);
 	MapNode leavesnode(CONTENT_LEAVES);
 	uint8_t b = 0xE0;
 
-	s16 trunk_h = myrand_range(10, 12);
+	s16 trunk_h = random.range(10, 12);
 	v3s16 p1 = p0;
 	for (s16 ii=0; ii<trunk_h; ii++) {
 		treenode.param1 = b|ii;
@@ -311,9 +312,9 @@ void make_largetree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 				s16 d = 1;
 
 				v3s16 p(
-					myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-					myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-					myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+					random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+					random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+					random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 				);
 
 				for(s16 z=0; z<=d; z++)
@@ -345,7 +346,7 @@ void make_largetree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 	}
 }
 
-void make_jungletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
+void make_jungletree(ManualMapVoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_JUNGLETREE);
 	MapNode leavesnode(CONTENT_JUNGLELEAVES);
@@ -353,7 +354,7 @@ void make_jungletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 	for(s16 x=-1; x<=1; x++)
 	for(s16 z=-1; z<=1; z++)
 	{
-		if(myrand_range(0, 2) == 0)
+		if(random.range(0, 2) == 0)
 			continue;
 		v3s16 p1 = p0 + v3s16(x,0,z);
 		v3s16 p2 = p0 + v3s16(x,-1,z);
@@ -364,7 +365,7 @@ void make_jungletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 			vmanip.m_data[vmanip.m_area.index(p1)] = treenode;
 	}
 
-	s16 trunk_h = myrand_range(8, 12);
+	s16 trunk_h = random.range(8, 12);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -399,9 +400,9 @@ void make_jungletree(ManualMapVoxelManipulator &vmanip, v3s16 p0)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
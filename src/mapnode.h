@@ -392,6 +392,12 @@ struct ContentFeatures
 	bool destructive_mob_safe;
 	// Whether punching with fertilizer advances the growth rate of the node
 	bool fertilizer_affects;
+	// Whether the environment counts how many times it has stepped the
+	// node, see MapBlock::incNodeTicks()
+	bool envticks;
+	// Whether ServerEnvironment::step() has anything to do with the
+	// node on its node steps, see envstep_init()
+	bool envstep;
 	// when dug with a shovel near water, turns to farm dirt
 	bool farm_ploughable;
 	// if true, this node can be dug even in a borderstone protected area
@@ -582,6 +588,8 @@ struct ContentFeatures
 		often_contains_mineral = false;
 		destructive_mob_safe = false;
 		fertilizer_affects = false;
+		envticks = false;
+		envstep = false;
 		farm_ploughable = false;
 		borderstone_diggable = false;
 		dug_item = "";
@@ -962,8 +970,6 @@ struct MapNode
 	*/
 	u8 param2;
 
-	u32 envticks;
-
 	MapNode(const MapNode & n)
 	{
 		*this = n;
@@ -974,7 +980,6 @@ struct MapNode
 		content = a_content;
 		param1 = a_param1;
 		param2 = a_param2;
-		envticks = 0;
 	}
 
 	bool operator==(const MapNode &other)
@@ -992,7 +997,6 @@ struct MapNode
 	void setContent(content_t c)
 	{
 		content = c;
-		envticks = 0;
 	}
 
 	u8 getLightBanksWithSource()
@@ -28,6 +28,7 @@
 #include "client.h"
 #include "exceptions.h"
 #include "mapblock.h"
+#include "map.h"
 
 MapSector::MapSector(Map *parent, v2s16 pos):
 		m_parent(parent),
@@ -49,7 +50,10 @@ void MapSector::deleteBlocks()
 	// Delete all
 	core::map<s16, MapBlock*>::Iterator i = m_blocks.getIterator();
 	for (; i.atEnd() == false; i++) {
-		delete i.getNode()->getValue();
+		MapBlock *block = i.getNode()->getValue();
+		if (m_parent)
+			m_parent->blockRemoved(block);
+		delete block;
 	}
 
 	// Clear container
@@ -97,6 +101,8 @@ MapBlock * MapSector::createBlankBlock(s16 y)
 	MapBlock *block = createBlankBlockNoInsert(y);
 
 	m_blocks.insert(y, block);
+	if (m_parent)
+		m_parent->blockAdded(block);
 
 	return block;
 }
@@ -114,6 +120,8 @@ void MapSector::insertBlock(MapBlock *block)
 
 	// Insert into container
 	m_blocks.insert(block_y, block);
+	if (m_parent)
+		m_parent->blockAdded(block);
 }
 
 void MapSector::deleteBlock(MapBlock *block)
@@ -125,6 +133,8 @@ void MapSector::deleteBlock(MapBlock *block)
 
 	// Remove from container
 	m_blocks.remove(block_y);
+	if (m_parent)
+		m_parent->blockRemoved(block);
 
 	// Delete
 	delete block;
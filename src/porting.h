@@ -42,6 +42,13 @@
 	#define SWPRINTF_CHARSTRING L"%s"
 #endif
 
+// For variables that each thread has its own copy of
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 #ifdef _WIN32
 	#include <windows.h>
 	#define sleep_ms(x) Sleep(x)
@@ -50,6 +57,20 @@
 	#define sleep_ms(x) usleep(x*1000)
 #endif
 
+// Atomic operations on 32 bit integers, all of them are full barriers
+#ifdef _MSC_VER
+	#define atomic_cas(ptr, oldval, newval) \
+		(InterlockedCompareExchange((volatile LONG*)(ptr), \
+				(LONG)(newval), (LONG)(oldval)) == (LONG)(oldval))
+	#define atomic_add(ptr, n) InterlockedExchangeAdd((volatile LONG*)(ptr), (n))
+	#define memory_barrier() MemoryBarrier()
+#else
+	#define atomic_cas(ptr, oldval, newval) \
+		__sync_bool_compare_and_swap((ptr), (oldval), (newval))
+	#define atomic_add(ptr, n) __sync_fetch_and_add((ptr), (n))
+	#define memory_barrier() __sync_synchronize()
+#endif
+
 #if defined(__APPLE__) || defined(__FreeBSD__)
 	#include <sys/types.h>
 	#include <sys/sysctl.h>
@@ -95,6 +116,28 @@ bool * signal_handler_killstatus(void);
 	}*/
 #endif
 
+/*
+	Microseconds, for timing things too short for getTimeMs().
+	Wraps around every 71 minutes, only use differences.
+*/
+#ifdef _WIN32 // Windows
+	inline u32 getTimeUs()
+	{
+		LARGE_INTEGER freq, count;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&count);
+		return (u32)(count.QuadPart / freq.QuadPart * 1000000
+				+ count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+	}
+#else // Posix
+	inline u32 getTimeUs()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+#endif
+
 std::string getUser();
 
 } // namespace porting
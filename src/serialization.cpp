@@ -29,6 +29,9 @@
 	#define ZLIB_WINAPI
 #endif
 #include "zlib.h"
+#if USE_ZSTD
+#include <zstd.h>
+#endif
 
 /* report a zlib or i/o error */
 void zerr(int ret)
@@ -58,7 +61,7 @@ void zerr(int ret)
 	}
 }
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os)
+void compressZlib(SharedBuffer<u8> data, std::ostream &os, int level)
 {
 	z_stream z;
 	const s32 bufsize = 16384;
@@ -70,7 +73,7 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 	z.zfree = Z_NULL;
 	z.opaque = Z_NULL;
 
-	ret = deflateInit(&z, -1);
+	ret = deflateInit(&z, level);
 	if(ret != Z_OK)
 		throw SerializationError("compressZlib: deflateInit failed");
 
@@ -102,10 +105,10 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 
 }
 
-void compressZlib(const std::string &data, std::ostream &os)
+void compressZlib(const std::string &data, std::ostream &os, int level)
 {
 	SharedBuffer<u8> databuf((u8*)data.c_str(), data.size());
-	compressZlib(databuf, os);
+	compressZlib(databuf, os, level);
 }
 
 void decompressZlib(std::istream &is, std::ostream &os)
@@ -271,4 +274,142 @@ void decompress(std::istream &is, std::ostream &os, u8 version)
 	}
 }
 
+u8 serCodecI(char *name)
+{
+	if (!name)
+		return SER_CODEC_ZLIB;
+	if (!strcmp(name,"fast"))
+		return SER_CODEC_ZLIB_FAST;
+	if (!strcmp(name,"none"))
+		return SER_CODEC_NONE;
+	if (!strcmp(name,"zstd")) {
+#if USE_ZSTD
+		return SER_CODEC_ZSTD;
+#else
+		return SER_CODEC_ZLIB_FAST;
+#endif
+	}
+	return SER_CODEC_ZLIB;
+}
+
+#if USE_ZSTD
+/*
+	Written as a u32 length and a single frame, so that the data
+	following it in the stream is left alone.
+*/
+static void compressZstd(SharedBuffer<u8> &data, std::ostream &os)
+{
+	size_t bound = ZSTD_compressBound(data.getSize());
+	Buffer<char> buf(bound);
+	size_t len = ZSTD_compress(*buf, bound, *data, data.getSize(), ZSTD_CLEVEL_DEFAULT);
+	if (ZSTD_isError(len))
+		throw SerializationError("compressZstd: compress failed");
+	writeU32(os, len);
+	os.write(*buf, len);
+}
+
+static void decompressZstd(std::istream &is, std::ostream &os)
+{
+	u32 len = readU32(is);
+	const u32 bufsize = 16384;
+	char input_buffer[bufsize];
+	char output_buffer[bufsize];
+	size_t status = 0;
+
+	ZSTD_DStream *z = ZSTD_createDStream();
+	if (z == NULL)
+		throw SerializationError("decompressZstd: ZSTD_createDStream failed");
+
+	ZSTD_inBuffer in = {input_buffer, 0, 0};
+	for (;;) {
+		if (in.pos == in.size && len > 0) {
+			u32 count = len < bufsize ? len : bufsize;
+			is.read(input_buffer, count);
+			if (is.gcount() != (std::streamsize)count) {
+				ZSTD_freeDStream(z);
+				throw SerializationError("decompressZstd: stream ended halfway");
+			}
+			in.size = count;
+			in.pos = 0;
+			len -= count;
+		}
+		ZSTD_outBuffer out = {output_buffer, bufsize, 0};
+		status = ZSTD_decompressStream(z, &out, &in);
+		if (ZSTD_isError(status)) {
+			ZSTD_freeDStream(z);
+			throw SerializationError("decompressZstd: decompress failed");
+		}
+		if (out.pos)
+			os.write(output_buffer, out.pos);
+		// Frame done, or nothing left to feed it
+		if (status == 0 || (in.pos == in.size && len == 0 && out.pos < bufsize))
+			break;
+	}
+	ZSTD_freeDStream(z);
+
+	if (status != 0)
+		throw SerializationError("decompressZstd: frame ended halfway");
+}
+#endif
 
+void compressCodec(SharedBuffer<u8> data, std::ostream &os, u8 codec)
+{
+	switch (codec) {
+	case SER_CODEC_ZLIB:
+		compressZlib(data, os);
+		break;
+	case SER_CODEC_ZLIB_FAST:
+		compressZlib(data, os, Z_BEST_SPEED);
+		break;
+	case SER_CODEC_NONE:
+		writeU32(os, data.getSize());
+		if (data.getSize())
+			os.write((char*)*data, data.getSize());
+		break;
+#if USE_ZSTD
+	case SER_CODEC_ZSTD:
+		compressZstd(data, os);
+		break;
+#endif
+	default:
+		throw SerializationError("compressCodec: unknown codec");
+	}
+}
+
+void compressCodec(const std::string &data, std::ostream &os, u8 codec)
+{
+	SharedBuffer<u8> databuf((u8*)data.c_str(), data.size());
+	compressCodec(databuf, os, codec);
+}
+
+void decompressCodec(std::istream &is, std::ostream &os, u8 codec)
+{
+	switch (codec) {
+	case SER_CODEC_ZLIB:
+	case SER_CODEC_ZLIB_FAST:
+		decompressZlib(is, os);
+		break;
+	case SER_CODEC_NONE:
+	{
+		u32 len = readU32(is);
+		const u32 bufsize = 16384;
+		char buf[bufsize];
+		while (len > 0) {
+			u32 count = len < bufsize ? len : bufsize;
+			is.read(buf, count);
+			if (is.gcount() != (std::streamsize)count)
+				throw SerializationError("decompressCodec: stream ended halfway");
+			os.write(buf, count);
+			len -= count;
+		}
+		break;
+	}
+#if USE_ZSTD
+	case SER_CODEC_ZSTD:
+		decompressZstd(is, os);
+		break;
+#endif
+	default:
+		throw SerializationError("decompressCodec: unknown codec");
+	}
+}
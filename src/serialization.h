@@ -28,6 +28,7 @@
 
 #include "common_irrlicht.h"
 #include "exceptions.h"
+#include "config.h"
 #include <iostream>
 #include "utility.h"
 
@@ -64,22 +65,52 @@
 	20: many existing content types translated to extended ones
 	21: u8 param0 replaced with content_t content
 	22: added biome id
+	23: codec byte, block data compressed with the codec it names
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
-#define SER_FMT_VER_HIGHEST 22
+#define SER_FMT_VER_HIGHEST 23
 // Lowest supported serialization version
 #define SER_FMT_VER_LOWEST 20
 
 #define ser_ver_supported(v) (v >= SER_FMT_VER_LOWEST && v <= SER_FMT_VER_HIGHEST)
 
+/*
+	Block data codecs, written as a byte from version 23 up
+
+	Older versions are always zlib with the default level.
+*/
+// zlib with the default level
+#define SER_CODEC_ZLIB 0
+// zlib with the fastest level, same size of output to inflate
+#define SER_CODEC_ZLIB_FAST 1
+// Not compressed, u32 length followed by the data
+#define SER_CODEC_NONE 2
+// zstd, u32 length followed by a zstd frame, only with USE_ZSTD
+#define SER_CODEC_ZSTD 3
+
+// Codecs every version 23 reader knows, as bits of (1<<codec)
+#define SER_CODEC_MASK_BASE ((1<<SER_CODEC_ZLIB)|(1<<SER_CODEC_ZLIB_FAST)|(1<<SER_CODEC_NONE))
+// Codecs this build reads and writes
+#if USE_ZSTD
+#define SER_CODEC_MASK (SER_CODEC_MASK_BASE|(1<<SER_CODEC_ZSTD))
+#else
+#define SER_CODEC_MASK SER_CODEC_MASK_BASE
+#endif
+
+#define ser_codec_supported(c) (c < 16 && (SER_CODEC_MASK & (1<<c)))
+
+// Codec from its config name (zlib, fast, none, zstd), zlib if unknown,
+// fast if zstd isn't built in
+u8 serCodecI(char *name);
+
 /*
 	Misc. serialization functions
 */
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os);
-void compressZlib(const std::string &data, std::ostream &os);
+void compressZlib(SharedBuffer<u8> data, std::ostream &os, int level=-1);
+void compressZlib(const std::string &data, std::ostream &os, int level=-1);
 void decompressZlib(std::istream &is, std::ostream &os);
 
 // These choose between zlib and a self-made one according to version
@@ -87,5 +118,10 @@ void compress(SharedBuffer<u8> data, std::ostream &os, u8 version);
 //void compress(const std::string &data, std::ostream &os, u8 version);
 void decompress(std::istream &is, std::ostream &os, u8 version);
 
+// These use one of the SER_CODEC_* codecs
+void compressCodec(SharedBuffer<u8> data, std::ostream &os, u8 codec);
+void compressCodec(const std::string &data, std::ostream &os, u8 codec);
+void decompressCodec(std::istream &is, std::ostream &os, u8 codec);
+
 #endif
 
@@ -34,6 +34,7 @@
 #include "main.h"
 #include "constants.h"
 #include "voxel.h"
+#include "noise.h"
 #include "mineral.h"
 #include "config.h"
 #include "content_object.h"
@@ -121,6 +122,629 @@ void * ServerThread::Thread()
 	return NULL;
 }
 
+/*
+	BlockEmergeQueue
+*/
+
+BlockEmergeQueue::BlockEmergeQueue()
+{
+	m_mutex.Init();
+}
+
+BlockEmergeQueue::~BlockEmergeQueue()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for (core::map<v3s16, Item*>::Iterator i = m_items.getIterator(); i.atEnd() == false; i++) {
+		Item *item = i.getNode()->getValue();
+		delete item->q;
+		delete item;
+	}
+	for (core::map<u16, core::map<v3s16, bool>*>::Iterator i = m_peer_items.getIterator(); i.atEnd() == false; i++) {
+		delete i.getNode()->getValue();
+	}
+}
+
+void BlockEmergeQueue::addBlock(u16 peer_id, v3s16 pos, u8 flags)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	JMutexAutoLock lock(m_mutex);
+
+	Item *item = NULL;
+	core::map<v3s16, Item*>::Node *n = m_items.find(pos);
+	if (n != NULL) {
+		item = n->getValue();
+	}else{
+		item = new Item;
+		item->q = new QueuedBlockEmerge;
+		item->q->pos = pos;
+		item->pinned = false;
+		item->queued_ms = porting::getTimeMs();
+		m_items.insert(pos, item);
+	}
+
+	if (peer_id == 0) {
+		item->pinned = true;
+	}else{
+		item->q->peer_ids[peer_id] = flags;
+
+		core::map<u16, core::map<v3s16, bool>*>::Node *pn = m_peer_items.find(peer_id);
+		core::map<v3s16, bool> *blocks = NULL;
+		if (pn != NULL) {
+			blocks = pn->getValue();
+		}else{
+			blocks = new core::map<v3s16, bool>;
+			m_peer_items.insert(peer_id, blocks);
+		}
+		blocks->set(pos, true);
+	}
+
+	if (n != NULL)
+		m_order.erase(item->order);
+	item->order = m_order.insert(std::pair<f32, Item*>(getPriority(item), item));
+}
+
+QueuedBlockEmerge * BlockEmergeQueue::pop(BlockEmergeRegions *regions)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	g_profiler->avg("EmergeQueue: length", m_items.size());
+
+	for (std::multimap<f32, Item*>::iterator i = m_order.begin(); i != m_order.end(); i++) {
+		Item *item = i->second;
+		if (regions && regions->acquire(item->q->pos) == false)
+			continue;
+
+		m_order.erase(i);
+		m_items.remove(item->q->pos);
+		for (core::map<u16, u8>::Iterator j = item->q->peer_ids.getIterator(); j.atEnd() == false; j++) {
+			core::map<u16, core::map<v3s16, bool>*>::Node *pn = m_peer_items.find(j.getNode()->getKey());
+			if (pn != NULL)
+				pn->getValue()->remove(item->q->pos);
+		}
+
+		g_profiler->avg("EmergeQueue: wait ms", porting::getTimeMs() - item->queued_ms);
+
+		QueuedBlockEmerge *q = item->q;
+		delete item;
+		return q;
+	}
+	return NULL;
+}
+
+void BlockEmergeQueue::updatePeer(u16 peer_id, const BlockEmergePeerView &view)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_peer_views[peer_id] = view;
+
+	core::map<u16, core::map<v3s16, bool>*>::Node *pn = m_peer_items.find(peer_id);
+	if (pn == NULL)
+		return;
+
+	v3s16 center(
+		floor(view.pos.X),
+		floor(view.pos.Y),
+		floor(view.pos.Z)
+	);
+
+	core::list<v3s16> unwanted;
+	core::map<v3s16, bool> *blocks = pn->getValue();
+	for (core::map<v3s16, bool>::Iterator i = blocks->getIterator(); i.atEnd() == false; i++) {
+		v3s16 p = i.getNode()->getKey();
+		v3s16 d = p - center;
+		if (abs(d.X) > view.range || abs(d.Y) > view.range || abs(d.Z) > view.range) {
+			unwanted.push_back(p);
+			continue;
+		}
+		core::map<v3s16, Item*>::Node *n = m_items.find(p);
+		if (n != NULL)
+			rerank(n->getValue());
+	}
+
+	for (core::list<v3s16>::Iterator i = unwanted.begin(); i != unwanted.end(); i++) {
+		blocks->remove(*i);
+		core::map<v3s16, Item*>::Node *n = m_items.find(*i);
+		if (n != NULL)
+			dropPeer(n->getValue(), peer_id);
+	}
+}
+
+void BlockEmergeQueue::removePeer(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_peer_views.remove(peer_id);
+
+	core::map<u16, core::map<v3s16, bool>*>::Node *pn = m_peer_items.find(peer_id);
+	if (pn == NULL)
+		return;
+
+	core::map<v3s16, bool> *blocks = pn->getValue();
+	m_peer_items.remove(peer_id);
+
+	for (core::map<v3s16, bool>::Iterator i = blocks->getIterator(); i.atEnd() == false; i++) {
+		core::map<v3s16, Item*>::Node *n = m_items.find(i.getNode()->getKey());
+		if (n != NULL)
+			dropPeer(n->getValue(), peer_id);
+	}
+
+	delete blocks;
+}
+
+u32 BlockEmergeQueue::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_items.size();
+}
+
+u32 BlockEmergeQueue::peerItemCount(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<u16, core::map<v3s16, bool>*>::Node *pn = m_peer_items.find(peer_id);
+	if (pn == NULL)
+		return 0;
+	return pn->getValue()->size();
+}
+
+/*
+	Lower is sooner. Blocks the server itself wants, or ones wanted by a
+	peer whose view isn't known yet, go first. Otherwise this is the
+	distance from the nearest camera in blocks, doubled for blocks that
+	are out of sight.
+*/
+f32 BlockEmergeQueue::getPriority(Item *item)
+{
+	if (item->pinned)
+		return 0;
+
+	// Same field of view as RemoteClient::GetNextBlocks uses
+	static const f32 cos_half_fov = cos((72.0*PI/180) * 4./3. / 2.);
+
+	v3f p(
+		item->q->pos.X + 0.5,
+		item->q->pos.Y + 0.5,
+		item->q->pos.Z + 0.5
+	);
+
+	f32 best = -1;
+	for (core::map<u16, u8>::Iterator i = item->q->peer_ids.getIterator(); i.atEnd() == false; i++) {
+		core::map<u16, BlockEmergePeerView>::Node *vn = m_peer_views.find(i.getNode()->getKey());
+		if (vn == NULL)
+			return 0;
+		BlockEmergePeerView &view = vn->getValue();
+
+		v3f off = p - view.pos;
+		f32 d = off.getLength();
+		// Blocks right next to the camera are always in sight
+		if (d > 1.0 && off.dotProduct(view.dir) < d * cos_half_fov)
+			d *= 2;
+
+		if (best < 0 || d < best)
+			best = d;
+	}
+
+	return best;
+}
+
+void BlockEmergeQueue::rerank(Item *item)
+{
+	f32 priority = getPriority(item);
+	if (priority == item->order->first)
+		return;
+	m_order.erase(item->order);
+	item->order = m_order.insert(std::pair<f32, Item*>(priority, item));
+}
+
+bool BlockEmergeQueue::dropPeer(Item *item, u16 peer_id)
+{
+	item->q->peer_ids.remove(peer_id);
+
+	if (item->pinned || item->q->peer_ids.size() != 0) {
+		rerank(item);
+		return false;
+	}
+
+	g_profiler->add("EmergeQueue: cancelled (num)", 1);
+
+	m_order.erase(item->order);
+	m_items.remove(item->q->pos);
+	delete item->q;
+	delete item;
+	return true;
+}
+
+/*
+	BlockPacketCache
+*/
+
+bool BlockPacketCache::get(MapBlock *block, u8 ver, u8 codec, SharedBuffer<u8> &packet)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<v3s16, Entry>::Node *n = m_entries.find(block->getPos());
+	if (n == NULL)
+		return false;
+
+	Entry &e = n->getValue();
+	if (e.load_generation != block->getLoadGeneration() || e.ver != ver
+			|| e.codec != codec || e.mod_counter != block->getModCounter())
+		return false;
+
+	packet = e.packet;
+	return true;
+}
+
+void BlockPacketCache::set(v3s16 p, u32 load_generation, u32 mod_counter, u8 ver, u8 codec,
+		SharedBuffer<u8> &packet)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	Entry e;
+	e.load_generation = load_generation;
+	e.ver = ver;
+	e.codec = codec;
+	e.mod_counter = mod_counter;
+	e.packet = packet;
+	m_entries.set(p, e);
+}
+
+void BlockPacketCache::remove(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_entries.remove(p);
+}
+
+/*
+	SendScheduler
+*/
+
+SendScheduler::SendScheduler():
+	m_total_tokens(0),
+	m_last_flush_ms(0),
+	m_window_time(0),
+	m_first_peer(0)
+{
+	m_mutex.Init();
+}
+
+void SendScheduler::addPeer(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_peers[peer_id] = PeerQueue();
+}
+
+void SendScheduler::removePeer(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_peers.erase(peer_id);
+}
+
+void SendScheduler::queue(PeerQueue &q, SendClass cls, QueuedPacket &p)
+{
+	u32 size = p.data.getSize();
+	if (!p.reliable && q.bytes[cls] + size > SEND_UNRELIABLE_QUEUE_MAX) {
+		q.dropped++;
+		return;
+	}
+	q.packets[cls].push_back(p);
+	q.bytes[cls] += size;
+}
+
+void SendScheduler::send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data,
+		bool reliable, SendClass cls)
+{
+	assert(cls != SEND_CONTROL);
+
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<u16, PeerQueue>::iterator i = m_peers.find(peer_id);
+	// The peer is gone
+	if (i == m_peers.end())
+		return;
+
+	QueuedPacket p;
+	p.channelnum = channelnum;
+	p.reliable = reliable;
+	p.is_block = false;
+	p.data = data;
+	queue(i->second, cls, p);
+}
+
+void SendScheduler::sentControl(u16 peer_id, u32 size)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<u16, PeerQueue>::iterator i = m_peers.find(peer_id);
+	if (i == m_peers.end())
+		return;
+	i->second.tokens -= size;
+	i->second.window_bytes += size;
+}
+
+bool SendScheduler::removeBlock(PeerQueue &q, v3s16 pos)
+{
+	for (u32 c=SEND_BLOCKS_NEAR; c<=SEND_BLOCKS_FAR; c++) {
+		for (std::list<QueuedPacket>::iterator j = q.packets[c].begin(); j != q.packets[c].end(); j++) {
+			if (j->is_block && j->blockpos == pos) {
+				q.bytes[c] -= j->data.getSize();
+				q.packets[c].erase(j);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void SendScheduler::sendBlock(u16 peer_id, v3s16 pos, SharedBuffer<u8> data, SendClass cls)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<u16, PeerQueue>::iterator i = m_peers.find(peer_id);
+	if (i == m_peers.end())
+		return;
+	PeerQueue &q = i->second;
+
+	removeBlock(q, pos);
+
+	QueuedPacket p;
+	p.channelnum = 1;
+	p.reliable = true;
+	p.is_block = true;
+	p.blockpos = pos;
+	p.data = data;
+	queue(q, cls, p);
+}
+
+bool SendScheduler::dropBlock(u16 peer_id, v3s16 pos)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<u16, PeerQueue>::iterator i = m_peers.find(peer_id);
+	if (i == m_peers.end())
+		return false;
+	return removeBlock(i->second, pos);
+}
+
+/*
+	Adds the budget for dtime seconds, unused budget is kept for up
+	to SEND_BUDGET_BURST seconds
+*/
+static float refill_send_budget(float tokens, u32 rate, float dtime)
+{
+	if (rate == 0)
+		return 0;
+	tokens += rate*dtime;
+	if (tokens > rate*SEND_BUDGET_BURST)
+		tokens = rate*SEND_BUDGET_BURST;
+	return tokens;
+}
+
+void SendScheduler::flush(std::list<OutgoingPacket> &out, u32 peer_rate, u32 total_rate)
+{
+	float dtime = 0;
+	{
+		JMutexAutoLock lock(m_mutex);
+		u32 now = porting::getTimeMs();
+		if (m_last_flush_ms != 0)
+			dtime = (float)(now - m_last_flush_ms)/1000.0;
+		m_last_flush_ms = now;
+	}
+	if (dtime > 1.0)
+		dtime = 1.0;
+
+	flush(out, peer_rate, total_rate, dtime);
+}
+
+void SendScheduler::flush(std::list<OutgoingPacket> &out, u32 peer_rate, u32 total_rate,
+		float dtime)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_total_tokens = refill_send_budget(m_total_tokens, total_rate, dtime);
+	m_window_time += dtime;
+	bool update_rate = (m_window_time >= 1.0);
+	for (std::map<u16, PeerQueue>::iterator i = m_peers.begin(); i != m_peers.end(); i++) {
+		PeerQueue &q = i->second;
+		q.tokens = refill_send_budget(q.tokens, peer_rate, dtime);
+		if (update_rate) {
+			q.rate = (float)q.window_bytes/m_window_time;
+			q.window_bytes = 0;
+		}
+	}
+	if (update_rate)
+		m_window_time = 0;
+
+	if (m_peers.size() == 0)
+		return;
+
+	// Start one peer further each time, so that none is always last
+	std::map<u16, PeerQueue>::iterator first = m_peers.upper_bound(m_first_peer);
+	if (first == m_peers.end())
+		first = m_peers.begin();
+	m_first_peer = first->first;
+
+	/*
+		Every peer with something queued and budget left gets
+		SEND_QUANTUM more bytes per round, and sends as many packets as
+		fit in what it has. Budgets may go below zero by one packet, so
+		packets larger than the budget still go out.
+	*/
+	bool active = true;
+	while (active) {
+		active = false;
+		std::map<u16, PeerQueue>::iterator i = first;
+		do{
+			PeerQueue &q = i->second;
+			u32 c = SEND_OBJECTS;
+			while (c < SEND_CLASS_COUNT && q.packets[c].empty())
+				c++;
+
+			if (c == SEND_CLASS_COUNT) {
+				q.deficit = 0;
+			}else if (peer_rate == 0 || q.tokens > 0) {
+				active = true;
+				q.deficit += SEND_QUANTUM;
+				while (c < SEND_CLASS_COUNT) {
+					if (q.packets[c].empty()) {
+						c++;
+						continue;
+					}
+					if (total_rate != 0 && m_total_tokens <= 0)
+						return;
+					QueuedPacket &p = q.packets[c].front();
+					s32 size = p.data.getSize();
+					if (size > q.deficit)
+						break;
+					OutgoingPacket o;
+					o.peer_id = i->first;
+					o.channelnum = p.channelnum;
+					o.reliable = p.reliable;
+					o.data = p.data;
+					out.push_back(o);
+					q.packets[c].pop_front();
+					q.bytes[c] -= size;
+					q.deficit -= size;
+					q.tokens -= size;
+					q.window_bytes += size;
+					m_total_tokens -= size;
+					if (peer_rate != 0 && q.tokens <= 0)
+						break;
+				}
+			}
+
+			i++;
+			if (i == m_peers.end())
+				i = m_peers.begin();
+		}while (i != first);
+	}
+}
+
+bool SendScheduler::getStats(u16 peer_id, SendQueueStats &stats)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<u16, PeerQueue>::iterator i = m_peers.find(peer_id);
+	if (i == m_peers.end())
+		return false;
+
+	PeerQueue &q = i->second;
+	stats.queued_packets = 0;
+	stats.queued_bytes = 0;
+	for (u32 c=0; c<SEND_CLASS_COUNT; c++) {
+		stats.queued_packets += q.packets[c].size();
+		stats.queued_bytes += q.bytes[c];
+	}
+	stats.rate = q.rate;
+	stats.dropped = q.dropped;
+	return true;
+}
+
+/*
+	Releases an emerge area when going out of scope
+*/
+class EmergeRegionReleaser
+{
+public:
+	EmergeRegionReleaser(BlockEmergeRegions *regions, v3s16 p):
+		m_regions(regions),
+		m_p(p)
+	{
+	}
+
+	~EmergeRegionReleaser()
+	{
+		m_regions->release(m_p);
+	}
+
+private:
+	BlockEmergeRegions *m_regions;
+	v3s16 m_p;
+};
+
+/*
+	Looks for a place for mobs to spawn in a freshly made block.
+	This reads the map generator's voxel data, so it can be done without
+	holding the environment lock. Water is preferred.
+*/
+struct EmergeMobSpawn
+{
+	bool has_spawn;
+	bool water_spawn;
+	v3s16 pos;
+	u8 overlay;
+
+	EmergeMobSpawn():
+		has_spawn(false),
+		water_spawn(false),
+		pos(0,0,0),
+		overlay(0)
+	{
+	}
+
+	void find(VoxelManipulator &vm, v3s16 blockpos)
+	{
+		v3s16 p0;
+		v3s16 bp = blockpos*MAP_BLOCKSIZE;
+		for (p0.X=0; !water_spawn && p0.X<MAP_BLOCKSIZE; p0.X++) {
+		for (p0.Y=0; !water_spawn && p0.Y<MAP_BLOCKSIZE-2; p0.Y++) {
+		for (p0.Z=0; !water_spawn && p0.Z<MAP_BLOCKSIZE; p0.Z++) {
+			v3s16 p = p0 + bp;
+			MapNode n = vm.getNodeNoExNoEmerge(p);
+			MapNode n1 = vm.getNodeNoExNoEmerge(p+v3s16(0,1,0));
+			MapNode n2 = vm.getNodeNoExNoEmerge(p+v3s16(0,2,0));
+			if (n1.getContent() == CONTENT_IGNORE || n2.getContent() == CONTENT_IGNORE)
+				continue;
+			if (
+				n.getContent() == CONTENT_WATERSOURCE
+				&& n1.getContent() == CONTENT_WATERSOURCE
+				&& n2.getContent() == CONTENT_WATERSOURCE
+			) {
+				water_spawn = true;
+				pos = p;
+				break;
+			}
+			if (has_spawn)
+				continue;
+			if (
+				content_features(n.getContent()).draw_type == CDT_DIRTLIKE
+				&& content_features(n1.getContent()).air_equivalent
+				&& content_features(n2.getContent()).air_equivalent
+			) {
+				has_spawn = true;
+				pos = p+v3s16(0,1,0);
+				overlay = (n.param1&0x0F);
+			}
+		}
+		}
+		}
+	}
+
+	// Environment must be locked when called
+	void spawn(ServerEnvironment *env, v3s16 blockpos, PseudoRandom &random)
+	{
+		if (water_spawn) {
+			if (random.range(0,5) == 0) {
+				mob_spawn_hostile(pos,true,env);
+			}else{
+				mob_spawn_passive(pos,true,env);
+			}
+		}else if (has_spawn) {
+			if (overlay == 0x01 || overlay == 0x02 || (overlay == 0x04 && random.range(0,5) == 0)) {
+				mob_spawn_passive(pos,false,env);
+			}else if (overlay == 0x00 && blockpos.Y*MAP_BLOCKSIZE < -16) {
+				mob_spawn(pos,CONTENT_MOB_RAT,env);
+			}else if (overlay == 0x08) {
+				for (int i=0; i<4; i++) {
+					mob_spawn(pos,CONTENT_MOB_FIREFLY,env);
+				}
+			}
+		}
+	}
+};
+
 void * EmergeThread::Thread()
 {
 	ThreadStarted();
@@ -139,15 +763,26 @@ void * EmergeThread::Thread()
 	*/
 	while(getRun())
 	{
-		QueuedBlockEmerge *qptr = m_server->m_emerge_queue.pop();
-		if (qptr == NULL)
-			break;
+		/*
+			Only take blocks whose area no other emerge thread is
+			working on, generation writes to all the neighbours.
+		*/
+		QueuedBlockEmerge *qptr = m_server->m_emerge_queue.pop(&m_server->m_emerge_regions);
+		if (qptr == NULL) {
+			if (m_server->m_emerge_queue.size() == 0)
+				break;
+			// All queued blocks are near ones other threads are making
+			sleep_ms(5);
+			continue;
+		}
 
 		SharedPtr<QueuedBlockEmerge> q(qptr);
 
 		v3s16 &p = q->pos;
 		v2s16 p2d(p.X,p.Z);
 
+		EmergeRegionReleaser region_releaser(&m_server->m_emerge_regions, p);
+
 		/*
 			Do not generate over-limit
 		*/
@@ -197,15 +832,29 @@ void * EmergeThread::Thread()
 
 		ServerMap &map = ((ServerMap&)m_server->m_env.getMap());
 
-		//core::map<v3s16, MapBlock*> changed_blocks;
-		//core::map<v3s16, MapBlock*> lighting_invalidated_blocks;
-
 		MapBlock *block = NULL;
 		bool got_block = true;
+		bool generate = false;
 		core::map<v3s16, MapBlock*> modified_blocks;
+		mapgen::BlockMakeData data;
 
 		/*
-			Fetch block from map or generate a single block
+			If it isn't loaded, read and decode the stored blocks
+			around it without holding the environment lock
+		*/
+		{
+			bool loaded = false;
+			{
+				JMutexAutoLock envlock(m_server->m_env_mutex);
+				block = map.getBlockNoCreateNoEx(p);
+				loaded = (block && !block->isDummy() && block->isGenerated());
+			}
+			if (!loaded)
+				map.prefetchBlocks(p, 1);
+		}
+
+		/*
+			Fetch block from map or disk, or set up the generator
 		*/
 		{
 			JMutexAutoLock envlock(m_server->m_env_mutex);
@@ -215,7 +864,6 @@ void * EmergeThread::Thread()
 
 			block = map.getBlockNoCreateNoEx(p);
 			if (!block || block->isDummy() || !block->isGenerated()) {
-				bool was_generated = false;
 				//vlprintf(CN_DEBUG,"EmergeThread: not in memory, loading");
 
 				// Load/generate block
@@ -224,89 +872,81 @@ void * EmergeThread::Thread()
 				if (only_from_disk == false) {
 					if (block == NULL || block->isGenerated() == false) {
 						//vlprintf(CN_DEBUG,"EmergeThread: generating");
-						block = map.generateBlock(p, modified_blocks);
-						was_generated = true;
+						map.initBlockMake(&data, p, true);
+						generate = true;
 					}
 				}
 
-				//vlprintf(CN_DEBUG,"EmergeThread: ended up with: %s",analyze_block(block).c_str());
+				if (generate == false) {
+					if (block == NULL) {
+						got_block = false;
+					}else{
+						/*
+							Ignore map edit events, they will not need to be
+							sent to anybody because the block hasn't been sent
+							to anybody
+						*/
+						MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+
+						// Activate objects and stuff
+						m_server->m_env.activateBlock(block, 3600);
+					}
+				}
+			}
+		}
 
-				if (block == NULL) {
-					got_block = false;
-				}else{
-					/*
-						Ignore map edit events, they will not need to be
-						sent to anybody because the block hasn't been sent
-						to anybody
-					*/
-					MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+		/*
+			Generate without holding the environment lock, the
+			generator only touches its own voxel manipulator.
+		*/
+		if (generate) {
+			EmergeMobSpawn mobspawn;
+			bool spawn_mobs = false;
+			/*
+				The global myrand() isn't safe to use from several
+				emerge threads, so use one seeded from the block
+			*/
+			PseudoRandom random((u32)(data.seed%0x100000000ULL)
+					+ p.Z*38134234 + p.Y*42123 + p.X*23);
+
+			if (!data.no_op) {
+				ScopeProfiler sp(g_profiler, "EmergeThread: make block", SPT_AVG);
+				mapgen::make_block(&data);
 
-					// Activate objects and stuff
-					m_server->m_env.activateBlock(block, 3600);
+				if (random.range(0,27) == 0) {
+					spawn_mobs = true;
+					mobspawn.find(*data.vmanip, p);
 				}
+			}
 
-				if (was_generated && myrand_range(0,27) == 0) {
-					bool has_spawn = false;
-					bool water_spawn = false;
-					v3s16 bsp(0,0,0);
-					v3s16 sp(0,0,0);
-					v3s16 wsp(0,0,0);
-
-					/* find a place to spawn, bias to water */
-					v3s16 p0;
-					for (p0.X=0; !water_spawn && p0.X<MAP_BLOCKSIZE; p0.X++) {
-					for (p0.Y=0; !water_spawn && p0.Y<MAP_BLOCKSIZE; p0.Y++) {
-					for (p0.Z=0; !water_spawn && p0.Z<MAP_BLOCKSIZE; p0.Z++) {
-						v3s16 p = p0 + block->getPosRelative();
-						MapNode n = block->getNodeNoEx(p0);
-						MapNode n1 = block->getNodeNoEx(p0+v3s16(0,1,0));
-						MapNode n2 = block->getNodeNoEx(p0+v3s16(0,2,0));
-						if (n1.getContent() == CONTENT_IGNORE || n2.getContent() == CONTENT_IGNORE)
-							continue;
-						if (
-							n.getContent() == CONTENT_WATERSOURCE
-							&& n1.getContent() == CONTENT_WATERSOURCE
-							&& n2.getContent() == CONTENT_WATERSOURCE
-						) {
-							water_spawn = true;
-							wsp = p;
-							break;
-						}
-						if (has_spawn)
-							continue;
-						if (
-							content_features(n.getContent()).draw_type == CDT_DIRTLIKE
-							&& content_features(n1.getContent()).air_equivalent
-							&& content_features(n2.getContent()).air_equivalent
-						) {
-							has_spawn = true;
-							sp = p+v3s16(0,1,0);
-							bsp = p0;
-						}
-					}
-					}
-					}
+			JMutexAutoLock envlock(m_server->m_env_mutex);
+			ScopeProfiler sp(g_profiler, "EmergeThread: commit block", SPT_AVG);
 
-					if (water_spawn) {
-						if (myrand_range(0,5) == 0) {
-							mob_spawn_hostile(wsp,true,&m_server->m_env);
-						}else{
-							mob_spawn_passive(wsp,true,&m_server->m_env);
-						}
-					}else if (has_spawn) {
-						MapNode n = block->getNodeNoEx(bsp);
-						u8 overlay = (n.param1&0x0F);
-						if (overlay == 0x01 || overlay == 0x02 || (overlay == 0x04 && myrand_range(0,5) == 0)) {
-							mob_spawn_passive(sp,false,&m_server->m_env);
-						}else if (overlay == 0x00 && block->getPosRelative().Y < -16) {
-							mob_spawn(sp,CONTENT_MOB_RAT,&m_server->m_env);
-						}else if (overlay == 0x08) {
-							for (int i=0; i<4; i++) {
-								mob_spawn(sp,CONTENT_MOB_FIREFLY,&m_server->m_env);
-							}
-						}
-					}
-				}
+			/*
+				Blit data back on map, update lighting, add mobs and
+				whatever this does
+			*/
+			map.finishBlockMake(&data, modified_blocks);
+
+			block = map.getBlockNoCreateNoEx(p);
+
+			//vlprintf(CN_DEBUG,"EmergeThread: ended up with: %s",analyze_block(block).c_str());
+
+			if (block == NULL) {
+				got_block = false;
+			}else{
+				/*
+					Ignore map edit events, they will not need to be
+					sent to anybody because the block hasn't been sent
+					to anybody
+				*/
+				MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+
+				// Activate objects and stuff
+				m_server->m_env.activateBlock(block, 3600);
+
+				if (spawn_mobs)
+					mobspawn.spawn(&m_server->m_env, p, random);
 			}
 
 			// TODO: Some additional checking and lighting updating,
@@ -314,35 +954,274 @@ void * EmergeThread::Thread()
 		}
 
 		/*
-			Set sent status of modified blocks on clients
+			Add the originally fetched block to the modified list
+		*/
+		if (got_block)
+			modified_blocks.insert(p, block);
+
+		/*
+			The server thread sets the modified blocks unsent for all
+			the clients
+		*/
+		for (core::map<v3s16, MapBlock*>::Iterator i = modified_blocks.getIterator(); i.atEnd() == false; i++) {
+			m_server->m_emerged_blocks.push_back(i.getNode()->getKey());
+		}
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+void * BlockSendThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("BlockSendThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while (getRun()) {
+		QueuedBlockSend *qptr = NULL;
+		try{
+			qptr = m_queue.pop_front();
+		}catch(ItemNotFoundException &e) {
+			break;
+		}
+
+		SharedPtr<QueuedBlockSend> q(qptr);
+		v3s16 p = q->snapshot.getPos();
+
+		/*
+			Create a packet with the block in the right format
 		*/
+		SharedBuffer<u8> reply;
+		{
+			ScopeProfiler sp(g_profiler, "SendBlocks: serialize", SPT_AVG);
+
+			std::ostringstream os(std::ios_base::binary);
+			q->snapshot.serialize(os, q->ver, q->codec);
+			std::string s = os.str();
+
+			// Headroom lets the connection add its headers in place
+			reply = SharedBuffer<u8>(8 + s.size(), PACKET_HEADROOM);
+			writeU16(&reply[0], TOCLIENT_BLOCKDATA);
+			writeS16(&reply[2], p.X);
+			writeS16(&reply[4], p.Y);
+			writeS16(&reply[6], p.Z);
+			memcpy(&reply[8], s.c_str(), s.size());
+
+			m_server->m_block_packets.set(p, q->snapshot.getLoadGeneration(),
+					q->snapshot.getModCounter(), q->ver, q->codec, reply);
+		}
+		g_profiler->add("Server: block packet cache misses (num)", 1);
+
+		/*
+			Queue packet, all peers share the buffer. The connection
+			puts the headers of the first one sent in its headroom, the
+			others are copied when their headers are added.
+		*/
+		{
+			ScopeProfiler sp(g_profiler, "SendBlocks: enqueue (locked)", SPT_AVG);
+
+			for (core::map<u16, u8>::Iterator i = q->peers.getIterator(); i.atEnd() == false; i++) {
+				m_server->m_send_scheduler.sendBlock(i.getNode()->getKey(), p, reply,
+						(SendClass)i.getNode()->getValue());
+			}
+		}
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
 
-		// NOTE: Server's clients are also behind the connection mutex
-		JMutexAutoLock lock(m_server->m_con_mutex);
+	return NULL;
+}
+
+/*
+	BlockSendFrontier
+*/
+
+void BlockSendFrontier::update(v3s16 center, s16 range, core::map<v3s16, bool> &sent)
+{
+	if (m_valid && center == m_center && range == m_range)
+		return;
+
+	bool rebuild = (m_valid == false || range != m_range);
+	v3s16 old_center = m_center;
+
+	m_center = center;
+	m_range = range;
+	m_valid = true;
+
+	if (rebuild) {
+		m_blocks.clear();
+		m_parked.clear();
+		m_sealed.clear();
+	}else{
+		// Distances of the blocks that stay in range change
+		std::set<Entry> blocks;
+		for (std::set<Entry>::iterator i = m_blocks.begin(); i != m_blocks.end(); i++) {
+			if (inRange(i->p, center))
+				blocks.insert(Entry(distance(i->p), i->p));
+		}
+		m_blocks.swap(blocks);
+
+		for (std::set<v3s16>::iterator i = m_parked.begin(); i != m_parked.end();) {
+			v3s16 p = *i;
+			if (inRange(p, center) == false) {
+				m_parked.erase(i++);
+			}else if (distance(p) < BLOCK_SEND_GROUND_ONLY_MIN_D) {
+				m_blocks.insert(Entry(distance(p), p));
+				m_parked.erase(i++);
+			}else{
+				i++;
+			}
+		}
+
+		for (std::set<v3s16>::iterator i = m_sealed.begin(); i != m_sealed.end();) {
+			if (inRange(*i, center) == false)
+				m_sealed.erase(i++);
+			else
+				i++;
+		}
+	}
+
+	/*
+		Add the unsent blocks that weren't in range before, rows that
+		were in range are only walked where they stick out
+	*/
+	for (s16 x=center.X-range; x<=center.X+range; x++)
+	for (s16 y=center.Y-range/2; y<=center.Y+range/2; y++) {
+		bool row_was_in_range = (rebuild == false
+				&& abs(x-old_center.X) <= range
+				&& abs(y-old_center.Y) <= range/2);
+		for (s16 z=center.Z-range; z<=center.Z+range; z++) {
+			if (row_was_in_range && abs(z-old_center.Z) <= range) {
+				z = old_center.Z+range;
+				continue;
+			}
+			v3s16 p(x,y,z);
+			if (sent.find(p) == NULL)
+				m_blocks.insert(Entry(distance(p), p));
+		}
+	}
+}
+
+void BlockSendFrontier::add(v3s16 p)
+{
+	if (m_valid == false || inRange(p, m_center) == false)
+		return;
+	m_parked.erase(p);
+	m_sealed.erase(p);
+	m_blocks.insert(Entry(distance(p), p));
+}
+
+void BlockSendFrontier::remove(v3s16 p)
+{
+	if (m_valid == false)
+		return;
+	m_blocks.erase(Entry(distance(p), p));
+	m_parked.erase(p);
+	m_sealed.erase(p);
+}
+
+void BlockSendFrontier::park(v3s16 p)
+{
+	if (m_blocks.erase(Entry(distance(p), p)) != 0)
+		m_parked.insert(p);
+}
+
+void BlockSendFrontier::seal(v3s16 p)
+{
+	if (m_blocks.erase(Entry(distance(p), p)) != 0)
+		m_sealed.insert(p);
+}
+
+void BlockSendFrontier::unseal()
+{
+	for (std::set<v3s16>::iterator i = m_sealed.begin(); i != m_sealed.end(); i++)
+		m_blocks.insert(Entry(distance(*i), *i));
+	m_sealed.clear();
+}
+
+void BlockSendFrontier::get(s16 d, std::vector<v3s16> &dest)
+{
+	v3s16 min(-32768,-32768,-32768);
+	for (std::set<Entry>::iterator i = m_blocks.lower_bound(Entry(d, min)); i != m_blocks.end() && i->d == d; i++) {
+		dest.push_back(i->p);
+	}
+}
 
-		/*
-			Add the originally fetched block to the modified list
-		*/
-		if (got_block)
-			modified_blocks.insert(p, block);
+void BlockSendFrontier::clear()
+{
+	m_blocks.clear();
+	m_parked.clear();
+	m_sealed.clear();
+	m_valid = false;
+}
 
-		/*
-			Set the modified blocks unsent for all the clients
-		*/
+/*
+	Opaque faces of a block for finding visible blocks, blocks that
+	aren't there or not generated yet are taken as open
+*/
+static u8 visibility_opaque_faces(Map &map, v3s16 p)
+{
+	MapBlock *block = map.getBlockNoCreateNoEx(p);
+	if (block == NULL || block->isDummy() || block->isGenerated() == false)
+		return 0;
+	return block->getOpaqueFaces();
+}
 
-		for (core::map<u16, RemoteClient*>::Iterator i = m_server->m_clients.getIterator(); i.atEnd() == false; i++) {
-			RemoteClient *client = i.getNode()->getValue();
+void RemoteClient::updateVisibleBlocks(Server *server, v3s16 player_block, v3s16 center, s16 range)
+{
+	Map &map = server->m_env.getMap();
+
+	m_visible_blocks.clear();
+	m_visible_center = center;
+	m_visible_range = range;
+	m_visible_stale = false;
+	m_visible_timer = 0.0;
+	// Blocks that were passed over may be visible now
+	m_nearest_unsent_d = 0;
 
-			// Remove block from sent history
-			if (modified_blocks.size() > 0)
-				client->SetBlocksNotSent(modified_blocks);
+	/*
+		A block next to a non-opaque face of a block that is looked
+		through can be seen. It is looked through itself if its face
+		on that side isn't opaque either.
+	*/
+	std::set<v3s16> looked_through;
+	std::vector<v3s16> open;
+	looked_through.insert(player_block);
+	looked_through.insert(center);
+	m_visible_blocks.insert(player_block);
+	m_visible_blocks.insert(center);
+	open.push_back(player_block);
+	if (center != player_block)
+		open.push_back(center);
+
+	while (open.size() != 0) {
+		v3s16 p = open.back();
+		open.pop_back();
+		u8 faces = visibility_opaque_faces(map, p);
+		for (u32 j=0; j<6; j++) {
+			if (faces & (1<<j))
+				continue;
+			v3s16 p2 = p + g_6dirs[j];
+			v3s16 r = p2 - center;
+			if (abs(r.X) > range || abs(r.Y) > range/2 || abs(r.Z) > range)
+				continue;
+			m_visible_blocks.insert(p2);
+			// The face of p2 towards p is the opposite direction
+			if (visibility_opaque_faces(map, p2) & (1<<((j+3)%6)))
+				continue;
+			if (looked_through.insert(p2).second)
+				open.push_back(p2);
 		}
-
 	}
 
-	END_DEBUG_EXCEPTION_HANDLER(errorstream)
-
-	return NULL;
+	// Sealed blocks may be visible now
+	m_frontier.unseal();
 }
 
 void RemoteClient::GetNextBlocks(Server *server, float dtime,
@@ -356,6 +1235,28 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	// Increment timers
 	m_nothing_to_send_pause_timer -= dtime;
 	m_nearest_unsent_reset_timer += dtime;
+	m_visible_timer += dtime;
+
+	Player *player = server->m_env.getPlayer(peer_id);
+
+	assert(player != NULL);
+
+	s16 send_range = config_get_int("world.server.chunk.range.send");
+	bool cull = config_get_bool("server.net.chunk.culling");
+
+	/*
+		Let the emerge queue re-rank what this client is waiting for,
+		and forget the blocks that are now out of range.
+	*/
+	{
+		BlockEmergePeerView view;
+		view.pos = player->getEyePosition() / (BS*MAP_BLOCKSIZE);
+		view.dir = v3f(0,0,1);
+		view.dir.rotateYZBy(player->getPitch());
+		view.dir.rotateXZBy(player->getYaw());
+		view.range = send_range + 2;
+		server->m_emerge_queue.updatePeer(peer_id, view);
+	}
 
 	if (m_nothing_to_send_pause_timer >= 0)
 		return;
@@ -366,10 +1267,6 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 
 	//TimeTaker timer("RemoteClient::GetNextBlocks");
 
-	Player *player = server->m_env.getPlayer(peer_id);
-
-	assert(player != NULL);
-
 	v3f playerpos = player->getPosition();
 	v3f playerspeed = player->getSpeed();
 	v3f playerspeeddir(0,0,0);
@@ -409,10 +1306,19 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	{
 		m_nearest_unsent_reset_timer = 0;
 		m_nearest_unsent_d = 0;
+		m_frontier.clear();
 		//infostream<<"Resetting m_nearest_unsent_d for "
 		//		<<server->getPlayerName(peer_id)<<std::endl;
 	}
 
+	m_frontier.update(center, send_range, m_blocks_sent);
+
+	if (cull && (center != m_visible_center || (m_visible_stale && m_visible_timer >= 1.0))) {
+		ScopeProfiler sp(g_profiler, "Server: finding visible blocks", SPT_AVG);
+		v3s16 player_block = getNodeBlockPos(floatToInt(playerpos, BS));
+		updateVisibleBlocks(server, player_block, center, send_range);
+	}
+
 	//s16 last_nearest_unsent_d = m_nearest_unsent_d;
 	s16 d_start = m_nearest_unsent_d;
 
@@ -444,7 +1350,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	*/
 	s32 new_nearest_unsent_d = -1;
 
-	int d_max = config_get_int("world.server.chunk.range.send");
+	int d_max = send_range;
 	int d_max_gen = config_get_int("world.server.chunk.range.generate");
 
 	// Don't loop very much at a time
@@ -481,16 +1387,15 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		}*/
 
 		/*
-			Get the border/face dot coordinates of a "d-radiused"
+			Get the unsent blocks on the border of a "d-radiused"
 			box
 		*/
-		core::list<v3s16> list;
-		getFacePositions(list, d);
+		std::vector<v3s16> list;
+		m_frontier.get(d, list);
 
-		core::list<v3s16>::Iterator li;
-		for(li=list.begin(); li!=list.end(); li++)
+		for(u32 li=0; li<list.size(); li++)
 		{
-			v3s16 p = *li + center;
+			v3s16 p = list[li];
 
 			/*
 				Send throttling
@@ -588,16 +1493,6 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				continue;
 			}
 #endif
-			/*
-				Don't send already sent blocks
-			*/
-			{
-				if(m_blocks_sent.find(p) != NULL)
-				{
-					continue;
-				}
-			}
-
 			/*
 				Check if map has this block
 			*/
@@ -645,10 +1540,13 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 					Block is near ground level if night-time mesh
 					differs from day-time mesh.
 				*/
-				if(d >= 4)
+				if(d >= BLOCK_SEND_GROUND_ONLY_MIN_D)
 				{
 					if(block->dayNightDiffed() == false)
+					{
+						m_frontier.park(p);
 						continue;
+					}
 				}
 #endif
 			}
@@ -684,7 +1582,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 						flags |= BLOCK_EMERGE_FLAG_FROMDISK;
 
 					server->m_emerge_queue.addBlock(peer_id, p, flags);
-					server->m_emergethread.trigger();
+					server->triggerEmergeThreads();
 
 					if(nearest_emerged_d == -1)
 						nearest_emerged_d = d;
@@ -697,6 +1595,18 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				continue;
 			}
 
+			/*
+				Don't send blocks that can't be seen from where the
+				player is, until they might be. The nearest ones are
+				always sent, the player may be about to dig into them.
+			*/
+			if(cull && d > BLOCK_SEND_DISABLE_LIMITS_MAX_D
+					&& m_visible_blocks.find(p) == m_visible_blocks.end())
+			{
+				m_frontier.seal(p);
+				continue;
+			}
+
 			if(nearest_sent_d == -1)
 				nearest_sent_d = d;
 
@@ -725,7 +1635,7 @@ queue_full_break:
 	}else if (nearest_emergefull_d != -1) {
 		new_nearest_unsent_d = nearest_emergefull_d;
 	}else{
-		if (d > config_get_int("world.server.chunk.range.send")) {
+		if (d > send_range) {
 			new_nearest_unsent_d = 0;
 			m_nothing_to_send_pause_timer = 2.0;
 			/*infostream<<"GetNextBlocks(): d wrapped around for "
@@ -756,9 +1666,15 @@ void RemoteClient::GotBlock(v3s16 p)
 	{
 		/*infostream<<"RemoteClient::GotBlock(): Didn't find in"
 				" m_blocks_sending"<<std::endl;*/
+		/*
+			The block was set not sent since, the copy the client
+			got can be older than a change sent after it
+		*/
 		m_excess_gotblocks++;
+		return;
 	}
 	m_blocks_sent.insert(p, true);
+	m_frontier.remove(p);
 }
 
 void RemoteClient::SentBlock(v3s16 p)
@@ -771,14 +1687,26 @@ void RemoteClient::SentBlock(v3s16 p)
 	}
 }
 
+/*
+	Visible blocks have to be found again when blocks in range change
+*/
+static bool visible_range_contains(v3s16 center, s16 range, v3s16 p)
+{
+	v3s16 r = p - center;
+	return (abs(r.X) <= range && abs(r.Y) <= range/2 && abs(r.Z) <= range);
+}
+
 void RemoteClient::SetBlockNotSent(v3s16 p)
 {
 	m_nearest_unsent_d = 0;
+	if (visible_range_contains(m_visible_center, m_visible_range, p))
+		m_visible_stale = true;
 
 	if(m_blocks_sending.find(p) != NULL)
 		m_blocks_sending.remove(p);
 	if(m_blocks_sent.find(p) != NULL)
 		m_blocks_sent.remove(p);
+	m_frontier.add(p);
 }
 
 void RemoteClient::SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks)
@@ -795,6 +1723,9 @@ void RemoteClient::SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks)
 			m_blocks_sending.remove(p);
 		if(m_blocks_sent.find(p) != NULL)
 			m_blocks_sent.remove(p);
+		m_frontier.add(p);
+		if (visible_range_contains(m_visible_center, m_visible_range, p))
+			m_visible_stale = true;
 	}
 }
 
@@ -841,7 +1772,6 @@ Server::Server():
 	m_env(new ServerMap(), this),
 	m_con(PROTOCOL_ID, 512, CONNECTION_TIMEOUT, this),
 	m_thread(this),
-	m_emergethread(this),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
 	m_shutdown_requested(false),
@@ -864,6 +1794,28 @@ Server::Server():
 	m_step_dtime_mutex.Init();
 	m_step_dtime = 0.0;
 
+	{
+		int threads = config_get_int("server.emerge.threads");
+		if (threads < 1)
+			threads = 1;
+		if (threads > 16)
+			threads = 16;
+		for (int i=0; i<threads; i++) {
+			m_emergethreads.push_back(new EmergeThread(this));
+		}
+
+		threads = config_get_int("server.net.chunk.threads");
+		if (threads < 1)
+			threads = 1;
+		if (threads > 16)
+			threads = 16;
+		for (int i=0; i<threads; i++) {
+			m_blocksendthreads.push_back(new BlockSendThread(this));
+		}
+	}
+
+	m_block_codec = serCodecI(config_get("server.net.chunk.codec"));
+
 	// Register us to receive map edit events
 	m_env.getMap().addEventReceiver(this);
 
@@ -931,6 +1883,15 @@ Server::~Server()
 	*/
 	stop();
 
+	for (u32 i=0; i<m_emergethreads.size(); i++) {
+		delete m_emergethreads[i];
+	}
+	m_emergethreads.clear();
+	for (u32 i=0; i<m_blocksendthreads.size(); i++) {
+		delete m_blocksendthreads[i];
+	}
+	m_blocksendthreads.clear();
+
 	/*
 		Delete clients
 	*/
@@ -1028,9 +1989,19 @@ void Server::stop()
 
 	// Stop threads (set run=false first so both start stopping)
 	m_thread.setRun(false);
-	m_emergethread.setRun(false);
+	for (u32 i=0; i<m_emergethreads.size(); i++) {
+		m_emergethreads[i]->setRun(false);
+	}
+	for (u32 i=0; i<m_blocksendthreads.size(); i++) {
+		m_blocksendthreads[i]->setRun(false);
+	}
 	m_thread.stop();
-	m_emergethread.stop();
+	for (u32 i=0; i<m_emergethreads.size(); i++) {
+		m_emergethreads[i]->stop();
+	}
+	for (u32 i=0; i<m_blocksendthreads.size(); i++) {
+		m_blocksendthreads[i]->stop();
+	}
 
 	infostream<<"Server: Threads stopped"<<std::endl;
 }
@@ -1062,12 +2033,38 @@ void Server::AsyncRunStep()
 		dtime = m_step_dtime;
 	}
 
+	{
+		/*
+			Set the blocks changed by the emerge threads unsent for all
+			the clients
+		*/
+		core::map<v3s16, MapBlock*> modified_blocks;
+		v3s16 p;
+		while (m_emerged_blocks.try_pop_front(p))
+			modified_blocks.set(p, NULL);
+		if (modified_blocks.size() != 0) {
+			for (core::map<u16, RemoteClient*>::Iterator i = m_clients.getIterator(); i.atEnd() == false; i++) {
+				i.getNode()->getValue()->SetBlocksNotSent(modified_blocks);
+			}
+		}
+	}
+
 	{
 		ScopeProfiler sp(g_profiler, "Server: sel and send blocks to clients");
 		// Send blocks to clients
 		SendBlocks(dtime);
 	}
 
+	{
+		ScopeProfiler sp(g_profiler, "Server: send scheduler flush", SPT_AVG);
+		std::list<SendScheduler::OutgoingPacket> out;
+		m_send_scheduler.flush(out, config_get_int("server.net.client.budget"),
+				config_get_int("server.net.budget"));
+		for (std::list<SendScheduler::OutgoingPacket>::iterator i = out.begin(); i != out.end(); i++) {
+			m_con.Send(i->peer_id, i->channelnum, i->data, i->reliable);
+		}
+	}
+
 	if(dtime < 0.001)
 		return;
 
@@ -1090,7 +2087,6 @@ void Server::AsyncRunStep()
 
 	{
 		// Process connection's timeouts
-		JMutexAutoLock lock2(m_con_mutex);
 		ScopeProfiler sp(g_profiler, "Server: connection timeout processing");
 		m_con.RunTimeouts(dtime);
 	}
@@ -1120,7 +2116,6 @@ void Server::AsyncRunStep()
 			m_time_of_day_send_timer = config_get_float("server.net.client.time.interval");
 
 			//JMutexAutoLock envlock(m_env_mutex);
-			JMutexAutoLock conlock(m_con_mutex);
 
 			for (core::map<u16, RemoteClient*>::Iterator i = m_clients.getIterator(); i.atEnd() == false; i++) {
 				RemoteClient *client = i.getNode()->getValue();
@@ -1128,7 +2123,25 @@ void Server::AsyncRunStep()
 
 				SharedBuffer<u8> data = makePacket_TOCLIENT_TIME_OF_DAY(m_env.getTimeOfDay(),time_speed, m_env.getTime());
 				// Send as reliable
-				m_con.Send(client->peer_id, 0, data, true);
+				SendToPeer(client->peer_id, 0, data, true);
+
+				try{
+					con::PeerStats stats = m_con.GetPeerStats(client->peer_id);
+					g_profiler->avg("Server: peer rtt ms", stats.avg_rtt*1000);
+					g_profiler->avg("Server: peer cwnd", stats.cwnd);
+					g_profiler->avg("Server: peer reliables in flight", stats.in_flight);
+					g_profiler->avg("Server: peer loss %", stats.loss_ratio*100);
+					g_profiler->avg("Server: peer pacing rate", stats.pacing_rate);
+				}catch(con::PeerNotFoundException &e) {
+				}
+
+				SendQueueStats qstats;
+				if (m_send_scheduler.getStats(client->peer_id, qstats)) {
+					g_profiler->avg("Server: peer send queue bytes", qstats.queued_bytes);
+					g_profiler->avg("Server: peer send queue packets", qstats.queued_packets);
+					g_profiler->avg("Server: peer send rate B/s", qstats.rate);
+					g_profiler->avg("Server: peer send dropped", qstats.dropped);
+				}
 			}
 		}
 	}
@@ -1146,7 +2159,11 @@ void Server::AsyncRunStep()
 		JMutexAutoLock lock(m_env_mutex);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
-		m_env.getMap().timerUpdate(map_timer_and_unload_dtime,config_get_float("server.chunk.timeout"));
+		core::list<v3s16> unloaded_blocks;
+		m_env.getMap().timerUpdate(map_timer_and_unload_dtime,config_get_float("server.chunk.timeout"),&unloaded_blocks);
+		for (core::list<v3s16>::Iterator i = unloaded_blocks.begin(); i != unloaded_blocks.end(); i++) {
+			m_block_packets.remove(*i);
+		}
 	}
 
 	/*
@@ -1171,8 +2188,6 @@ void Server::AsyncRunStep()
 			Set the modified blocks unsent for all the clients
 		*/
 
-		JMutexAutoLock lock2(m_con_mutex);
-
 		for(core::map<u16, RemoteClient*>::Iterator
 				i = m_clients.getIterator();
 				i.atEnd() == false; i++)
@@ -1193,7 +2208,6 @@ void Server::AsyncRunStep()
 	{
 		//infostream<<"Server: Checking added and deleted active objects"<<std::endl;
 		JMutexAutoLock envlock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
 
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
 
@@ -1251,6 +2265,7 @@ void Server::AsyncRunStep()
 				// Remove from known objects
 				std::map<u16, bool>::iterator c = client->m_known_objects.find(id);
 				client->m_known_objects.erase(c);
+				client->m_object_positions.erase(id);
 
 				if (obj && obj->m_known_by_count > 0) {
 					obj->m_known_by_count--;
@@ -1299,7 +2314,7 @@ void Server::AsyncRunStep()
 			writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_REMOVE_ADD);
 			memcpy((char*)&reply[2], data_buffer.c_str(), data_buffer.size());
 			// Send as reliable
-			m_con.Send(client->peer_id, 0, reply, true);
+			SendToPeer(client->peer_id, 0, reply, true, SEND_OBJECTS);
 
 			infostream<<"Server: Sent object remove/add: "
 					<<removed_objects.size()<<" removed, "
@@ -1315,7 +2330,6 @@ void Server::AsyncRunStep()
 		// Send object messages
 
 		JMutexAutoLock envlock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
 
 		//ScopeProfiler sp(g_profiler, "Server: sending object messages");
 
@@ -1358,12 +2372,18 @@ void Server::AsyncRunStep()
 			message_list->push_back(aom);
 		}
 
+		// Bytes of object positions per client and send
+		u32 position_budget = config_get_int("server.net.client.object.budget") * 0.2;
+
 		// Route data to every client
 		for(core::map<u16, RemoteClient*>::Iterator
 			i = m_clients.getIterator();
 			i.atEnd()==false; i++)
 		{
 			RemoteClient *client = i.getNode()->getValue();
+			Player *player = m_env.getPlayer(client->peer_id);
+			bool send_positions = (player != NULL
+					&& client->net_proto_version >= PROTOCOL_OBJECT_POSITIONS);
 			std::string reliable_data;
 			std::string unreliable_data;
 			// Go through all objects in message buffer
@@ -1383,6 +2403,14 @@ void Server::AsyncRunStep()
 				{
 					// Compose the full new data with header
 					ActiveObjectMessage aom = *k;
+					// Position updates go in TOCLIENT_ACTIVE_OBJECT_POSITIONS
+					if (send_positions && aom.datastring.size() == 1+12+4 && aom.datastring[0] == 0) {
+						ObjectPositionState &state = client->m_object_positions[id];
+						state.pending = true;
+						state.pos = readV3F1000((u8*)&aom.datastring[1]);
+						state.yaw = readF1000((u8*)&aom.datastring[13]);
+						continue;
+					}
 					std::string new_data;
 					// Add object id
 					char buf[2];
@@ -1408,7 +2436,7 @@ void Server::AsyncRunStep()
 				memcpy((char*)&reply[2], reliable_data.c_str(),
 						reliable_data.size());
 				// Send as reliable
-				m_con.Send(client->peer_id, 0, reply, true);
+				SendToPeer(client->peer_id, 0, reply, true, SEND_OBJECTS);
 			}
 			if(unreliable_data.size() > 0)
 			{
@@ -1417,8 +2445,10 @@ void Server::AsyncRunStep()
 				memcpy((char*)&reply[2], unreliable_data.c_str(),
 						unreliable_data.size());
 				// Send as unreliable
-				m_con.Send(client->peer_id, 0, reply, false);
+				SendToPeer(client->peer_id, 0, reply, false, SEND_OBJECTS);
 			}
+			if (send_positions)
+				SendObjectPositions(client, player->getPosition(), position_budget);
 		}
 
 		// Clear buffered_messages
@@ -1564,7 +2594,6 @@ void Server::AsyncRunStep()
 		counter += dtime;
 		if (counter >= config_get_float("server.net.client.object.interval")) {
 			JMutexAutoLock lock1(m_env_mutex);
-			JMutexAutoLock lock2(m_con_mutex);
 
 			//ScopeProfiler sp(g_profiler, "Server: sending player positions");
 
@@ -1584,7 +2613,7 @@ void Server::AsyncRunStep()
 		if (counter >= 2.0) {
 			counter = 0.0;
 
-			m_emergethread.trigger();
+			triggerEmergeThreads();
 		}
 	}
 
@@ -1592,7 +2621,7 @@ void Server::AsyncRunStep()
 	{
 		float &counter = m_savemap_timer;
 		counter += dtime;
-		if (counter >= config_get_float("server.save.interval")) {
+		if (counter >= config_get_float("server.save.interval") || m_savemap_requests.size() != 0) {
 			counter = 0.0;
 
 			ScopeProfiler sp(g_profiler, "Server: saving stuff");
@@ -1603,70 +2632,98 @@ void Server::AsyncRunStep()
 			// Ban stuff
 			ban_save();
 
-			// Map
-			JMutexAutoLock lock(m_env_mutex);
+			bool complete;
+			{
+				JMutexAutoLock lock(m_env_mutex);
+
+				// Save only changed parts, as many as the save queue
+				// takes without waiting for the disk
+				complete = m_env.getServerMap().save(true, false);
 
-			// Save only changed parts
-			m_env.getMap().save(true);
+				// Save players
+				m_env.serializePlayers();
 
-			// Save players
-			m_env.serializePlayers();
+				// Save environment metadata
+				m_env.saveMeta();
+
+				config_save("world","world","world.cfg");
+			}
 
-			// Save environment metadata
-			m_env.saveMeta();
+			if (m_savemap_requests.size() != 0) {
+				// Asked for with /save, write everything before answering
+				while (complete == false) {
+					m_env.getServerMap().waitSaveRoom();
+					JMutexAutoLock lock(m_env_mutex);
+					complete = m_env.getServerMap().save(true, false);
+				}
+				m_env.getServerMap().flushSave();
 
-			config_save("world","world","world.cfg");
+				JMutexAutoLock lock(m_env_mutex);
+				for (std::list<u16>::iterator i = m_savemap_requests.begin(); i != m_savemap_requests.end(); i++) {
+					SendChatMessage(*i, L"Server: Map saved.");
+				}
+				m_savemap_requests.clear();
+			}else if (complete == false) {
+				// Save the rest in a second, the queue has room by then
+				counter = config_get_float("server.save.interval") - 1.0;
+			}
 		}
 	}
 }
 
+void Server::requestMapSave(u16 peer_id)
+{
+	m_savemap_requests.push_back(peer_id);
+}
+
 void Server::Receive()
 {
 	DSTACK(__FUNCTION_NAME);
-	SharedBuffer<u8> data;
-	u16 peer_id;
-	u32 datasize;
-	try{
-		{
-			JMutexAutoLock conlock(m_con_mutex);
-			datasize = m_con.Receive(peer_id, data);
-		}
-
-		// This has to be called so that the client list gets synced
-		// with the peer list of the connection
-		handlePeerChanges();
-
-		ProcessData(*data, datasize, peer_id);
-	}
-	catch(con::InvalidIncomingDataException &e)
-	{
-		infostream<<"Server::Receive(): "
-				"InvalidIncomingDataException: what()="
-				<<e.what()<<std::endl;
-	}
-	catch(con::PeerNotFoundException &e)
+	/*
+		Handle everything that has arrived, up to SERVER_RECEIVE_BATCH
+		packets. Only the first one waits for data.
+	*/
+	for(u32 i=0; i<SERVER_RECEIVE_BATCH; i++)
 	{
-		//NOTE: This is not needed anymore
-
-		// The peer has been disconnected.
-		// Find the associated player and remove it.
-
-		/*JMutexAutoLock envlock(m_env_mutex);
+		SharedBuffer<u8> data;
+		u16 peer_id;
+		u32 datasize;
+		try{
+			if(i == 0)
+				datasize = m_con.Receive(peer_id, data);
+			else
+				datasize = m_con.Receive(peer_id, data, 0);
 
-		infostream<<"ServerThread: peer_id="<<peer_id
-				<<" has apparently closed connection. "
-				<<"Removing player."<<std::endl;
+			// This has to be called so that the client list gets synced
+			// with the peer list of the connection
+			handlePeerChanges();
 
-		m_env.removePlayer(peer_id);*/
+			ProcessData(*data, datasize, peer_id);
+		}
+		catch(con::NoIncomingDataException &e)
+		{
+			if(i == 0)
+				throw;
+			return;
+		}
+		catch(con::InvalidIncomingDataException &e)
+		{
+			infostream<<"Server::Receive(): "
+					"InvalidIncomingDataException: what()="
+					<<e.what()<<std::endl;
+		}
+		catch(con::PeerNotFoundException &e)
+		{
+			// The peer has been disconnected, the client list is
+			// synced by handlePeerChanges()
+		}
 	}
 }
 
 void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
-	// Environment is locked first.
 	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
 
 	try{
 		Address address = m_con.GetPeerAddress(peer_id);
@@ -1748,6 +2805,23 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 			return;
 		}
 
+		/*
+			Pick the codec blocks are sent with, clients that
+			don't say which codecs they read know the base ones
+		*/
+
+		u16 client_codecs = SER_CODEC_MASK_BASE;
+		if (datasize >= 2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2+2)
+			client_codecs = readU16(&data[2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2]);
+
+		if (deployed < 23) {
+			getClient(peer_id)->block_codec = SER_CODEC_ZLIB;
+		}else if (client_codecs & (1<<m_block_codec)) {
+			getClient(peer_id)->block_codec = m_block_codec;
+		}else{
+			getClient(peer_id)->block_codec = SER_CODEC_ZLIB_FAST;
+		}
+
 		/* Uhh... this should actually be a warning but let's do it like this */
 		if (config_get_bool("world.server.client.version.strict")) {
 			if (net_proto_version < PROTOCOL_VERSION) {
@@ -1894,7 +2968,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 			writeU16(&reply[2+1+6+8], (u16)m_env.getServerMap().getType());
 
 			// Send as reliable
-			m_con.Send(peer_id, 0, reply, true);
+			SendToPeer(peer_id, 0, reply, true);
 		}
 
 		/*
@@ -1950,7 +3024,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 				config_get_float("world.game.environment.time.speed"),
 				m_env.getTime()
 			);
-			m_con.Send(peer_id, 0, data, true);
+			SendToPeer(peer_id, 0, data, true);
 		}
 
 		// Send information about server to player in chat
@@ -3142,7 +4216,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 					}
 				}
 			}else if (wieldcontent == CONTENT_CRAFTITEM_FERTILIZER && selected_node_features.fertilizer_affects) {
-				selected_node.envticks = 1024;
+				m_env.getMap().setNodeTicks(p_under, 1024);
 				// send the node
 				core::list<u16> far_players;
 				core::map<v3s16, MapBlock*> modified_blocks;
@@ -5207,7 +6281,9 @@ void Server::SendPlayerInfo(float dtime)
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as unreliable
-	m_con.SendToAll(0, data, false);
+	for (core::map<u16, RemoteClient*>::Iterator i = m_clients.getIterator(); i.atEnd() == false; i++) {
+		SendToPeer(i.getNode()->getKey(), 0, data, false, SEND_OBJECTS);
+	}
 }
 
 void Server::SendPlayerData()
@@ -5273,7 +6349,7 @@ void Server::SendInventory(u16 peer_id, bool full)
 		SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 
 		// Send as reliable
-		m_con.Send(peer_id, 0, data, true);
+		SendToPeer(peer_id, 0, data, true);
 		return;
 	}
 	{
@@ -5300,7 +6376,7 @@ void Server::SendInventory(u16 peer_id, bool full)
 		SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 
 		// Send as reliable
-		m_con.Send(peer_id, 0, data, true);
+		SendToPeer(peer_id, 0, data, true);
 	}
 }
 
@@ -5388,6 +6464,106 @@ void Server::SendPlayerItems(Player *player)
 	m_con.SendToAll(0, data, true);
 }
 
+/*
+	Used for sorting object position updates by distance
+*/
+struct DistanceSortedObjectPosition
+{
+	DistanceSortedObjectPosition():
+		d(0),
+		id(0)
+	{}
+	DistanceSortedObjectPosition(f32 a_d, u16 a_id):
+		d(a_d),
+		id(a_id)
+	{}
+	bool operator < (const DistanceSortedObjectPosition &other) const
+	{
+		return d < other.d;
+	}
+
+	f32 d;
+	u16 id;
+};
+
+void Server::SendObjectPositions(RemoteClient *client, v3f player_pos, u32 budget)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	core::array<DistanceSortedObjectPosition> pending;
+	for (std::map<u16, ObjectPositionState>::iterator i = client->m_object_positions.begin(); i != client->m_object_positions.end(); i++) {
+		if (i->second.pending)
+			pending.push_back(DistanceSortedObjectPosition(i->second.pos.getDistanceFrom(player_pos), i->first));
+	}
+	if (pending.size() == 0)
+		return;
+	pending.sort();
+
+	v3s16 origin = getNodeBlockPos(floatToInt(player_pos, BS));
+	std::string keyframes;
+	std::string deltas;
+	u16 keyframe_count = 0;
+	u16 delta_count = 0;
+	u8 buf[11];
+
+	// Whatever doesn't fit in the budget is sent next time
+	for (u32 i=0; i<pending.size() && keyframes.size()+deltas.size() < budget; i++) {
+		u16 id = pending[i].id;
+		ObjectPositionState &state = client->m_object_positions[id];
+		state.pending = false;
+
+		v3f d = (state.pos - state.keyframe_pos) / OBJECT_POSITION_QUANTUM;
+		v3s16 delta(floor(d.X+0.5), floor(d.Y+0.5), floor(d.Z+0.5));
+		if (
+			state.has_keyframe
+			&& delta.X >= -127 && delta.X <= 127
+			&& delta.Y >= -127 && delta.Y <= 127
+			&& delta.Z >= -127 && delta.Z <= 127
+		) {
+			writeU16(&buf[0], id);
+			writeU8(&buf[2], 0);
+			writeU8(&buf[3], state.keyframe_num);
+			writeS8(&buf[4], delta.X);
+			writeS8(&buf[5], delta.Y);
+			writeS8(&buf[6], delta.Z);
+			writeU8(&buf[7], objectYawToU8(state.yaw));
+			deltas.append((char*)buf, 8);
+			delta_count++;
+			continue;
+		}
+
+		v3s16 keyframe;
+		// Too far to be of interest to the client
+		if (!objectPositionToKeyframe(state.pos, origin, keyframe))
+			continue;
+		state.has_keyframe = true;
+		state.keyframe_num++;
+		state.keyframe_pos = objectKeyframeToPosition(keyframe, origin);
+		writeU16(&buf[0], id);
+		writeU8(&buf[2], 1);
+		writeU8(&buf[3], state.keyframe_num);
+		writeV3S16(&buf[4], keyframe);
+		writeU8(&buf[10], objectYawToU8(state.yaw));
+		keyframes.append((char*)buf, 11);
+		keyframe_count++;
+	}
+
+	// Keyframes have to arrive, deltas are only good until the next one
+	for (u32 k=0; k<2; k++) {
+		bool reliable = (k == 0);
+		std::string &entries = reliable ? keyframes : deltas;
+		u16 count = reliable ? keyframe_count : delta_count;
+		if (count == 0)
+			continue;
+		SharedBuffer<u8> data(2+6+2+entries.size());
+		writeU16(&data[0], TOCLIENT_ACTIVE_OBJECT_POSITIONS);
+		writeV3S16(&data[2], origin);
+		writeU16(&data[8], count);
+		memcpy(&data[10], entries.c_str(), entries.size());
+		SendToPeer(client->peer_id, 0, data, reliable, SEND_OBJECTS);
+	}
+}
+
 void Server::SendChatMessage(u16 peer_id, const std::wstring &message)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -5414,7 +6590,7 @@ void Server::SendChatMessage(u16 peer_id, const std::wstring &message)
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as reliable
-	m_con.Send(peer_id, 0, data, true);
+	SendToPeer(peer_id, 0, data, true);
 }
 
 void Server::BroadcastChatMessage(const std::wstring &message)
@@ -5475,7 +6651,7 @@ void Server::SendSettings(Player *player)
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as reliable
-	m_con.Send(player->peer_id, 0, data, true);
+	SendToPeer(player->peer_id, 0, data, true);
 }
 
 void Server::SendMovePlayer(Player *player)
@@ -5503,7 +6679,7 @@ void Server::SendMovePlayer(Player *player)
 	std::string s = os.str();
 	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
 	// Send as reliable
-	m_con.Send(player->peer_id, 0, data, true);
+	SendToPeer(player->peer_id, 0, data, true);
 
 	{
 		std::string snd = "env-teleport";
@@ -5556,7 +6732,8 @@ void Server::sendRemoveNode(v3s16 p, u16 ignore_id,
 		}
 
 		// Send as reliable
-		m_con.Send(client->peer_id, 0, reply, true);
+		SendToPeer(client->peer_id, 0, reply, true);
+		resendChangedBlock(client, getNodeBlockPos(p));
 	}
 }
 
@@ -5606,10 +6783,19 @@ void Server::sendAddNode(v3s16 p, MapNode n, u16 ignore_id,
 		n.serialize(&reply[8], client->serialization_version);
 
 		// Send as reliable
-		m_con.Send(client->peer_id, 0, reply, true);
+		SendToPeer(client->peer_id, 0, reply, true);
+		resendChangedBlock(client, getNodeBlockPos(p));
 	}
 }
 
+void Server::resendChangedBlock(RemoteClient *client, v3s16 blockpos)
+{
+	if (!client->IsSendingBlock(blockpos))
+		return;
+	m_send_scheduler.dropBlock(client->peer_id, blockpos);
+	client->SetBlockNotSent(blockpos);
+}
+
 void Server::setBlockNotSent(v3s16 p)
 {
 	for(core::map<u16, RemoteClient*>::Iterator
@@ -5621,117 +6807,134 @@ void Server::setBlockNotSent(v3s16 p)
 	}
 }
 
-void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
+void Server::triggerEmergeThreads()
 {
-	DSTACK(__FUNCTION_NAME);
-
-	v3s16 p = block->getPos();
-
-#if 0
-	// Analyze it a bit
-	bool completely_air = true;
-	for(s16 z0=0; z0<MAP_BLOCKSIZE; z0++)
-	for(s16 x0=0; x0<MAP_BLOCKSIZE; x0++)
-	for(s16 y0=0; y0<MAP_BLOCKSIZE; y0++)
-	{
-		if(block->getNodeNoEx(v3s16(x0,y0,z0)).d != CONTENT_AIR)
-		{
-			completely_air = false;
-			x0 = y0 = z0 = MAP_BLOCKSIZE; // Break out
-		}
-	}
-
-	// Print result
-	infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<"): ";
-	if(completely_air)
-		infostream<<"[completely air] ";
-	infostream<<std::endl;
-#endif
-
-	/*
-		Create a packet with the block in the right format
-	*/
-
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
-
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
-
-	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
-			<<":  \tpacket size: "<<replysize<<std::endl;*/
-
 	/*
-		Send packet
+		Start as many threads as there are queued blocks, the ones
+		that are already running just keep going
 	*/
-	m_con.Send(peer_id, 1, reply, true);
+	u32 wanted = m_emerge_queue.size();
+	for (u32 i=0; i<m_emergethreads.size() && i<wanted; i++) {
+		m_emergethreads[i]->trigger();
+	}
 }
 
 void Server::SendBlocks(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
 
-	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
-
 	int max = config_get_int("server.net.chunk.max");
 
 	//TimeTaker timer("Server::SendBlocks");
 
 	core::array<PrioritySortedBlockTransfer> queue;
 
+	// Blocks to serialize, the first one of each position is in jobs_by_pos
+	core::list<QueuedBlockSend*> jobs;
+	core::map<v3s16, QueuedBlockSend*> jobs_by_pos;
+
 	s32 total_sending = 0;
 
 	{
-		ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
+		JMutexAutoLock envlock(m_env_mutex);
 
-		for (core::map<u16, RemoteClient*>::Iterator i = m_clients.getIterator(); i.atEnd() == false; i++) {
-			RemoteClient *client = i.getNode()->getValue();
-			assert(client->peer_id == i.getNode()->getKey());
+		ScopeProfiler sp_locked(g_profiler, "SendBlocks: select and snapshot (locked)", SPT_AVG);
 
-			total_sending += client->SendingCount();
+		{
+			ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
 
-			if (client->serialization_version == SER_FMT_VER_INVALID)
-				continue;
+			for (core::map<u16, RemoteClient*>::Iterator i = m_clients.getIterator(); i.atEnd() == false; i++) {
+				RemoteClient *client = i.getNode()->getValue();
+				assert(client->peer_id == i.getNode()->getKey());
+
+				total_sending += client->SendingCount();
 
-			client->GetNextBlocks(this, dtime, queue);
+				if (client->serialization_version == SER_FMT_VER_INVALID)
+					continue;
+
+				client->GetNextBlocks(this, dtime, queue);
+			}
 		}
-	}
 
-	// Sort.
-	// Lowest priority number comes first.
-	// Lowest is most important.
-	queue.sort();
+		// Sort.
+		// Lowest priority number comes first.
+		// Lowest is most important.
+		queue.sort();
 
-	for (u32 i=0; i<queue.size(); i++) {
-		//TODO: Calculate limit dynamically
-		if (total_sending >= max)
-			break;
+		for (u32 i=0; i<queue.size(); i++) {
+			//TODO: Calculate limit dynamically
+			if (total_sending >= max)
+				break;
 
-		PrioritySortedBlockTransfer q = queue[i];
+			PrioritySortedBlockTransfer q = queue[i];
 
-		MapBlock *block = NULL;
-		try{
-			block = m_env.getMap().getBlockNoCreate(q.pos);
-		}catch (InvalidPositionException &e) {
-			continue;
-		}
+			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(q.pos);
+			if (block == NULL || block->isDummy())
+				continue;
+
+			RemoteClient *client = getClient(q.peer_id);
+			u8 ver = client->serialization_version;
+			u8 codec = client->block_codec;
+			SendClass cls = SEND_BLOCKS_FAR;
+			if (q.priority <= SEND_NEAR_BLOCK_DISTANCE)
+				cls = SEND_BLOCKS_NEAR;
+
+			/*
+				Send right away if the block hasn't changed since it
+				was last serialized, otherwise copy it for the block
+				send threads
+			*/
+			SharedBuffer<u8> reply;
+			if (m_block_packets.get(block, ver, codec, reply)) {
+				g_profiler->add("Server: block packet cache hits (num)", 1);
+				m_send_scheduler.sendBlock(q.peer_id, q.pos, reply, cls);
+			}else{
+				core::map<v3s16, QueuedBlockSend*>::Node *n = jobs_by_pos.find(q.pos);
+				QueuedBlockSend *job = NULL;
+				if (n != NULL && n->getValue()->ver == ver && n->getValue()->codec == codec) {
+					job = n->getValue();
+				}else{
+					job = new QueuedBlockSend(block, ver, codec);
+					jobs.push_back(job);
+					if (n == NULL)
+						jobs_by_pos.insert(q.pos, job);
+				}
+				job->peers.set(q.peer_id, cls);
+			}
 
-		RemoteClient *client = getClient(q.peer_id);
+			client->SentBlock(q.pos);
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version);
+			total_sending++;
+		}
+	}
+
+	/*
+		Hand the blocks to the send threads, by position so that all
+		updates of a block go through the same thread
+	*/
+	for (core::list<QueuedBlockSend*>::Iterator i = jobs.begin(); i != jobs.end(); i++) {
+		v3s16 p = (*i)->snapshot.getPos();
+		u32 h = (u32)(p.X*73856093) ^ (u32)(p.Y*19349663) ^ (u32)(p.Z*83492791);
+		m_blocksendthreads[h % m_blocksendthreads.size()]->m_queue.push_back(*i);
+	}
 
-		client->SentBlock(q.pos);
+	// Threads may have stopped before seeing a block added to their queue
+	for (u32 i=0; i<m_blocksendthreads.size(); i++) {
+		if (m_blocksendthreads[i]->m_queue.size() != 0)
+			m_blocksendthreads[i]->trigger();
+	}
+}
 
-		total_sending++;
+void Server::SendToPeer(u16 peer_id, u8 channelnum, SharedBuffer<u8> data,
+		bool reliable, SendClass cls)
+{
+	if (cls == SEND_CONTROL) {
+		u32 size = data.getSize();
+		m_con.Send(peer_id, channelnum, data, reliable);
+		m_send_scheduler.sentControl(peer_id, size);
+		return;
 	}
+	m_send_scheduler.send(peer_id, channelnum, data, reliable, cls);
 }
 
 void Server::SendEnvEvent(u8 type, v3f pos, std::string &data, Player *except_player)
@@ -5778,7 +6981,7 @@ void Server::SendEnvEvent(u8 type, v3f pos, std::string &data, Player *except_pl
 		}
 
 		// Send as reliable
-		m_con.Send(client->peer_id, 0, reply, true);
+		SendToPeer(client->peer_id, 0, reply, true);
 	}
 }
 
@@ -5948,8 +7151,14 @@ std::wstring Server::getStatusString()
 		std::wstring name = L"unknown";
 		if(player != NULL)
 			name = narrow_to_wide(player->getName());
-		// Add name to information string
-		os<<name<<L",";
+		// Add name and send queue to information string
+		os<<name;
+		SendQueueStats stats;
+		if (m_send_scheduler.getStats(client->peer_id, stats)) {
+			os<<L"(queue="<<stats.queued_packets<<L"/"<<(stats.queued_bytes/1024)
+					<<L"KB, rate="<<(u32)(stats.rate/1024)<<L"KB/s)";
+		}
+		os<<L",";
 	}
 	os<<L"}";
 	char* motd = config_get("world.game.motd");
@@ -6119,6 +7328,7 @@ void Server::handlePeerChange(PeerChange &c)
 		RemoteClient *client = new RemoteClient();
 		client->peer_id = c.peer_id;
 		m_clients.insert(client->peer_id, client);
+		m_send_scheduler.addPeer(client->peer_id);
 
 	} // PEER_ADDED
 	else if(c.type == PEER_REMOVED)
@@ -6200,6 +7410,10 @@ void Server::handlePeerChange(PeerChange &c)
 			}
 		}
 
+		// Forget the blocks it was waiting for
+		m_emerge_queue.removePeer(c.peer_id);
+		m_send_scheduler.removePeer(c.peer_id);
+
 		// Delete client
 		delete m_clients[c.peer_id];
 		m_clients.remove(c.peer_id);
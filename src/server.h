@@ -31,8 +31,12 @@
 #include "common_irrlicht.h"
 #include <string>
 #include <map>
+#include <list>
+#include <set>
+#include <vector>
 #include "porting.h"
 #include "map.h"
+#include "mapblock.h"
 #include "inventory.h"
 #include "auth.h"
 #include "ban.h"
@@ -54,104 +58,334 @@ struct QueuedBlockEmerge
 };
 
 /*
+	Keeps track of the areas that the emerge threads are working on.
+
+	Generating a block writes to the block and all of its neighbours,
+	so two blocks can only be emerged at the same time if their 3x3x3
+	areas don't overlap.
+
 	This is a thread-safe class.
 */
-class BlockEmergeQueue
+class BlockEmergeRegions
 {
 public:
-	BlockEmergeQueue()
+	BlockEmergeRegions()
 	{
 		m_mutex.Init();
 	}
 
-	~BlockEmergeQueue()
+	/*
+		Marks the area around p as being worked on.
+		Returns false if it overlaps an area that already is.
+	*/
+	bool acquire(v3s16 p)
 	{
 		JMutexAutoLock lock(m_mutex);
 
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
+		core::list<v3s16>::Iterator i;
+		for(i=m_regions.begin(); i!=m_regions.end(); i++)
 		{
-			QueuedBlockEmerge *q = *i;
-			delete q;
+			v3s16 d = *i - p;
+			if(abs(d.X) <= 2 && abs(d.Y) <= 2 && abs(d.Z) <= 2)
+				return false;
 		}
+		m_regions.push_back(p);
+		return true;
 	}
 
-	/*
-		peer_id=0 adds with nobody to send to
-	*/
-	void addBlock(u16 peer_id, v3s16 pos, u8 flags)
+	void release(v3s16 p)
 	{
-		DSTACK(__FUNCTION_NAME);
-
 		JMutexAutoLock lock(m_mutex);
 
-		if(peer_id != 0)
+		core::list<v3s16>::Iterator i;
+		for(i=m_regions.begin(); i!=m_regions.end(); i++)
 		{
-			/*
-				Find if block is already in queue.
-				If it is, update the peer to it and quit.
-			*/
-			core::list<QueuedBlockEmerge*>::Iterator i;
-			for(i=m_queue.begin(); i!=m_queue.end(); i++)
+			if(*i == p)
 			{
-				QueuedBlockEmerge *q = *i;
-				if(q->pos == pos)
-				{
-					q->peer_ids[peer_id] = flags;
-					return;
-				}
+				m_regions.erase(i);
+				return;
 			}
 		}
+	}
 
-		/*
-			Add the block
-		*/
-		QueuedBlockEmerge *q = new QueuedBlockEmerge;
-		q->pos = pos;
-		if(peer_id != 0)
-			q->peer_ids[peer_id] = flags;
-		m_queue.push_back(q);
+	u32 size()
+	{
+		JMutexAutoLock lock(m_mutex);
+		return m_regions.size();
 	}
 
+private:
+	// Center blocks of the areas in use
+	core::list<v3s16> m_regions;
+	JMutex m_mutex;
+};
+
+/*
+	Where a peer is looking from, used for ranking its emerge requests.
+*/
+struct BlockEmergePeerView
+{
+	// Camera position in blocks
+	v3f pos;
+	// Normalized camera direction
+	v3f dir;
+	// Blocks further than this (in blocks) are no longer wanted
+	s16 range;
+};
+
+/*
+	Queue of blocks to emerge, highest priority first.
+
+	Blocks are keyed by position so adding a block that is already
+	queued only updates its list of peers. The priority of a block is
+	the best rank among the peers that want it, where a peer ranks
+	blocks by distance from its camera, and blocks outside its view
+	count as further away. Ranks are updated whenever a peer's view is
+	updated, and blocks that no peer wants anymore are cancelled.
+
+	Blocks added with peer_id=0 are never cancelled.
+
+	This is a thread-safe class.
+*/
+class BlockEmergeQueue
+{
+public:
+	BlockEmergeQueue();
+	~BlockEmergeQueue();
+
+	/*
+		peer_id=0 adds with nobody to send to
+	*/
+	void addBlock(u16 peer_id, v3s16 pos, u8 flags);
+
 	// Returned pointer must be deleted
 	// Returns NULL if queue is empty
-	QueuedBlockEmerge * pop()
+	// If regions is given, the highest priority block whose area can
+	// be acquired is returned, and NULL if all of them are being
+	// worked on.
+	QueuedBlockEmerge * pop(BlockEmergeRegions *regions=NULL);
+
+	/*
+		Updates the view of a peer, re-ranks the blocks it wants and
+		drops it from the ones that went out of its range.
+	*/
+	void updatePeer(u16 peer_id, const BlockEmergePeerView &view);
+	// Drops the peer from all blocks it wants
+	void removePeer(u16 peer_id);
+
+	u32 size();
+	u32 peerItemCount(u16 peer_id);
+
+private:
+	struct Item
 	{
-		JMutexAutoLock lock(m_mutex);
+		QueuedBlockEmerge *q;
+		// Added with peer_id=0, never cancelled
+		bool pinned;
+		// Time when the block was first queued
+		u32 queued_ms;
+		std::multimap<f32, Item*>::iterator order;
+	};
+
+	f32 getPriority(Item *item);
+	void rerank(Item *item);
+	// Removes the peer from the item and cancels the item if no
+	// peer wants it anymore. Returns true if the item was cancelled.
+	bool dropPeer(Item *item, u16 peer_id);
+
+	// Blocks by position
+	core::map<v3s16, Item*> m_items;
+	// Blocks by priority, lowest value first
+	std::multimap<f32, Item*> m_order;
+	// Blocks wanted by each peer
+	core::map<u16, core::map<v3s16, bool>*> m_peer_items;
+	core::map<u16, BlockEmergePeerView> m_peer_views;
+	JMutex m_mutex;
+};
+
+/*
+	Serialized TOCLIENT_BLOCKDATA packets of blocks, so that a block
+	sent to many clients is only serialized and compressed once.
+
+	An entry is current as long as it was made from the same load of
+	the block (see MapBlock::m_load_generation) with the same
+	modification counter, serialization version and codec.
 
-		core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
-		if(i == m_queue.end())
-			return NULL;
-		QueuedBlockEmerge *q = *i;
-		m_queue.erase(i);
-		return q;
+	This is a thread-safe class.
+*/
+class BlockPacketCache
+{
+public:
+	BlockPacketCache()
+	{
+		m_mutex.Init();
 	}
 
+	/*
+		Returns false if there is no current packet for the block.
+		The cached buffer itself is handed out, it must not be
+		written to.
+	*/
+	bool get(MapBlock *block, u8 ver, u8 codec, SharedBuffer<u8> &packet);
+	// mod_counter is that of the block the packet was made from
+	void set(v3s16 p, u32 load_generation, u32 mod_counter, u8 ver, u8 codec,
+			SharedBuffer<u8> &packet);
+	void remove(v3s16 p);
+
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
-		return m_queue.size();
+		return m_entries.size();
 	}
 
-	u32 peerItemCount(u16 peer_id)
+private:
+	struct Entry
 	{
-		JMutexAutoLock lock(m_mutex);
+		u32 load_generation;
+		u8 ver;
+		u8 codec;
+		u32 mod_counter;
+		SharedBuffer<u8> packet;
+	};
 
-		u32 count = 0;
+	core::map<v3s16, Entry> m_entries;
+	JMutex m_mutex;
+};
 
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
-		{
-			QueuedBlockEmerge *q = *i;
-			if(q->peer_ids.find(peer_id) != NULL)
-				count++;
-		}
+/*
+	Classes of outgoing packets, in the order they are served
+*/
+enum SendClass
+{
+	SEND_CONTROL = 0,
+	SEND_OBJECTS,
+	SEND_BLOCKS_NEAR,
+	SEND_BLOCKS_FAR,
+	SEND_CLASS_COUNT
+};
 
-		return count;
+struct SendQueueStats
+{
+	SendQueueStats():
+		queued_packets(0),
+		queued_bytes(0),
+		rate(0),
+		dropped(0)
+	{
 	}
 
+	u32 queued_packets;
+	u32 queued_bytes;
+	// Bytes per second handed to the connection
+	float rate;
+	// Unreliable packets dropped because the queue was full
+	u32 dropped;
+};
+
+/*
+	Queues outgoing packets by peer and class, and hands them to the
+	connection within a byte budget.
+
+	Every peer has a budget filled at server.net.client.budget bytes
+	per second, and the server has one filled at server.net.budget
+	bytes per second. The server's budget is shared by serving the
+	peers round-robin SEND_QUANTUM bytes at a time (deficit round
+	robin), so a client with a lot to receive can't starve the others.
+	A peer's classes are served in order.
+
+	Control packets are sent right away by the caller, their size is
+	still taken from the peer's budget. A rate of 0 means no limit.
+
+	This is a thread-safe class.
+*/
+class SendScheduler
+{
+public:
+	SendScheduler();
+
+	struct OutgoingPacket
+	{
+		u16 peer_id;
+		u8 channelnum;
+		bool reliable;
+		SharedBuffer<u8> data;
+	};
+
+	void addPeer(u16 peer_id);
+	void removePeer(u16 peer_id);
+
+	// Queues a packet, cls can't be SEND_CONTROL
+	void send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data,
+			bool reliable, SendClass cls);
+	// Takes a packet that was sent right away from the peer's budget
+	void sentControl(u16 peer_id, u32 size);
+	/*
+		Queues a block packet, replacing a queued one of the same
+		block so that an old copy can't arrive after a newer one
+	*/
+	void sendBlock(u16 peer_id, v3s16 p, SharedBuffer<u8> data, SendClass cls);
+	/*
+		Drops the queued packet of a block, returns false if there
+		wasn't one
+	*/
+	bool dropBlock(u16 peer_id, v3s16 p);
+
+	/*
+		Takes the queued packets that the budgets filled since the
+		last call allow, in the order they are to be sent
+	*/
+	void flush(std::list<OutgoingPacket> &out, u32 peer_rate, u32 total_rate);
+	// Same, with the budgets filled for dtime seconds
+	void flush(std::list<OutgoingPacket> &out, u32 peer_rate, u32 total_rate,
+			float dtime);
+
+	// Returns false if the peer is unknown
+	bool getStats(u16 peer_id, SendQueueStats &stats);
+
 private:
-	core::list<QueuedBlockEmerge*> m_queue;
+	struct QueuedPacket
+	{
+		u8 channelnum;
+		bool reliable;
+		bool is_block;
+		v3s16 blockpos;
+		SharedBuffer<u8> data;
+	};
+
+	struct PeerQueue
+	{
+		PeerQueue():
+			tokens(0),
+			deficit(0),
+			window_bytes(0),
+			rate(0),
+			dropped(0)
+		{
+			for (u32 i=0; i<SEND_CLASS_COUNT; i++)
+				bytes[i] = 0;
+		}
+
+		std::list<QueuedPacket> packets[SEND_CLASS_COUNT];
+		u32 bytes[SEND_CLASS_COUNT];
+		float tokens;
+		// Bytes the peer may send in this round
+		s32 deficit;
+		// Bytes sent since the rate was last updated
+		u32 window_bytes;
+		float rate;
+		u32 dropped;
+	};
+
+	void queue(PeerQueue &q, SendClass cls, QueuedPacket &p);
+	// Removes the queued packet of a block, if there is one
+	bool removeBlock(PeerQueue &q, v3s16 pos);
+
+	std::map<u16, PeerQueue> m_peers;
+	float m_total_tokens;
+	u32 m_last_flush_ms;
+	float m_window_time;
+	// Peer served first by the last flush
+	u16 m_first_peer;
 	JMutex m_mutex;
 };
 
@@ -196,6 +430,68 @@ public:
 	}
 };
 
+/*
+	A block to be serialized by a BlockSendThread, and the peers it
+	goes to.
+*/
+struct QueuedBlockSend
+{
+	QueuedBlockSend(MapBlock *block, u8 a_ver, u8 a_codec):
+		snapshot(block),
+		ver(a_ver),
+		codec(a_codec)
+	{
+	}
+
+	MapBlockSnapshot snapshot;
+	u8 ver;
+	u8 codec;
+	// Peer ids and the SendClass of the block for each
+	core::map<u16, u8> peers;
+};
+
+/*
+	Serializes queued blocks and sends them to the peers waiting for
+	them. Blocks are handed to threads by position, so the updates of
+	a block are always sent in order.
+*/
+class BlockSendThread : public SimpleThread
+{
+	Server *m_server;
+
+public:
+
+	BlockSendThread(Server *server):
+		SimpleThread(),
+		m_server(server)
+	{
+	}
+
+	~BlockSendThread()
+	{
+		for (;;) {
+			try{
+				delete m_queue.pop_front();
+			}catch(ItemNotFoundException &e) {
+				break;
+			}
+		}
+	}
+
+	void * Thread();
+
+	void trigger()
+	{
+		setRun(true);
+		if(IsRunning() == false)
+		{
+			Start();
+		}
+	}
+
+	MutexedQueue<QueuedBlockSend*> m_queue;
+};
+
 struct PlayerInfo
 {
 	u16 id;
@@ -210,6 +506,29 @@ struct PlayerInfo
 
 u32 PIChecksum(core::list<PlayerInfo> &l);
 
+/*
+	What a client has been sent of the position of an object, see
+	TOCLIENT_ACTIVE_OBJECT_POSITIONS
+*/
+struct ObjectPositionState
+{
+	ObjectPositionState():
+		has_keyframe(false),
+		keyframe_num(0),
+		pending(false),
+		yaw(0)
+	{}
+
+	bool has_keyframe;
+	u8 keyframe_num;
+	// The last keyframe as the client decodes it
+	v3f keyframe_pos;
+	// Set if pos and yaw are yet to be sent
+	bool pending;
+	v3f pos;
+	f32 yaw;
+};
+
 /*
 	Used for queueing and sorting block transfers in containers
 
@@ -232,6 +551,96 @@ struct PrioritySortedBlockTransfer
 	u16 peer_id;
 };
 
+/*
+	The blocks in sending range of a client that haven't been sent to
+	it, by distance from the client's block (the radius of the box
+	shell they are on).
+
+	Kept up to date as the client moves and blocks are sent or
+	invalidated, so finding the blocks to send costs as much as there
+	are unsent blocks instead of going through every position in range.
+
+	Blocks that are only sent when near can be parked, they are left
+	out until they are invalidated or come near. Blocks that can't be
+	seen from the client's position can be sealed, they are left out
+	until they are invalidated or unseal() is called.
+*/
+class BlockSendFrontier
+{
+public:
+	BlockSendFrontier():
+		m_range(0),
+		m_valid(false)
+	{
+	}
+
+	/*
+		Moves the center or changes the range. Blocks that come into
+		range are added unless they are in sent.
+	*/
+	void update(v3s16 center, s16 range, core::map<v3s16, bool> &sent);
+	// Adds (or unparks) a block if it is in range
+	void add(v3s16 p);
+	void remove(v3s16 p);
+	void park(v3s16 p);
+	void seal(v3s16 p);
+	// Puts the sealed blocks back
+	void unseal();
+	// Gets the blocks at distance d
+	void get(s16 d, std::vector<v3s16> &dest);
+	// Blocks are found again from scratch by the next update()
+	void clear();
+
+	u32 size()
+	{
+		return m_blocks.size();
+	}
+	u32 parkedCount()
+	{
+		return m_parked.size();
+	}
+	u32 sealedCount()
+	{
+		return m_sealed.size();
+	}
+
+private:
+	struct Entry
+	{
+		Entry(s16 a_d, v3s16 a_p):
+			d(a_d),
+			p(a_p)
+		{
+		}
+		bool operator < (const Entry &other) const
+		{
+			if (d != other.d)
+				return d < other.d;
+			return p < other.p;
+		}
+		s16 d;
+		v3s16 p;
+	};
+
+	s16 distance(v3s16 p)
+	{
+		v3s16 r = p - m_center;
+		return MYMAX(MYMAX(abs(r.X), abs(r.Y)), abs(r.Z));
+	}
+	bool inRange(v3s16 p, v3s16 center)
+	{
+		v3s16 r = p - center;
+		return (abs(r.X) <= m_range && abs(r.Y) <= m_range/2 && abs(r.Z) <= m_range);
+	}
+
+	std::set<Entry> m_blocks;
+	std::set<v3s16> m_parked;
+	std::set<v3s16> m_sealed;
+	v3s16 m_center;
+	s16 m_range;
+	bool m_valid;
+};
+
 class RemoteClient
 {
 public:
@@ -246,6 +655,8 @@ public:
 	u16 net_proto_version;
 	// Version is stored in here after INIT before INIT2
 	u8 pending_serialization_version;
+	// SER_CODEC_* that blocks are sent to the client with
+	u8 block_codec;
 
 	RemoteClient():
 		m_time_from_building(9999),
@@ -255,10 +666,14 @@ public:
 		serialization_version = SER_FMT_VER_INVALID;
 		net_proto_version = 0;
 		pending_serialization_version = SER_FMT_VER_INVALID;
+		block_codec = SER_CODEC_ZLIB;
 		m_nearest_unsent_d = 0;
 		m_nearest_unsent_reset_timer = 0.0;
 		m_nothing_to_send_counter = 0;
 		m_nothing_to_send_pause_timer = 0;
+		m_visible_range = -1;
+		m_visible_stale = true;
+		m_visible_timer = 1.0;
 	}
 	~RemoteClient()
 	{
@@ -275,6 +690,11 @@ public:
 	void GotBlock(v3s16 p);
 
 	void SentBlock(v3s16 p);
+	// Tells whether the block is sent but the client hasn't got it yet
+	bool IsSendingBlock(v3s16 p)
+	{
+		return (m_blocks_sending.find(p) != NULL);
+	}
 
 	void SetBlockNotSent(v3s16 p);
 	void SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks);
@@ -315,6 +735,12 @@ public:
 	*/
 	std::map<u16, bool> m_known_objects;
 
+	/*
+		Position updates of the known objects, for clients that
+		support TOCLIENT_ACTIVE_OBJECT_POSITIONS
+	*/
+	std::map<u16, ObjectPositionState> m_object_positions;
+
 private:
 	/*
 		Blocks that have been sent to client.
@@ -326,6 +752,21 @@ private:
 		No MapBlock* is stored here because the blocks can get deleted.
 	*/
 	core::map<v3s16, bool> m_blocks_sent;
+	// Blocks in range that are not in m_blocks_sent
+	BlockSendFrontier m_frontier;
+
+	/*
+		Blocks that can be seen from the player's position, found by
+		going through the non-opaque faces of blocks. Found again when
+		the player moves to another block, or at most once a second
+		when blocks in range have changed.
+	*/
+	void updateVisibleBlocks(Server *server, v3s16 player_block, v3s16 center, s16 range);
+	std::set<v3s16> m_visible_blocks;
+	v3s16 m_visible_center;
+	s16 m_visible_range;
+	bool m_visible_stale;
+	float m_visible_timer;
 	s16 m_nearest_unsent_d;
 	v3s16 m_last_center;
 	float m_nearest_unsent_reset_timer;
@@ -437,6 +878,13 @@ public:
 
 	uint64_t getPlayerPrivs(Player *player);
 
+	/*
+		Saves the map right away and writes all of it to the database,
+		out of the environment lock, then tells the player. Only for
+		the server thread, as chat commands are run in.
+	*/
+	void requestMapSave(u16 peer_id);
+
 	void setIpBanned(const std::string &ip, const std::string &name)
 	{
 		ban_add(const_cast<char*>(ip.c_str()),const_cast<char*>(name.c_str()));
@@ -506,6 +954,14 @@ private:
 	void SendPlayerItems();
 	// send wielded item info about a player to all players
 	void SendPlayerItems(Player *player);
+	/*
+		Sends the client's pending object positions, nearest first,
+		until budget bytes have been used
+	*/
+	void SendObjectPositions(RemoteClient *client, v3f player_pos, u32 budget);
+	// Sends through the send scheduler
+	void SendToPeer(u16 peer_id, u8 channelnum, SharedBuffer<u8> data,
+			bool reliable, SendClass cls=SEND_CONTROL);
 	void SendChatMessage(u16 peer_id, const std::wstring &message);
 	void BroadcastChatMessage(const std::wstring &message);
 	void SendPlayerState(Player *player);
@@ -521,14 +977,25 @@ private:
 			core::list<u16> *far_players=NULL, float far_d_nodes=100);
 	void sendAddNode(v3s16 p, MapNode n, u16 ignore_id=0,
 			core::list<u16> *far_players=NULL, float far_d_nodes=100);
+	/*
+		A copy of the block that the client hasn't got yet can arrive
+		after a node change sent now, and undo it. Drops the queued one
+		and has the block sent again.
+	*/
+	void resendChangedBlock(RemoteClient *client, v3s16 blockpos);
 	void setBlockNotSent(v3s16 p);
 
-	// Environment and Connection must be locked when called
-	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver);
+	/*
+		Sends blocks to clients (locks env and con on its own)
 
-	// Sends blocks to clients (locks env and con on its own)
+		Blocks are selected and copied with env and con locked, then
+		serialized and sent by the block send threads.
+	*/
 	void SendBlocks(float dtime);
 
+	// Starts emerge threads for the queued blocks
+	void triggerEmergeThreads();
+
 	// sends env events (sound, particles, etc) to clients
 	// will not send to except_player if not NULL
 	void SendEnvEvent(u8 type, v3f pos, std::string &data, Player *except_player);
@@ -579,6 +1046,8 @@ private:
 	float m_objectdata_timer;
 	float m_emergethread_trigger_timer;
 	float m_savemap_timer;
+	// Players waiting for requestMapSave() to finish
+	std::list<u16> m_savemap_requests;
 	float m_send_object_info_timer;
 	float m_send_full_inventory_timer;
 	IntervalLimiter m_map_timer_and_unload_interval;
@@ -592,8 +1061,14 @@ private:
 
 	// Connection
 	con::Connection m_con;
+	/*
+		Only the server thread adds and removes clients, and it does so
+		behind this. Other threads lock it to read m_clients; the server
+		thread itself doesn't need to.
+	*/
 	JMutex m_con_mutex;
-	// Connected clients (behind the con mutex)
+	// Connected clients, only used by the server thread apart from the
+	// above
 	core::map<u16, RemoteClient*> m_clients;
 
 	/*
@@ -607,10 +1082,24 @@ private:
 
 	// The server mainly operates in this thread
 	ServerThread m_thread;
-	// This thread fetches and generates map
-	EmergeThread m_emergethread;
-	// Queue of block coordinates to be processed by the emerge thread
+	// These threads fetch and generate map
+	core::array<EmergeThread*> m_emergethreads;
+	// Queue of block coordinates to be processed by the emerge threads
 	BlockEmergeQueue m_emerge_queue;
+	// Areas of the map the emerge threads are working on
+	BlockEmergeRegions m_emerge_regions;
+	// Blocks changed by the emerge threads, to be set not sent to the
+	// clients by the server thread
+	LockFreeQueue<v3s16> m_emerged_blocks;
+	// Serialized blocks to be sent again
+	BlockPacketCache m_block_packets;
+	// These threads serialize and send blocks
+	core::array<BlockSendThread*> m_blocksendthreads;
+	// Everything sent to clients goes through this
+	SendScheduler m_send_scheduler;
+	// Codec blocks are sent with to clients that can read it, see
+	// RemoteClient::block_codec
+	u8 m_block_codec;
 
 	/*
 		Time related stuff
@@ -667,6 +1156,7 @@ private:
 	bool m_ignore_map_edit_events;
 
 	friend class EmergeThread;
+	friend class BlockSendThread;
 	friend class RemoteClient;
 };
 
@@ -481,6 +481,49 @@ int command_clearobjects(command_context_t *ctx, array_t *args)
 	return 0;
 }
 
+int command_convertmap(command_context_t *ctx, array_t *args)
+{
+	uint32_t count;
+	int complete;
+	if (ctx && (ctx->privs&PRIV_SERVER) == 0) {
+		command_print(ctx,SEND_TO_SENDER,CN_WARN,"You don't have permission to do that");
+		return 1;
+	}
+
+	bridge_server_notify_player(ctx,NULL,"Converting the map to the current format, server may lag for a while.");
+
+	if (bridge_env_convert_map(ctx,&count,&complete)) {
+		command_print(ctx,SEND_TO_SENDER,CN_WARN,"Unable to convert the map");
+		return 1;
+	}
+
+	if (!complete) {
+		command_print(ctx,SEND_TO_SENDER|SEND_TO_OTHERS,CN_INFO,"Converting map paused, %u blocks rewritten. Run it again to convert the rest.",count);
+		return 0;
+	}
+
+	command_print(ctx,SEND_TO_SENDER|SEND_TO_OTHERS,CN_INFO,"Converting map complete, %u blocks rewritten.",count);
+
+	return 0;
+}
+
+int command_save_map(command_context_t *ctx, array_t *args)
+{
+	if (ctx && (ctx->privs&PRIV_SERVER) == 0) {
+		command_print(ctx,SEND_TO_SENDER,CN_WARN,"You don't have permission to do that");
+		return 1;
+	}
+
+	if (bridge_env_save_map(ctx)) {
+		command_print(ctx,SEND_TO_SENDER,CN_WARN,"Unable to save the map");
+		return 1;
+	}
+
+	command_print(ctx,SEND_TO_SENDER,CN_INFO,"Saving the map.");
+
+	return 0;
+}
+
 int command_setpassword(command_context_t *ctx, array_t *args)
 {
 	char* name;
@@ -29,7 +29,11 @@
 #include <iostream>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include "utility.h"
+#ifdef USE_UDP_MMSG
+	#include <sys/epoll.h>
+#endif
 
 // Debug printing options
 // Set to 1 for debug output
@@ -169,6 +173,25 @@ UDPSocket::UDPSocket()
 	}
 
 	setTimeoutMs(0);
+	m_sim_latency_ms = 0;
+	m_sim_loss_ratio = 0;
+
+#ifdef USE_UDP_MMSG
+	m_send_count = 0;
+	m_epoll_fd = epoll_create(1);
+	if(m_epoll_fd >= 0)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = m_handle;
+		if(epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_handle, &ev) < 0)
+		{
+			close(m_epoll_fd);
+			m_epoll_fd = -1;
+		}
+	}
+#endif
 }
 
 UDPSocket::~UDPSocket()
@@ -176,6 +199,11 @@ UDPSocket::~UDPSocket()
 	if(DP)
 	dstream<<DPS<<"UDPSocket("<<(int)m_handle<<")::~UDPSocket()"<<std::endl;
 
+#ifdef USE_UDP_MMSG
+	if(m_epoll_fd >= 0)
+		close(m_epoll_fd);
+#endif
+
 #ifdef _WIN32
 	closesocket(m_handle);
 #else
@@ -238,6 +266,24 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 	if(dumping_packet)
 		return;
 
+	if(m_sim_latency_ms != 0 || m_sim_loss_ratio > 0){
+		sendDelayed();
+		if(myrand_range(0, 9999) < m_sim_loss_ratio * 10000)
+			return;
+		DelayedPacket p;
+		p.due_ms = porting::getTimeMs() + m_sim_latency_ms;
+		p.destination = destination;
+		p.data.assign((const char*)data, size);
+		m_delayed.push_back(p);
+		sendDelayed();
+		return;
+	}
+
+	rawSend(destination, data, size);
+}
+
+void UDPSocket::rawSend(const Address & destination, const void * data, int size)
+{
 	sockaddr_in address;
 	address.sin_family = AF_INET;
 	address.sin_addr.s_addr = htonl(destination.getAddress());
@@ -252,6 +298,169 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 	}
 }
 
+void UDPSocket::setLinkSimulation(unsigned int latency_ms, float loss_ratio)
+{
+	m_sim_latency_ms = latency_ms;
+	m_sim_loss_ratio = loss_ratio;
+}
+
+void UDPSocket::sendDelayed()
+{
+	if(m_delayed.empty())
+		return;
+	unsigned int now = porting::getTimeMs();
+	while(!m_delayed.empty()){
+		DelayedPacket &p = m_delayed.front();
+		// Wrap-safe "due_ms <= now"
+		if((int)(now - p.due_ms) < 0)
+			break;
+		try{
+			rawSend(p.destination, p.data.c_str(), p.data.size());
+		}catch(SendFailedException &e){
+		}
+		m_delayed.pop_front();
+	}
+}
+
+void UDPSocket::QueueSend(const Address & destination, const void * data, int size,
+		const void * data2, int size2)
+{
+#ifdef USE_UDP_MMSG
+	bool direct = (INTERNET_SIMULATOR || DP
+			|| m_sim_latency_ms != 0 || m_sim_loss_ratio > 0);
+	if(!direct)
+	{
+		if(m_send_count == UDP_BATCH_SIZE)
+			FlushSends();
+		QueuedPacket &p = m_send_queue[m_send_count];
+		p.destination = destination;
+		p.data = data;
+		p.size = size;
+		p.data2 = data2;
+		p.size2 = size2;
+		m_send_count++;
+		return;
+	}
+	// Keep the order of the packets
+	FlushSends();
+#endif
+	if(size2 == 0)
+	{
+		Send(destination, data, size);
+		return;
+	}
+	std::string joined((const char*)data, size);
+	joined.append((const char*)data2, size2);
+	Send(destination, joined.c_str(), joined.size());
+}
+
+void UDPSocket::FlushSends()
+{
+#ifdef USE_UDP_MMSG
+	int count = m_send_count;
+	if(count == 0)
+		return;
+	m_send_count = 0;
+
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iovecs[UDP_BATCH_SIZE][2];
+	sockaddr_in addresses[UDP_BATCH_SIZE];
+	memset(msgs, 0, sizeof(msgs));
+	for(int i=0; i<count; i++)
+	{
+		QueuedPacket &p = m_send_queue[i];
+		addresses[i].sin_family = AF_INET;
+		addresses[i].sin_addr.s_addr = htonl(p.destination.getAddress());
+		addresses[i].sin_port = htons(p.destination.getPort());
+		iovecs[i][0].iov_base = (void*)p.data;
+		iovecs[i][0].iov_len = p.size;
+		iovecs[i][1].iov_base = (void*)p.data2;
+		iovecs[i][1].iov_len = p.size2;
+		msgs[i].msg_hdr.msg_name = &addresses[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = (p.size2 != 0) ? 2 : 1;
+	}
+
+	int sent = 0;
+	while(sent < count)
+	{
+		int result = sendmmsg(m_handle, &msgs[sent], count - sent, 0);
+		if(result < 0 && errno == EINTR)
+			continue;
+		if(result <= 0)
+		{
+			// The first packet not sent failed, the ones after it are
+			// for other destinations as likely as not
+			dstream<<"UDPSocket::FlushSends(): Failed to send packet to "
+					<<m_send_queue[sent].destination.serializeString()
+					<<std::endl;
+			sent++;
+			continue;
+		}
+		sent += result;
+	}
+#endif
+}
+
+int UDPSocket::ReceiveBatch(UDPBatch &batch, bool wait)
+{
+	batch.count = 0;
+
+	if(WaitData(wait ? m_timeout_ms : 0) == false)
+		return 0;
+
+#ifdef USE_UDP_MMSG
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iovecs[UDP_BATCH_SIZE];
+	sockaddr_in addresses[UDP_BATCH_SIZE];
+	memset(msgs, 0, sizeof(msgs));
+	for(int i=0; i<UDP_BATCH_SIZE; i++)
+	{
+		iovecs[i].iov_base = batch.getData(i);
+		iovecs[i].iov_len = UDP_BATCH_PACKET_MAX;
+		msgs[i].msg_hdr.msg_name = &addresses[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int received = recvmmsg(m_handle, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if(received <= 0)
+		return 0;
+
+	for(int i=0; i<received; i++)
+	{
+		batch.addresses[i] = Address(ntohl(addresses[i].sin_addr.s_addr),
+				ntohs(addresses[i].sin_port));
+		if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+		{
+			dstream<<"UDPSocket::ReceiveBatch(): Dropping a packet larger "
+					"than "<<UDP_BATCH_PACKET_MAX<<" bytes"<<std::endl;
+			batch.sizes[i] = 0;
+			continue;
+		}
+		batch.sizes[i] = msgs[i].msg_len;
+	}
+	batch.count = received;
+#else
+	while(batch.count < UDP_BATCH_SIZE)
+	{
+		int i = batch.count;
+		int received = rawReceive(batch.addresses[i], batch.getData(i),
+				UDP_BATCH_PACKET_MAX);
+		if(received < 0)
+			break;
+		batch.sizes[i] = received;
+		batch.count++;
+		if(WaitData(0) == false)
+			break;
+	}
+#endif
+
+	return batch.count;
+}
+
 int UDPSocket::Receive(Address & sender, void * data, int size)
 {
 	if(WaitData(m_timeout_ms) == false)
@@ -259,6 +468,11 @@ int UDPSocket::Receive(Address & sender, void * data, int size)
 		return -1;
 	}
 
+	return rawReceive(sender, data, size);
+}
+
+int UDPSocket::rawReceive(Address & sender, void * data, int size)
+{
 	sockaddr_in address;
 	socklen_t address_len = sizeof(address);
 
@@ -303,6 +517,26 @@ void UDPSocket::setTimeoutMs(int timeout_ms)
 
 bool UDPSocket::WaitData(int timeout_ms)
 {
+	sendDelayed();
+
+#ifdef USE_UDP_MMSG
+	if(m_epoll_fd >= 0)
+	{
+		struct epoll_event ev;
+		int result = epoll_wait(m_epoll_fd, &ev, 1, timeout_ms);
+		if(result < 0)
+		{
+			if(errno == EINTR)
+				return false;
+#ifndef DISABLE_ERRNO
+			dstream<<(int)m_handle<<": epoll_wait failed: "<<strerror(errno)<<std::endl;
+#endif
+			throw SocketException("epoll_wait failed");
+		}
+		return result > 0;
+	}
+#endif
+
 	fd_set readset;
 	int result;
 
@@ -350,6 +584,21 @@ bool UDPSocket::WaitData(int timeout_ms)
 	return true;
 }
 
+/* UDPBatch */
+
+UDPBatch::UDPBatch():
+	count(0)
+{
+	m_data = new unsigned char[UDP_BATCH_SIZE * UDP_BATCH_PACKET_MAX];
+	for(int i=0; i<UDP_BATCH_SIZE; i++)
+		sizes[i] = 0;
+}
+
+UDPBatch::~UDPBatch()
+{
+	delete[] m_data;
+}
+
 /* TCPSocket */
 
 TCPSocket::TCPSocket()
@@ -50,7 +50,14 @@ typedef int socklen_t;
 typedef int socket_t;
 #endif
 
+#if defined(linux) || defined(__linux)
+	// epoll and recvmmsg()/sendmmsg()
+	#define USE_UDP_MMSG 1
+#endif
+
 #include <ostream>
+#include <string>
+#include <list>
 #include "exceptions.h"
 #include "constants.h"
 
@@ -109,6 +116,36 @@ private:
 	unsigned short m_port;
 };
 
+// Number of packets moved at once by ReceiveBatch() and FlushSends()
+#define UDP_BATCH_SIZE 32
+// Larger packets are dropped by ReceiveBatch()
+#define UDP_BATCH_PACKET_MAX 2048
+
+/*
+	A set of packets and their senders or destinations
+*/
+class UDPBatch
+{
+public:
+	UDPBatch();
+	~UDPBatch();
+
+	unsigned char *getData(int i)
+	{
+		return &m_data[i * UDP_BATCH_PACKET_MAX];
+	}
+
+	Address addresses[UDP_BATCH_SIZE];
+	// 0 for a packet that was dropped
+	int sizes[UDP_BATCH_SIZE];
+	int count;
+private:
+	UDPBatch(const UDPBatch &);
+	UDPBatch &operator=(const UDPBatch &);
+
+	unsigned char *m_data;
+};
+
 class UDPSocket
 {
 public:
@@ -124,9 +161,63 @@ public:
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
 	bool WaitData(int timeout_ms);
+	/*
+		Receives the packets that have arrived, up to UDP_BATCH_SIZE.
+		If wait is set, waits up to the socket timeout for the first one.
+		Uses a single recvmmsg() where available.
+		Returns the number of packets, also stored in batch.count.
+	*/
+	int ReceiveBatch(UDPBatch &batch, bool wait);
+	/*
+		Queues a packet to be sent by FlushSends(), which is also done
+		when the queue fills up. The packet is data followed by data2;
+		they are gathered by the kernel without being copied, so both
+		have to stay valid until FlushSends() returns. Where sendmmsg()
+		is not available, the packet is sent right away.
+		FlushSends() logs and skips a packet that fails to send, and
+		sends the rest.
+	*/
+	void QueueSend(const Address & destination, const void * data, int size,
+			const void * data2 = NULL, int size2 = 0);
+	void FlushSends();
+	/*
+		Simulates a slow and lossy link for testing: every sent packet
+		is held back for latency_ms and loss_ratio of them are dropped.
+		Held packets go out from Send() and WaitData(), so the socket
+		has to be polled regularly. Only call before using the socket.
+	*/
+	void setLinkSimulation(unsigned int latency_ms, float loss_ratio);
 private:
+	struct DelayedPacket
+	{
+		unsigned int due_ms;
+		Address destination;
+		std::string data;
+	};
+	struct QueuedPacket
+	{
+		Address destination;
+		const void *data;
+		int size;
+		const void *data2;
+		int size2;
+	};
+	void sendDelayed();
+	void rawSend(const Address & destination, const void * data, int size);
+	// Doesn't wait; returns -1 if there is no data
+	int rawReceive(Address & sender, void * data, int size);
+
 	int m_handle;
 	int m_timeout_ms;
+#ifdef USE_UDP_MMSG
+	// -1 if not available, select() is used then
+	int m_epoll_fd;
+	QueuedPacket m_send_queue[UDP_BATCH_SIZE];
+	int m_send_count;
+#endif
+	unsigned int m_sim_latency_ms;
+	float m_sim_loss_ratio;
+	std::list<DelayedPacket> m_delayed;
 };
 
 class TCPSocket
@@ -38,6 +38,11 @@
 #include "porting.h"
 #include "content_mapnode.h"
 #include "mapsector.h"
+#include "mapblock.h"
+#include "environment.h"
+#include "serverobject.h"
+#include "server.h"
+#include "noise.h"
 #include "log.h"
 
 /*
@@ -69,6 +74,67 @@ struct TestUtilities
 	}
 };
 
+struct TestLockFreeQueue
+{
+	class Producer : public SimpleThread
+	{
+	public:
+		LockFreeQueue<u32> *queue;
+		u32 id;
+		void * Thread()
+		{
+			ThreadStarted();
+			for (u32 i=0; i<20000; i++)
+				queue->push_back((id << 24) | i);
+			return NULL;
+		}
+	};
+
+	void Run()
+	{
+		// A small ring, so that it overflows
+		LockFreeQueue<u32> queue(16);
+		assert(queue.size() == 0);
+		u32 t;
+		assert(queue.try_pop_front(t) == false);
+		EXCEPTION_CHECK(ItemNotFoundException, queue.pop_front(10));
+
+		// Items pushed while overflowing come after the ones in the
+		// ring, also the ones pushed after some were popped
+		for (u32 i=0; i<24; i++)
+			queue.push_back(i);
+		for (u32 i=0; i<8; i++)
+			assert(queue.pop_front() == i);
+		for (u32 i=24; i<32; i++)
+			queue.push_back(i);
+		for (u32 i=8; i<32; i++)
+			assert(queue.pop_front() == i);
+		assert(queue.size() == 0);
+
+		Producer producers[4];
+		for (u32 i=0; i<4; i++) {
+			producers[i].queue = &queue;
+			producers[i].id = i;
+			producers[i].Start();
+		}
+
+		// Every producer's items come out in order
+		u32 next[4] = {0, 0, 0, 0};
+		for (u32 n=0; n<4*20000; n++) {
+			t = queue.pop_front(10000);
+			u32 id = t >> 24;
+			assert(id < 4);
+			assert((t & 0xffffff) == next[id]);
+			next[id]++;
+		}
+		assert(queue.size() == 0);
+		for (u32 i=0; i<4; i++) {
+			while (producers[i].IsRunning())
+				sleep_ms(1);
+		}
+	}
+};
+
 struct TestCompress
 {
 	void Run()
@@ -184,6 +250,49 @@ struct TestCompress
 		}
 
 		}
+
+		// Codecs, each followed by more data that has to be left alone
+		for (u8 codec=0; ser_codec_supported(codec); codec++)
+		{
+
+		SharedBuffer<u8> fromdata(4);
+		fromdata[0]=1;
+		fromdata[1]=5;
+		fromdata[2]=5;
+		fromdata[3]=1;
+
+		std::ostringstream os(std::ios_base::binary);
+		// Larger than the buffers the data is streamed through
+		SharedBuffer<u8> bigdata(50000);
+		for (u32 i=0; i<bigdata.getSize(); i++)
+			bigdata[i] = (i*i)>>7;
+
+		compressCodec(fromdata, os, codec);
+		compressCodec(bigdata, os, codec);
+		compressCodec(std::string("after"), os, codec);
+
+		std::istringstream is(os.str(), std::ios_base::binary);
+		std::ostringstream os2(std::ios_base::binary);
+		std::ostringstream os3(std::ios_base::binary);
+		std::ostringstream os4(std::ios_base::binary);
+
+		decompressCodec(is, os2, codec);
+		decompressCodec(is, os4, codec);
+		decompressCodec(is, os3, codec);
+		std::string str_out2 = os2.str();
+
+		assert(os4.str() == std::string((char*)*bigdata, bigdata.getSize()));
+
+		assert(str_out2.size() == fromdata.getSize());
+
+		for(u32 i=0; i<str_out2.size(); i++)
+		{
+			assert(str_out2[i] == fromdata[i]);
+		}
+
+		assert(os3.str() == "after");
+
+		}
 	}
 };
 
@@ -203,6 +312,548 @@ struct TestMapNode
 		assert(content_features(n).light_propagates == true);
 		n.setContent(CONTENT_STONE);
 		assert(content_features(n).light_propagates == false);
+
+		// Nodes are packed, tick counts are kept by the block
+		assert(sizeof(MapNode) == 4);
+	}
+};
+
+struct TestNodeTickTable
+{
+	void Run()
+	{
+		NodeTickTable t;
+		assert(t.empty());
+		assert(t.increment(100) == 1);
+		assert(t.increment(100) == 2);
+		assert(t.increment(5) == 1);
+		assert(t.get(100) == 2);
+		assert(t.get(5) == 1);
+		assert(t.get(6) == 0);
+		t.set(100, 0);
+		assert(t.get(100) == 0);
+		assert(t.get(5) == 1);
+
+		// Enough counted nodes switch it to the array, keeping counts
+		for (u16 i=0; i<NODETICKS_LIST_MAX+1; i++) {
+			t.set(i*3, i+1);
+		}
+		assert(t.isArray());
+		for (u16 i=0; i<NODETICKS_LIST_MAX+1; i++) {
+			assert(t.get(i*3) == (u32)i+1);
+		}
+		assert(t.get(4) == 0);
+		assert(t.increment(4) == 1);
+
+		t.clear();
+		assert(t.empty());
+		assert(t.get(3) == 0);
+	}
+};
+
+struct TestMapBlockStorage
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0));
+		assert(b.isUniform());
+		assert(b.getNodeNoEx(v3s16(1,2,3)).getContent() == CONTENT_IGNORE);
+
+		// A different node expands it
+		MapNode stone(CONTENT_STONE);
+		b.setNode(v3s16(1,2,3), stone);
+		assert(!b.isCompact());
+		assert(b.getNodeNoEx(v3s16(1,2,3)).getContent() == CONTENT_STONE);
+		assert(b.getNodeNoEx(v3s16(3,2,1)).getContent() == CONTENT_IGNORE);
+
+		// Three kinds of node take two bits each
+		MapNode air(CONTENT_AIR);
+		for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for (s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++) {
+			MapNode &n = y < 8 ? stone : air;
+			b.setNode(v3s16(x,y,z), n);
+		}
+		MapNode water(CONTENT_WATERSOURCE);
+		b.setNode(v3s16(4,8,4), water);
+		assert(b.compact());
+		assert(b.isCompact() && !b.isUniform());
+		assert(b.getMemoryUsage() == MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*2/8);
+		assert(b.getNodeNoEx(v3s16(4,7,4)).getContent() == CONTENT_STONE);
+		assert(b.getNodeNoEx(v3s16(4,8,4)).getContent() == CONTENT_WATERSOURCE);
+		assert(b.getNodeNoEx(v3s16(4,9,4)).getContent() == CONTENT_AIR);
+
+		// A fourth fits in the bits, a fifth doesn't
+		MapNode sand(CONTENT_SAND);
+		b.setNode(v3s16(15,15,15), sand);
+		assert(b.isCompact());
+		assert(b.getNodeNoEx(v3s16(15,15,15)).getContent() == CONTENT_SAND);
+		assert(b.getNodeNoEx(v3s16(14,15,15)).getContent() == CONTENT_AIR);
+		MapNode mud(CONTENT_MUD);
+		b.setNode(v3s16(0,0,0), mud);
+		assert(!b.isCompact());
+		assert(b.getNodeNoEx(v3s16(0,0,0)).getContent() == CONTENT_MUD);
+		assert(b.getNodeNoEx(v3s16(15,15,15)).getContent() == CONTENT_SAND);
+		assert(b.getNodeNoEx(v3s16(4,8,4)).getContent() == CONTENT_WATERSOURCE);
+
+		// The serialized block is the same whatever the storage
+		std::ostringstream os1(std::ios_base::binary);
+		b.serialize(os1, SER_FMT_VER_HIGHEST);
+		assert(b.compact());
+		std::ostringstream os2(std::ios_base::binary);
+		b.serialize(os2, SER_FMT_VER_HIGHEST);
+		assert(os1.str() == os2.str());
+	}
+};
+
+struct TestMapBlockIndex
+{
+	void Run()
+	{
+		MapBlockIndex index;
+		core::map<v3s16, MapBlock*> expected;
+		PseudoRandom pr(13);
+
+		// Enough blocks to grow the table a few times
+		for (u32 i=0; i<2000; i++) {
+			v3s16 p(pr.range(-40,40), pr.range(-20,20), pr.range(-40,40));
+			MapBlock *block = (MapBlock*)(size_t)(i+1);
+			index.insert(p, block);
+			expected[p] = block;
+		}
+		assert(index.size() == expected.size());
+
+		// Removing every other one mustn't lose the rest
+		bool remove = false;
+		for (core::map<v3s16, MapBlock*>::Iterator i = expected.getIterator(); i.atEnd() == false; i++) {
+			remove = !remove;
+			if (remove) {
+				index.remove(i.getNode()->getKey());
+				i.getNode()->setValue(NULL);
+			}
+		}
+		for (core::map<v3s16, MapBlock*>::Iterator i = expected.getIterator(); i.atEnd() == false; i++) {
+			assert(index.get(i.getNode()->getKey()) == i.getNode()->getValue());
+		}
+		assert(index.get(v3s16(1000,0,0)) == NULL);
+	}
+};
+
+struct TestMapLighter
+{
+	// Blank blocks radius blocks out from the origin each way
+	class TestMap : public Map
+	{
+	public:
+		TestMap(s16 radius):
+			Map(dstream)
+		{
+			for (s16 z=-radius; z<radius; z++)
+			for (s16 x=-radius; x<radius; x++) {
+				v2s16 p2d(x,z);
+				MapSector *sector = new ServerMapSector(this, p2d);
+				m_sectors.insert(p2d, sector);
+				for (s16 y=-radius; y<radius; y++)
+					sector->createBlankBlock(y);
+			}
+		}
+	};
+
+	void Run()
+	{
+		// A dark cave crossing block borders, inside stone
+		TestMap map(1);
+		s16 r = MAP_BLOCKSIZE;
+		for (s16 z=-r; z<r; z++)
+		for (s16 y=-r; y<r; y++)
+		for (s16 x=-r; x<r; x++) {
+			bool cave = (x >= -4 && x <= 4 && y >= -4 && y <= 4 && z >= -4 && z <= 4);
+			MapNode n(cave ? CONTENT_AIR : CONTENT_STONE);
+			map.setNode(v3s16(x,y,z), n);
+		}
+
+		core::map<v3s16, MapBlock*> modified_blocks;
+		std::string player_name("test");
+		u8 source = content_features(CONTENT_FLASH).light_source;
+		map.addNodeAndUpdate(v3s16(0,0,0), MapNode(CONTENT_FLASH), modified_blocks, player_name);
+		// Every block has a corner of the cave
+		assert(modified_blocks.size() == 8);
+		for (s16 z=-4; z<=4; z++)
+		for (s16 y=-4; y<=4; y++)
+		for (s16 x=-4; x<=4; x++) {
+			if (x == 0 && y == 0 && z == 0)
+				continue;
+			u8 light = source - abs(x) - abs(y) - abs(z);
+			MapNode n = map.getNodeNoEx(v3s16(x,y,z));
+			assert(n.getLight(LIGHTBANK_DAY) == light);
+			assert(n.getLight(LIGHTBANK_NIGHT) == light);
+		}
+		assert(map.getNodeNoEx(v3s16(5,0,0)).getLight(LIGHTBANK_NIGHT) == 0);
+
+		// Taking the light away darkens the cave again
+		map.removeNodeAndUpdate(v3s16(0,0,0), modified_blocks);
+		for (s16 z=-4; z<=4; z++)
+		for (s16 y=-4; y<=4; y++)
+		for (s16 x=-4; x<=4; x++) {
+			MapNode n = map.getNodeNoEx(v3s16(x,y,z));
+			assert(n.getLight(LIGHTBANK_DAY) == 0);
+			assert(n.getLight(LIGHTBANK_NIGHT) == 0);
+		}
+	}
+};
+
+struct TestMapSaveThread
+{
+	void Run()
+	{
+		MapSaveThread t;
+		v3s16 p(1,2,3);
+		v3s16 p2(4,5,6);
+		core::list<v3s16> batch_pos;
+		core::list<MapSaveThread::Entry> batch;
+
+		// A block is saved
+		t.queue(p, "new");
+		std::string blob;
+		assert(t.get(p, &blob) && blob == "new");
+
+		// A prefetch starts and reads the old copy from the database
+		u32 seq = t.watch();
+		assert(t.changedSince(p, seq));
+		assert(t.changedSince(p2, seq) == false);
+
+		// The save is written before the prefetch caches its copy
+		t.takeBatch(batch_pos, batch, 256);
+		assert(batch.size() == 1);
+		t.removeWritten(batch_pos, batch);
+		assert(t.size() == 0);
+
+		// Loading doesn't find it queued, so the old copy can't be kept
+		assert(t.get(p, &blob) == false);
+		assert(t.changedSince(p, seq));
+		assert(t.changedSince(p2, seq) == false);
+
+		// Requeued while being written, it stays queued
+		t.queue(p2, "a");
+		batch_pos.clear();
+		batch.clear();
+		t.takeBatch(batch_pos, batch, 256);
+		t.queue(p2, "b");
+		t.removeWritten(batch_pos, batch);
+		assert(t.get(p2, &blob) && blob == "b");
+		assert(t.changedSince(p2, seq));
+		batch_pos.clear();
+		batch.clear();
+		t.takeBatch(batch_pos, batch, 256);
+		t.removeWritten(batch_pos, batch);
+		assert(t.size() == 0);
+
+		// Reads starting after the last one ended see all writes
+		t.unwatch();
+		seq = t.watch();
+		assert(t.changedSince(p, seq) == false);
+		assert(t.changedSince(p2, seq) == false);
+		t.unwatch();
+	}
+};
+
+struct TestActiveObjectGrid
+{
+	class TestSAO : public ServerActiveObject
+	{
+	public:
+		TestSAO(u16 id, v3f pos):
+			ServerActiveObject(NULL, id, pos)
+		{}
+		u8 getType() const
+		{
+			return ACTIVEOBJECT_TYPE_INVALID;
+		}
+	};
+
+	void Run()
+	{
+		ActiveObjectGrid grid;
+		std::map<u16, ServerActiveObject*> objects;
+		PseudoRandom pr(17);
+
+		for (u16 id=1; id<=500; id++) {
+			v3f p(pr.range(-1600,1600)*0.1*BS, pr.range(-500,500)*0.1*BS, pr.range(-1600,1600)*0.1*BS);
+			objects[id] = new TestSAO(id, p);
+			grid.insert(objects[id]);
+		}
+		// Move some across blocks and remove some
+		for (u16 id=1; id<=500; id+=3) {
+			ServerActiveObject *obj = objects[id];
+			obj->setBasePosition(obj->getBasePosition()
+					+ v3f(pr.range(-400,400)*0.1*BS, 0, pr.range(-400,400)*0.1*BS));
+			grid.update(obj);
+		}
+		for (u16 id=2; id<=500; id+=7) {
+			grid.remove(id);
+			delete objects[id];
+			objects.erase(id);
+		}
+
+		// Whatever is within the radius has to be found
+		for (u32 k=0; k<50; k++) {
+			v3f pos(pr.range(-200,200)*BS, pr.range(-50,50)*BS, pr.range(-200,200)*BS);
+			f32 radius = pr.range(1,80)*BS;
+			std::vector<ServerActiveObject*> nearby;
+			grid.getNear(pos, radius, nearby);
+			std::set<u16> found;
+			for (u32 i=0; i<nearby.size(); i++)
+				found.insert(nearby[i]->getId());
+			assert(found.size() == nearby.size());
+			for (std::map<u16, ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++) {
+				if (i->second->getBasePosition().getDistanceFrom(pos) <= radius)
+					assert(found.count(i->first) == 1);
+			}
+			for (std::set<u16>::iterator i = found.begin(); i != found.end(); i++)
+				assert(objects.count(*i) == 1);
+		}
+
+		for (std::map<u16, ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++)
+			delete i->second;
+	}
+};
+
+struct TestMapBlockOpaqueFaces
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0));
+		MapNode stone(CONTENT_STONE);
+		MapNode air(CONTENT_AIR);
+
+		// Ground in the lower half, only the bottom can't be seen through
+		for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for (s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++) {
+			MapNode &n = y < 8 ? stone : air;
+			b.setNode(v3s16(x,y,z), n);
+		}
+		assert(b.getOpaqueFaces() == (1<<4));
+
+		// Solid, then a hole in the right side
+		for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for (s16 y=8; y<MAP_BLOCKSIZE; y++)
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++)
+			b.setNode(v3s16(x,y,z), stone);
+		assert(b.getOpaqueFaces() == 0x3f);
+		b.compact();
+		assert(b.isUniform() && b.getOpaqueFaces() == 0x3f);
+		b.setNode(v3s16(MAP_BLOCKSIZE-1,5,5), air);
+		assert(b.getOpaqueFaces() == (0x3f & ~(1<<2)));
+	}
+};
+
+struct TestMapBlockNodeCounts
+{
+	void Run()
+	{
+		envstep_init();
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		MapBlock b(NULL, v3s16(0,0,0));
+		MapNode stone(CONTENT_STONE);
+		MapNode air(CONTENT_AIR);
+		MapNode mud(CONTENT_MUD);
+
+		for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for (s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++) {
+			MapNode &n = z < 8 ? stone : air;
+			b.setNode(v3s16(x,y,z), n);
+		}
+		assert(b.getEnvStepNodeCount() == 0);
+		assert(b.getAirNodeCount() == nodecount/2);
+
+		// Kept up to date by single node writes
+		b.setNode(v3s16(1,1,15), mud);
+		b.setNode(v3s16(2,2,15), mud);
+		b.setNode(v3s16(2,2,15), mud);
+		assert(b.getEnvStepNodeCount() == 2);
+		assert(b.getAirNodeCount() == nodecount/2-2);
+		b.setNode(v3s16(1,1,15), stone);
+		assert(b.getEnvStepNodeCount() == 1);
+		assert(b.getAirNodeCount() == nodecount/2-2);
+
+		// Counted again from the palette after a bulk write
+		b.compact();
+		std::ostringstream os(std::ios_base::binary);
+		b.serialize(os, SER_FMT_VER_HIGHEST);
+		MapBlock b2(NULL, v3s16(0,0,0));
+		std::istringstream is(os.str(), std::ios_base::binary);
+		b2.deSerialize(is, SER_FMT_VER_HIGHEST);
+		assert(b2.isCompact());
+		assert(b2.getEnvStepNodeCount() == 1);
+		assert(b2.getAirNodeCount() == nodecount/2-2);
+	}
+};
+
+struct TestBlockSendFrontier
+{
+	void Run()
+	{
+		BlockSendFrontier frontier;
+		core::map<v3s16, bool> sent;
+		PseudoRandom pr(31);
+		s16 range = 6;
+
+		for (u32 i=0; i<300; i++)
+			sent.insert(v3s16(pr.range(-10,10), pr.range(-5,5), pr.range(-10,10)), true);
+
+		v3s16 center(0,0,0);
+		for (u32 k=0; k<20; k++) {
+			frontier.update(center, range, sent);
+
+			// Same as going through every position in range
+			u32 count = 0;
+			for (s16 d=0; d<=range; d++) {
+				std::vector<v3s16> list;
+				frontier.get(d, list);
+				count += list.size();
+				for (u32 i=0; i<list.size(); i++) {
+					v3s16 r = list[i] - center;
+					assert(MYMAX(MYMAX(abs(r.X), abs(r.Y)), abs(r.Z)) == d);
+					assert(abs(r.Y) <= range/2);
+					assert(sent.find(list[i]) == NULL);
+				}
+			}
+			u32 expected = 0;
+			for (s16 x=-range; x<=range; x++)
+			for (s16 y=-range/2; y<=range/2; y++)
+			for (s16 z=-range; z<=range; z++) {
+				if (sent.find(center + v3s16(x,y,z)) == NULL)
+					expected++;
+			}
+			assert(count == expected);
+			assert(frontier.size() == expected);
+
+			center += v3s16(pr.range(-2,2), pr.range(-1,1), pr.range(-2,2));
+		}
+
+		// Sent blocks leave, invalidated ones come back
+		v3s16 p = center + v3s16(1,0,1);
+		assert(sent.find(p) == NULL);
+		u32 size = frontier.size();
+		frontier.remove(p);
+		assert(frontier.size() == size-1);
+		frontier.add(p);
+		assert(frontier.size() == size);
+
+		// Parked blocks come back when near
+		v3s16 far = center + v3s16(BLOCK_SEND_GROUND_ONLY_MIN_D,0,0);
+		frontier.park(far);
+		assert(frontier.size() == size-1 && frontier.parkedCount() == 1);
+		frontier.update(center + v3s16(BLOCK_SEND_GROUND_ONLY_MIN_D-1,0,0), range, sent);
+		assert(frontier.parkedCount() == 0);
+
+		// Sealed blocks come back when unsealed
+		size = frontier.size();
+		frontier.seal(p);
+		assert(frontier.size() == size-1 && frontier.sealedCount() == 1);
+		frontier.unseal();
+		assert(frontier.size() == size && frontier.sealedCount() == 0);
+	}
+};
+
+struct TestSendScheduler
+{
+	typedef std::list<SendScheduler::OutgoingPacket> OutList;
+
+	void Run()
+	{
+		SendScheduler s;
+		SendQueueStats stats;
+		OutList out;
+		s.addPeer(2);
+		s.addPeer(3);
+
+		// Classes go in order, a block replaces its queued copy
+		s.sendBlock(2, v3s16(0,0,0), SharedBuffer<u8>(100), SEND_BLOCKS_FAR);
+		s.sendBlock(2, v3s16(1,0,0), SharedBuffer<u8>(150), SEND_BLOCKS_NEAR);
+		s.send(2, 0, SharedBuffer<u8>(10), true, SEND_OBJECTS);
+		s.sendBlock(2, v3s16(0,0,0), SharedBuffer<u8>(200), SEND_BLOCKS_FAR);
+		assert(s.getStats(2, stats));
+		assert(stats.queued_packets == 3);
+		assert(stats.queued_bytes == 360);
+		s.flush(out, 0, 0, 0.1);
+		assert(out.size() == 3);
+		OutList::iterator i = out.begin();
+		assert(i->peer_id == 2 && i->channelnum == 0 && i->data.getSize() == 10);
+		i++;
+		assert(i->channelnum == 1 && i->data.getSize() == 150);
+		i++;
+		assert(i->data.getSize() == 200);
+		out.clear();
+
+		// Dropped blocks aren't sent, the other ones still are
+		s.sendBlock(2, v3s16(0,0,0), SharedBuffer<u8>(100), SEND_BLOCKS_NEAR);
+		s.sendBlock(2, v3s16(0,1,0), SharedBuffer<u8>(120), SEND_BLOCKS_NEAR);
+		assert(s.dropBlock(2, v3s16(0,0,0)));
+		assert(s.dropBlock(2, v3s16(0,0,0)) == false);
+		assert(s.dropBlock(3, v3s16(0,1,0)) == false);
+		s.flush(out, 0, 0, 0.1);
+		assert(out.size() == 1);
+		assert(out.front().data.getSize() == 120);
+		out.clear();
+
+		// The peer's budget limits what is sent, it may go below zero
+		// by one packet
+		s.removePeer(2);
+		s.addPeer(2);
+		for (u32 k=0; k<5; k++)
+			s.send(2, 0, SharedBuffer<u8>(300), true, SEND_OBJECTS);
+		s.flush(out, 4000, 0, 0.1);
+		assert(out.size() == 2);
+		out.clear();
+		s.flush(out, 4000, 0, 0.1);
+		assert(out.size() == 1);
+		out.clear();
+		// Sending control packets takes from it too
+		s.sentControl(2, 1000);
+		s.flush(out, 4000, 0, 0.1);
+		assert(out.size() == 0);
+		s.flush(out, 4000, 0, 0.25);
+		assert(out.size() == 1);
+		out.clear();
+		s.flush(out, 0, 0, 0.1);
+		assert(out.size() == 1);
+		out.clear();
+		assert(s.getStats(2, stats) && stats.queued_packets == 0);
+
+		// The shared budget starts with a different peer each time
+		{
+			SendScheduler s2;
+			s2.addPeer(2);
+			s2.addPeer(3);
+			for (u32 k=0; k<4; k++) {
+				s2.send(2, 0, SharedBuffer<u8>(300), true, SEND_OBJECTS);
+				s2.send(3, 0, SharedBuffer<u8>(300), true, SEND_OBJECTS);
+			}
+			s2.flush(out, 0, 4000, 0.1);
+			assert(out.size() == 2);
+			assert(out.front().peer_id == 2 && out.back().peer_id == 2);
+			out.clear();
+			s2.flush(out, 0, 4000, 0.1);
+			assert(out.size() == 1);
+			assert(out.front().peer_id == 3);
+			out.clear();
+		}
+
+		// Unreliable packets are dropped when the queue is full
+		s.removePeer(2);
+		s.removePeer(3);
+		s.addPeer(2);
+		for (u32 k=0; k<SEND_UNRELIABLE_QUEUE_MAX/1000+1; k++)
+			s.send(2, 0, SharedBuffer<u8>(1000), false, SEND_OBJECTS);
+		assert(s.getStats(2, stats));
+		assert(stats.queued_packets == SEND_UNRELIABLE_QUEUE_MAX/1000);
+		assert(stats.dropped == 1);
+		// Packets of unknown peers are ignored
+		s.send(3, 0, SharedBuffer<u8>(10), true, SEND_OBJECTS);
+		assert(s.getStats(3, stats) == false);
 	}
 };
 
@@ -534,7 +1185,7 @@ struct TestMapBlock
 			parent.node.setContent(CONTENT_AIR);
 			parent.node.setLight(LIGHTBANK_DAY, LIGHT_SUN);
 			parent.node.setLight(LIGHTBANK_NIGHT, 0);
-			core::map<v3s16, bool> light_sources;
+			std::vector<v3s16> light_sources;
 			// The bottom block is invalid, because we have a shadowing node
 			assert(b.propagateSunlight(light_sources) == false);
 			assert(b.getNode(v3s16(1,4,0)).getLight(LIGHTBANK_DAY) == LIGHT_SUN);
@@ -561,7 +1212,7 @@ struct TestMapBlock
 			parent.position_valid = true;
 			b.setIsUnderground(true);
 			parent.node.setLight(LIGHTBANK_DAY, LIGHT_MAX/2);
-			core::map<v3s16, bool> light_sources;
+			std::vector<v3s16> light_sources;
 			// The block below should be valid because there shouldn't be
 			// sunlight in there either
 			assert(b.propagateSunlight(light_sources, true) == true);
@@ -602,7 +1253,7 @@ struct TestMapBlock
 			}
 			// Lighting value for the valid nodes
 			parent.node.setLight(LIGHTBANK_DAY, LIGHT_MAX/2);
-			core::map<v3s16, bool> light_sources;
+			std::vector<v3s16> light_sources;
 			// Bottom block is not valid
 			assert(b.propagateSunlight(light_sources) == false);
 		}
@@ -703,6 +1354,65 @@ struct TestSocket
 		//FIXME: This fails on some systems
 		assert(strncmp(sendbuffer, rcvbuffer, sizeof(sendbuffer))==0);
 		assert(sender.getAddress() == Address(127,0,0,1, 0).getAddress());
+
+#ifdef USE_UDP_MMSG
+		// A packet that can't be sent doesn't hold back the next one
+		const char sendbuffer2[] = "second";
+		socket.QueueSend(Address(255,255,255,255,port), sendbuffer, sizeof(sendbuffer));
+		socket.QueueSend(Address(127,0,0,1,port), sendbuffer2, sizeof(sendbuffer2));
+		socket.FlushSends();
+
+		sleep_ms(50);
+
+		memset(rcvbuffer, 0, sizeof(rcvbuffer));
+		for(;;)
+		{
+			int bytes_read = socket.Receive(sender, rcvbuffer, sizeof(rcvbuffer));
+			if(bytes_read < 0)
+				break;
+		}
+		assert(strncmp(sendbuffer2, rcvbuffer, sizeof(sendbuffer2))==0);
+#endif
+	}
+};
+
+struct TestReliablePacketBuffer
+{
+	con::BufferedPacket makePacket(u16 seqnum)
+	{
+		Address address;
+		SharedBuffer<u8> data(1);
+		SharedBuffer<u8> reliable = con::makeReliablePacket(data, seqnum);
+		return con::makePacket(address, reliable, 0, 0, 0);
+	}
+
+	void Run()
+	{
+		con::ReliablePacketBuffer buffer;
+
+		// Out of order, across the seqnum wrap and past the initial size
+		for (u32 i=0; i<200; i++) {
+			con::BufferedPacket p = makePacket(65500 + (i*7)%200);
+			buffer.insert(p);
+		}
+		assert(buffer.size() == 200);
+		assert(buffer.getFirstSeqnum() == 65500);
+		assert(buffer.findPacket(163) != buffer.notFound());
+		assert(buffer.findPacket(164) == buffer.notFound());
+
+		// Timers restart when packets time out
+		buffer.incrementTimeouts(1.0);
+		assert(buffer.anyTotaltimeReached(1.0));
+		assert(buffer.getTimedOuts(1.0).size() == 200);
+		assert(buffer.getTimedOuts(1.0).size() == 0);
+		assert(buffer.popSeqnum(10).resent);
+
+		assert(buffer.popBefore(0) == 36);
+		assert(buffer.getFirstSeqnum() == 0);
+		assert(buffer.getReceivedMask(65535) == (0xffffffff ^ (1 << 10)));
+		while (buffer.empty() == false)
+			buffer.popFirst();
+		assert(buffer.size() == 0);
 	}
 };
 
@@ -753,6 +1463,35 @@ struct TestConnection
 		assert(readU8(&p2[0]) == TYPE_RELIABLE);
 		assert(readU16(&p2[1]) == seqnum);
 		assert(readU8(&p2[3]) == data1[0]);
+
+		/*
+			With headroom the headers are prepended in place, but only
+			once; a second packet from the same data gets a copy
+		*/
+		SharedBuffer<u8> data2(2, PACKET_HEADROOM);
+		data2[0] = 200;
+		data2[1] = 201;
+		SharedBuffer<u8> p3 = con::makeReliablePacket(
+				con::makeOriginalPacket(data2), seqnum);
+		con::BufferedPacket p4 = con::makePacket(a, p3,
+				proto_id, peer_id, channel);
+		assert(*p4.data + PACKET_HEADROOM == *data2);
+		assert(p4.data.getSize() == PACKET_HEADROOM + 2);
+		assert(readU8(&p4.data[7]) == TYPE_RELIABLE);
+		assert(readU8(&p4.data[10]) == TYPE_ORIGINAL);
+		SharedBuffer<u8> p5 = con::makeOriginalPacket(data2);
+		assert(*p5 + 1 != *data2);
+		assert(readU8(&p5[0]) == TYPE_ORIGINAL);
+		assert(readU8(&p5[2]) == 201);
+
+		// Split chunks refer to the data instead of copying it
+		SharedBuffer<u8> data3(1000);
+		core::list<con::PacketParts> chunks =
+				con::makeSplitPacket(data3, 400, 7);
+		assert(chunks.size() == 3);
+		assert(*chunks.begin()->tail == *data3);
+		assert(readU16(&chunks.begin()->data[3]) == 3);
+		assert((*chunks.getLast()).tail.getSize() == 1000 - 2 * (400 - 7));
 	}
 
 	struct Handler : public con::PeerHandler
@@ -1121,9 +1860,21 @@ void run_tests()
 	DSTACK(__FUNCTION_NAME);
 	infostream<<"run_tests() started"<<std::endl;
 	TEST(TestUtilities);
+	TEST(TestLockFreeQueue);
 	TEST(TestCompress);
 	TEST(TestMapNode);
+	TEST(TestNodeTickTable);
+	TEST(TestMapBlockStorage);
+	TEST(TestMapBlockOpaqueFaces);
+	TEST(TestMapBlockNodeCounts);
+	TEST(TestMapBlockIndex);
+	TEST(TestMapLighter);
+	TEST(TestMapSaveThread);
+	TEST(TestActiveObjectGrid);
+	TEST(TestBlockSendFrontier);
+	TEST(TestSendScheduler);
 	TEST(TestVoxelManipulator);
+	TEST(TestReliablePacketBuffer);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	if(INTERNET_SIMULATOR == false){
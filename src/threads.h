@@ -27,6 +27,10 @@
 #define THREADS_HEADER
 
 #include <jmutex.h>
+#if !(defined(WIN32) || defined(_WIN32_WCE))
+#include <sys/time.h>
+#include <errno.h>
+#endif
 
 #if (defined(WIN32) || defined(_WIN32_WCE))
 typedef DWORD threadid_t;
@@ -47,5 +51,79 @@ inline threadid_t get_current_thread_id()
 #endif
 }
 
+/*
+	An event that a thread can sleep on until another one signals it.
+	A signal given while nobody is waiting wakes up the next wait.
+*/
+class ThreadEvent
+{
+public:
+	ThreadEvent()
+	{
+#if (defined(WIN32) || defined(_WIN32_WCE))
+		m_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+		pthread_mutex_init(&m_mutex, NULL);
+		pthread_cond_init(&m_cond, NULL);
+		m_signaled = false;
+#endif
+	}
+	~ThreadEvent()
+	{
+#if (defined(WIN32) || defined(_WIN32_WCE))
+		CloseHandle(m_event);
+#else
+		pthread_cond_destroy(&m_cond);
+		pthread_mutex_destroy(&m_mutex);
+#endif
+	}
+	void signal()
+	{
+#if (defined(WIN32) || defined(_WIN32_WCE))
+		SetEvent(m_event);
+#else
+		pthread_mutex_lock(&m_mutex);
+		m_signaled = true;
+		pthread_cond_signal(&m_cond);
+		pthread_mutex_unlock(&m_mutex);
+#endif
+	}
+	// Returns false if timeout_ms passed without a signal
+	bool wait(unsigned int timeout_ms)
+	{
+#if (defined(WIN32) || defined(_WIN32_WCE))
+		return (WaitForSingleObject(m_event, timeout_ms) == WAIT_OBJECT_0);
+#else
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		struct timespec until;
+		unsigned long long nsec = (unsigned long long)now.tv_usec * 1000
+				+ (unsigned long long)(timeout_ms % 1000) * 1000000;
+		until.tv_sec = now.tv_sec + timeout_ms / 1000 + nsec / 1000000000;
+		until.tv_nsec = nsec % 1000000000;
+
+		pthread_mutex_lock(&m_mutex);
+		while (!m_signaled) {
+			if (pthread_cond_timedwait(&m_cond, &m_mutex, &until) == ETIMEDOUT)
+				break;
+		}
+		bool signaled = m_signaled;
+		m_signaled = false;
+		pthread_mutex_unlock(&m_mutex);
+		return signaled;
+#endif
+	}
+private:
+	ThreadEvent(const ThreadEvent &);
+	ThreadEvent &operator=(const ThreadEvent &);
+#if (defined(WIN32) || defined(_WIN32_WCE))
+	HANDLE m_event;
+#else
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_cond;
+	bool m_signaled;
+#endif
+};
+
 #endif
 
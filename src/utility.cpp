@@ -29,19 +29,20 @@
 #include "base64.h"
 #include "log.h"
 
-TimeTaker::TimeTaker(const char *name, u32 *result)
+TimeTaker::TimeTaker(const char *name, u32 *result, TimePrecision prec)
 {
 	m_name = name;
 	m_result = result;
 	m_running = true;
-	m_time1 = getTimeMs();
+	m_precision = prec;
+	m_time1 = now();
 }
 
 u32 TimeTaker::stop(bool quiet)
 {
 	if(m_running)
 	{
-		u32 time2 = getTimeMs();
+		u32 time2 = now();
 		u32 dtime = time2 - m_time1;
 		if(m_result != NULL)
 		{
@@ -50,7 +51,8 @@ u32 TimeTaker::stop(bool quiet)
 		else
 		{
 			if(quiet == false)
-				infostream<<m_name<<" took "<<dtime<<"ms"<<std::endl;
+				infostream<<m_name<<" took "<<dtime
+						<<(m_precision == PRECISION_MICRO ? "us" : "ms")<<std::endl;
 		}
 		m_running = false;
 		return dtime;
@@ -60,11 +62,18 @@ u32 TimeTaker::stop(bool quiet)
 
 u32 TimeTaker::getTime()
 {
-	u32 time2 = getTimeMs();
+	u32 time2 = now();
 	u32 dtime = time2 - m_time1;
 	return dtime;
 }
 
+u32 TimeTaker::now()
+{
+	if(m_precision == PRECISION_MICRO)
+		return porting::getTimeUs();
+	return getTimeMs();
+}
+
 const v3s16 g_6dirs[6] =
 {
 	// +right, +top, +back
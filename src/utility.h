@@ -42,6 +42,7 @@
 #include "strfnd.h"
 #include "exceptions.h"
 #include "porting.h"
+#include "threads.h"
 
 using namespace jthread;
 
@@ -459,6 +460,18 @@ private:
 	unsigned int m_size;
 };
 
+/*
+	A reference counted buffer.
+
+	A buffer can be allocated with headroom in front of the data, so that
+	protocol layers can prepend their headers in place with prepend()
+	instead of copying the data into a bigger buffer. slice() makes a
+	buffer that shares the storage of another one.
+
+	The reference count and the headroom are updated atomically, so
+	copies of a buffer can be used by several threads as long as none
+	of them writes to the data.
+*/
 template <typename T>
 class SharedBuffer
 {
@@ -467,8 +480,7 @@ public:
 	{
 		m_size = 0;
 		data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(NULL, 0);
 	}
 	SharedBuffer(unsigned int size)
 	{
@@ -477,27 +489,38 @@ public:
 			data = new T[m_size];
 		else
 			data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(data, 0);
+	}
+	/*
+		Leaves room for headroom elements to be prepended
+	*/
+	SharedBuffer(unsigned int size, unsigned int headroom)
+	{
+		m_size = size;
+		T *base = NULL;
+		if(m_size + headroom != 0)
+			base = new T[headroom + m_size];
+		data = base + headroom;
+		init(base, headroom);
 	}
 	SharedBuffer(const SharedBuffer &buffer)
 	{
 		//std::cout<<"SharedBuffer(const SharedBuffer &buffer)"<<std::endl;
 		m_size = buffer.m_size;
 		data = buffer.data;
-		refcount = buffer.refcount;
-		(*refcount)++;
+		m_storage = buffer.m_storage;
+		atomic_add(&m_storage->refcount, 1);
 	}
 	SharedBuffer & operator=(const SharedBuffer & buffer)
 	{
 		//std::cout<<"SharedBuffer & operator=(const SharedBuffer & buffer)"<<std::endl;
 		if(this == &buffer)
 			return *this;
+		atomic_add(&buffer.m_storage->refcount, 1);
 		drop();
 		m_size = buffer.m_size;
 		data = buffer.data;
-		refcount = buffer.refcount;
-		(*refcount)++;
+		m_storage = buffer.m_storage;
 		return *this;
 	}
 	/*
@@ -513,8 +536,7 @@ public:
 		}
 		else
 			data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(data, 0);
 	}
 	/*
 		Copies whole buffer
@@ -529,8 +551,7 @@ public:
 		}
 		else
 			data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		init(data, 0);
 	}
 	~SharedBuffer()
 	{
@@ -553,21 +574,63 @@ public:
 	{
 		return Buffer<T>(data, m_size);
 	}
+	/*
+		Grows the buffer by count elements at the front, into the
+		headroom. Only the first buffer to claim the space in front of
+		some data gets it; returns false if it is taken or too small.
+	*/
+	bool prepend(unsigned int count)
+	{
+		if(m_storage->base == NULL)
+			return false;
+		unsigned int offset = data - m_storage->base;
+		if(offset < count)
+			return false;
+		if(!atomic_cas(&m_storage->front, offset, offset - count))
+			return false;
+		data -= count;
+		m_size += count;
+		return true;
+	}
+	/*
+		Returns size elements from start on without copying them
+	*/
+	SharedBuffer slice(unsigned int start, unsigned int size) const
+	{
+		assert(start + size <= m_size);
+		SharedBuffer b(*this);
+		b.data += start;
+		b.m_size = size;
+		return b;
+	}
 private:
+	struct Storage
+	{
+		volatile unsigned int refcount;
+		T *base;
+		// Lowest offset from base claimed by any buffer
+		volatile unsigned int front;
+	};
+	void init(T *base, unsigned int headroom)
+	{
+		m_storage = new Storage;
+		m_storage->refcount = 1;
+		m_storage->base = base;
+		m_storage->front = headroom;
+	}
 	void drop()
 	{
-		assert((*refcount) > 0);
-		(*refcount)--;
-		if(*refcount == 0)
+		assert(m_storage->refcount > 0);
+		if(atomic_add(&m_storage->refcount, -1) == 1)
 		{
-			if(data)
-				delete[] data;
-			delete refcount;
+			if(m_storage->base)
+				delete[] m_storage->base;
+			delete m_storage;
 		}
 	}
 	T *data;
 	unsigned int m_size;
-	unsigned int *refcount;
+	Storage *m_storage;
 };
 
 inline SharedBuffer<u8> SharedBufferFromString(const char *string)
@@ -615,10 +678,17 @@ private:
 	TimeTaker
 */
 
+enum TimePrecision
+{
+	PRECISION_MILLI,
+	PRECISION_MICRO
+};
+
 class TimeTaker
 {
 public:
-	TimeTaker(const char *name, u32 *result=NULL);
+	TimeTaker(const char *name, u32 *result=NULL,
+			TimePrecision prec=PRECISION_MILLI);
 
 	~TimeTaker()
 	{
@@ -630,10 +700,13 @@ public:
 	u32 getTime();
 
 private:
+	u32 now();
+
 	const char *m_name;
 	u32 m_time1;
 	bool m_running;
 	u32 *m_result;
+	TimePrecision m_precision;
 };
 
 #ifndef SERVER
@@ -1127,6 +1200,164 @@ protected:
 	core::list<T> m_list;
 };
 
+/*
+	A queue for any number of producer threads and a single consumer
+	thread, which doesn't lock in the common case.
+
+	Items go through a ring buffer. When it is full they go to an
+	overflow list behind a mutex instead, and keep going there until
+	the consumer has emptied it, so producers never block on the
+	consumer. The overflow is only taken from once every claimed cell
+	of the ring has been popped, so the items of each producer stay in
+	order.
+
+	The consumer sleeps on an event while waiting for items.
+*/
+template<typename T>
+class LockFreeQueue
+{
+public:
+	// capacity is rounded up to a power of two
+	LockFreeQueue(u32 capacity=1024):
+		m_head(0),
+		m_tail(0),
+		m_size(0),
+		m_overflowing(0),
+		m_waiting(0)
+	{
+		u32 n = 1;
+		while (n < capacity)
+			n *= 2;
+		m_cells = new Cell[n];
+		m_mask = n - 1;
+		for (u32 i=0; i<n; i++)
+			m_cells[i].sequence = i;
+		m_overflow_mutex.Init();
+	}
+	~LockFreeQueue()
+	{
+		delete[] m_cells;
+	}
+	u32 size()
+	{
+		return m_size;
+	}
+	void push_back(const T &t)
+	{
+		for (;;) {
+			if (m_overflowing) {
+				pushOverflow(t);
+				break;
+			}
+			u32 pos = m_head;
+			Cell &c = m_cells[pos & m_mask];
+			s32 diff = (s32)(c.sequence - pos);
+			if (diff < 0) {
+				// Full
+				pushOverflow(t);
+				break;
+			}
+			if (diff == 0 && atomic_cas(&m_head, pos, pos + 1)) {
+				c.item = t;
+				memory_barrier();
+				c.sequence = pos + 1;
+				break;
+			}
+			// Another producer took the cell
+		}
+		atomic_add(&m_size, 1);
+		if (m_waiting)
+			m_event.signal();
+	}
+	// Only for the consumer; returns false if the queue is empty
+	bool try_pop_front(T &t)
+	{
+		Cell &c = m_cells[m_tail & m_mask];
+		if ((s32)(c.sequence - (m_tail + 1)) == 0) {
+			memory_barrier();
+			t = c.item;
+			c.item = T();
+			memory_barrier();
+			c.sequence = m_tail + m_mask + 1;
+			m_tail++;
+		}else{
+			if (m_overflowing == 0)
+				return false;
+			// A producer may have claimed the cell and not filled it
+			// yet, and the cells after it can hold items pushed
+			// before ones now in the overflow
+			if (m_head != m_tail)
+				return false;
+			JMutexAutoLock lock(m_overflow_mutex);
+			if (m_overflow.size() == 0)
+				return false;
+			typename core::list<T>::Iterator begin = m_overflow.begin();
+			t = *begin;
+			m_overflow.erase(begin);
+			if (m_overflow.size() == 0)
+				m_overflowing = 0;
+		}
+		atomic_add(&m_size, -1);
+		return true;
+	}
+	// Only for the consumer; waits up to wait_time_max_ms for an item
+	T pop_front(u32 wait_time_max_ms=0)
+	{
+		T t;
+		u32 start_ms = porting::getTimeMs();
+		for (;;) {
+			if (try_pop_front(t))
+				return t;
+			u32 waited_ms = porting::getTimeMs() - start_ms;
+			if (waited_ms >= wait_time_max_ms)
+				throw ItemNotFoundException("LockFreeQueue: queue is empty");
+
+			// Producers signal the event if they see this, or else
+			// the item they pushed is found here
+			m_waiting = 1;
+			memory_barrier();
+			if (try_pop_front(t)) {
+				m_waiting = 0;
+				return t;
+			}
+			m_event.wait(wait_time_max_ms - waited_ms);
+			m_waiting = 0;
+		}
+	}
+
+private:
+	LockFreeQueue(const LockFreeQueue &);
+	LockFreeQueue &operator=(const LockFreeQueue &);
+
+	void pushOverflow(const T &t)
+	{
+		JMutexAutoLock lock(m_overflow_mutex);
+		m_overflowing = 1;
+		m_overflow.push_back(t);
+	}
+
+	struct Cell
+	{
+		// Position the cell can be pushed to, plus one once pushed
+		volatile u32 sequence;
+		T item;
+	};
+	Cell *m_cells;
+	u32 m_mask;
+	// Next position to push to, shared by producers
+	volatile u32 m_head;
+	// Next position to pop from, only used by the consumer
+	u32 m_tail;
+	volatile s32 m_size;
+
+	JMutex m_overflow_mutex;
+	core::list<T> m_overflow;
+	volatile u32 m_overflowing;
+
+	volatile u32 m_waiting;
+	ThreadEvent m_event;
+};
+
 /*
 	A single worker thread - multiple client threads queue framework.
 */